@@ -0,0 +1,180 @@
+/*
+ * bench_clock.c: Cost and granularity of the time sources server.dll sees.
+ *
+ * Built only with -DNETWORKFIX_TEST, like the tests, so hook_GetTickCount
+ * can be called directly; every caller counts as server.dll there. For
+ * each source it measures:
+ *
+ *   call cost  average time per call over BENCH_CALLS calls
+ *   steps      how far the value jumps each time it changes, sampled for BENCH_SAMPLE_MS
+ *
+ * It then times BENCH_SLEEPS calls of Sleep(1) through hook_Sleep with
+ * HighResSleep=1 (the original Sleep) and =2 (a high-resolution timer).
+ *
+ * Run with `make bench`.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "clock.h"
+#include "config.h"
+#include "hooks.h"
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+
+#define BENCH_CALLS 10000000
+#define BENCH_SAMPLE_MS 1000
+#define BENCH_SLEEPS 200
+
+/* hooks.c global exposed under NETWORKFIX_TEST */
+extern DWORD(WINAPI *real_GetTickCount)(void);
+extern BOOL(WINAPI *real_QueryPerformanceCounter)(LARGE_INTEGER *);
+extern void(WINAPI *real_Sleep)(DWORD);
+
+/* main.c global referenced by hooks.c */
+HMODULE g_hModule = NULL;
+
+void test_sleep(DWORD ms)
+{
+    Sleep(ms);
+}
+
+typedef DWORD (*time_source)(void);
+
+static DWORD source_get_tick_count(void)
+{
+    return GetTickCount();
+}
+
+static DWORD source_qpc(void)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (DWORD)now.QuadPart;
+}
+
+static DWORD source_hook_qpc(void)
+{
+    LARGE_INTEGER now;
+    hook_QueryPerformanceCounter(&now);
+    return (DWORD)now.QuadPart;
+}
+
+static DWORD source_hook_plain(void)
+{
+    g_config.high_res_clock = FALSE;
+    return hook_GetTickCount();
+}
+
+static DWORD source_hook_clock(void)
+{
+    g_config.high_res_clock = TRUE;
+    return hook_GetTickCount();
+}
+
+static DWORD source_hook_profiled(void)
+{
+    g_config.high_res_clock = FALSE;
+    g_config.frame_profiler = TRUE;
+    DWORD now = hook_GetTickCount();
+    g_config.frame_profiler = FALSE;
+    return now;
+}
+
+static double now_us(void)
+{
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER        now;
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * 1000000.0 / (double)frequency.QuadPart;
+}
+
+static void run_source(const char *name, time_source source, BOOL milliseconds)
+{
+    volatile DWORD sink = 0;
+
+    double start = now_us();
+    for (int i = 0; i < BENCH_CALLS; i++)
+    {
+        sink += source();
+    }
+    double ns_per_call = (now_us() - start) * 1000.0 / BENCH_CALLS;
+
+    if (!milliseconds)
+    {
+        printf("%-28s  %8.1f ns  %10s  %10s\n", name, ns_per_call, "-", "-");
+        return;
+    }
+
+    // Steps: spin for BENCH_SAMPLE_MS and record each change of the value
+    DWORD  last = source();
+    DWORD  max_step = 0;
+    int    changes = 0;
+    double sample_start = now_us();
+    while (now_us() - sample_start < BENCH_SAMPLE_MS * 1000.0)
+    {
+        DWORD value = source();
+        if (value != last)
+        {
+            max_step = value - last > max_step ? value - last : max_step;
+            changes++;
+            last = value;
+        }
+    }
+    printf("%-28s  %8.1f ns  %7.2f ms  %7lu ms\n", name, ns_per_call,
+           changes ? (double)BENCH_SAMPLE_MS / changes : 0.0, (unsigned long)max_step);
+}
+
+static void run_sleep(const char *name, DWORD mode)
+{
+    clock_sleep_stats before = clock_get_sleep_stats();
+
+    g_config.high_res_sleep = mode;
+    for (int i = 0; i < BENCH_SLEEPS; i++)
+    {
+        hook_Sleep(1);
+    }
+    g_config.high_res_sleep = HIGH_RES_SLEEP_OFF;
+
+    // Buckets below 0.5 ms and from 2 ms late on, see clock.c
+    clock_sleep_stats after = clock_get_sleep_stats();
+    uint32_t          on_time = after.late[0] + after.late[1] - before.late[0] - before.late[1];
+    uint32_t          late = 0;
+    for (int i = 3; i < CLOCK_SLEEP_BUCKETS; i++)
+    {
+        late += after.late[i] - before.late[i];
+    }
+    printf("%-28s  %8.2f ms  %10lu  %10lu\n", name,
+           (double)(after.actual_us - before.actual_us) / BENCH_SLEEPS / 1000.0, (unsigned long)on_time,
+           (unsigned long)late);
+}
+
+int main(void)
+{
+    setvbuf(stdout, NULL, _IONBF, 0); // Show each result as soon as it is measured
+    reset_config();
+    real_GetTickCount = GetTickCount;
+    real_QueryPerformanceCounter = QueryPerformanceCounter;
+    real_Sleep = Sleep;
+    clock_init(GetTickCount());
+
+    printf("%d calls per source, steps sampled for %d ms\n\n", BENCH_CALLS, BENCH_SAMPLE_MS);
+    printf("%-28s  %11s  %10s  %10s\n", "source", "call cost", "avg step", "max step");
+    run_source("GetTickCount", source_get_tick_count, TRUE);
+    run_source("QueryPerformanceCounter", source_qpc, FALSE);
+    run_source("hook_QueryPerformanceCounter", source_hook_qpc, FALSE);
+    run_source("clock_now_ms", clock_now_ms, TRUE);
+    run_source("hook_GetTickCount", source_hook_plain, TRUE);
+    run_source("hook_GetTickCount (clock)", source_hook_clock, TRUE);
+    run_source("hook_GetTickCount (profiled)", source_hook_profiled, TRUE);
+
+    printf("\n%d calls of Sleep(1) each\n\n", BENCH_SLEEPS);
+    printf("%-28s  %11s  %10s  %10s\n", "sleep", "avg time", "< 0.5 late", ">= 2 late");
+    run_sleep("hook_Sleep (original)", HIGH_RES_SLEEP_MEASURE);
+    run_sleep("hook_Sleep (high-res)", HIGH_RES_SLEEP_ON);
+    return 0;
+}
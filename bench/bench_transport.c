@@ -0,0 +1,409 @@
+/*
+ * bench_transport.c: Throughput and latency of the peer transports.
+ *
+ * Built only with -DNETWORKFIX_TEST, like the tests, so the hooks can be
+ * pointed at the real Winsock functions without MinHook. Two connected
+ * sockets in one process stand in for two game instances on one host; a
+ * second thread plays the remote server.dll and polls hook_recv the way
+ * the game does. Each transport runs the same two measurements:
+ *
+ *   throughput  one side streams BENCH_STREAM_MB in game-sized writes
+ *   latency     BENCH_ROUND_TRIPS ping-pongs of a small message
+ *
+ * A second table drains SendQueueKB queues of small updates once with one
+ * send() per queued update and once with the gathered WSASend() flush,
+ * counting the system calls that drain the queue per KB and the bytes
+ * copied per byte sent.
+ *
+ * Run with `make bench`.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "config.h"
+#include "hooks.h"
+#include "socket_state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+
+#define BENCH_STREAM_MB 64
+#define BENCH_WRITE_SIZE 4096 // Bytes per hook_send call while streaming
+#define BENCH_ROUND_TRIPS 20000
+#define BENCH_PING_SIZE 64
+#define BENCH_QUEUE_ROUNDS 500
+#define BENCH_QUEUE_UPDATES 64 // Updates queued per round
+#define BENCH_QUEUE_SIZE 128   // Bytes per update
+
+/* hooks.c globals exposed under NETWORKFIX_TEST */
+extern int(WSAAPI *real_recv)(SOCKET, char *, int, int);
+extern int(WSAAPI *real_send)(SOCKET, const char *, int, int);
+extern int(WSAAPI *real_WSASend)(SOCKET, LPWSABUF, DWORD, LPDWORD, DWORD, LPWSAOVERLAPPED,
+                                 LPWSAOVERLAPPED_COMPLETION_ROUTINE);
+extern int(WSAAPI *real_closesocket)(SOCKET);
+extern int(WSAAPI *real_connect)(SOCKET, const struct sockaddr *, int);
+extern SOCKET(WSAAPI *real_accept)(SOCKET, struct sockaddr *, int *);
+
+/* main.c global referenced by hooks.c */
+HMODULE g_hModule = NULL;
+
+/* The send retry loop sleeps for real here; its cost is part of what is measured. */
+void test_sleep(DWORD ms)
+{
+    Sleep(ms);
+}
+
+typedef enum
+{
+    TRANSPORT_RAW_TCP,    // Hooks with the peer protocol off
+    TRANSPORT_FRAMED_TCP, // Peer protocol on, frames over loopback TCP
+    TRANSPORT_SHM         // Peer protocol on, frames through shared-memory rings
+} bench_transport;
+
+static const char *const TRANSPORT_NAMES[] = {"loopback TCP (raw)", "loopback TCP (framed)", "shared memory"};
+
+typedef struct
+{
+    SOCKET        s;
+    int           mode;  // 0 = drain the stream, 1 = echo pings
+    long long     bytes; // Bytes to drain, or round trips to echo
+    volatile LONG done;
+} remote_job;
+
+static volatile LONG s_send_calls = 0; // send() and WSASend() calls made by the hooks
+
+static int WSAAPI counting_send(SOCKET s, const char *buf, int len, int flags)
+{
+    InterlockedIncrement(&s_send_calls);
+    return send(s, buf, len, flags);
+}
+
+static int WSAAPI counting_WSASend(SOCKET s, LPWSABUF bufs, DWORD count, LPDWORD sent, DWORD flags,
+                                   LPWSAOVERLAPPED overlapped, LPWSAOVERLAPPED_COMPLETION_ROUTINE routine)
+{
+    InterlockedIncrement(&s_send_calls);
+    return WSASend(s, bufs, count, sent, flags, overlapped, routine);
+}
+
+static double now_us(void)
+{
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER        now;
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * 1000000.0 / (double)frequency.QuadPart;
+}
+
+/* Polls like server.dll does, giving up the time slice when nothing arrived. */
+static int poll_recv(SOCKET s, char *buf, int len)
+{
+    int r = hook_recv(s, buf, len, 0);
+    if (r == 0)
+    {
+        SwitchToThread();
+    }
+    return r;
+}
+
+/* Receives exactly len bytes. */
+static BOOL recv_exact(SOCKET s, char *buf, int len)
+{
+    int got = 0;
+    while (got < len)
+    {
+        int r = poll_recv(s, buf + got, len - got);
+        if (r == SOCKET_ERROR)
+        {
+            return FALSE;
+        }
+        got += r;
+    }
+    return TRUE;
+}
+
+static DWORD WINAPI remote_thread(LPVOID param)
+{
+    remote_job *job = (remote_job *)param;
+    static char buf[65536];
+
+    if (job->mode == 0)
+    {
+        long long left = job->bytes;
+        while (left > 0)
+        {
+            int r = poll_recv(job->s, buf, left < (long long)sizeof(buf) ? (int)left : (int)sizeof(buf));
+            if (r == SOCKET_ERROR)
+            {
+                break;
+            }
+            left -= r;
+        }
+    }
+    else
+    {
+        for (long long i = 0; i < job->bytes; i++)
+        {
+            if (!recv_exact(job->s, buf, BENCH_PING_SIZE) ||
+                hook_send(job->s, buf, BENCH_PING_SIZE, 0) != BENCH_PING_SIZE)
+            {
+                break;
+            }
+        }
+    }
+    InterlockedExchange(&job->done, 1);
+    return 0;
+}
+
+static void wait_for_remote(remote_job *job, HANDLE thread)
+{
+    while (!job->done)
+    {
+        Sleep(0);
+    }
+    CloseHandle(thread);
+}
+
+static BOOL make_pair(SOCKET *client, SOCKET *server)
+{
+    struct sockaddr_in addr;
+    int                addr_len = sizeof(addr);
+    u_long             non_blocking = 1;
+    BOOL               no_delay = TRUE;
+
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener == INVALID_SOCKET || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(listener, 1) == SOCKET_ERROR ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) == SOCKET_ERROR)
+    {
+        return FALSE;
+    }
+
+    *client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (*client == INVALID_SOCKET || connect(*client, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        return FALSE;
+    }
+    *server = accept(listener, NULL, NULL);
+    closesocket(listener);
+    if (*server == INVALID_SOCKET)
+    {
+        return FALSE;
+    }
+    // Nagle would hold every ping back for the delayed ACK and measure that instead of the transport
+    setsockopt(*client, IPPROTO_TCP, TCP_NODELAY, (const char *)&no_delay, sizeof(no_delay));
+    setsockopt(*server, IPPROTO_TCP, TCP_NODELAY, (const char *)&no_delay, sizeof(no_delay));
+    ioctlsocket(*client, FIONBIO, &non_blocking);
+    ioctlsocket(*server, FIONBIO, &non_blocking);
+    return TRUE;
+}
+
+/* Polls both ends until the transport under test carries both directions. */
+static BOOL wait_until_ready(SOCKET a, SOCKET b, bench_transport transport)
+{
+    char  scratch[16];
+    DWORD start = GetTickCount();
+
+    if (transport == TRANSPORT_RAW_TCP)
+    {
+        return TRUE;
+    }
+    while (GetTickCount() - start < 5000)
+    {
+        hook_recv(a, scratch, sizeof(scratch), 0);
+        hook_recv(b, scratch, sizeof(scratch), 0);
+        socket_state *sa = get_socket_state(a, FALSE);
+        socket_state *sb = get_socket_state(b, FALSE);
+        if (sa && sb && sa->peer.tx_framed && sa->peer.rx_framed && sb->peer.tx_framed && sb->peer.rx_framed &&
+            (transport == TRANSPORT_FRAMED_TCP ||
+             (sa->peer.shm_tx && sa->peer.shm_rx && sb->peer.shm_tx && sb->peer.shm_rx)))
+        {
+            return TRUE;
+        }
+        Sleep(1);
+    }
+    return FALSE;
+}
+
+static int compare_doubles(const void *x, const void *y)
+{
+    double a = *(const double *)x;
+    double b = *(const double *)y;
+    return a < b ? -1 : a > b;
+}
+
+static void run_transport(bench_transport transport)
+{
+    static char   chunk[BENCH_WRITE_SIZE];
+    static double rtt[BENCH_ROUND_TRIPS];
+    SOCKET        a, b;
+    remote_job    job;
+
+    reset_config();
+    reset_socket_states();
+    g_config.heartbeat_interval_ms = transport == TRANSPORT_FRAMED_TCP ? 1000 : 0; // Cheapest option that frames
+    g_config.shared_memory = transport == TRANSPORT_SHM;
+
+    if (!make_pair(&a, &b) || !wait_until_ready(a, b, transport))
+    {
+        printf("%-24s  setup failed\n", TRANSPORT_NAMES[transport]);
+        return;
+    }
+
+    // Throughput: a streams, b drains on its own thread
+    memset(chunk, 'x', sizeof(chunk));
+    long long total = (long long)BENCH_STREAM_MB * 1024 * 1024;
+    job.s = b;
+    job.mode = 0;
+    job.bytes = total;
+    job.done = 0;
+    HANDLE thread = CreateThread(NULL, 0, remote_thread, &job, 0, NULL);
+    double start = now_us();
+    for (long long sent = 0; sent < total; sent += sizeof(chunk))
+    {
+        hook_send(a, chunk, sizeof(chunk), 0);
+    }
+    wait_for_remote(&job, thread);
+    double elapsed_s = (now_us() - start) / 1000000.0;
+
+    // Latency: a pings, b echoes
+    job.mode = 1;
+    job.bytes = BENCH_ROUND_TRIPS;
+    job.done = 0;
+    thread = CreateThread(NULL, 0, remote_thread, &job, 0, NULL);
+    int completed = 0;
+    for (; completed < BENCH_ROUND_TRIPS; completed++)
+    {
+        double sent_at = now_us();
+        if (hook_send(a, chunk, BENCH_PING_SIZE, 0) != BENCH_PING_SIZE || !recv_exact(a, chunk, BENCH_PING_SIZE))
+        {
+            break;
+        }
+        rtt[completed] = now_us() - sent_at;
+    }
+    wait_for_remote(&job, thread);
+
+    qsort(rtt, completed, sizeof(rtt[0]), compare_doubles);
+    printf("%-24s  %9.1f MB/s  %9.1f us  %9.1f us\n", TRANSPORT_NAMES[transport],
+           (double)BENCH_STREAM_MB / elapsed_s, completed ? rtt[completed / 2] : 0.0,
+           completed ? rtt[completed * 99 / 100] : 0.0);
+
+    hook_closesocket(a);
+    hook_closesocket(b);
+}
+
+/*
+ * Each round queues BENCH_QUEUE_UPDATES updates behind a full socket buffer,
+ * then reads them on the other end while polling the queue, the way a
+ * host's queue drains while the game keeps calling the hooks.
+ */
+static void run_queue_flush(BOOL gather)
+{
+    static char filler[65536];
+    static char update[BENCH_QUEUE_SIZE];
+    const int   round_bytes = BENCH_QUEUE_UPDATES * BENCH_QUEUE_SIZE;
+    SOCKET      a, b;
+
+    reset_config();
+    reset_socket_states();
+    g_config.send_queue_kb = 1024;
+    real_send = counting_send;
+    real_WSASend = gather ? counting_WSASend : NULL; // NULL makes the flush fall back to one send() per update
+    const char *name = gather ? "WSASend gather" : "send() per update";
+
+    if (!make_pair(&a, &b))
+    {
+        printf("%-24s  setup failed\n", name);
+        return;
+    }
+
+    long long sent_bytes = 0;
+    LONG      flush_calls = 0;
+    double    drain_us = 0.0;
+    for (int round = 0; round < BENCH_QUEUE_ROUNDS; round++)
+    {
+        int filled = 0;
+        for (int r; (r = send(a, filler, sizeof(filler), 0)) > 0;)
+        {
+            filled += r;
+        }
+        for (int i = 0; i < BENCH_QUEUE_UPDATES; i++)
+        {
+            update[0] = (char)i;
+            hook_send(a, update, sizeof(update), 0);
+        }
+        sent_bytes += round_bytes;
+
+        for (int got = 0; got < filled;)
+        {
+            int r = recv(b, filler, sizeof(filler), 0);
+            got += r > 0 ? r : 0;
+        }
+        // The player caught up; the queue drains from the hooks' polls once the socket takes data again
+        LONG   calls_before = s_send_calls;
+        double drain_start = now_us();
+        for (int got = 0; got < round_bytes;)
+        {
+            fd_set         writable;
+            struct timeval wait = {1, 0};
+            FD_ZERO(&writable);
+            FD_SET(a, &writable);
+            select(0, NULL, &writable, NULL, &wait);
+            send_queue_poll();
+            int r = recv(b, filler, sizeof(filler), 0);
+            got += r > 0 ? r : 0;
+        }
+        flush_calls += s_send_calls - calls_before;
+        drain_us += now_us() - drain_start;
+    }
+
+    socket_state *state = get_socket_state(a, FALSE);
+    double        kb = (double)sent_bytes / 1024.0;
+    printf("%-24s  %11.1f us  %12.2f  %12.2f\n", name, drain_us / BENCH_QUEUE_ROUNDS, (double)flush_calls / kb,
+           state ? (double)state->queue.copied_bytes / (double)sent_bytes : 0.0);
+
+    hook_closesocket(a);
+    hook_closesocket(b);
+    real_send = send;
+    real_WSASend = WSASend;
+}
+
+int main(void)
+{
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+    {
+        fprintf(stderr, "WSAStartup failed: %d\n", WSAGetLastError());
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IONBF, 0); // Show each result as soon as it is measured
+    real_recv = recv;
+    real_send = send;
+    real_WSASend = WSASend;
+    real_closesocket = closesocket;
+    real_connect = connect;
+    real_accept = accept;
+
+    printf("%d MB in %d-byte writes, %d round trips of %d bytes\n\n", BENCH_STREAM_MB, BENCH_WRITE_SIZE,
+           BENCH_ROUND_TRIPS, BENCH_PING_SIZE);
+    printf("%-24s  %14s  %12s  %12s\n", "transport", "throughput", "rtt median", "rtt p99");
+    run_transport(TRANSPORT_RAW_TCP);
+    run_transport(TRANSPORT_FRAMED_TCP);
+    run_transport(TRANSPORT_SHM);
+
+    printf("\n%d rounds of %d queued %d-byte updates behind a full socket buffer\n\n", BENCH_QUEUE_ROUNDS,
+           BENCH_QUEUE_UPDATES, BENCH_QUEUE_SIZE);
+    printf("%-24s  %14s  %12s  %12s\n", "queue flush", "drain time", "flushes/KB", "copied B/B");
+    run_queue_flush(FALSE);
+    run_queue_flush(TRUE);
+
+    reset_socket_states();
+    WSACleanup();
+    return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * buftune.c: Socket buffer autotuning for server.dll's connections.
+ *
+ * Windows gives a socket small default buffers, and server.dll writes a
+ * turn's worth of updates in one burst. When the burst does not fit, every
+ * write in it answers WSAEWOULDBLOCK and the send hook sleeps and retries,
+ * even though the link has bandwidth to spare. With BufferTuning, each
+ * socket's writes and reads are counted in windows of BUFTUNE_WINDOW_MS.
+ * A window in which writes kept finding the send buffer full doubles
+ * SO_SNDBUF; a window that ends with most of the receive buffer unread
+ * doubles SO_RCVBUF.
+ *
+ * Neither buffer grows past twice the bandwidth-delay product: the bytes
+ * the socket moved in the window, scaled to one round trip (the heartbeat
+ * estimate between patched peers, BUFTUNE_DEFAULT_RTT_MS otherwise). A
+ * buffer that holds more than two round trips of what the link carries
+ * would only add queuing delay. The tuner only ever grows buffers, and
+ * with BufferTuning on, sockprofile_apply() keeps buffers larger than its
+ * profile's, so an AutoProfile switch cannot undo a grow. Every change is
+ * logged.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "buftune.h"
+#include "clock.h"
+#include "logging.h"
+#include "socket_state.h"
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+
+typedef struct
+{
+    SOCKET   socket;       // INVALID_SOCKET = free slot
+    DWORD    window_start; // Tick count when the current window began
+    uint32_t sends;        // Writes in the current window, blocked ones included
+    uint32_t blocks;       // Of those, writes that found the send buffer full
+    uint64_t bytes_out;    // Bytes written in the current window
+    uint64_t bytes_in;     // Bytes read in the current window
+    int      sndbuf;       // SO_SNDBUF now
+    int      rcvbuf;       // SO_RCVBUF now
+    int      first_sndbuf; // SO_SNDBUF when the socket was first seen
+    int      first_rcvbuf; // SO_RCVBUF when the socket was first seen
+    uint32_t total_blocks; // Writes that found the send buffer full, over the socket's life
+    uint32_t grows;        // Adjustments made
+} buftune_socket;
+
+static CRITICAL_SECTION s_lock;          // Guards the sockets and the counters
+static volatile LONG    s_lock_init = 0; // 0 = not initialized, 1 = initializing, 2 = ready
+static buftune_socket   s_sockets[BUFTUNE_SOCKETS];
+static buftune_stats    s_stats;
+
+/**
+ * Initializes the module lock exactly once (hooks may fire from any thread).
+ */
+static void ensure_lock_initialized(void)
+{
+    if (s_lock_init == 2)
+    {
+        return;
+    }
+    if (InterlockedCompareExchange(&s_lock_init, 1, 0) == 0)
+    {
+        InitializeCriticalSection(&s_lock);
+        for (int i = 0; i < BUFTUNE_SOCKETS; i++)
+        {
+            s_sockets[i].socket = INVALID_SOCKET;
+        }
+        InterlockedExchange(&s_lock_init, 2);
+        return;
+    }
+    while (s_lock_init != 2)
+    {
+        Sleep(0);
+    }
+}
+
+static int get_buffer_size(SOCKET s, int option)
+{
+    int size = 0;
+    int size_len = sizeof(size);
+    if (getsockopt(s, SOL_SOCKET, option, (char *)&size, &size_len) == SOCKET_ERROR)
+    {
+        return 0;
+    }
+    return size;
+}
+
+/**
+ * Finds a socket's entry, starting one if needed. Caller holds s_lock.
+ *
+ * @return Entry, or NULL if every slot is taken
+ */
+static buftune_socket *find_socket(SOCKET s)
+{
+    buftune_socket *free_slot = NULL;
+    for (int i = 0; i < BUFTUNE_SOCKETS; i++)
+    {
+        if (s_sockets[i].socket == s)
+        {
+            return &s_sockets[i];
+        }
+        if (!free_slot && s_sockets[i].socket == INVALID_SOCKET)
+        {
+            free_slot = &s_sockets[i];
+        }
+    }
+    if (!free_slot)
+    {
+        return NULL;
+    }
+
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->socket = s;
+    free_slot->window_start = clock_ticks();
+    free_slot->sndbuf = free_slot->first_sndbuf = get_buffer_size(s, SO_SNDBUF);
+    free_slot->rcvbuf = free_slot->first_rcvbuf = get_buffer_size(s, SO_RCVBUF);
+    s_stats.sockets++;
+    return free_slot;
+}
+
+/**
+ * Returns the round trip to size buffers for: the heartbeat estimate if
+ * the peer layer has one, BUFTUNE_DEFAULT_RTT_MS otherwise.
+ */
+static DWORD round_trip_ms(SOCKET s)
+{
+    socket_state *state = get_socket_state(s, FALSE);
+    if (state && state->stats.rtt_samples > 0 && state->stats.srtt_us >= 1000)
+    {
+        return state->stats.srtt_us / 1000;
+    }
+    return BUFTUNE_DEFAULT_RTT_MS;
+}
+
+/**
+ * Doubles one of a socket's buffers, but not past twice the bandwidth-delay
+ * product of what it moved in the window. Caller holds s_lock.
+ *
+ * @param option SO_SNDBUF or SO_RCVBUF
+ * @param moved Bytes the socket moved in that direction during the window
+ * @param elapsed_ms Length of the window
+ * @param reason What triggered the adjustment, for the log
+ * @return TRUE if the buffer grew
+ */
+static BOOL grow_buffer(buftune_socket *entry, int option, uint64_t moved, DWORD elapsed_ms, const char *reason)
+{
+    int     *current = option == SO_SNDBUF ? &entry->sndbuf : &entry->rcvbuf;
+    DWORD    rtt_ms = round_trip_ms(entry->socket);
+    uint64_t cap = 2 * moved * rtt_ms / elapsed_ms;
+    int      size_now = get_buffer_size(entry->socket, option);
+
+    if (size_now > 0)
+    {
+        *current = size_now; // An AutoProfile switch may have grown it since; doubling the old size could shrink it
+    }
+
+    if (cap < BUFTUNE_MIN_BYTES)
+    {
+        cap = BUFTUNE_MIN_BYTES;
+    }
+    if (cap > BUFTUNE_MAX_BYTES)
+    {
+        cap = BUFTUNE_MAX_BYTES;
+    }
+    int target = (uint64_t)*current * 2 < cap ? *current * 2 : (int)cap;
+    if (target <= *current)
+    {
+        s_stats.capped++;
+        return FALSE;
+    }
+
+    const char *name = option == SO_SNDBUF ? "SO_SNDBUF" : "SO_RCVBUF";
+    if (setsockopt(entry->socket, SOL_SOCKET, option, (const char *)&target, sizeof(target)) == SOCKET_ERROR)
+    {
+        logf_rate_limited("buftune_failed", "[BUFTUNE] Socket %u: setting %s to %d failed: %d",
+                          (unsigned)entry->socket, name, target, WSAGetLastError());
+        return FALSE;
+    }
+    int actual = get_buffer_size(entry->socket, option);
+    logf("[BUFTUNE] Socket %u: %s %d -> %d bytes (%s, %.1f KB/s, round trip %lu ms)", (unsigned)entry->socket, name,
+         *current, actual > 0 ? actual : target, reason, (double)moved * 1000.0 / 1024.0 / (double)elapsed_ms,
+         (unsigned long)rtt_ms);
+    *current = actual > 0 ? actual : target;
+    entry->grows++;
+    return TRUE;
+}
+
+/**
+ * Acts on a window that has run its course and starts the next one.
+ * Caller holds s_lock.
+ */
+static void check_window(buftune_socket *entry)
+{
+    DWORD elapsed_ms = clock_ticks() - entry->window_start;
+    char  reason[64];
+
+    if (elapsed_ms < BUFTUNE_WINDOW_MS)
+    {
+        return;
+    }
+
+    if (entry->blocks >= BUFTUNE_MIN_BLOCKS && entry->blocks * 100 >= entry->sends * BUFTUNE_BLOCK_PERCENT)
+    {
+        snprintf(reason, sizeof(reason), "%lu of %lu writes blocked", (unsigned long)entry->blocks,
+                 (unsigned long)entry->sends);
+        if (grow_buffer(entry, SO_SNDBUF, entry->bytes_out, elapsed_ms, reason))
+        {
+            s_stats.send_grows++;
+        }
+    }
+
+    u_long unread = 0;
+    if (entry->bytes_in > 0 && entry->rcvbuf > 0 && ioctlsocket(entry->socket, FIONREAD, &unread) == 0 &&
+        (uint64_t)unread * 100 >= (uint64_t)entry->rcvbuf * BUFTUNE_BACKLOG_PERCENT)
+    {
+        snprintf(reason, sizeof(reason), "%lu of %d bytes unread", (unsigned long)unread, entry->rcvbuf);
+        if (grow_buffer(entry, SO_RCVBUF, entry->bytes_in + unread, elapsed_ms, reason))
+        {
+            s_stats.recv_grows++;
+        }
+    }
+
+    entry->window_start += elapsed_ms;
+    entry->sends = 0;
+    entry->blocks = 0;
+    entry->bytes_out = 0;
+    entry->bytes_in = 0;
+}
+
+void buftune_note_send(SOCKET s, int bytes, BOOL blocked)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    buftune_socket *entry = find_socket(s);
+    if (entry)
+    {
+        entry->sends++;
+        if (blocked)
+        {
+            entry->blocks++;
+            entry->total_blocks++;
+            s_stats.blocks++;
+        }
+        entry->bytes_out += bytes > 0 ? bytes : 0;
+        check_window(entry);
+    }
+    LeaveCriticalSection(&s_lock);
+}
+
+void buftune_note_recv(SOCKET s, int bytes)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    buftune_socket *entry = find_socket(s);
+    if (entry)
+    {
+        entry->bytes_in += bytes > 0 ? bytes : 0;
+        check_window(entry);
+    }
+    LeaveCriticalSection(&s_lock);
+}
+
+void buftune_close(SOCKET s)
+{
+    if (s_lock_init != 2)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&s_lock);
+    for (int i = 0; i < BUFTUNE_SOCKETS; i++)
+    {
+        buftune_socket *entry = &s_sockets[i];
+        if (entry->socket != s)
+        {
+            continue;
+        }
+        if (entry->grows > 0)
+        {
+            logf("[BUFTUNE] Socket %u: SO_SNDBUF %d -> %d, SO_RCVBUF %d -> %d bytes after %lu adjustments, "
+                 "%lu writes blocked",
+                 (unsigned)s, entry->first_sndbuf, entry->sndbuf, entry->first_rcvbuf, entry->rcvbuf,
+                 (unsigned long)entry->grows, (unsigned long)entry->total_blocks);
+        }
+        entry->socket = INVALID_SOCKET;
+        break;
+    }
+    LeaveCriticalSection(&s_lock);
+}
+
+buftune_stats buftune_get_stats(void)
+{
+    buftune_stats copy;
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    copy = s_stats;
+    LeaveCriticalSection(&s_lock);
+    return copy;
+}
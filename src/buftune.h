@@ -0,0 +1,62 @@
+#ifndef BUFTUNE_H
+#define BUFTUNE_H
+
+#include <stdint.h>
+#include <windows.h>
+#include <winsock2.h>
+
+#define BUFTUNE_SOCKETS 64              // Sockets tuned at once (MAX_TRACKED_SOCKETS)
+#define BUFTUNE_WINDOW_MS 100           // How often a socket's counters are checked
+#define BUFTUNE_BLOCK_PERCENT 10        // WSAEWOULDBLOCK answers per 100 writes that make SO_SNDBUF grow
+#define BUFTUNE_MIN_BLOCKS 4            // ...if there were at least this many in the window
+#define BUFTUNE_BACKLOG_PERCENT 50      // Unread data, in percent of SO_RCVBUF, that makes SO_RCVBUF grow
+#define BUFTUNE_DEFAULT_RTT_MS 100      // Round trip assumed for the bandwidth-delay product without heartbeats
+#define BUFTUNE_MIN_BYTES 65536         // The bandwidth-delay cap never goes below this
+#define BUFTUNE_MAX_BYTES (4096 * 1024) // Nor above this
+
+/**
+ * Tuner counters for the log and tests.
+ */
+typedef struct
+{
+    uint32_t sockets;    // Sockets seen
+    uint32_t blocks;     // WSAEWOULDBLOCK answers to writes
+    uint32_t send_grows; // SO_SNDBUF adjustments
+    uint32_t recv_grows; // SO_RCVBUF adjustments
+    uint32_t capped;     // Checks that wanted a larger buffer but were at the bandwidth-delay cap
+} buftune_stats;
+
+/**
+ * Books one write to a socket. Every BUFTUNE_WINDOW_MS, a socket whose
+ * writes kept finding the send buffer full gets a larger SO_SNDBUF.
+ *
+ * @param s Socket written to
+ * @param bytes Bytes the write took (0 for a WSAEWOULDBLOCK)
+ * @param blocked TRUE if the write failed with WSAEWOULDBLOCK
+ */
+void buftune_note_send(SOCKET s, int bytes, BOOL blocked);
+
+/**
+ * Books one read from a socket. Every BUFTUNE_WINDOW_MS, a socket with
+ * more than BUFTUNE_BACKLOG_PERCENT of its receive buffer waiting unread
+ * gets a larger SO_RCVBUF.
+ *
+ * @param s Socket read from
+ * @param bytes Bytes the read returned
+ */
+void buftune_note_recv(SOCKET s, int bytes);
+
+/**
+ * Logs what the tuner changed on a socket that is about to be closed and
+ * forgets it. Cheap for sockets the tuner never saw.
+ *
+ * @param s Socket handle
+ */
+void buftune_close(SOCKET s);
+
+/**
+ * Returns a copy of the counters.
+ */
+buftune_stats buftune_get_stats(void);
+
+#endif // BUFTUNE_H
@@ -0,0 +1,707 @@
+/*
+ * clock.c: High-resolution millisecond clock for server.dll's timers.
+ *
+ * GetTickCount() advances with the system timer interrupt, in steps of
+ * 10-16 ms. server.dll times its network loop with it, so a message that
+ * arrives just after a step looks up to 16 ms older or younger than it is,
+ * which shows up as jitter in its timeouts and turn pacing. This clock
+ * counts QueryPerformanceCounter ticks since clock_init() in 64 bits and
+ * adds them to the tick count at that moment, so it reads like
+ * GetTickCount() (including the 32-bit wrap) but moves every millisecond.
+ *
+ * A VPN latency spike stops all incoming data for a few seconds, and
+ * server.dll's timeouts, measured with GetTickCount(), drop players who
+ * would have recovered. Time dilation slows the clock server.dll sees
+ * while nothing arrives, by a bounded amount, and lets it run faster
+ * afterwards until it is back in step. Time never runs backwards, so the
+ * game only sees a slow second, never a negative interval.
+ *
+ * server.dll may read GetTickCount(), timeGetTime() and
+ * QueryPerformanceCounter(). All three are served from this clock and
+ * share one dilation lag and alignment offset, so shaping one source never
+ * lets it drift against the others. Calls are counted per source to show
+ * which ones the network loop polls.
+ *
+ * Sleep(1) has the same granularity: it wakes on the next timer interrupt,
+ * up to 16 ms later, unless something raised the timer resolution for the
+ * whole system with timeBeginPeriod(). clock_sleep() serves server.dll's
+ * short sleeps with clock_wait_us() instead and records how late each one
+ * woke up, so the log shows the difference.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "clock.h"
+#include "logging.h"
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+
+static BOOL(WINAPI *s_query_counter)(LARGE_INTEGER *) = QueryPerformanceCounter;
+static LARGE_INTEGER s_frequency;
+static LARGE_INTEGER s_start;
+static DWORD         s_base_ms;
+static volatile LONG s_ready = 0;   // 0 = not started, 1 = starting, 2 = ready
+static volatile LONG s_last_ms = 0; // Latest value returned, keeps the clock monotonic across CPUs
+
+#ifdef NETWORKFIX_TEST
+static volatile LONG s_virtual = FALSE;
+static volatile LONG s_virtual_ms = 0;
+#endif
+
+// Time dilation, guarded by s_dilation_lock
+static CRITICAL_SECTION s_dilation_lock;
+static volatile LONG    s_dilation_lock_init = 0; // 0 = not initialized, 1 = initializing, 2 = ready
+static BOOL             s_dilation_started = FALSE;
+static DWORD            s_dilation_ms;    // clock_now_ms() the lag was last brought up to date
+static DWORD            s_progress_ms;    // Last time data arrived
+static uint32_t         s_lag;            // Lag in hundredths of a millisecond
+static uint32_t         s_peak_lag;       // Largest lag of the current stall, for the log
+static DWORD            s_max_lag_ms;     // Limit passed to the latest clock_dilate()
+static BOOL             s_dilated[CLOCK_SOURCES];      // Source has a previous result to stay above
+static DWORD            s_last_dilated[CLOCK_SOURCES]; // Latest clock_dilate() result per source
+static int64_t          s_last_counter;                // Latest clock_server_counter() result
+
+// Alignment to the host, also guarded by s_dilation_lock
+static BOOL    s_align_set = FALSE;
+static BOOL    s_align_read = FALSE;         // server.dll read an aligned source, so the offset may only slew
+static int64_t s_align_target_us;            // Latest clock_set_alignment() offset
+static int64_t s_align_us;                   // Offset applied now, moving towards the target
+static int64_t s_align_updated_us;           // clock_now_us() when s_align_us was last moved
+static BOOL    s_aligned[CLOCK_SOURCES];     // Source has a previous result to stay above
+static DWORD   s_last_aligned[CLOCK_SOURCES];
+
+// Timed Sleep() calls, also guarded by s_dilation_lock
+static clock_sleep_stats s_sleeps;
+
+// Calls from server.dll per source
+static volatile LONG s_calls[CLOCK_SOURCES];
+static volatile LONG s_call_checks = 0;
+static volatile LONG s_report_ms = 0;
+static DWORD         s_reported[CLOCK_SOURCES]; // Counts at the last report, written by the reporting thread
+
+void clock_init(DWORD base_ms)
+{
+    QueryPerformanceFrequency(&s_frequency);
+    s_query_counter(&s_start);
+    s_base_ms = base_ms;
+    s_last_ms = (LONG)base_ms;
+    s_report_ms = (LONG)base_ms;
+    InterlockedExchange(&s_ready, 2);
+}
+
+void clock_use_counter(BOOL(WINAPI *query)(LARGE_INTEGER *))
+{
+    s_query_counter = query;
+}
+
+/**
+ * Starts the clock exactly once if nobody called clock_init().
+ */
+static void ensure_started(void)
+{
+    if (s_ready == 2)
+    {
+        return;
+    }
+    if (InterlockedCompareExchange(&s_ready, 1, 0) == 0)
+    {
+        clock_init(GetTickCount());
+        return;
+    }
+    while (s_ready != 2)
+    {
+        Sleep(0);
+    }
+}
+
+DWORD clock_ticks(void)
+{
+#ifdef NETWORKFIX_TEST
+    if (s_virtual)
+    {
+        return (DWORD)s_virtual_ms;
+    }
+#endif
+    return GetTickCount();
+}
+
+#ifdef NETWORKFIX_TEST
+void clock_set_virtual(BOOL enabled)
+{
+    if (enabled)
+    {
+        s_virtual_ms = (LONG)clock_now_ms();
+    }
+    s_virtual = enabled;
+}
+
+void clock_advance(DWORD ms)
+{
+    InterlockedExchangeAdd(&s_virtual_ms, (LONG)ms);
+}
+#endif
+
+DWORD clock_now_ms(void)
+{
+    LARGE_INTEGER now;
+
+#ifdef NETWORKFIX_TEST
+    if (s_virtual)
+    {
+        return (DWORD)s_virtual_ms;
+    }
+#endif
+    ensure_started();
+    s_query_counter(&now);
+    uint64_t ticks = (uint64_t)(now.QuadPart - s_start.QuadPart);
+    uint64_t hz = (uint64_t)s_frequency.QuadPart;
+    DWORD    value = s_base_ms + (DWORD)(ticks / hz * 1000 + ticks % hz * 1000 / hz);
+
+    // A thread on another CPU may have read a slightly later counter; never report less than it did
+    for (;;)
+    {
+        LONG last = s_last_ms;
+        if ((int32_t)(value - (DWORD)last) <= 0)
+        {
+            return (DWORD)last;
+        }
+        if (InterlockedCompareExchange(&s_last_ms, (LONG)value, last) == last)
+        {
+            return value;
+        }
+    }
+}
+
+/**
+ * Returns real time in microseconds on the scale of clock_now_us(), even
+ * in tests running on virtual time.
+ */
+static int64_t counter_us(void)
+{
+    LARGE_INTEGER now;
+
+    ensure_started();
+    s_query_counter(&now);
+    uint64_t ticks = (uint64_t)(now.QuadPart - s_start.QuadPart);
+    uint64_t hz = (uint64_t)s_frequency.QuadPart;
+    return (int64_t)s_base_ms * 1000 + (int64_t)(ticks / hz * 1000000 + ticks % hz * 1000000 / hz);
+}
+
+int64_t clock_now_us(void)
+{
+#ifdef NETWORKFIX_TEST
+    if (s_virtual)
+    {
+        return (int64_t)(DWORD)s_virtual_ms * 1000;
+    }
+#endif
+    return counter_us();
+}
+
+/**
+ * Converts microseconds to performance counter ticks.
+ */
+static int64_t us_to_counter(int64_t us)
+{
+    return us / 1000000 * s_frequency.QuadPart + us % 1000000 * s_frequency.QuadPart / 1000000;
+}
+
+/**
+ * Reads the performance counter, or in tests on virtual time the counter
+ * value that virtual time stands for.
+ */
+static int64_t now_counter(void)
+{
+    LARGE_INTEGER now;
+
+    ensure_started();
+#ifdef NETWORKFIX_TEST
+    if (s_virtual)
+    {
+        return s_start.QuadPart + us_to_counter(clock_now_us() - (int64_t)s_base_ms * 1000);
+    }
+#endif
+    s_query_counter(&now);
+    return now.QuadPart;
+}
+
+/**
+ * Initializes the dilation lock exactly once (hooks may fire from any thread).
+ */
+static void ensure_dilation_lock(void)
+{
+    if (s_dilation_lock_init == 2)
+    {
+        return;
+    }
+    if (InterlockedCompareExchange(&s_dilation_lock_init, 1, 0) == 0)
+    {
+        InitializeCriticalSection(&s_dilation_lock);
+        InterlockedExchange(&s_dilation_lock_init, 2);
+        return;
+    }
+    while (s_dilation_lock_init != 2)
+    {
+        Sleep(0);
+    }
+}
+
+/**
+ * Brings the lag up to now: the part of the interval before the stall
+ * began pays the lag back, the part after it adds to the lag. Caller must
+ * hold s_dilation_lock.
+ */
+static void advance_dilation(DWORD now)
+{
+    if (!s_dilation_started)
+    {
+        s_dilation_started = TRUE;
+        s_dilation_ms = now;
+        s_progress_ms = now;
+        return;
+    }
+
+    DWORD    stall_start = s_progress_ms + CLOCK_STALL_MS;
+    DWORD    elapsed = now - s_dilation_ms;
+    DWORD    stalled = 0;
+    uint32_t max_lag = s_max_lag_ms * 100;
+
+    if ((int32_t)(now - stall_start) > 0)
+    {
+        stalled = (int32_t)(s_dilation_ms - stall_start) >= 0 ? elapsed : now - stall_start;
+    }
+    s_dilation_ms = now;
+
+    uint64_t repaid = (uint64_t)(elapsed - stalled) * (CLOCK_CATCH_UP_PERCENT - 100);
+    s_lag = repaid >= s_lag ? 0 : s_lag - (uint32_t)repaid;
+    if (stalled != 0)
+    {
+        uint64_t lag = (uint64_t)s_lag + (uint64_t)stalled * (100 - CLOCK_STALL_RATE_PERCENT);
+        s_lag = lag > max_lag ? max_lag : (uint32_t)lag;
+    }
+    else if (s_lag > max_lag)
+    {
+        s_lag = max_lag; // The limit was lowered
+    }
+
+    if (s_lag > s_peak_lag)
+    {
+        if (s_peak_lag == 0)
+        {
+            logf("[CLOCK] No data for %d ms, slowing server.dll's clock", CLOCK_STALL_MS);
+        }
+        s_peak_lag = s_lag;
+    }
+    else if (s_lag == 0 && s_peak_lag != 0)
+    {
+        logf("[CLOCK] Caught up after a stall that held server.dll's clock back by up to %lu ms",
+             (unsigned long)(s_peak_lag / 100));
+        s_peak_lag = 0;
+    }
+}
+
+void clock_note_progress(void)
+{
+    ensure_dilation_lock();
+    EnterCriticalSection(&s_dilation_lock);
+    DWORD now = clock_now_ms();
+    if (s_dilation_started)
+    {
+        advance_dilation(now);
+        s_progress_ms = now;
+    }
+    LeaveCriticalSection(&s_dilation_lock);
+}
+
+DWORD clock_dilate(clock_source source, DWORD now_ms, DWORD max_lag_ms)
+{
+    ensure_dilation_lock();
+    EnterCriticalSection(&s_dilation_lock);
+    s_max_lag_ms = max_lag_ms;
+    advance_dilation(clock_now_ms());
+
+    DWORD value = now_ms - s_lag / 100;
+    if (s_dilated[source] && (int32_t)(value - s_last_dilated[source]) < 0)
+    {
+        value = s_last_dilated[source];
+    }
+    s_dilated[source] = TRUE;
+    s_last_dilated[source] = value;
+    LeaveCriticalSection(&s_dilation_lock);
+    return value;
+}
+
+DWORD clock_dilation_ms(void)
+{
+    ensure_dilation_lock();
+    EnterCriticalSection(&s_dilation_lock);
+    DWORD lag = s_lag / 100;
+    LeaveCriticalSection(&s_dilation_lock);
+    return lag;
+}
+
+/**
+ * Logs the call rate of every source since the last report if
+ * CLOCK_REPORT_MS passed. Only the thread that claims the report writes
+ * s_reported.
+ */
+static void report_calls_if_due(void)
+{
+    LONG  last = s_report_ms;
+    DWORD now = clock_now_ms();
+    DWORD elapsed = now - (DWORD)last;
+
+    if (elapsed < CLOCK_REPORT_MS || InterlockedCompareExchange(&s_report_ms, (LONG)now, last) != last)
+    {
+        return;
+    }
+
+    DWORD rates[CLOCK_SOURCES];
+    for (int i = 0; i < CLOCK_SOURCES; i++)
+    {
+        DWORD calls = (DWORD)s_calls[i];
+        rates[i] = (DWORD)((uint64_t)(calls - s_reported[i]) * 1000 / elapsed);
+        s_reported[i] = calls;
+    }
+    logf("[CLOCK] server.dll calls per second: GetTickCount %lu, timeGetTime %lu, QueryPerformanceCounter %lu",
+         (unsigned long)rates[CLOCK_SOURCE_TICK_COUNT], (unsigned long)rates[CLOCK_SOURCE_TIME_GET_TIME],
+         (unsigned long)rates[CLOCK_SOURCE_PERF_COUNTER]);
+}
+
+void clock_count_call(clock_source source)
+{
+    InterlockedIncrement(&s_calls[source]);
+    if ((InterlockedIncrement(&s_call_checks) & (CLOCK_REPORT_CHECK - 1)) == 0)
+    {
+        report_calls_if_due();
+    }
+}
+
+DWORD clock_call_count(clock_source source)
+{
+    return (DWORD)s_calls[source];
+}
+
+void clock_log_calls(void)
+{
+    logf("[CLOCK] server.dll calls in total: GetTickCount %lu, timeGetTime %lu, QueryPerformanceCounter %lu",
+         (unsigned long)clock_call_count(CLOCK_SOURCE_TICK_COUNT),
+         (unsigned long)clock_call_count(CLOCK_SOURCE_TIME_GET_TIME),
+         (unsigned long)clock_call_count(CLOCK_SOURCE_PERF_COUNTER));
+}
+
+void clock_set_alignment(int64_t offset_us)
+{
+    ensure_dilation_lock();
+    EnterCriticalSection(&s_dilation_lock);
+    s_align_target_us = offset_us;
+    if (!s_align_set)
+    {
+        // Step only while server.dll has not read the clock: a step could send its time backwards
+        s_align_set = TRUE;
+        s_align_us = s_align_read ? 0 : offset_us;
+        s_align_updated_us = clock_now_us();
+        if (s_align_read)
+        {
+            logf("[CLOCK] Slewing server.dll's clock towards the host's: %+.2f ms at up to %d%%",
+                 (double)offset_us / 1000.0, CLOCK_SLEW_PERCENT);
+        }
+        else
+        {
+            logf("[CLOCK] Aligned server.dll's clock to the host: %+.2f ms", (double)offset_us / 1000.0);
+        }
+    }
+    LeaveCriticalSection(&s_dilation_lock);
+}
+
+/**
+ * Moves the applied offset towards the target by at most
+ * CLOCK_SLEW_PERCENT of the time since the last move. Caller must hold
+ * s_dilation_lock and have checked s_align_set.
+ *
+ * @return Offset to apply now, in microseconds
+ */
+static int64_t slew_alignment(void)
+{
+    int64_t now_us = clock_now_us();
+    int64_t step = (now_us - s_align_updated_us) * CLOCK_SLEW_PERCENT / 100;
+    int64_t remaining = s_align_target_us - s_align_us;
+    if (step > 0)
+    {
+        s_align_us += remaining > step ? step : remaining < -step ? -step : remaining;
+        s_align_updated_us = now_us;
+    }
+    return s_align_us;
+}
+
+DWORD clock_align(clock_source source, DWORD now_ms)
+{
+    ensure_dilation_lock();
+    EnterCriticalSection(&s_dilation_lock);
+    s_align_read = TRUE;
+    if (!s_align_set)
+    {
+        LeaveCriticalSection(&s_dilation_lock);
+        return now_ms;
+    }
+
+    DWORD value = now_ms + (DWORD)(slew_alignment() / 1000);
+    if (s_aligned[source] && (int32_t)(value - s_last_aligned[source]) < 0)
+    {
+        value = s_last_aligned[source];
+    }
+    s_aligned[source] = TRUE;
+    s_last_aligned[source] = value;
+    LeaveCriticalSection(&s_dilation_lock);
+    return value;
+}
+
+int64_t clock_alignment_us(void)
+{
+    ensure_dilation_lock();
+    EnterCriticalSection(&s_dilation_lock);
+    int64_t offset = s_align_set ? s_align_us : 0;
+    LeaveCriticalSection(&s_dilation_lock);
+    return offset;
+}
+
+int64_t clock_server_counter(DWORD max_lag_ms, BOOL align)
+{
+    int64_t counter = now_counter();
+    int64_t shift_us = 0;
+
+    ensure_dilation_lock();
+    EnterCriticalSection(&s_dilation_lock);
+    if (max_lag_ms != 0)
+    {
+        s_max_lag_ms = max_lag_ms;
+        advance_dilation(clock_now_ms());
+        shift_us -= (int64_t)s_lag * 10; // s_lag is in hundredths of a millisecond
+    }
+    if (align)
+    {
+        s_align_read = TRUE;
+        shift_us += s_align_set ? slew_alignment() : 0;
+    }
+
+    int64_t value = counter + us_to_counter(shift_us);
+    if (s_dilated[CLOCK_SOURCE_PERF_COUNTER] && value < s_last_counter)
+    {
+        value = s_last_counter;
+    }
+    s_dilated[CLOCK_SOURCE_PERF_COUNTER] = TRUE;
+    s_last_counter = value;
+    LeaveCriticalSection(&s_dilation_lock);
+    return value;
+}
+
+#ifdef NETWORKFIX_TEST
+void clock_reset_shaping(void)
+{
+    ensure_dilation_lock();
+    EnterCriticalSection(&s_dilation_lock);
+    s_dilation_started = FALSE;
+    s_lag = 0;
+    s_peak_lag = 0;
+    memset(s_dilated, 0, sizeof(s_dilated));
+    s_align_set = FALSE;
+    s_align_read = FALSE;
+    s_align_target_us = 0;
+    s_align_us = 0;
+    memset(s_aligned, 0, sizeof(s_aligned));
+    LeaveCriticalSection(&s_dilation_lock);
+}
+#endif
+
+// Per-thread clock_wait_us() timers
+static volatile LONG s_timer_support = 0; // 0 = unknown, 1 = available, 2 = unavailable
+static volatile LONG s_slot_init = 0;     // 0 = not allocated, 1 = allocating, 2 = ready
+static DWORD         s_slot = TLS_OUT_OF_INDEXES;
+
+/**
+ * Returns the calling thread's high-resolution waitable timer, creating it
+ * on the thread's first wait. Each thread keeps its timer for its
+ * lifetime, so a wait costs no kernel object creation; only threads that
+ * call clock_thread_exit() give theirs back, as DllMain gets no
+ * thread-detach notifications. Remembers after the first failure that this
+ * Windows version has no such timers.
+ *
+ * @return Timer handle, or NULL
+ */
+static HANDLE thread_wait_timer(void)
+{
+    if (s_timer_support == 2)
+    {
+        return NULL;
+    }
+    if (s_slot_init != 2)
+    {
+        if (InterlockedCompareExchange(&s_slot_init, 1, 0) == 0)
+        {
+            s_slot = TlsAlloc();
+            InterlockedExchange(&s_slot_init, 2);
+        }
+        while (s_slot_init != 2)
+        {
+            Sleep(0);
+        }
+    }
+    if (s_slot == TLS_OUT_OF_INDEXES)
+    {
+        return NULL;
+    }
+
+    HANDLE timer = (HANDLE)TlsGetValue(s_slot);
+    if (timer)
+    {
+        return timer;
+    }
+    timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (InterlockedCompareExchange(&s_timer_support, timer ? 1 : 2, 0) == 0)
+    {
+        logf("[CLOCK] High-resolution waitable timers %s", timer ? "available" : "unavailable, spinning short waits");
+    }
+    if (timer)
+    {
+        TlsSetValue(s_slot, timer);
+    }
+    return timer;
+}
+
+void clock_thread_exit(void)
+{
+    if (s_slot_init != 2 || s_slot == TLS_OUT_OF_INDEXES)
+    {
+        return;
+    }
+    HANDLE timer = (HANDLE)TlsGetValue(s_slot);
+    if (timer)
+    {
+        TlsSetValue(s_slot, NULL);
+        CloseHandle(timer);
+    }
+}
+
+BOOL clock_wait_us(HANDLE event, DWORD timeout_us)
+{
+    if (timeout_us == 0)
+    {
+        return event && WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+    }
+#ifdef NETWORKFIX_TEST
+    if (s_virtual)
+    {
+        if (event && WaitForSingleObject(event, 0) == WAIT_OBJECT_0)
+        {
+            return TRUE;
+        }
+        clock_advance((timeout_us + 999) / 1000);
+        return FALSE;
+    }
+#endif
+
+    // Setting the timer also clears a signal left over from a wait the event ended early
+    HANDLE        timer = thread_wait_timer();
+    LARGE_INTEGER due;
+    due.QuadPart = -(LONGLONG)timeout_us * 10; // Relative, in 100 ns units
+    if (timer && SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE))
+    {
+        HANDLE handles[2] = {timer, event};
+        DWORD  result = WaitForMultipleObjects(event ? 2 : 1, handles, FALSE, INFINITE);
+        return result == WAIT_OBJECT_0 + 1;
+    }
+
+    // Blocking waits end on a timer tick, so block only while that cannot overshoot the deadline by much
+    int64_t deadline = counter_us() + timeout_us;
+    for (;;)
+    {
+        int64_t remaining = deadline - counter_us();
+        if (remaining <= 0)
+        {
+            return event && WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+        }
+        DWORD block_ms = remaining > CLOCK_WAIT_SPIN_US ? (DWORD)((remaining - CLOCK_WAIT_SPIN_US) / 1000) : 0;
+        if (event && WaitForSingleObject(event, block_ms) == WAIT_OBJECT_0)
+        {
+            return TRUE;
+        }
+        if (!event && block_ms > 0)
+        {
+            Sleep(block_ms);
+        }
+        else if (block_ms == 0)
+        {
+            SwitchToThread();
+        }
+    }
+}
+
+// Upper bounds of the wake-up delay buckets in microseconds; the last bucket is open
+static const DWORD SLEEP_LATE_LIMITS_US[CLOCK_SLEEP_BUCKETS - 1] = {100, 500, 1000, 2000, 5000, 10000, 16000};
+
+void clock_sleep(DWORD ms, void(WINAPI *coarse)(DWORD))
+{
+    int64_t start = counter_us();
+    if (coarse)
+    {
+        coarse(ms);
+    }
+    else
+    {
+        clock_wait_us(NULL, ms * 1000);
+    }
+    int64_t actual = counter_us() - start;
+    int64_t late = actual - (int64_t)ms * 1000;
+    int     bucket = 0;
+
+    while (bucket < CLOCK_SLEEP_BUCKETS - 1 && late >= (int64_t)SLEEP_LATE_LIMITS_US[bucket])
+    {
+        bucket++;
+    }
+
+    ensure_dilation_lock();
+    EnterCriticalSection(&s_dilation_lock);
+    s_sleeps.calls++;
+    s_sleeps.precise += coarse == NULL;
+    s_sleeps.requested_us += (uint64_t)ms * 1000;
+    s_sleeps.actual_us += (uint64_t)actual;
+    s_sleeps.max_late_us = late > s_sleeps.max_late_us ? late : s_sleeps.max_late_us;
+    s_sleeps.late[bucket]++;
+    LeaveCriticalSection(&s_dilation_lock);
+}
+
+clock_sleep_stats clock_get_sleep_stats(void)
+{
+    ensure_dilation_lock();
+    EnterCriticalSection(&s_dilation_lock);
+    clock_sleep_stats stats = s_sleeps;
+    LeaveCriticalSection(&s_dilation_lock);
+    return stats;
+}
+
+void clock_log_sleeps(void)
+{
+    clock_sleep_stats stats = clock_get_sleep_stats();
+    if (stats.calls == 0)
+    {
+        return;
+    }
+
+    char histogram[256];
+    int  used = 0;
+    for (int i = 0; i < CLOCK_SLEEP_BUCKETS && used < (int)sizeof(histogram); i++)
+    {
+        used += i < CLOCK_SLEEP_BUCKETS - 1
+                    ? snprintf(histogram + used, sizeof(histogram) - used, "%s<%.1f ms %lu", i ? ", " : "",
+                               SLEEP_LATE_LIMITS_US[i] / 1000.0, (unsigned long)stats.late[i])
+                    : snprintf(histogram + used, sizeof(histogram) - used, ", >=%.1f ms %lu",
+                               SLEEP_LATE_LIMITS_US[i - 1] / 1000.0, (unsigned long)stats.late[i]);
+    }
+    logf("[CLOCK] server.dll Sleep: %lu calls (%lu high-resolution), requested %.1f ms, slept %.1f ms, "
+         "avg %.2f ms late, max %.2f ms",
+         (unsigned long)stats.calls, (unsigned long)stats.precise, stats.requested_us / 1000.0,
+         stats.actual_us / 1000.0,
+         (double)((int64_t)stats.actual_us - (int64_t)stats.requested_us) / stats.calls / 1000.0,
+         stats.max_late_us / 1000.0);
+    logf("[CLOCK] server.dll Sleep wake-up delay: %s", histogram);
+}
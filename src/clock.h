@@ -0,0 +1,235 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <windows.h>
+
+#define CLOCK_STALL_MS 500          // Time without received data after which the network counts as stalled
+#define CLOCK_STALL_RATE_PERCENT 25 // Speed of dilated time during a stall
+#define CLOCK_CATCH_UP_PERCENT 150  // Speed of dilated time while it catches up after the stall
+
+#define CLOCK_SLEW_PERCENT 5 // Largest speed change an alignment makes to server.dll's time
+
+#define CLOCK_REPORT_MS 60000   // Interval between logged call rates of server.dll's time sources
+#define CLOCK_REPORT_CHECK 1024 // Calls between checks whether a report is due (power of two)
+
+/**
+ * Time sources server.dll can read, served from this clock.
+ */
+typedef enum
+{
+    CLOCK_SOURCE_TICK_COUNT,    // GetTickCount
+    CLOCK_SOURCE_TIME_GET_TIME, // timeGetTime
+    CLOCK_SOURCE_PERF_COUNTER,  // QueryPerformanceCounter
+    CLOCK_SOURCES
+} clock_source;
+
+#define CLOCK_WAIT_SPIN_US 2000 // Without high-resolution timers, the last part of a wait is spun instead of blocked
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002 // Windows 10 1803 and later
+#endif
+
+#define CLOCK_SLEEP_MAX_MS 100 // Longer Sleep() calls from server.dll are passed through and not timed
+#define CLOCK_SLEEP_BUCKETS 8  // Wake-up delay histogram buckets, see clock.c
+
+/**
+ * Sleep() calls from server.dll timed by clock_sleep().
+ */
+typedef struct
+{
+    uint32_t calls;                     // Sleeps timed
+    uint32_t precise;                   // Of those, served by clock_wait_us()
+    uint64_t requested_us;              // Total time asked for
+    uint64_t actual_us;                 // Total time until the caller ran again
+    int64_t  max_late_us;               // Longest wake-up delay
+    uint32_t late[CLOCK_SLEEP_BUCKETS]; // Wake-up delay histogram
+} clock_sleep_stats;
+
+/**
+ * Starts the clock. clock_now_ms() continues from base_ms, so switching a
+ * caller from GetTickCount() to this clock does not make time jump.
+ *
+ * @param base_ms Value clock_now_ms() returns right now, normally GetTickCount()
+ */
+void clock_init(DWORD base_ms);
+
+/**
+ * Returns the clock behind clock_now_ms() in microseconds, as a 64-bit
+ * count that does not wrap, for timestamps exchanged with peers.
+ */
+int64_t clock_now_us(void);
+
+/**
+ * Returns the tick count the plugin's own timeouts and rate limits use:
+ * GetTickCount(), or virtual time in tests that called clock_set_virtual().
+ */
+DWORD clock_ticks(void);
+
+#ifdef NETWORKFIX_TEST
+/**
+ * Switches clock_ticks() and clock_now_ms() to virtual time, which only
+ * moves when clock_advance() is called, so tests can fast-forward through
+ * timeouts deterministically. Virtual time starts at the current
+ * clock_now_ms(), so switching does not make time jump.
+ *
+ * @param enabled TRUE for virtual time, FALSE for real time
+ */
+void clock_set_virtual(BOOL enabled);
+
+/**
+ * Advances virtual time. The test build's Sleep() replacement calls this,
+ * so retry loops that sleep move virtual time forward as they would move
+ * real time.
+ *
+ * @param ms Milliseconds to add
+ */
+void clock_advance(DWORD ms);
+
+/**
+ * Forgets the dilation lag, the alignment and every source's monotonic
+ * guard, so a test starts from unshaped time.
+ */
+void clock_reset_shaping(void);
+#endif
+
+/**
+ * Makes the clock read the performance counter through the given function.
+ * Once QueryPerformanceCounter is hooked, pass the hook's trampoline so the
+ * clock does not go through the hook itself.
+ *
+ * @param query Original QueryPerformanceCounter
+ */
+void clock_use_counter(BOOL(WINAPI *query)(LARGE_INTEGER *));
+
+/**
+ * Returns milliseconds derived from QueryPerformanceCounter. Advances every
+ * millisecond instead of in 10-16 ms steps, never goes backwards, and wraps
+ * after 49.7 days like GetTickCount(). Thread-safe; starts itself from
+ * GetTickCount() if clock_init() was not called.
+ */
+DWORD clock_now_ms(void);
+
+/**
+ * Records that data arrived, ending a stall.
+ */
+void clock_note_progress(void);
+
+/**
+ * Shapes a millisecond time for server.dll: once no data arrived for
+ * CLOCK_STALL_MS, the returned time falls behind at
+ * (100 - CLOCK_STALL_RATE_PERCENT)% until it lags max_lag_ms, and after
+ * the next arrival it runs at CLOCK_CATCH_UP_PERCENT% until the lag is
+ * gone. All sources share one lag, so they stay in step; each source's
+ * result never goes backwards. Thread-safe.
+ *
+ * @param source Time source now_ms was read from
+ * @param now_ms Undilated time in milliseconds
+ * @param max_lag_ms Largest lag a stall may build up
+ * @return now_ms minus the current lag
+ */
+DWORD clock_dilate(clock_source source, DWORD now_ms, DWORD max_lag_ms);
+
+/**
+ * Returns the current lag of clock_dilate() in milliseconds.
+ */
+DWORD clock_dilation_ms(void);
+
+/**
+ * Sets how far server.dll's clock should be ahead of this machine's, as
+ * estimated against the host. The offset is approached gradually, never
+ * changing the speed of server.dll's time by more than CLOCK_SLEW_PERCENT%,
+ * so its time never runs backwards. Only a first call before server.dll
+ * read an aligned source steps to the offset at once. Thread-safe.
+ *
+ * @param offset_us Host clock minus ours
+ */
+void clock_set_alignment(int64_t offset_us);
+
+/**
+ * Adds the current alignment offset to a millisecond time for server.dll.
+ * Returns now_ms unchanged until clock_set_alignment() was called. Each
+ * source's result never goes backwards. Thread-safe.
+ *
+ * @param source Time source now_ms was read from
+ * @param now_ms Time in milliseconds, after dilation
+ * @return Aligned time
+ */
+DWORD clock_align(clock_source source, DWORD now_ms);
+
+/**
+ * Returns the alignment offset currently applied, in microseconds.
+ */
+int64_t clock_alignment_us(void);
+
+/**
+ * Returns QueryPerformanceCounter for server.dll: the counter behind
+ * clock_now_us() (virtual time in tests), held back by the dilation lag of
+ * clock_dilate() and shifted by the offset of clock_align(). The result
+ * never goes backwards. Thread-safe.
+ *
+ * @param max_lag_ms Largest lag a stall may build up (0 = no dilation)
+ * @param align TRUE to add the alignment offset (ClockSync=2)
+ * @return Counter value in QueryPerformanceFrequency() units
+ */
+int64_t clock_server_counter(DWORD max_lag_ms, BOOL align);
+
+/**
+ * Counts a call from server.dll to a time source. Every CLOCK_REPORT_MS
+ * the call rates since the last report are logged. Thread-safe.
+ */
+void clock_count_call(clock_source source);
+
+/**
+ * Returns the number of calls counted for a time source since startup.
+ */
+DWORD clock_call_count(clock_source source);
+
+/**
+ * Logs the call counts of every time source since startup.
+ */
+void clock_log_calls(void);
+
+/**
+ * Waits for an event, or only for the time if event is NULL, with
+ * microsecond precision and without changing the system timer resolution.
+ * Uses a high-resolution waitable timer where Windows has one (10 1803 and
+ * later), created once per thread and reused; elsewhere blocks in whole
+ * milliseconds until CLOCK_WAIT_SPIN_US remain and yields in a loop for
+ * the rest. Measures real time, except in tests on virtual time, where a
+ * wait the event does not end only advances virtual time by the timeout,
+ * rounded up to whole milliseconds.
+ *
+ * @param event Event to wait for, or NULL
+ * @param timeout_us Longest wait in microseconds (0 = only check the event)
+ * @return TRUE if the event was signaled, FALSE if the time ran out
+ */
+BOOL clock_wait_us(HANDLE event, DWORD timeout_us);
+
+/**
+ * Closes the calling thread's clock_wait_us() timer. Threads the plugin
+ * starts for a single job call this before they exit, as DllMain gets no
+ * thread-detach notifications to do it for them.
+ */
+void clock_thread_exit(void);
+
+/**
+ * Sleeps for a server.dll Sleep() call and records how late it woke up.
+ * Thread-safe.
+ *
+ * @param ms Requested time in milliseconds
+ * @param coarse Original Sleep() to measure, or NULL to sleep with clock_wait_us()
+ */
+void clock_sleep(DWORD ms, void(WINAPI *coarse)(DWORD));
+
+/**
+ * Returns a copy of the Sleep() counters.
+ */
+clock_sleep_stats clock_get_sleep_stats(void);
+
+/**
+ * Logs the Sleep() counters: requested against actual time and the
+ * wake-up delay histogram.
+ */
+void clock_log_sleeps(void);
+
+#endif // CLOCK_H
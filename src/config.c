@@ -0,0 +1,251 @@
+/*
+ * config.c: Runtime options for the network fix read from game.ini.
+ *
+ * The plugin's own settings live in a [NetworkFix] section next to the
+ * game's [Network] section. All options are opt-in; defaults reproduce
+ * the original hook behavior.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "config.h"
+#include "logging.h"
+#include <shlwapi.h>
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+
+// Defaults
+#define DEFAULT_NEGOTIATE_TIMEOUT_MS 3000
+#define DEFAULT_STATS_INTERVAL_MS 60000
+#define DEFAULT_DEAD_PEER_TIMEOUT_MS 10000
+#define DEFAULT_RESUME_TIMEOUT_MS 20000
+#define DEFAULT_RESUME_BUFFER_KB 256
+#define MAX_RESUME_BUFFER_KB 8192
+#define MAX_SEND_QUEUE_KB 8192
+#define MIN_TUNNEL_MTU 576 // Smallest MTU every IPv4 path carries
+#define MAX_TIME_DILATION_MS 60000
+#define MAX_RECV_WAIT_US 5000
+
+networkfix_config g_config = {
+    FALSE,                        // compression
+    FALSE,                        // delta_encoding
+    DEFAULT_NEGOTIATE_TIMEOUT_MS, // negotiate_timeout_ms
+    DEFAULT_STATS_INTERVAL_MS,    // stats_interval_ms
+    0,                            // heartbeat_interval_ms
+    DEFAULT_DEAD_PEER_TIMEOUT_MS, // dead_peer_timeout_ms
+    FALSE,                        // session_resume
+    DEFAULT_RESUME_TIMEOUT_MS,    // resume_timeout_ms
+    DEFAULT_RESUME_BUFFER_KB,     // resume_buffer_kb
+    FALSE,                        // udp_tunnel
+    FALSE,                        // tunnel_pacing
+    0,                            // tunnel_mtu
+    0,                            // impair_loss_percent
+    0,                            // impair_delay_ms
+    0,                            // impair_jitter_ms
+    0,                            // impair_rate_kbps
+    0,                            // impair_mtu
+    FALSE,                        // shared_memory
+    0,                            // send_queue_kb
+    FALSE,                        // high_res_clock
+    0,                            // time_dilation_ms
+    CLOCK_SYNC_OFF,               // clock_sync
+    FALSE,                        // frame_profiler
+    FALSE,                        // select_cache
+    0,                            // recv_wait_us
+    HIGH_RES_SLEEP_OFF,           // high_res_sleep
+    FALSE,                        // overlapped_io
+    FALSE,                        // buffer_tuning
+    SOCKET_PROFILE_OFF,           // socket_profile
+    FALSE,                        // auto_profile
+};
+
+BOOL get_ini_path(HMODULE hModule, char *ini_path, size_t ini_path_size)
+{
+    if (hModule == NULL)
+    {
+        logf("[CONFIG] Module handle is NULL.");
+        return FALSE;
+    }
+
+    // Get the path of the DLL using GetModuleFileNameA()
+    if (GetModuleFileNameA(hModule, ini_path, (DWORD)ini_path_size) == 0)
+    {
+        logf("[CONFIG] Failed to get module file name: %lu", GetLastError());
+        return FALSE;
+    }
+
+    // Remove filename and append game.ini using Path API
+    if (!PathRemoveFileSpecA(ini_path))
+    {
+        logf("[CONFIG] Could not remove file spec from module path: %s", ini_path);
+        return FALSE;
+    }
+
+    if (!PathCombineA(ini_path, ini_path, "game.ini"))
+    {
+        logf("[CONFIG] Could not combine path with game.ini");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void reset_config(void)
+{
+    g_config.compression = FALSE;
+    g_config.delta_encoding = FALSE;
+    g_config.negotiate_timeout_ms = DEFAULT_NEGOTIATE_TIMEOUT_MS;
+    g_config.stats_interval_ms = DEFAULT_STATS_INTERVAL_MS;
+    g_config.heartbeat_interval_ms = 0;
+    g_config.dead_peer_timeout_ms = DEFAULT_DEAD_PEER_TIMEOUT_MS;
+    g_config.session_resume = FALSE;
+    g_config.resume_timeout_ms = DEFAULT_RESUME_TIMEOUT_MS;
+    g_config.resume_buffer_kb = DEFAULT_RESUME_BUFFER_KB;
+    g_config.udp_tunnel = FALSE;
+    g_config.tunnel_pacing = FALSE;
+    g_config.tunnel_mtu = 0;
+    g_config.impair_loss_percent = 0;
+    g_config.impair_delay_ms = 0;
+    g_config.impair_jitter_ms = 0;
+    g_config.impair_rate_kbps = 0;
+    g_config.impair_mtu = 0;
+    g_config.shared_memory = FALSE;
+    g_config.send_queue_kb = 0;
+    g_config.high_res_clock = FALSE;
+    g_config.time_dilation_ms = 0;
+    g_config.clock_sync = CLOCK_SYNC_OFF;
+    g_config.frame_profiler = FALSE;
+    g_config.select_cache = FALSE;
+    g_config.recv_wait_us = 0;
+    g_config.high_res_sleep = HIGH_RES_SLEEP_OFF;
+    g_config.overlapped_io = FALSE;
+    g_config.buffer_tuning = FALSE;
+    g_config.socket_profile = SOCKET_PROFILE_OFF;
+    g_config.auto_profile = FALSE;
+}
+
+/**
+ * Reads an unsigned integer option from the [NetworkFix] section.
+ *
+ * @param ini_path Path to game.ini
+ * @param key Option name
+ * @param default_value Value used when the key is absent
+ * @return Configured or default value
+ */
+static DWORD read_config_uint(const char *ini_path, const char *key, DWORD default_value)
+{
+    return (DWORD)GetPrivateProfileIntA(CONFIG_SECTION, key, (int)default_value, ini_path);
+}
+
+void load_config(HMODULE hModule)
+{
+    char iniPath[MAX_PATH];
+
+    reset_config();
+    if (!get_ini_path(hModule, iniPath, sizeof(iniPath)))
+    {
+        logf("[CONFIG] Using default options");
+        return;
+    }
+
+    g_config.compression = read_config_uint(iniPath, "Compression", g_config.compression) != 0;
+    g_config.delta_encoding = read_config_uint(iniPath, "DeltaEncoding", g_config.delta_encoding) != 0;
+    g_config.negotiate_timeout_ms = read_config_uint(iniPath, "NegotiateTimeoutMs", g_config.negotiate_timeout_ms);
+    g_config.stats_interval_ms = read_config_uint(iniPath, "StatsIntervalMs", g_config.stats_interval_ms);
+    g_config.heartbeat_interval_ms = read_config_uint(iniPath, "HeartbeatIntervalMs", g_config.heartbeat_interval_ms);
+    g_config.dead_peer_timeout_ms = read_config_uint(iniPath, "DeadPeerTimeoutMs", g_config.dead_peer_timeout_ms);
+    g_config.session_resume = read_config_uint(iniPath, "SessionResume", g_config.session_resume) != 0;
+    g_config.resume_timeout_ms = read_config_uint(iniPath, "ResumeTimeoutMs", g_config.resume_timeout_ms);
+    g_config.resume_buffer_kb = read_config_uint(iniPath, "ResumeBufferKB", g_config.resume_buffer_kb);
+    if (g_config.resume_buffer_kb == 0 || g_config.resume_buffer_kb > MAX_RESUME_BUFFER_KB)
+    {
+        logf("[CONFIG] ResumeBufferKB=%lu out of range, using %d", g_config.resume_buffer_kb, DEFAULT_RESUME_BUFFER_KB);
+        g_config.resume_buffer_kb = DEFAULT_RESUME_BUFFER_KB;
+    }
+
+    g_config.udp_tunnel = read_config_uint(iniPath, "UdpTunnel", g_config.udp_tunnel) != 0;
+    g_config.tunnel_pacing = read_config_uint(iniPath, "TunnelPacing", g_config.tunnel_pacing) != 0;
+    g_config.tunnel_mtu = read_config_uint(iniPath, "TunnelMtu", g_config.tunnel_mtu);
+    if (g_config.tunnel_mtu != 0 && g_config.tunnel_mtu < MIN_TUNNEL_MTU)
+    {
+        logf("[CONFIG] TunnelMtu=%lu out of range, using %d", g_config.tunnel_mtu, MIN_TUNNEL_MTU);
+        g_config.tunnel_mtu = MIN_TUNNEL_MTU;
+    }
+    g_config.impair_loss_percent = read_config_uint(iniPath, "ImpairLossPercent", g_config.impair_loss_percent);
+    g_config.impair_delay_ms = read_config_uint(iniPath, "ImpairDelayMs", g_config.impair_delay_ms);
+    g_config.impair_jitter_ms = read_config_uint(iniPath, "ImpairJitterMs", g_config.impair_jitter_ms);
+    g_config.impair_rate_kbps = read_config_uint(iniPath, "ImpairRateKbps", g_config.impair_rate_kbps);
+    g_config.impair_mtu = read_config_uint(iniPath, "ImpairMtu", g_config.impair_mtu);
+    if (g_config.impair_loss_percent > 100)
+    {
+        logf("[CONFIG] ImpairLossPercent=%lu out of range, using 100", g_config.impair_loss_percent);
+        g_config.impair_loss_percent = 100;
+    }
+    g_config.shared_memory = read_config_uint(iniPath, "SharedMemory", g_config.shared_memory) != 0;
+    g_config.send_queue_kb = read_config_uint(iniPath, "SendQueueKB", g_config.send_queue_kb);
+    if (g_config.send_queue_kb > MAX_SEND_QUEUE_KB)
+    {
+        logf("[CONFIG] SendQueueKB=%lu out of range, using %d", g_config.send_queue_kb, MAX_SEND_QUEUE_KB);
+        g_config.send_queue_kb = MAX_SEND_QUEUE_KB;
+    }
+    g_config.select_cache = read_config_uint(iniPath, "SelectCache", g_config.select_cache) != 0;
+    g_config.recv_wait_us = read_config_uint(iniPath, "RecvWaitUs", g_config.recv_wait_us);
+    if (g_config.recv_wait_us > MAX_RECV_WAIT_US)
+    {
+        logf("[CONFIG] RecvWaitUs=%lu out of range, using %d", g_config.recv_wait_us, MAX_RECV_WAIT_US);
+        g_config.recv_wait_us = MAX_RECV_WAIT_US;
+    }
+    g_config.overlapped_io = read_config_uint(iniPath, "OverlappedIo", g_config.overlapped_io) != 0;
+    g_config.buffer_tuning = read_config_uint(iniPath, "BufferTuning", g_config.buffer_tuning) != 0;
+    g_config.socket_profile = read_config_uint(iniPath, "SocketProfile", g_config.socket_profile);
+    if (g_config.socket_profile > SOCKET_PROFILE_VPN_LOSSY)
+    {
+        logf("[CONFIG] SocketProfile=%lu out of range, using %d", g_config.socket_profile, SOCKET_PROFILE_OFF);
+        g_config.socket_profile = SOCKET_PROFILE_OFF;
+    }
+    g_config.auto_profile = read_config_uint(iniPath, "AutoProfile", g_config.auto_profile) != 0;
+    g_config.high_res_clock = read_config_uint(iniPath, "HighResClock", g_config.high_res_clock) != 0;
+    g_config.time_dilation_ms = read_config_uint(iniPath, "TimeDilationMs", g_config.time_dilation_ms);
+    if (g_config.time_dilation_ms > MAX_TIME_DILATION_MS)
+    {
+        logf("[CONFIG] TimeDilationMs=%lu out of range, using %d", g_config.time_dilation_ms, MAX_TIME_DILATION_MS);
+        g_config.time_dilation_ms = MAX_TIME_DILATION_MS;
+    }
+    g_config.clock_sync = read_config_uint(iniPath, "ClockSync", g_config.clock_sync);
+    if (g_config.clock_sync > CLOCK_SYNC_ALIGN)
+    {
+        logf("[CONFIG] ClockSync=%lu out of range, using %d", g_config.clock_sync, CLOCK_SYNC_ALIGN);
+        g_config.clock_sync = CLOCK_SYNC_ALIGN;
+    }
+    g_config.frame_profiler = read_config_uint(iniPath, "FrameProfiler", g_config.frame_profiler) != 0;
+    g_config.high_res_sleep = read_config_uint(iniPath, "HighResSleep", g_config.high_res_sleep);
+    if (g_config.high_res_sleep > HIGH_RES_SLEEP_ON)
+    {
+        logf("[CONFIG] HighResSleep=%lu out of range, using %d", g_config.high_res_sleep, HIGH_RES_SLEEP_ON);
+        g_config.high_res_sleep = HIGH_RES_SLEEP_ON;
+    }
+
+    logf("[CONFIG] Options: Compression=%d, DeltaEncoding=%d, NegotiateTimeoutMs=%lu, StatsIntervalMs=%lu, "
+         "HeartbeatIntervalMs=%lu, DeadPeerTimeoutMs=%lu, SessionResume=%d, ResumeTimeoutMs=%lu, ResumeBufferKB=%lu",
+         g_config.compression, g_config.delta_encoding, g_config.negotiate_timeout_ms, g_config.stats_interval_ms,
+         g_config.heartbeat_interval_ms, g_config.dead_peer_timeout_ms, g_config.session_resume,
+         g_config.resume_timeout_ms, g_config.resume_buffer_kb);
+    logf("[CONFIG] Transport options: UdpTunnel=%d, TunnelPacing=%d, TunnelMtu=%lu, ImpairLossPercent=%lu, "
+         "ImpairDelayMs=%lu, ImpairJitterMs=%lu, ImpairRateKbps=%lu, ImpairMtu=%lu, SharedMemory=%d, SendQueueKB=%lu, "
+         "SelectCache=%d, RecvWaitUs=%lu, OverlappedIo=%d, BufferTuning=%d, SocketProfile=%lu, AutoProfile=%d",
+         g_config.udp_tunnel, g_config.tunnel_pacing, g_config.tunnel_mtu, g_config.impair_loss_percent,
+         g_config.impair_delay_ms, g_config.impair_jitter_ms, g_config.impair_rate_kbps, g_config.impair_mtu,
+         g_config.shared_memory, g_config.send_queue_kb, g_config.select_cache, g_config.recv_wait_us,
+         g_config.overlapped_io, g_config.buffer_tuning, g_config.socket_profile, g_config.auto_profile);
+    logf("[CONFIG] Clock options: HighResClock=%d, TimeDilationMs=%lu, ClockSync=%lu, FrameProfiler=%d, "
+         "HighResSleep=%lu",
+         g_config.high_res_clock, g_config.time_dilation_ms, g_config.clock_sync, g_config.frame_profiler,
+         g_config.high_res_sleep);
+}
+
+BOOL peer_protocol_enabled(void)
+{
+    return g_config.compression || g_config.delta_encoding || g_config.heartbeat_interval_ms != 0 ||
+           g_config.session_resume || g_config.udp_tunnel || g_config.shared_memory ||
+           g_config.clock_sync != CLOCK_SYNC_OFF;
+}
@@ -0,0 +1,94 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <windows.h>
+
+#define CONFIG_SECTION "NetworkFix" // game.ini section holding the plugin's own options
+
+// ClockSync values
+#define CLOCK_SYNC_OFF 0
+#define CLOCK_SYNC_MEASURE 1 // Estimate the clock offset to patched peers and log it
+#define CLOCK_SYNC_ALIGN 2   // Also align server.dll's clock to the host's
+
+// HighResSleep values
+#define HIGH_RES_SLEEP_OFF 0
+#define HIGH_RES_SLEEP_MEASURE 1 // Time server.dll's short Sleep() calls and log how late they wake up
+#define HIGH_RES_SLEEP_ON 2      // Also serve them from a high-resolution timer
+
+// SocketProfile values
+#define SOCKET_PROFILE_OFF 0       // Leave every socket on Windows defaults
+#define SOCKET_PROFILE_LAN 1       // Low round trip, no loss: small buffers, fast dead-link detection
+#define SOCKET_PROFILE_VPN 2       // Tunnel (Hamachi, Radmin, ...) with a longer but steady round trip
+#define SOCKET_PROFILE_VPN_LOSSY 3 // Tunnel that drops packets: larger buffers, patient keepalives
+
+/**
+ * Runtime options read from the [NetworkFix] section of game.ini.
+ * Every option defaults to the plugin's original behavior so an absent
+ * section or key changes nothing.
+ */
+typedef struct
+{
+    BOOL  compression;           // Compression=1: LZ4-compress game data between patched peers
+    BOOL  delta_encoding;        // DeltaEncoding=1: send repeated messages as deltas between patched peers
+    DWORD negotiate_timeout_ms;  // NegotiateTimeoutMs: how long to wait for a patched peer to answer
+    DWORD stats_interval_ms;     // StatsIntervalMs: per-socket statistics log interval (0 = only on close)
+    DWORD heartbeat_interval_ms; // HeartbeatIntervalMs: PING interval between patched peers (0 = off)
+    DWORD dead_peer_timeout_ms;  // DeadPeerTimeoutMs: silence after which a heartbeat peer is dead (0 = never)
+    BOOL  session_resume;        // SessionResume=1: reconnect and replay after brief drops between patched peers
+    DWORD resume_timeout_ms;     // ResumeTimeoutMs: how long a lost session may take to reconnect
+    DWORD resume_buffer_kb;      // ResumeBufferKB: replay buffer per socket
+    BOOL  udp_tunnel;            // UdpTunnel=1: carry the game stream over reliable UDP between patched peers
+    BOOL  tunnel_pacing;         // TunnelPacing=1: pace the tunnel at its measured bandwidth instead of filling queues
+    DWORD tunnel_mtu;            // TunnelMtu: path MTU to size tunnel datagrams for (0 = discover it with probes)
+    DWORD impair_loss_percent;   // ImpairLossPercent: testing only, drop this share of tunnel datagrams
+    DWORD impair_delay_ms;       // ImpairDelayMs: testing only, delay every tunnel datagram
+    DWORD impair_jitter_ms;      // ImpairJitterMs: testing only, random extra delay (reorders datagrams)
+    DWORD impair_rate_kbps;      // ImpairRateKbps: testing only, bottleneck bandwidth for tunnel datagrams
+    DWORD impair_mtu;            // ImpairMtu: testing only, path MTU above which tunnel datagrams are fragmented
+    BOOL  shared_memory;         // SharedMemory=1: use a shared-memory ring between patched peers on the same host
+    DWORD send_queue_kb;         // SendQueueKB: per-socket queue for sends a slow receiver cannot take yet (0 = off)
+    BOOL  high_res_clock;        // HighResClock=1: give server.dll a millisecond-smooth GetTickCount
+    DWORD time_dilation_ms;      // TimeDilationMs: slow server.dll's clock by up to this much while no data arrives
+    DWORD clock_sync;            // ClockSync: CLOCK_SYNC_MEASURE or CLOCK_SYNC_ALIGN with patched peers (0 = off)
+    BOOL  frame_profiler;        // FrameProfiler=1: log frame time histograms per game thread
+    BOOL  select_cache;          // SelectCache=1: answer server.dll's select()/WSAPoll() from an event-driven watcher
+    DWORD recv_wait_us;          // RecvWaitUs: wait this long for data once a socket keeps coming up empty (0 = off)
+    DWORD high_res_sleep;        // HighResSleep: HIGH_RES_SLEEP_MEASURE or HIGH_RES_SLEEP_ON for server.dll (0 = off)
+    BOOL  overlapped_io;         // OverlappedIo=1: serve server.dll's sockets from an I/O completion port engine
+    BOOL  buffer_tuning;         // BufferTuning=1: grow SO_SNDBUF/SO_RCVBUF on sockets that keep running full
+    DWORD socket_profile;        // SocketProfile: SOCKET_PROFILE_* options to set on every connection (0 = off)
+    BOOL  auto_profile;          // AutoProfile=1: classify each connection as LAN or VPN and retune it while it runs
+} networkfix_config;
+
+extern networkfix_config g_config;
+
+/**
+ * Builds the path of game.ini next to the given module.
+ *
+ * @param hModule Module handle to determine DLL location
+ * @param ini_path Output buffer for the path
+ * @param ini_path_size Size of ini_path in bytes
+ * @return TRUE if the path was built, FALSE on failure
+ */
+BOOL get_ini_path(HMODULE hModule, char *ini_path, size_t ini_path_size);
+
+/**
+ * Loads g_config from game.ini. Missing keys keep their defaults.
+ *
+ * @param hModule Module handle to determine DLL location (NULL keeps defaults)
+ */
+void load_config(HMODULE hModule);
+
+/**
+ * Restores every option in g_config to its default value.
+ */
+void reset_config(void);
+
+/**
+ * Returns TRUE if any option needs the framed peer protocol.
+ */
+BOOL peer_protocol_enabled(void);
+
+#endif // CONFIG_H
@@ -0,0 +1,217 @@
+/*
+ * delta.c: XOR delta encoding of game messages against recent history.
+ *
+ * server.dll resends many messages (state updates, keep-alives) with only a
+ * few bytes changed. A message that matches a recent one of the same length
+ * is sent as runs of XOR bytes covering just the changed ranges. Scanning
+ * for changed ranges uses SSE2 to skip 16 equal bytes per compare.
+ */
+
+#include "delta.h"
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static void put_u16(uint8_t *p, int v)
+{
+    p[0] = (uint8_t)(v & 0xFF);
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static int get_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/**
+ * Returns the first index >= pos where a and b differ, or len.
+ */
+static int next_diff(const uint8_t *a, const uint8_t *b, int len, int pos)
+{
+#if defined(__SSE2__)
+    while (pos + 16 <= len)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + pos));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + pos));
+        int     equal = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (equal != 0xFFFF)
+        {
+            return pos + __builtin_ctz(~equal & 0xFFFF);
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < len && a[pos] == b[pos])
+    {
+        pos++;
+    }
+    return pos;
+}
+
+/**
+ * Returns the first index >= pos where a and b are equal, or len.
+ */
+static int next_equal(const uint8_t *a, const uint8_t *b, int len, int pos)
+{
+#if defined(__SSE2__)
+    while (pos + 16 <= len)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + pos));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + pos));
+        int     equal = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (equal != 0)
+        {
+            return pos + __builtin_ctz(equal);
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < len && a[pos] != b[pos])
+    {
+        pos++;
+    }
+    return pos;
+}
+
+int delta_count_diff(const uint8_t *a, const uint8_t *b, int len)
+{
+    int diff = 0;
+    int pos = 0;
+
+#if defined(__SSE2__)
+    for (; pos + 16 <= len; pos += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + pos));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + pos));
+        diff += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)));
+    }
+#endif
+    for (; pos < len; pos++)
+    {
+        diff += a[pos] != b[pos];
+    }
+    return diff;
+}
+
+int delta_encode(const uint8_t *msg, const uint8_t *ref, int len, uint8_t *out, int out_capacity)
+{
+    int out_len = 0;
+    int prev_end = 0;
+    int pos = next_diff(msg, ref, len, 0);
+
+    while (pos < len)
+    {
+        int run_start = pos;
+        int run_end;
+
+        // Equal gaps shorter than a run header are cheaper to include in the run
+        for (;;)
+        {
+            run_end = next_equal(msg, ref, len, pos);
+            pos = next_diff(msg, ref, len, run_end);
+            if (pos >= len || pos - run_end > DELTA_RUN_HEADER_SIZE)
+            {
+                break;
+            }
+        }
+
+        int count = run_end - run_start;
+        if (out_capacity - out_len < DELTA_RUN_HEADER_SIZE + count)
+        {
+            return -1;
+        }
+        put_u16(out + out_len, run_start - prev_end);
+        put_u16(out + out_len + 2, count);
+        out_len += DELTA_RUN_HEADER_SIZE;
+        for (int i = run_start; i < run_end; i++)
+        {
+            out[out_len++] = msg[i] ^ ref[i];
+        }
+        prev_end = run_end;
+    }
+
+    return out_len;
+}
+
+int delta_apply(const uint8_t *ref, int len, const uint8_t *runs, int runs_len, uint8_t *out)
+{
+    int in = 0;
+    int pos = 0;
+
+    if (!ref || !out || len < 0 || runs_len < 0)
+    {
+        return -1;
+    }
+    memcpy(out, ref, len);
+
+    while (in < runs_len)
+    {
+        if (runs_len - in < DELTA_RUN_HEADER_SIZE)
+        {
+            return -1;
+        }
+        int skip = get_u16(runs + in);
+        int count = get_u16(runs + in + 2);
+        in += DELTA_RUN_HEADER_SIZE;
+
+        if (count == 0 || skip > len - pos || count > len - pos - skip || count > runs_len - in)
+        {
+            return -1;
+        }
+        pos += skip;
+        for (int i = 0; i < count; i++)
+        {
+            out[pos + i] ^= runs[in + i];
+        }
+        pos += count;
+        in += count;
+    }
+
+    return len;
+}
+
+void delta_history_push(delta_history *history, const uint8_t *msg, int len)
+{
+    if (!history->data || len <= 0 || len > DELTA_MAX_MESSAGE)
+    {
+        return;
+    }
+
+    memcpy(DELTA_HISTORY_SLOT(history, history->next), msg, len);
+    history->len[history->next] = (uint16_t)len;
+    history->next = (history->next + 1) % DELTA_HISTORY_SLOTS;
+}
+
+int delta_history_find(const delta_history *history, const uint8_t *msg, int len, int *diff)
+{
+    int best_slot = -1;
+    int best_diff = len + 1;
+
+    if (!history->data)
+    {
+        return -1;
+    }
+
+    for (int slot = 0; slot < DELTA_HISTORY_SLOTS; slot++)
+    {
+        if (history->len[slot] != len)
+        {
+            continue;
+        }
+        int d = delta_count_diff(msg, DELTA_HISTORY_SLOT(history, slot), len);
+        if (d < best_diff)
+        {
+            best_diff = d;
+            best_slot = slot;
+            if (d == 0)
+            {
+                break;
+            }
+        }
+    }
+
+    *diff = best_diff;
+    return best_slot;
+}
@@ -0,0 +1,86 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+
+#define DELTA_HISTORY_SLOTS 8   // Recent messages kept per direction
+#define DELTA_MAX_MESSAGE 2048  // Longer messages are neither stored nor delta-encoded
+#define DELTA_MIN_MESSAGE 16    // Shorter messages are never worth a delta
+#define DELTA_RUN_HEADER_SIZE 4 // Each run: [skip u16][count u16] followed by count XOR bytes
+
+/**
+ * Ring of recently sent (or received) messages. Sender and receiver push the
+ * same messages in the same order, so a slot index identifies the same bytes
+ * on both ends.
+ */
+typedef struct
+{
+    uint8_t *data;                     // DELTA_HISTORY_SLOTS * DELTA_MAX_MESSAGE bytes
+    uint16_t len[DELTA_HISTORY_SLOTS]; // 0 = empty slot
+    int      next;                     // Slot overwritten by the next push
+} delta_history;
+
+/**
+ * Counts the bytes that differ between two equally long buffers.
+ *
+ * @param a First buffer
+ * @param b Second buffer
+ * @param len Length of both buffers
+ * @return Number of differing bytes
+ */
+int delta_count_diff(const uint8_t *a, const uint8_t *b, int len);
+
+/**
+ * Encodes msg as XOR runs against an equally long reference message.
+ * Identical messages encode to zero bytes.
+ *
+ * @param msg Message to encode
+ * @param ref Reference message
+ * @param len Length of both messages (at most 65535)
+ * @param out Output buffer for the runs
+ * @param out_capacity Size of out in bytes
+ * @return Encoded length, or -1 if the runs do not fit in out
+ */
+int delta_encode(const uint8_t *msg, const uint8_t *ref, int len, uint8_t *out, int out_capacity);
+
+/**
+ * Rebuilds a message from its reference and XOR runs. Malformed runs are
+ * rejected, never overrun out.
+ *
+ * @param ref Reference message
+ * @param len Length of the reference (and of the rebuilt message)
+ * @param runs Encoded runs
+ * @param runs_len Length of the runs in bytes
+ * @param out Output buffer of at least len bytes (must not overlap ref)
+ * @return len on success, or -1 if the runs are malformed
+ */
+int delta_apply(const uint8_t *ref, int len, const uint8_t *runs, int runs_len, uint8_t *out);
+
+/**
+ * Stores a message in the next history slot. Messages longer than
+ * DELTA_MAX_MESSAGE (or empty ones) are skipped on both ends alike.
+ *
+ * @param history History ring with allocated data
+ * @param msg Message bytes
+ * @param len Message length
+ */
+void delta_history_push(delta_history *history, const uint8_t *msg, int len);
+
+/**
+ * Finds the stored message of the same length that differs from msg in the
+ * fewest bytes.
+ *
+ * @param history History ring with allocated data
+ * @param msg Message to match
+ * @param len Message length
+ * @param diff Receives the number of differing bytes for the returned slot
+ * @return Slot index, or -1 if no stored message has the same length
+ */
+int delta_history_find(const delta_history *history, const uint8_t *msg, int len, int *diff);
+
+/**
+ * Returns the bytes stored in a history slot.
+ */
+#define DELTA_HISTORY_SLOT(history, slot) ((history)->data + (slot) * DELTA_MAX_MESSAGE)
+
+#endif // DELTA_H
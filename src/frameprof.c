@@ -0,0 +1,334 @@
+/*
+ * frameprof.c: Frame pacing profiler built on the GetTickCount hook.
+ *
+ * The game's loops read GetTickCount() on every iteration, so the hook sees
+ * the frame rhythm without touching the renderer. Each thread's frames are
+ * the intervals between calls from one call site, and the time the thread
+ * spent in hook_send, hook_recv and srv_gameStreamReader during a frame is
+ * booked to it. The log then shows a frame time histogram per thread and
+ * how much of the stutter frames went to the network layer.
+ *
+ * A thread's statistics are written only by that thread and reported when
+ * its own frame ends, so no locks are needed. frameprof_log() at cleanup
+ * reads them from another thread and may see a frame half booked.
+ *
+ * Any thread that calls GetTickCount() takes a slot, and the plugin gets
+ * no thread-detach notifications (DllMain disables them). A thread gives
+ * its slot back when learning found no frame loop, and a thread that finds
+ * the table full frees the slots of threads that have exited, logging
+ * their last statistics first.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "frameprof.h"
+#include "clock.h"
+#include "logging.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+
+// Upper bounds of the histogram buckets in milliseconds; the last bucket is open
+static const DWORD BUCKET_LIMITS_MS[FRAMEPROF_BUCKETS - 1] = {5, 10, 17, 25, 33, 50, 100, 250, 500};
+
+static const char *const PART_NAMES[FRAMEPROF_PARTS] = {"send", "recv", "stream reader"};
+
+static frameprof_thread s_threads[FRAMEPROF_THREADS];
+static volatile LONG    s_next_evict_ms = 0; // clock_ticks() before which a full table is not searched again
+
+static double percent(int64_t part, int64_t total)
+{
+    return total > 0 ? 100.0 * (double)part / (double)total : 0.0;
+}
+
+/**
+ * Logs one thread's statistics and starts a new interval.
+ */
+static void report_thread(frameprof_thread *thread, int64_t now_us)
+{
+    if (thread->frames == 0)
+    {
+        thread->report_us = now_us;
+        return;
+    }
+
+    char histogram[256];
+    int  used = 0;
+    for (int i = 0; i < FRAMEPROF_BUCKETS && used < (int)sizeof(histogram); i++)
+    {
+        used += i < FRAMEPROF_BUCKETS - 1
+                    ? snprintf(histogram + used, sizeof(histogram) - used, "%s<%lu ms %lu", i ? ", " : "",
+                               (unsigned long)BUCKET_LIMITS_MS[i], (unsigned long)thread->histogram[i])
+                    : snprintf(histogram + used, sizeof(histogram) - used, ", >=%lu ms %lu",
+                               (unsigned long)BUCKET_LIMITS_MS[i - 1], (unsigned long)thread->histogram[i]);
+    }
+
+    logf("[FRAME] Thread %lu: %lu frames, avg %.1f ms, max %.1f ms; %s", (unsigned long)thread->thread_id,
+         (unsigned long)thread->frames, (double)thread->frame_total_us / thread->frames / 1000.0,
+         (double)thread->frame_max_us / 1000.0, histogram);
+    logf("[FRAME] Thread %lu: network share %s %.1f%%, %s %.1f%%, %s %.1f%%; %lu stutters (>= %d ms), %.1f%% of their "
+         "time in the network layer",
+         (unsigned long)thread->thread_id, PART_NAMES[FRAMEPROF_SEND],
+         percent(thread->part_total_us[FRAMEPROF_SEND], thread->frame_total_us), PART_NAMES[FRAMEPROF_RECV],
+         percent(thread->part_total_us[FRAMEPROF_RECV], thread->frame_total_us), PART_NAMES[FRAMEPROF_STREAM_READER],
+         percent(thread->part_total_us[FRAMEPROF_STREAM_READER], thread->frame_total_us),
+         (unsigned long)thread->stutters, FRAMEPROF_STUTTER_MS,
+         percent(thread->stutter_part_us[FRAMEPROF_SEND] + thread->stutter_part_us[FRAMEPROF_RECV] +
+                     thread->stutter_part_us[FRAMEPROF_STREAM_READER],
+                 thread->stutter_us));
+
+    memset(thread->histogram, 0, sizeof(thread->histogram));
+    memset(thread->part_total_us, 0, sizeof(thread->part_total_us));
+    memset(thread->stutter_part_us, 0, sizeof(thread->stutter_part_us));
+    thread->frames = 0;
+    thread->frame_total_us = 0;
+    thread->frame_max_us = 0;
+    thread->stutters = 0;
+    thread->stutter_us = 0;
+    thread->report_us = now_us;
+}
+
+/**
+ * Claims a free slot for the calling thread and clears what its previous
+ * owner left behind.
+ *
+ * @return Slot, or NULL if none is free
+ */
+static frameprof_thread *claim_slot(LONG id)
+{
+    for (int i = 0; i < FRAMEPROF_THREADS; i++)
+    {
+        if (s_threads[i].thread_id == 0 && InterlockedCompareExchange(&s_threads[i].thread_id, id, 0) == 0)
+        {
+            frameprof_thread *thread = &s_threads[i];
+            int64_t           now = clock_now_us();
+            memset((char *)thread + offsetof(frameprof_thread, sites), 0,
+                   sizeof(*thread) - offsetof(frameprof_thread, sites));
+            thread->learn_start_us = now;
+            thread->report_us = now;
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Reports and frees the slots of threads that have exited. Runs at most
+ * once per FRAMEPROF_EVICT_CHECK_MS, since it opens every slot's thread.
+ *
+ * @return TRUE if a slot was freed
+ */
+static BOOL evict_exited_threads(void)
+{
+    LONG  next = s_next_evict_ms;
+    DWORD now = clock_ticks();
+    BOOL  freed = FALSE;
+
+    if ((int32_t)(now - (DWORD)next) < 0 ||
+        InterlockedCompareExchange(&s_next_evict_ms, (LONG)(now + FRAMEPROF_EVICT_CHECK_MS), next) != next)
+    {
+        return FALSE;
+    }
+    for (int i = 0; i < FRAMEPROF_THREADS; i++)
+    {
+        LONG   id = s_threads[i].thread_id;
+        HANDLE handle = id > 0 ? OpenThread(SYNCHRONIZE, FALSE, (DWORD)id) : NULL;
+        BOOL   exited = id > 0 && (!handle || WaitForSingleObject(handle, 0) == WAIT_OBJECT_0);
+
+        if (handle)
+        {
+            CloseHandle(handle);
+        }
+        if (exited)
+        {
+            // Only one thread evicts at a time, and the slot's owner is gone
+            report_thread(&s_threads[i], clock_now_us());
+            InterlockedExchange(&s_threads[i].thread_id, 0);
+            freed = TRUE;
+        }
+    }
+    return freed;
+}
+
+/**
+ * Finds the calling thread's slot, claiming a free one on its first call.
+ *
+ * @return Slot, or NULL if every slot belongs to another thread
+ */
+static frameprof_thread *current_thread(BOOL create)
+{
+    LONG id = (LONG)GetCurrentThreadId();
+
+    for (int i = 0; i < FRAMEPROF_THREADS; i++)
+    {
+        if (s_threads[i].thread_id == id)
+        {
+            return &s_threads[i];
+        }
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+
+    frameprof_thread *thread = claim_slot(id);
+    if (!thread && evict_exited_threads())
+    {
+        thread = claim_slot(id);
+    }
+    if (!thread)
+    {
+        logf_rate_limited("frameprof_full", "[FRAME] All %d thread slots in use, thread %lu not profiled",
+                          FRAMEPROF_THREADS, (unsigned long)id);
+    }
+    return thread;
+}
+
+/**
+ * Picks the frame site once the learning period is over: the least
+ * frequent site that is still called often enough to be a loop. The
+ * first frame starts at the next call from that site. Without such a site
+ * the slot is freed for other threads.
+ */
+static void pick_frame_site(frameprof_thread *thread, int64_t now_us)
+{
+    uint32_t min_hits = (uint32_t)((now_us - thread->learn_start_us) * FRAMEPROF_MIN_HZ / 1000000);
+    int      best = -1;
+
+    for (int i = 0; i < thread->site_count; i++)
+    {
+        if (thread->site_hits[i] >= min_hits && (best < 0 || thread->site_hits[i] < thread->site_hits[best]))
+        {
+            best = i;
+        }
+    }
+    if (best < 0)
+    {
+        // Nothing looked like a loop: give the slot back, the thread claims a fresh one on its next call
+        InterlockedExchange(&thread->thread_id, 0);
+        return;
+    }
+
+    thread->frame_site = thread->sites[best];
+    thread->frame_start_us = -1;
+    memset(thread->part_us, 0, sizeof(thread->part_us));
+    logf("[FRAME] Thread %lu: frame loop found at %p, %lu calls/s", (unsigned long)thread->thread_id,
+         (void *)thread->sites[best],
+         (unsigned long)((uint64_t)thread->site_hits[best] * 1000000 / (now_us - thread->learn_start_us)));
+}
+
+/**
+ * Books the frame that just ended.
+ */
+static void end_frame(frameprof_thread *thread, int64_t now_us)
+{
+    if (thread->frame_start_us < 0)
+    {
+        memset(thread->part_us, 0, sizeof(thread->part_us));
+        thread->frame_start_us = now_us;
+        return;
+    }
+
+    int64_t frame_us = now_us - thread->frame_start_us;
+    int     bucket = 0;
+
+    while (bucket < FRAMEPROF_BUCKETS - 1 && frame_us >= (int64_t)BUCKET_LIMITS_MS[bucket] * 1000)
+    {
+        bucket++;
+    }
+    thread->histogram[bucket]++;
+    thread->frames++;
+    thread->frame_total_us += frame_us;
+    thread->frame_max_us = frame_us > thread->frame_max_us ? frame_us : thread->frame_max_us;
+    for (int i = 0; i < FRAMEPROF_PARTS; i++)
+    {
+        thread->part_total_us[i] += thread->part_us[i];
+    }
+    if (frame_us >= (int64_t)FRAMEPROF_STUTTER_MS * 1000)
+    {
+        thread->stutters++;
+        thread->stutter_us += frame_us;
+        for (int i = 0; i < FRAMEPROF_PARTS; i++)
+        {
+            thread->stutter_part_us[i] += thread->part_us[i];
+        }
+    }
+
+    memset(thread->part_us, 0, sizeof(thread->part_us));
+    thread->frame_start_us = now_us;
+    if (now_us - thread->report_us >= (int64_t)FRAMEPROF_REPORT_MS * 1000)
+    {
+        report_thread(thread, now_us);
+    }
+}
+
+void frameprof_tick(uintptr_t site)
+{
+    frameprof_thread *thread = current_thread(TRUE);
+    if (!thread)
+    {
+        return;
+    }
+
+    int64_t now = clock_now_us();
+    if (thread->frame_site != 0)
+    {
+        if (site == thread->frame_site)
+        {
+            end_frame(thread, now);
+        }
+        return;
+    }
+
+    // Learning: count calls per site
+    int i = 0;
+    while (i < thread->site_count && thread->sites[i] != site)
+    {
+        i++;
+    }
+    if (i == thread->site_count && i < FRAMEPROF_SITES)
+    {
+        thread->sites[i] = site;
+        thread->site_hits[i] = 0;
+        thread->site_count++;
+    }
+    if (i < thread->site_count)
+    {
+        thread->site_hits[i]++;
+    }
+    if (now - thread->learn_start_us >= FRAMEPROF_LEARN_US)
+    {
+        pick_frame_site(thread, now);
+    }
+}
+
+int64_t frameprof_enter(void)
+{
+    return clock_now_us();
+}
+
+void frameprof_leave(frameprof_part part, int64_t start_us)
+{
+    frameprof_thread *thread = current_thread(FALSE);
+    if (thread)
+    {
+        thread->part_us[part] += clock_now_us() - start_us;
+    }
+}
+
+const frameprof_thread *frameprof_current(void)
+{
+    return current_thread(FALSE);
+}
+
+void frameprof_log(void)
+{
+    int64_t now = clock_now_us();
+    for (int i = 0; i < FRAMEPROF_THREADS; i++)
+    {
+        if (s_threads[i].thread_id != 0)
+        {
+            report_thread(&s_threads[i], now);
+        }
+    }
+}
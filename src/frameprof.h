@@ -0,0 +1,85 @@
+#ifndef FRAMEPROF_H
+#define FRAMEPROF_H
+
+#include <stdint.h>
+#include <windows.h>
+
+#define FRAMEPROF_THREADS 16          // Threads profiled at once; more wait for a slot to be freed
+#define FRAMEPROF_EVICT_CHECK_MS 1000 // How often a thread without a slot looks for slots of exited threads
+#define FRAMEPROF_SITES 8             // GetTickCount call sites remembered per thread while learning
+#define FRAMEPROF_LEARN_US 1000000    // How long a thread's calls are watched before a frame site is picked
+#define FRAMEPROF_MIN_HZ 5            // Slowest call rate that still counts as a loop
+#define FRAMEPROF_STUTTER_MS 50       // Frames at least this long count as stutters
+#define FRAMEPROF_REPORT_MS 60000     // Interval between logged histograms per thread
+#define FRAMEPROF_BUCKETS 10          // Frame time histogram buckets, see frameprof.c
+
+/**
+ * Network layer work a frame's time is attributed to.
+ */
+typedef enum
+{
+    FRAMEPROF_SEND,          // hook_send, including retries and waits for a slow receiver
+    FRAMEPROF_RECV,          // hook_recv polling
+    FRAMEPROF_STREAM_READER, // srv_gameStreamReader
+    FRAMEPROF_PARTS
+} frameprof_part;
+
+/**
+ * Frame statistics of one thread since its last report. Written only by
+ * that thread.
+ */
+typedef struct
+{
+    volatile LONG thread_id;                        // 0 = free slot
+    uintptr_t     sites[FRAMEPROF_SITES];           // Call sites seen while learning
+    uint32_t      site_hits[FRAMEPROF_SITES];
+    int           site_count;
+    int64_t       learn_start_us;
+    uintptr_t     frame_site;                       // Call site hit once per loop iteration, 0 while learning
+    int64_t       frame_start_us;                   // -1 until the frame site is first hit
+    int64_t       part_us[FRAMEPROF_PARTS];         // Network time in the current frame
+    int64_t       report_us;                        // Start of the reporting interval
+    uint32_t      histogram[FRAMEPROF_BUCKETS];
+    uint32_t      frames;
+    int64_t       frame_total_us;
+    int64_t       frame_max_us;
+    int64_t       part_total_us[FRAMEPROF_PARTS];
+    uint32_t      stutters;
+    int64_t       stutter_us;
+    int64_t       stutter_part_us[FRAMEPROF_PARTS]; // Network time inside stutter frames
+} frameprof_thread;
+
+/**
+ * Records a GetTickCount() call. Each thread first watches its call sites
+ * for FRAMEPROF_LEARN_US and picks the least frequent one that is still
+ * called at least FRAMEPROF_MIN_HZ times a second: the outer loop, which
+ * runs once per frame while inner loops run several times. Every later
+ * call from that site ends a frame.
+ *
+ * @param site Return address of the call
+ */
+void frameprof_tick(uintptr_t site);
+
+/**
+ * Marks the start of network layer work on the calling thread.
+ *
+ * @return Start time to pass to frameprof_leave()
+ */
+int64_t frameprof_enter(void);
+
+/**
+ * Attributes the time since frameprof_enter() to the current frame.
+ */
+void frameprof_leave(frameprof_part part, int64_t start_us);
+
+/**
+ * Returns the calling thread's statistics, or NULL if it is not profiled.
+ */
+const frameprof_thread *frameprof_current(void);
+
+/**
+ * Logs and resets the statistics of every profiled thread.
+ */
+void frameprof_log(void);
+
+#endif // FRAMEPROF_H
@@ -8,9 +8,20 @@
 #define WIN32_LEAN_AND_MEAN
 #include "hooks.h"
 #include "MinHook.h"
+#include "buftune.h"
+#include "clock.h"
+#include "config.h"
+#include "frameprof.h"
+#include "iocp.h"
 #include "logging.h"
+#include "netclass.h"
 #include "pattern_matcher.h"
+#include "peer.h"
+#include "readiness.h"
+#include "send_queue.h"
 #include "sha256.h"
+#include "socket_state.h"
+#include "sockprofile.h"
 #include "versions.h"
 #include <limits.h>
 #include <psapi.h>
@@ -37,10 +48,12 @@
 #define DEFAULT_SERVER_PATH "Server\\server.dll"
 #define SEND_MAX_RETRIES INT_MAX // Maximum retry attempts for send operations
 #define SEND_RETRY_DELAY_MS 1    // Delay between send retries (matches original)
+#define RECV_WAIT_STREAK 8       // Empty recv() calls in a row after which RecvWaitUs waits for data
 
 #ifdef NETWORKFIX_TEST
 // Test build: real_recv/real_send are externally writable mocks.
-// Sleep is redirected to a counter so retry loops do not waste wallclock time.
+// Sleep is redirected to a counter so retry loops do not waste wallclock time;
+// it advances clock_ticks() when a test runs on virtual time.
 #define HOOK_STATIC
 void test_sleep(DWORD ms);
 #define HOOK_SLEEP(ms) test_sleep(ms)
@@ -59,7 +72,19 @@ static size_t    g_server_size = 0;
 // Original function pointers
 HOOK_STATIC int(WSAAPI *real_recv)(SOCKET, char *, int, int) = NULL;
 HOOK_STATIC int(WSAAPI *real_send)(SOCKET, const char *, int, int) = NULL;
-static DWORD(WINAPI *real_GetTickCount)(void) = NULL;
+HOOK_STATIC int(WSAAPI *real_WSASend)(SOCKET, LPWSABUF, DWORD, LPDWORD, DWORD, LPWSAOVERLAPPED,
+                                      LPWSAOVERLAPPED_COMPLETION_ROUTINE) = NULL;
+HOOK_STATIC int(WSAAPI *real_closesocket)(SOCKET) = NULL;
+HOOK_STATIC int(WSAAPI *real_connect)(SOCKET, const struct sockaddr *, int) = NULL;
+HOOK_STATIC SOCKET(WSAAPI *real_accept)(SOCKET, struct sockaddr *, int *) = NULL;
+HOOK_STATIC int(WSAAPI *real_listen)(SOCKET, int) = NULL;
+HOOK_STATIC int(WSAAPI *real_ioctlsocket)(SOCKET, long, u_long *) = NULL;
+HOOK_STATIC int(WSAAPI *real_select)(int, fd_set *, fd_set *, fd_set *, const struct timeval *) = NULL;
+HOOK_STATIC int(WSAAPI *real_WSAPoll)(WSAPOLLFD *, ULONG, int) = NULL;
+HOOK_STATIC DWORD(WINAPI *real_GetTickCount)(void) = NULL;
+HOOK_STATIC DWORD(WINAPI *real_timeGetTime)(void) = NULL;
+HOOK_STATIC BOOL(WINAPI *real_QueryPerformanceCounter)(LARGE_INTEGER *) = NULL;
+HOOK_STATIC void(WINAPI *real_Sleep)(DWORD) = NULL;
 
 /* Server.dll srv_gameStreamReader function - RVA varies by version */
 typedef int(__cdecl *srv_gameStreamReader_t)(int *ctx, int received, int totalLen);
@@ -248,216 +273,1351 @@ BOOL is_caller_from_server(uintptr_t caller_addr)
 #endif
 }
 
+/**
+ * Returns TRUE if server.dll's time sources are shaped by HighResClock,
+ * TimeDilationMs or ClockSync=2.
+ */
+static BOOL server_clock_shaped(void)
+{
+    return g_config.high_res_clock || g_config.time_dilation_ms != 0 || g_config.clock_sync == CLOCK_SYNC_ALIGN;
+}
+
+/**
+ * Reads a millisecond time source for server.dll. With HighResClock every
+ * source returns clock_now_ms(), so GetTickCount() and timeGetTime() agree,
+ * with TimeDilationMs all of them fall behind by the same lag, and with
+ * ClockSync=2 they are shifted to the host's time.
+ *
+ * @param source Time source being called
+ * @param real Original function, used without HighResClock
+ * @param name Function name for the log
+ * @return Shaped time in milliseconds, or 0 if the original function is missing
+ */
+static DWORD server_time_ms(clock_source source, DWORD(WINAPI *real)(void), const char *name)
+{
+    DWORD now;
+
+    if (g_config.high_res_clock)
+    {
+        now = clock_now_ms();
+    }
+    else if (real)
+    {
+        now = real();
+    }
+    else
+    {
+        logf("[SERVER HOOK] %s was NULL. Falling back to 0", name);
+        return 0;
+    }
+
+    if (g_config.time_dilation_ms != 0)
+    {
+        now = clock_dilate(source, now, g_config.time_dilation_ms);
+    }
+    if (g_config.clock_sync == CLOCK_SYNC_ALIGN)
+    {
+        now = clock_align(source, now);
+    }
+    return now;
+}
+
 /**
  * Hook for GetTickCount() Windows API function.
- * Provides fallback behavior in case the original function pointer is invalid.
+ * With HighResClock, server.dll gets the millisecond clock from clock.c
+ * instead of the coarse system tick count, and with TimeDilationMs that
+ * time slows down while the network is stalled. Every other caller gets
+ * the original. With FrameProfiler, every call is also handed to
+ * frameprof.c, which finds each thread's frame loop from its call sites.
+ * Provides fallback behavior in case the original function pointer is
+ * invalid.
+ *
+ * @return Tick count from original function or 0 as fallback
+ */
+DWORD WINAPI hook_GetTickCount(void)
+{
+    if (g_config.frame_profiler)
+    {
+        frameprof_tick((uintptr_t)CALLER_IP());
+    }
+
+    if (is_caller_from_server((uintptr_t)CALLER_IP()))
+    {
+        clock_count_call(CLOCK_SOURCE_TICK_COUNT);
+        if (server_clock_shaped())
+        {
+            return server_time_ms(CLOCK_SOURCE_TICK_COUNT, real_GetTickCount, "GetTickCount");
+        }
+    }
+
+    if (!real_GetTickCount)
+    {
+        logf("[SERVER HOOK] GetTickCount was NULL. Falling back to 0");
+        return 0;
+    }
+    return real_GetTickCount();
+}
+
+/**
+ * Hook for timeGetTime() from winmm. server.dll's calls are shaped like
+ * its GetTickCount() calls, from the same clock; everyone else gets the
+ * original.
+ *
+ * @return Milliseconds from the original function or the shaped clock, 0 as fallback
+ */
+DWORD WINAPI hook_timeGetTime(void)
+{
+    if (is_caller_from_server((uintptr_t)CALLER_IP()))
+    {
+        clock_count_call(CLOCK_SOURCE_TIME_GET_TIME);
+        if (server_clock_shaped())
+        {
+            return server_time_ms(CLOCK_SOURCE_TIME_GET_TIME, real_timeGetTime, "timeGetTime");
+        }
+    }
+
+    if (!real_timeGetTime)
+    {
+        logf("[SERVER HOOK] timeGetTime was NULL. Falling back to 0");
+        return 0;
+    }
+    return real_timeGetTime();
+}
+
+/**
+ * Hook for QueryPerformanceCounter() Windows API function. While a clock
+ * option shapes server.dll's time, its reads come from clock.c: the same
+ * counter, held back by the same lag and shifted by the same offset as its
+ * millisecond sources. Everyone else gets the original.
+ *
+ * @param counter Receives the counter value
+ * @return Result of the original function, FALSE if it is missing
+ */
+BOOL WINAPI hook_QueryPerformanceCounter(LARGE_INTEGER *counter)
+{
+    if (!real_QueryPerformanceCounter)
+    {
+        logf("[SERVER HOOK] QueryPerformanceCounter was NULL");
+        return FALSE;
+    }
+
+    if (is_caller_from_server((uintptr_t)CALLER_IP()))
+    {
+        clock_count_call(CLOCK_SOURCE_PERF_COUNTER);
+        if (server_clock_shaped())
+        {
+            counter->QuadPart =
+                clock_server_counter(g_config.time_dilation_ms, g_config.clock_sync == CLOCK_SYNC_ALIGN);
+            return TRUE;
+        }
+    }
+    return real_QueryPerformanceCounter(counter);
+}
+
+/**
+ * Hook for Sleep() Windows API function. A short Sleep() wakes on the next
+ * timer interrupt, up to 16 ms late, so server.dll's network thread idles
+ * far longer than it asked to. With HighResSleep=2 its sleeps of up to
+ * CLOCK_SLEEP_MAX_MS are served by a high-resolution timer instead,
+ * without raising the timer resolution for the whole system; with
+ * HighResSleep=1 they are only timed, as a baseline for the log. Sleep(0)
+ * and every other caller keep the original.
+ *
+ * @param ms Requested time in milliseconds
+ */
+void WINAPI hook_Sleep(DWORD ms)
+{
+    if (!real_Sleep)
+    {
+        logf("[SERVER HOOK] Sleep was NULL. Falling back to SleepEx");
+        SleepEx(ms, FALSE);
+        return;
+    }
+    if (g_config.high_res_sleep == HIGH_RES_SLEEP_OFF || ms == 0 || ms > CLOCK_SLEEP_MAX_MS ||
+        !is_caller_from_server((uintptr_t)CALLER_IP()))
+    {
+        real_Sleep(ms);
+        return;
+    }
+    clock_sleep(ms, g_config.high_res_sleep == HIGH_RES_SLEEP_ON ? NULL : real_Sleep);
+}
+
+/**
+ * Hook for server.dll srv_gameStreamReader function (RVA varies by version).
+ * Fixes stability issues by preventing negative values in packet context.
+ *
+ * The original function can assign negative values to the error field which causes
+ * network desynchronization and crashes.
+ *
+ * @param ctx Stream context structure pointer (validated for NULL)
+ * @param received Number of bytes received
+ * @param totalLen Total expected length
+ * @return Modified return value (negative values converted to 0)
+ */
+int __cdecl hook_srv_gameStreamReader(int *ctx, int received, int totalLen)
+{
+    // Validate parameters
+    if (!ctx)
+    {
+        logf("[SERVER HOOK] srv_gameStreamReader called with NULL context");
+        return -1;
+    }
+
+    // Call original function
+    int64_t frame_start = g_config.frame_profiler ? frameprof_enter() : 0;
+    int     ret = real_srv_gameStreamReader(ctx, received, totalLen);
+    if (g_config.frame_profiler)
+    {
+        frameprof_leave(FRAMEPROF_STREAM_READER, frame_start);
+    }
+
+    // Apply fixes to prevent network instability
+    BOOL modified = false;
+    if (ctx[0xE] < 0)
+    {
+        logf("[SERVER HOOK] srv_gameStreamReader: Fixed negative ctx[0xE] (%d -> 0)", ctx[0xE]);
+        ctx[0xE] = 0;
+        modified = true;
+    }
+
+    if (ret < 0)
+    {
+        logf("[SERVER HOOK] srv_gameStreamReader: Fixed negative return value (%d -> 0)", ret);
+        ret = 0;
+        modified = true;
+    }
+
+    if (modified)
+    {
+        logf("[SERVER HOOK] srv_gameStreamReader: received=%d, totalLen=%d, result=%d", received, totalLen, ret);
+    }
+
+    return ret;
+}
+
+/**
+ * recv_once() that also tells a WSAEWOULDBLOCK apart from a graceful close.
+ *
+ * @param would_block Set to TRUE if no data was available
+ */
+static int recv_checked(SOCKET s, char *buf, int len, int flags, BOOL *would_block)
+{
+    int result = real_recv(s, buf, len, flags);
+
+    *would_block = FALSE;
+    if (result == SOCKET_ERROR)
+    {
+        int error = WSAGetLastError();
+        if (error == WSAEWOULDBLOCK)
+        {
+            *would_block = TRUE;
+
+            // Show buffer state when WSAEWOULDBLOCK occurs (rate limited)
+            int available = get_available_bytes(s);
+            if (available >= 0)
+            {
+                logf_rate_limited("recv_wouldblock", "[WS2 HOOK] recv: WSAEWOULDBLOCK, %d bytes available in buffer",
+                                  available);
+            }
+            else
+            {
+                logf_rate_limited("recv_wouldblock_unknown", "[WS2 HOOK] recv: WSAEWOULDBLOCK, buffer state unknown");
+            }
+
+            // Convert WSAEWOULDBLOCK to 0 for server.dll calls
+            WSASetLastError(NO_ERROR);
+            return 0;
+        }
+
+        log_winsock_error("[WS2 HOOK] recv", s, error);
+    }
+    else if (result == 0)
+    {
+        logf("[WS2 HOOK] recv: Connection gracefully closed by peer on socket %u", (unsigned)s);
+        log_socket_buffer_info(s);
+    }
+    else if (g_config.buffer_tuning)
+    {
+        buftune_note_recv(s, result);
+    }
+
+    return result;
+}
+
+/**
+ * Performs a single recv() on a server.dll socket with the WSAEWOULDBLOCK fix.
+ * Converts WSAEWOULDBLOCK errors to 0-byte receives.
+ *
+ * The original game code doesn't handle WSAEWOULDBLOCK correctly, causing
+ * desynchronization. This makes non-blocking sockets work gracefully.
+ *
+ * @param s Socket handle
+ * @param buf Buffer to receive data into
+ * @param len Buffer size
+ * @param flags Recv flags (MSG_*)
+ * @return Number of bytes received, 0 for graceful close, SOCKET_ERROR on error
+ */
+int recv_once(SOCKET s, char *buf, int len, int flags)
+{
+    BOOL would_block;
+    return recv_checked(s, buf, len, flags, &would_block);
+}
+
+/**
+ * recv_once() with RecvWaitUs: once a socket came up empty
+ * RECV_WAIT_STREAK times in a row, the game is spinning on it, and the
+ * next empty call waits up to RecvWaitUs microseconds for data through the
+ * readiness watcher before returning 0. Data that arrives during the wait
+ * is returned at once, so the game gets it no later than from its next
+ * spin, and the thread sleeps instead of burning the rest of its quantum.
+ * AutoProfile shortens the wait on tunnels and skips it on lossy ones.
+ * The socket's counters record what the waits cost and caught.
+ *
+ * @return Number of bytes received, 0 for no data or graceful close, SOCKET_ERROR on error
+ */
+static int recv_waiting(SOCKET s, char *buf, int len, int flags)
+{
+    BOOL would_block;
+    int  result = recv_checked(s, buf, len, flags, &would_block);
+
+    socket_state *state = g_config.recv_wait_us != 0 ? get_socket_state(s, TRUE) : NULL;
+    if (!state)
+    {
+        return result;
+    }
+    if (!would_block)
+    {
+        state->recv_streak = 0;
+        return result;
+    }
+    state->nonblocking = TRUE; // Only server.dll's own choice can make recv() report WSAEWOULDBLOCK here
+    state->stats.recv_empty_calls++;
+    if (++state->recv_streak < RECV_WAIT_STREAK)
+    {
+        return result;
+    }
+
+    DWORD wait_us = g_config.auto_profile ? netclass_recv_wait_us(s, g_config.recv_wait_us) : g_config.recv_wait_us;
+    if (wait_us == 0)
+    {
+        return result; // AutoProfile found a link on which waits do not pay off
+    }
+
+    int64_t         start = clock_now_us();
+    readiness_state ready = readiness_wait(&s, 1, wait_us);
+    int64_t         waited = clock_now_us() - start;
+    if (ready == READINESS_UNWATCHED)
+    {
+        return result;
+    }
+    state->stats.recv_waits++;
+    state->stats.recv_wait_us += (uint64_t)waited;
+    if (ready == READINESS_QUIET)
+    {
+        return result;
+    }
+
+    result = recv_checked(s, buf, len, flags, &would_block);
+    if (!would_block)
+    {
+        state->stats.recv_wait_hits++;
+        state->stats.recv_hit_us += (uint64_t)waited;
+        state->recv_streak = 0;
+    }
+    return result;
+}
+
+/**
+ * Logs what RecvWaitUs did on a socket that is being closed.
+ */
+static void log_recv_wait_stats(SOCKET s)
+{
+    socket_state *state = g_config.recv_wait_us != 0 ? get_socket_state(s, FALSE) : NULL;
+    if (!state || state->stats.recv_empty_calls == 0)
+    {
+        return;
+    }
+
+    const socket_stats *stats = &state->stats;
+    logf("[WS2 HOOK] Socket %u recv waits: %lu empty recv calls, %lu waits (%.1f ms total), %lu ended with data "
+         "after %.1f us on average",
+         (unsigned)s, (unsigned long)stats->recv_empty_calls, (unsigned long)stats->recv_waits,
+         (double)stats->recv_wait_us / 1000.0, (unsigned long)stats->recv_wait_hits,
+         stats->recv_wait_hits ? (double)stats->recv_hit_us / stats->recv_wait_hits : 0.0);
+}
+
+/**
+ * Returns TRUE if server.dll's calls on a socket go through the overlapped
+ * I/O engine (OverlappedIo), handing the socket to it on first use.
+ */
+static BOOL use_iocp(SOCKET s)
+{
+    return g_config.overlapped_io && !peer_protocol_enabled() && iocp_adopt(s);
+}
+
+/**
+ * recv_once() through the overlapped I/O engine: copies from the socket's
+ * receive ring, with WSAEWOULDBLOCK converted to 0 the same way.
+ *
+ * @return Number of bytes received, 0 for no data or graceful close, SOCKET_ERROR on error
+ */
+static int iocp_recv_once(SOCKET s, char *buf, int len, int flags)
+{
+    if (!buf || len <= 0 || (flags & ~MSG_PEEK) != 0)
+    {
+        return recv_once(s, buf, len, flags); // Out-of-band data is not part of the stream the engine reads
+    }
+
+    int result = iocp_recv(s, buf, len, flags);
+    if (result == SOCKET_ERROR)
+    {
+        int error = WSAGetLastError();
+        if (error == WSAEWOULDBLOCK)
+        {
+            WSASetLastError(NO_ERROR);
+            return 0;
+        }
+        log_winsock_error("[WS2 HOOK] recv", s, error);
+        WSASetLastError(error);
+    }
+    else if (result == 0)
+    {
+        logf_rate_limited("iocp_recv_closed", "[WS2 HOOK] recv: Connection gracefully closed by peer on socket %u",
+                          (unsigned)s);
+    }
+    return result;
+}
+
+/**
+ * Hook for recv() Winsock function to handle non-blocking socket errors.
+ * Converts WSAEWOULDBLOCK errors to 0-byte receives for server.dll calls
+ * and decodes the framed stream of patched peers.
+ *
+ * @param s Socket handle
+ * @param buf Buffer to receive data into
+ * @param len Buffer size
+ * @param flags Recv flags (MSG_*)
+ * @return Number of bytes received, 0 for graceful close, SOCKET_ERROR on error
+ */
+int WSAAPI hook_recv(SOCKET s, char *buf, int len, int flags)
+{
+    // Check if caller is from server.dll
+    if (!is_caller_from_server((uintptr_t)CALLER_IP()))
+    {
+        return real_recv(s, buf, len, flags);
+    }
+
+    // Log suspicious parameters but don't block - let Windows handle them
+    // (Original HarryTheBird version passed all params through directly)
+    if (!buf || len <= 0)
+    {
+        logf("[WS2 HOOK] recv: Suspicious parameters: buf=%p, len=%d (hex=0x%08X)", buf, len, (unsigned int)len);
+    }
+
+    int64_t frame_start = g_config.frame_profiler ? frameprof_enter() : 0;
+
+    // The host polls every player socket, which keeps queued broadcasts moving
+    if (g_config.send_queue_kb != 0)
+    {
+        send_queue_poll();
+    }
+
+    int result;
+    if (peer_protocol_enabled())
+    {
+        result = peer_recv(s, buf, len, flags);
+    }
+    else if (use_iocp(s))
+    {
+        result = iocp_recv_once(s, buf, len, flags);
+    }
+    else
+    {
+        result = recv_waiting(s, buf, len, flags);
+    }
+    if (result > 0 && g_config.time_dilation_ms != 0)
+    {
+        clock_note_progress();
+    }
+    if (g_config.frame_profiler)
+    {
+        frameprof_leave(FRAMEPROF_RECV, frame_start);
+    }
+    return result;
+}
+
+/**
+ * Books one write for BufferTuning and AutoProfile.
+ *
+ * @param s Socket written to
+ * @param bytes Bytes the write took (0 for a WSAEWOULDBLOCK)
+ * @param blocked TRUE if the write failed with WSAEWOULDBLOCK
+ */
+static void note_send(SOCKET s, int bytes, BOOL blocked)
+{
+    if (g_config.buffer_tuning)
+    {
+        buftune_note_send(s, bytes, blocked);
+    }
+    if (g_config.auto_profile)
+    {
+        netclass_note_send(s, blocked);
+    }
+}
+
+/**
+ * Sends a buffer completely, retrying on WSAEWOULDBLOCK errors.
+ *
+ * The original game doesn't handle cases where send buffer is full,
+ * leading to packet loss. This retries until all data is sent.
+ *
+ * @param s Socket handle
+ * @param buf Data buffer to send
+ * @param len Number of bytes to send
+ * @param flags Send flags (MSG_*)
+ * @return Total bytes sent, or SOCKET_ERROR on failure
+ */
+int send_all(SOCKET s, const char *buf, int len, int flags)
+{
+    int   total = 0;
+    int   retry_count = 0;
+    DWORD stall_start = clock_ticks();
+
+    while (total < len && retry_count < SEND_MAX_RETRIES)
+    {
+        int sent = real_send(s, buf + total, len - total, flags);
+
+        if (sent == SOCKET_ERROR)
+        {
+            int error = WSAGetLastError();
+            if (error == WSAEWOULDBLOCK)
+            {
+                logf_rate_limited("send_wouldblock",
+                                  "[WS2 HOOK] send: WSAEWOULDBLOCK, send buffer likely full (retry %d/%d)",
+                                  retry_count + 1, SEND_MAX_RETRIES);
+                note_send(s, 0, TRUE);
+                if (peer_send_stalled(s, clock_ticks() - stall_start))
+                {
+                    WSASetLastError(WSAECONNRESET);
+                    return total > 0 ? total : SOCKET_ERROR;
+                }
+                DWORD delay_ms =
+                    g_config.auto_profile ? netclass_retry_delay_ms(s, SEND_RETRY_DELAY_MS) : SEND_RETRY_DELAY_MS;
+                HOOK_SLEEP(delay_ms);
+                retry_count++;
+                continue;
+            }
+
+            log_winsock_error("[WS2 HOOK] send", s, error);
+            WSASetLastError(error);
+            if (error == WSAECONNRESET || error == WSAECONNABORTED)
+            {
+                return total > 0 ? total : SOCKET_ERROR;
+            }
+            return SOCKET_ERROR;
+        }
+
+        if (sent == 0)
+        {
+            logf("[WS2 HOOK] send: Connection closed by peer after %d/%d bytes", total, len);
+            return total;
+        }
+
+        note_send(s, sent, FALSE);
+        total += sent;
+        retry_count = 0; // Reset retry counter on successful send
+        stall_start = clock_ticks();
+    }
+
+    if (retry_count >= SEND_MAX_RETRIES)
+    {
+        logf_rate_limited("send_max_retries",
+                          "[WS2 HOOK] send: Max retries exceeded, sent %d/%d bytes (send buffer full)", total, len);
+        log_socket_buffer_info(s);
+        WSASetLastError(WSAETIMEDOUT);
+        return total > 0 ? total : SOCKET_ERROR;
+    }
+
+    return total;
+}
+
+/**
+ * Performs a single send() without waiting for buffer space.
+ * Converts WSAEWOULDBLOCK errors to 0-byte sends.
+ *
+ * @param s Socket handle
+ * @param buf Data buffer to send
+ * @param len Number of bytes to send
+ * @param flags Send flags (MSG_*)
+ * @return Bytes sent (0 if the send buffer is full), or SOCKET_ERROR on failure
+ */
+int send_once(SOCKET s, const char *buf, int len, int flags)
+{
+    int sent = real_send(s, buf, len, flags);
+
+    if (sent == SOCKET_ERROR)
+    {
+        int error = WSAGetLastError();
+        if (error == WSAEWOULDBLOCK)
+        {
+            note_send(s, 0, TRUE);
+            WSASetLastError(NO_ERROR);
+            return 0;
+        }
+
+        log_winsock_error("[WS2 HOOK] send", s, error);
+        WSASetLastError(error);
+    }
+    else
+    {
+        note_send(s, sent, FALSE);
+    }
+
+    return sent;
+}
+
+/**
+ * Writes the buffers, in order, with a single WSASend() and without copying
+ * them. Like send_once(), stops where the socket buffer is full.
+ *
+ * @param s Socket handle
+ * @param bufs Buffers to write
+ * @param count Number of buffers
+ * @return Bytes sent (0 if the send buffer is full), or SOCKET_ERROR on failure
+ */
+int send_gather(SOCKET s, WSABUF *bufs, DWORD count)
+{
+    if (!real_WSASend)
+    {
+        // The tests' mocks only provide send(): write the buffers one call at a time
+        int total = 0;
+        for (DWORD i = 0; i < count; i++)
+        {
+            int sent = send_once(s, bufs[i].buf, (int)bufs[i].len, 0);
+            if (sent == SOCKET_ERROR)
+            {
+                return total > 0 ? total : SOCKET_ERROR;
+            }
+            total += sent;
+            if (sent < (int)bufs[i].len)
+            {
+                break;
+            }
+        }
+        return total;
+    }
+
+    DWORD sent = 0;
+    if (real_WSASend(s, bufs, count, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+    {
+        int error = WSAGetLastError();
+        if (error == WSAEWOULDBLOCK)
+        {
+            note_send(s, 0, TRUE);
+            WSASetLastError(NO_ERROR);
+            return 0;
+        }
+
+        log_winsock_error("[WS2 HOOK] WSASend", s, error);
+        WSASetLastError(error);
+        return SOCKET_ERROR;
+    }
+    note_send(s, (int)sent, FALSE);
+    return (int)sent;
+}
+
+/**
+ * send_all() through the overlapped I/O engine: copies into the socket's
+ * send ring and returns once all of buf is there. A send with flags waits
+ * for the ring to drain and then goes to Winsock directly, so it cannot
+ * overtake buffered data.
+ *
+ * @return Total bytes sent, or SOCKET_ERROR on failure
+ */
+static int iocp_send_all(SOCKET s, const char *buf, int len, int flags)
+{
+    if (flags != 0)
+    {
+        iocp_drain(s);
+        return send_all(s, buf, len, flags);
+    }
+
+    int result = iocp_send(s, buf, len);
+    if (result != len)
+    {
+        int error = WSAGetLastError();
+        log_winsock_error("[WS2 HOOK] send", s, error);
+        WSASetLastError(error);
+    }
+    return result;
+}
+
+/**
+ * Hook for send() Winsock function to add retry logic for partial sends.
+ * Ensures all data is sent by retrying on WSAEWOULDBLOCK errors, framing
+ * it first when the remote side is a patched peer.
+ *
+ * @param s Socket handle
+ * @param buf Data buffer to send
+ * @param len Number of bytes to send
+ * @param flags Send flags (MSG_*)
+ * @return Total bytes sent, or SOCKET_ERROR on failure
+ */
+int WSAAPI hook_send(SOCKET s, const char *buf, int len, int flags)
+{
+    // Check if caller is from server.dll
+    if (!is_caller_from_server((uintptr_t)CALLER_IP()))
+    {
+        return real_send(s, buf, len, flags);
+    }
+
+    logf_rate_limited("send_called", "[WS2 HOOK] send: called from server.dll: socket=%u, len=%d, flags=0x%X",
+                      (unsigned)s, len, flags);
+
+    // Log suspicious parameters but don't block - let the loop handle them naturally
+    // (Original HarryTheBird version: while(total < len) exits immediately if len <= 0)
+    if (!buf || len <= 0)
+    {
+        logf("[WS2 HOOK] send: Suspicious parameters: buf=%p, len=%d (hex=0x%08X)", buf, len, (unsigned int)len);
+    }
+
+    int64_t frame_start = g_config.frame_profiler ? frameprof_enter() : 0;
+
+    if (g_config.send_queue_kb != 0)
+    {
+        send_queue_poll();
+    }
+
+    int result;
+    if (peer_protocol_enabled())
+    {
+        result = peer_send(s, buf, len, flags);
+    }
+    else if (buf && len > 0 && use_iocp(s))
+    {
+        result = iocp_send_all(s, buf, len, flags);
+    }
+    else if (g_config.send_queue_kb != 0)
+    {
+        result = send_queue_send(s, buf, len, flags);
+    }
+    else
+    {
+        result = send_all(s, buf, len, flags);
+    }
+
+    if (g_config.frame_profiler)
+    {
+        frameprof_leave(FRAMEPROF_SEND, frame_start);
+    }
+    return result;
+}
+
+/**
+ * A zero-timeout poll for readiness_poll(), restoring its input first.
+ */
+typedef int (*readiness_probe)(void *ctx);
+
+/**
+ * Serves a read poll from the readiness watcher: waits while the watcher
+ * has seen no event on the sockets and asks Winsock only when one may be
+ * readable. A false alarm (the data was read in the meantime) goes back to
+ * waiting for the rest of the timeout.
+ *
+ * @param sockets Polled sockets
+ * @param count Number of sockets
+ * @param timeout_us Caller's timeout in microseconds
+ * @param probe Zero-timeout Winsock poll that also calls readiness_mark()
+ * @param ctx Argument for probe
+ * @param result Result of the last probe, or 0 if the timeout passed without one
+ * @return FALSE if the sockets cannot be watched and the caller must poll Winsock itself
+ */
+static BOOL readiness_poll(const SOCKET *sockets, int count, DWORD timeout_us, readiness_probe probe, void *ctx,
+                           int *result)
+{
+    int64_t start = clock_now_us();
+    DWORD   remaining = timeout_us;
+
+    for (;;)
+    {
+        readiness_state state = readiness_wait(sockets, count, remaining);
+        if (state == READINESS_UNWATCHED)
+        {
+            return FALSE;
+        }
+        if (state == READINESS_QUIET)
+        {
+            *result = 0;
+            return TRUE;
+        }
+
+        *result = probe(ctx);
+        int64_t elapsed = clock_now_us() - start;
+        if (*result != 0 || elapsed >= (int64_t)timeout_us)
+        {
+            return TRUE;
+        }
+        remaining = timeout_us - (DWORD)elapsed;
+    }
+}
+
+typedef struct
+{
+    int    nfds;
+    fd_set requested;
+    fd_set readable;
+} select_probe_ctx;
+
+static int select_probe(void *ctx)
+{
+    select_probe_ctx *probe = (select_probe_ctx *)ctx;
+    struct timeval    zero = {0, 0};
+
+    probe->readable = probe->requested;
+    int result = real_select(probe->nfds, &probe->readable, NULL, NULL, &zero);
+    for (int i = 0; result > 0 && i < (int)probe->readable.fd_count; i++)
+    {
+        readiness_mark(probe->readable.fd_array[i]);
+    }
+    return result;
+}
+
+/**
+ * select() over sockets the overlapped I/O engine owns. Their kernel
+ * buffers are always empty while a WSARecv is outstanding, so their
+ * readability and writability come from the engine's rings. Other sockets
+ * in the sets, such as the host's listener, are polled with a zero timeout
+ * in between, at least once a millisecond.
+ *
+ * @param result Number of ready sockets, or SOCKET_ERROR
+ * @return FALSE if the engine owns none of the sockets
+ */
+static BOOL iocp_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const struct timeval *timeout,
+                        int *result)
+{
+    fd_set *sets[3] = {readfds, writefds, exceptfds};
+    fd_set  others[3];
+    fd_set  ready[3];
+    BOOL    owned = FALSE;
+    BOOL    any_other = FALSE;
+
+    for (int i = 0; i < 3; i++)
+    {
+        FD_ZERO(&others[i]);
+        for (u_int j = 0; sets[i] && j < sets[i]->fd_count; j++)
+        {
+            if (iocp_owns(sets[i]->fd_array[j]))
+            {
+                owned = TRUE;
+            }
+            else
+            {
+                FD_SET(sets[i]->fd_array[j], &others[i]);
+                any_other = TRUE;
+            }
+        }
+    }
+    if (!owned)
+    {
+        return FALSE;
+    }
+
+    int64_t deadline = timeout ? clock_now_us() + (int64_t)timeout->tv_sec * 1000000 + timeout->tv_usec : INT64_MAX;
+    for (;;)
+    {
+        LONG generation = iocp_generation();
+        int  count = 0;
+
+        // Owned sockets report errors as readable or writable, never through the except set
+        for (int i = 0; i < 3; i++)
+        {
+            FD_ZERO(&ready[i]);
+            for (u_int j = 0; i < 2 && sets[i] && j < sets[i]->fd_count; j++)
+            {
+                SOCKET socket = sets[i]->fd_array[j];
+                if (iocp_owns(socket) && (i == 0 ? iocp_readable(socket) : iocp_writable(socket)))
+                {
+                    FD_SET(socket, &ready[i]);
+                    count++;
+                }
+            }
+        }
+        if (any_other)
+        {
+            fd_set         probe[3] = {others[0], others[1], others[2]};
+            struct timeval zero = {0, 0};
+            int found = real_select(nfds, probe[0].fd_count ? &probe[0] : NULL, probe[1].fd_count ? &probe[1] : NULL,
+                                    probe[2].fd_count ? &probe[2] : NULL, &zero);
+            if (found == SOCKET_ERROR)
+            {
+                *result = SOCKET_ERROR;
+                return TRUE;
+            }
+            for (int i = 0; i < 3 && found > 0; i++)
+            {
+                for (u_int j = 0; j < probe[i].fd_count; j++)
+                {
+                    FD_SET(probe[i].fd_array[j], &ready[i]);
+                }
+            }
+            count += found;
+        }
+
+        int64_t remaining = deadline - clock_now_us();
+        if (count > 0 || remaining <= 0)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                if (sets[i])
+                {
+                    *sets[i] = ready[i];
+                }
+            }
+            *result = count;
+            return TRUE;
+        }
+
+        // Completions end the wait early; other sockets can only be polled again
+        int64_t limit = any_other ? 1000 : 1000000;
+        iocp_wait_us(generation, (DWORD)(remaining < limit ? remaining : limit));
+    }
+}
+
+/**
+ * WSAPoll() over sockets the overlapped I/O engine owns, like
+ * iocp_select().
+ *
+ * @param result Number of sockets with events, or SOCKET_ERROR
+ * @return FALSE if the engine owns none of the sockets
+ */
+static BOOL iocp_poll(WSAPOLLFD *fds, ULONG nfds, int timeout, int *result)
+{
+    WSAPOLLFD others[FD_SETSIZE];
+    ULONG     other_index[FD_SETSIZE];
+    BOOL      owned[FD_SETSIZE];
+    ULONG     other_count = 0;
+    BOOL      any_owned = FALSE;
+
+    if (!fds || nfds == 0 || nfds > FD_SETSIZE)
+    {
+        return FALSE;
+    }
+    for (ULONG i = 0; i < nfds; i++)
+    {
+        owned[i] = iocp_owns(fds[i].fd);
+        any_owned |= owned[i];
+        if (!owned[i])
+        {
+            others[other_count] = fds[i];
+            other_index[other_count++] = i;
+        }
+    }
+    if (!any_owned)
+    {
+        return FALSE;
+    }
+
+    int64_t deadline = timeout >= 0 ? clock_now_us() + (int64_t)timeout * 1000 : INT64_MAX;
+    for (;;)
+    {
+        LONG generation = iocp_generation();
+        int  count = 0;
+
+        for (ULONG i = 0; i < nfds; i++)
+        {
+            fds[i].revents = 0;
+            if (owned[i])
+            {
+                if ((fds[i].events & POLLRDNORM) && iocp_readable(fds[i].fd))
+                {
+                    fds[i].revents |= POLLRDNORM;
+                }
+                if ((fds[i].events & POLLWRNORM) && iocp_writable(fds[i].fd))
+                {
+                    fds[i].revents |= POLLWRNORM;
+                }
+            }
+        }
+        if (other_count > 0)
+        {
+            if (real_WSAPoll(others, other_count, 0) == SOCKET_ERROR)
+            {
+                *result = SOCKET_ERROR;
+                return TRUE;
+            }
+            for (ULONG i = 0; i < other_count; i++)
+            {
+                fds[other_index[i]].revents = others[i].revents;
+            }
+        }
+        for (ULONG i = 0; i < nfds; i++)
+        {
+            count += fds[i].revents != 0;
+        }
+
+        int64_t remaining = deadline - clock_now_us();
+        if (count > 0 || remaining <= 0)
+        {
+            *result = count;
+            return TRUE;
+        }
+        int64_t limit = other_count > 0 ? 1000 : 1000000;
+        iocp_wait_us(generation, (DWORD)(remaining < limit ? remaining : limit));
+    }
+}
+
+/**
+ * Hook for select() Winsock function. With SelectCache, server.dll's read
+ * polls with a timeout are served by readiness_poll(): zero-timeout polls
+ * of quiet sockets return 0 without a Winsock call and longer ones sleep
+ * until the watcher sees data. Polls for writability or errors, infinite
+ * waits and the peer protocol (whose framed and tunneled data does not
+ * show as socket readability) go to Winsock unchanged. With OverlappedIo,
+ * polls that include a socket the engine owns are served by iocp_select().
  *
- * @return Tick count from original function or 0 as fallback
+ * @return Number of ready sockets, 0 on timeout, SOCKET_ERROR on error
  */
-DWORD WINAPI hook_GetTickCount(void)
+int WSAAPI hook_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const struct timeval *timeout)
 {
-    if (real_GetTickCount)
+    BOOL from_server = is_caller_from_server((uintptr_t)CALLER_IP());
+    int  result;
+
+    if (from_server && g_config.overlapped_io && !peer_protocol_enabled() &&
+        iocp_select(nfds, readfds, writefds, exceptfds, timeout, &result))
     {
-        return real_GetTickCount();
+        return result;
     }
-    else
+    if (!from_server || !g_config.select_cache || peer_protocol_enabled() || !timeout ||
+        timeout->tv_sec > READINESS_MAX_TIMEOUT_S || !readfds || readfds->fd_count == 0 ||
+        (writefds && writefds->fd_count != 0) || (exceptfds && exceptfds->fd_count != 0))
     {
-        logf("[SERVER HOOK] GetTickCount was NULL. Falling back to 0");
-        return 0;
+        return real_select(nfds, readfds, writefds, exceptfds, timeout);
+    }
+
+    select_probe_ctx probe;
+    probe.nfds = nfds;
+    probe.requested = *readfds;
+    DWORD timeout_us = (DWORD)timeout->tv_sec * 1000000 + (DWORD)timeout->tv_usec;
+    if (!readiness_poll(readfds->fd_array, (int)readfds->fd_count, timeout_us, select_probe, &probe, &result))
+    {
+        return real_select(nfds, readfds, writefds, exceptfds, timeout);
+    }
+
+    if (result > 0)
+    {
+        *readfds = probe.readable;
+    }
+    else if (result == 0)
+    {
+        FD_ZERO(readfds);
+    }
+    return result;
+}
+
+typedef struct
+{
+    WSAPOLLFD *fds;
+    ULONG      count;
+} poll_probe_ctx;
+
+static int poll_probe(void *ctx)
+{
+    poll_probe_ctx *probe = (poll_probe_ctx *)ctx;
+
+    int result = real_WSAPoll(probe->fds, probe->count, 0);
+    for (ULONG i = 0; result > 0 && i < probe->count; i++)
+    {
+        if (probe->fds[i].revents != 0)
+        {
+            readiness_mark(probe->fds[i].fd);
+        }
     }
+    return result;
 }
 
 /**
- * Hook for server.dll srv_gameStreamReader function (RVA varies by version).
- * Fixes stability issues by preventing negative values in packet context.
- *
- * The original function can assign negative values to the error field which causes
- * network desynchronization and crashes.
+ * Hook for WSAPoll() Winsock function. Read-only polls from server.dll
+ * are served like hook_select(); anything else goes to Winsock.
  *
- * @param ctx Stream context structure pointer (validated for NULL)
- * @param received Number of bytes received
- * @param totalLen Total expected length
- * @return Modified return value (negative values converted to 0)
+ * @return Number of sockets with events, 0 on timeout, SOCKET_ERROR on error
  */
-int __cdecl hook_srv_gameStreamReader(int *ctx, int received, int totalLen)
+int WSAAPI hook_WSAPoll(WSAPOLLFD *fds, ULONG nfds, int timeout)
 {
-    // Validate parameters
-    if (!ctx)
+    BOOL from_server = is_caller_from_server((uintptr_t)CALLER_IP());
+    int  result;
+
+    if (from_server && g_config.overlapped_io && !peer_protocol_enabled() && iocp_poll(fds, nfds, timeout, &result))
     {
-        logf("[SERVER HOOK] srv_gameStreamReader called with NULL context");
-        return -1;
+        return result;
     }
 
-    // Call original function
-    int ret = real_srv_gameStreamReader(ctx, received, totalLen);
+    SOCKET sockets[READINESS_SOCKETS];
+    BOOL   cacheable = from_server && g_config.select_cache && !peer_protocol_enabled() && fds && nfds > 0 &&
+                     nfds <= READINESS_SOCKETS && timeout >= 0 && timeout <= READINESS_MAX_TIMEOUT_S * 1000;
 
-    // Apply fixes to prevent network instability
-    BOOL modified = false;
-    if (ctx[0xE] < 0)
+    for (ULONG i = 0; cacheable && i < nfds; i++)
     {
-        logf("[SERVER HOOK] srv_gameStreamReader: Fixed negative ctx[0xE] (%d -> 0)", ctx[0xE]);
-        ctx[0xE] = 0;
-        modified = true;
+        cacheable = fds[i].events != 0 && (fds[i].events & ~POLLIN) == 0;
+        sockets[i] = fds[i].fd;
     }
 
-    if (ret < 0)
+    poll_probe_ctx probe;
+    probe.fds = fds;
+    probe.count = nfds;
+    if (!cacheable || !readiness_poll(sockets, (int)nfds, (DWORD)timeout * 1000, poll_probe, &probe, &result))
     {
-        logf("[SERVER HOOK] srv_gameStreamReader: Fixed negative return value (%d -> 0)", ret);
-        ret = 0;
-        modified = true;
+        return real_WSAPoll(fds, nfds, timeout);
     }
 
-    if (modified)
+    if (result == 0)
     {
-        logf("[SERVER HOOK] srv_gameStreamReader: received=%d, totalLen=%d, result=%d", received, totalLen, ret);
+        for (ULONG i = 0; i < nfds; i++)
+        {
+            fds[i].revents = 0;
+        }
     }
-
-    return ret;
+    return result;
 }
 
 /**
- * Hook for recv() Winsock function to handle non-blocking socket errors.
- * Converts WSAEWOULDBLOCK errors to 0-byte receives for server.dll calls.
+ * Hook for closesocket() Winsock function.
+ * Gives queued sends a moment to leave, logs final per-socket statistics
+ * and frees tracked state so a reused socket handle starts clean. Applies
+ * to every caller, since handles are recycled process-wide.
  *
- * The original game code doesn't handle WSAEWOULDBLOCK correctly, causing
- * desynchronization. This hook makes non-blocking sockets work gracefully.
+ * @param s Socket handle
+ * @return Result of the original closesocket()
+ */
+int WSAAPI hook_closesocket(SOCKET s)
+{
+    send_queue_linger(s);
+    iocp_close(s);
+    log_recv_wait_stats(s);
+    buftune_close(s);
+    netclass_close(s);
+    BOOL handed_over = peer_close(s);
+    readiness_forget(s);
+    return handed_over ? 0 : real_closesocket(s);
+}
+
+/**
+ * Sets the SocketProfile options on a new connection, or lets AutoProfile
+ * classify it and set them.
  *
  * @param s Socket handle
- * @param buf Buffer to receive data into
- * @param len Buffer size
- * @param flags Recv flags (MSG_*)
- * @return Number of bytes received, 0 for graceful close, SOCKET_ERROR on error
+ * @param remote Peer address, or NULL to ask the socket
  */
-int WSAAPI hook_recv(SOCKET s, char *buf, int len, int flags)
+static void apply_socket_profile(SOCKET s, const struct sockaddr *remote)
 {
-    // Check if caller is from server.dll
-    if (!is_caller_from_server((uintptr_t)CALLER_IP()))
+    if (g_config.auto_profile)
     {
-        return real_recv(s, buf, len, flags);
+        netclass_start(s, remote, g_config.socket_profile);
     }
-
-    // Log suspicious parameters but don't block - let Windows handle them
-    // (Original HarryTheBird version passed all params through directly)
-    if (!buf || len <= 0)
+    else if (g_config.socket_profile != SOCKET_PROFILE_OFF)
     {
-        logf("[WS2 HOOK] recv: Suspicious parameters: buf=%p, len=%d (hex=0x%08X)", buf, len, (unsigned int)len);
+        sockprofile_apply(s, g_config.socket_profile);
     }
+}
 
-    int result = real_recv(s, buf, len, flags);
+/**
+ * Checks whether a socket has no local port yet, which before connect()
+ * means no connection attempt was started on it.
+ *
+ * @param s Socket handle
+ * @return TRUE if the socket is not bound
+ */
+static BOOL is_unbound(SOCKET s)
+{
+    struct sockaddr_storage local;
+    int                     local_len = sizeof(local);
 
-    if (result == SOCKET_ERROR)
+    if (getsockname(s, (struct sockaddr *)&local, &local_len) != 0)
     {
-        int error = WSAGetLastError();
-        if (error == WSAEWOULDBLOCK)
-        {
-            // Show buffer state when WSAEWOULDBLOCK occurs (rate limited)
-            int available = get_available_bytes(s);
-            if (available >= 0)
-            {
-                logf_rate_limited("recv_wouldblock", "[WS2 HOOK] recv: WSAEWOULDBLOCK, %d bytes available in buffer",
-                                  available);
-            }
-            else
-            {
-                logf_rate_limited("recv_wouldblock_unknown", "[WS2 HOOK] recv: WSAEWOULDBLOCK, buffer state unknown");
-            }
-
-            // Convert WSAEWOULDBLOCK to 0 for server.dll calls
-            WSASetLastError(NO_ERROR);
-            return 0;
-        }
-
-        log_winsock_error("[WS2 HOOK] recv", s, error);
+        return TRUE; // Windows refuses the call with WSAEINVAL until the socket is bound
     }
-    else if (result == 0)
+    if (local.ss_family == AF_INET)
     {
-        logf("[WS2 HOOK] recv: Connection gracefully closed by peer on socket %u", (unsigned)s);
-        log_socket_buffer_info(s);
+        return ((struct sockaddr_in *)&local)->sin_port == 0;
     }
-
-    return result;
+    if (local.ss_family == AF_INET6)
+    {
+        return ((struct sockaddr_in6 *)&local)->sin6_port == 0;
+    }
+    return FALSE;
 }
 
 /**
- * Hook for send() Winsock function to add retry logic for partial sends.
- * Ensures all data is sent by retrying on WSAEWOULDBLOCK errors.
- *
- * The original game doesn't handle cases where send buffer is full,
- * leading to packet loss. This hook retries until all data is sent.
+ * Hook for connect() Winsock function.
+ * Sets the SocketProfile options on server.dll's outgoing connections and
+ * remembers their target so a patched session can reconnect to it after a
+ * brief network drop. The options are set before the handshake, since the
+ * receive window scale is fixed by the SYN; a socket bound before
+ * connect() gets them once the connection is under way instead, because
+ * it cannot be told apart from a caller polling a connection in progress.
  *
  * @param s Socket handle
- * @param buf Data buffer to send
- * @param len Number of bytes to send
- * @param flags Send flags (MSG_*)
- * @return Total bytes sent, or SOCKET_ERROR on failure
+ * @param name Remote address
+ * @param namelen Size of name in bytes
+ * @return Result of the original connect()
  */
-int WSAAPI hook_send(SOCKET s, const char *buf, int len, int flags)
+int WSAAPI hook_connect(SOCKET s, const struct sockaddr *name, int namelen)
 {
-    // Check if caller is from server.dll
     if (!is_caller_from_server((uintptr_t)CALLER_IP()))
     {
-        return real_send(s, buf, len, flags);
+        return real_connect(s, name, namelen);
     }
 
-    logf_rate_limited("send_called", "[WS2 HOOK] send: called from server.dll: socket=%u, len=%d, flags=0x%X",
-                      (unsigned)s, len, flags);
-
-    // Log suspicious parameters but don't block - let the loop handle them naturally
-    // (Original HarryTheBird version: while(total < len) exits immediately if len <= 0)
-    if (!buf || len <= 0)
+    BOOL profiled = (g_config.auto_profile || g_config.socket_profile != SOCKET_PROFILE_OFF) && is_unbound(s);
+    if (profiled)
     {
-        logf("[WS2 HOOK] send: Suspicious parameters: buf=%p, len=%d (hex=0x%08X)", buf, len, (unsigned int)len);
+        apply_socket_profile(s, name);
     }
+    int result = real_connect(s, name, namelen);
+    int error = WSAGetLastError();
+    if (result != 0 && error != WSAEWOULDBLOCK)
+    {
+        return result; // Failed, or a non-blocking caller polling a connection already in progress
+    }
+    if (!profiled)
+    {
+        apply_socket_profile(s, name);
+        WSASetLastError(error);
+    }
+    if (peer_protocol_enabled())
+    {
+        peer_note_connection(s, SOCKET_DIRECTION_OUTGOING, name, namelen);
+        WSASetLastError(error);
+    }
+    return result;
+}
 
-    int total = 0;
-    int retry_count = 0;
+/**
+ * Gives an accepted socket the blocking mode Winsock copies from its
+ * listener, and drops the listener's event selection it copies as well.
+ *
+ * @param listener Listening socket
+ * @param accepted Socket accept() returned
+ */
+static void note_accepted_mode(SOCKET listener, SOCKET accepted)
+{
+    socket_state *listener_state = get_socket_state(listener, FALSE);
+    if (listener_state && listener_state->nonblocking)
+    {
+        socket_state *state = get_socket_state(accepted, TRUE);
+        if (state)
+        {
+            state->nonblocking = TRUE;
+        }
+    }
+    readiness_accepted(listener, accepted);
+}
 
-    while (total < len && retry_count < SEND_MAX_RETRIES)
+/**
+ * Hook for accept() Winsock function.
+ * Accepted connections get the SocketProfile options before anything else
+ * happens on them. Connections from patched peers resuming a lost session
+ * are attached to that session instead of being returned, and the call
+ * goes on with the next pending connection, exactly as if only that one
+ * had connected.
+ *
+ * @param s Listening socket
+ * @param addr Receives the remote address
+ * @param addrlen Size of addr in bytes
+ * @return Accepted socket, or INVALID_SOCKET
+ */
+SOCKET WSAAPI hook_accept(SOCKET s, struct sockaddr *addr, int *addrlen)
+{
+    if (!is_caller_from_server((uintptr_t)CALLER_IP()))
     {
-        int sent = real_send(s, buf + total, len - total, flags);
+        return real_accept(s, addr, addrlen);
+    }
 
-        if (sent == SOCKET_ERROR)
+    SOCKET accepted;
+    for (;;)
+    {
+        accepted = real_accept(s, addr, addrlen);
+        if (accepted == INVALID_SOCKET)
         {
-            int error = WSAGetLastError();
-            if (error == WSAEWOULDBLOCK)
-            {
-                logf_rate_limited("send_wouldblock",
-                                  "[WS2 HOOK] send: WSAEWOULDBLOCK, send buffer likely full (retry %d/%d)",
-                                  retry_count + 1, SEND_MAX_RETRIES);
-                HOOK_SLEEP(SEND_RETRY_DELAY_MS);
-                retry_count++;
-                continue;
-            }
-
-            log_winsock_error("[WS2 HOOK] send", s, error);
-            WSASetLastError(error);
-            if (error == WSAECONNRESET || error == WSAECONNABORTED)
-            {
-                return total > 0 ? total : SOCKET_ERROR;
-            }
-            return SOCKET_ERROR;
+            return accepted; // Also the WSAEWOULDBLOCK of a non-blocking listener after an attached resume
         }
-
-        if (sent == 0)
+        note_accepted_mode(s, accepted);
+        apply_socket_profile(accepted, addr && addrlen ? addr : NULL); // Also covers connections resuming a session
+        if (!peer_protocol_enabled())
         {
-            logf("[WS2 HOOK] send: Connection closed by peer after %d/%d bytes", total, len);
-            return total;
+            return accepted;
         }
+        if (!peer_accept_resume(accepted))
+        {
+            break;
+        }
+    }
 
-        total += sent;
-        retry_count = 0; // Reset retry counter on successful send
+    peer_note_connection(accepted, SOCKET_DIRECTION_ACCEPTED, NULL, 0);
+    WSASetLastError(NO_ERROR);
+    return accepted;
+}
+
+/**
+ * Hook for listen() Winsock function.
+ * Sets the SocketProfile options on server.dll's listening sockets before
+ * they listen, so accepted connections inherit them for their handshake.
+ * hook_accept() sets them again on each accepted socket, which also lets
+ * AutoProfile pick each connection's own class.
+ *
+ * @param s Bound socket
+ * @param backlog Maximum length of the pending connection queue
+ * @return Result of the original listen()
+ */
+int WSAAPI hook_listen(SOCKET s, int backlog)
+{
+    if (!is_caller_from_server((uintptr_t)CALLER_IP()))
+    {
+        return real_listen(s, backlog);
     }
 
-    if (retry_count >= SEND_MAX_RETRIES)
+    if (g_config.auto_profile)
     {
-        logf_rate_limited("send_max_retries",
-                          "[WS2 HOOK] send: Max retries exceeded, sent %d/%d bytes (send buffer full)", total, len);
-        log_socket_buffer_info(s);
-        WSASetLastError(WSAETIMEDOUT);
-        return total > 0 ? total : SOCKET_ERROR;
+        netclass_prepare_listener(s, g_config.socket_profile);
+    }
+    else if (g_config.socket_profile != SOCKET_PROFILE_OFF)
+    {
+        sockprofile_apply(s, g_config.socket_profile);
     }
+    return real_listen(s, backlog);
+}
 
-    return total;
+/**
+ * Hook for ioctlsocket() Winsock function.
+ * Records which sockets server.dll makes non-blocking: the readiness
+ * watcher only takes those, since its WSAEventSelect would make a blocking
+ * socket's calls fail with WSAEWOULDBLOCK. A socket switched back to
+ * blocking mode leaves the watcher first, because Winsock refuses FIONBIO
+ * while an event selection is active.
+ *
+ * @param s Socket handle
+ * @param cmd Command (FIONBIO, FIONREAD, ...)
+ * @param argp Command argument
+ * @return Result of the original ioctlsocket()
+ */
+int WSAAPI hook_ioctlsocket(SOCKET s, long cmd, u_long *argp)
+{
+    if (cmd != (long)FIONBIO || !argp || !is_caller_from_server((uintptr_t)CALLER_IP()))
+    {
+        return real_ioctlsocket(s, cmd, argp);
+    }
+
+    BOOL nonblocking = *argp != 0;
+    if (!nonblocking)
+    {
+        readiness_forget(s);
+    }
+    int           result = real_ioctlsocket(s, cmd, argp);
+    socket_state *state = result == 0 ? get_socket_state(s, TRUE) : NULL;
+    if (state)
+    {
+        state->nonblocking = nonblocking;
+    }
+    return result;
 }
 
 /**
@@ -475,29 +1635,9 @@ const char *get_server_path_from_ini(HMODULE hModule)
     static char serverPath[MAX_PATH];
     char        iniPath[MAX_PATH];
 
-    if (hModule == NULL)
-    {
-        logf("[CONFIG] Module handle is NULL.");
-        return NULL;
-    }
-
-    // Get the path of the DLL using GetModuleFileNameA()
-    if (GetModuleFileNameA(hModule, iniPath, sizeof(iniPath)) == 0)
-    {
-        logf("[CONFIG] Failed to get module file name: %lu", GetLastError());
-        return NULL;
-    }
-
-    // Remove filename and append game.ini using Path API
-    if (!PathRemoveFileSpecA(iniPath))
-    {
-        logf("[CONFIG] Could not remove file spec from module path: %s", iniPath);
-        return NULL;
-    }
-
-    if (!PathCombineA(iniPath, iniPath, "game.ini"))
+    // Locate game.ini next to the DLL
+    if (!get_ini_path(hModule, iniPath, sizeof(iniPath)))
     {
-        logf("[CONFIG] Could not combine path with game.ini");
         return NULL;
     }
 
@@ -583,8 +1723,42 @@ static BOOL create_hooks(void)
     // Create API hooks using helper function
     success &= create_hook_api(L"ws2_32", "recv", hook_recv, (void **)&real_recv, "recv");
     success &= create_hook_api(L"ws2_32", "send", hook_send, (void **)&real_send, "send");
+    real_WSASend = WSASend; // Not hooked: server.dll only calls send(), the send queue flushes with WSASend()
+    success &= create_hook_api(L"ws2_32", "closesocket", hook_closesocket, (void **)&real_closesocket, "closesocket");
+    success &= create_hook_api(L"ws2_32", "connect", hook_connect, (void **)&real_connect, "connect");
+    success &= create_hook_api(L"ws2_32", "accept", hook_accept, (void **)&real_accept, "accept");
+    success &= create_hook_api(L"ws2_32", "listen", hook_listen, (void **)&real_listen, "listen");
     success &=
         create_hook_api(L"kernel32", "GetTickCount", hook_GetTickCount, (void **)&real_GetTickCount, "GetTickCount");
+    success &= create_hook_api(L"kernel32", "QueryPerformanceCounter", hook_QueryPerformanceCounter,
+                               (void **)&real_QueryPerformanceCounter, "QueryPerformanceCounter");
+    if (real_QueryPerformanceCounter)
+    {
+        clock_use_counter(real_QueryPerformanceCounter); // clock.c must not time itself through the hook
+    }
+
+    // Optional: server.dll may not use winmm, in which case it is not loaded and there is nothing to shape
+    create_hook_api(L"winmm", "timeGetTime", hook_timeGetTime, (void **)&real_timeGetTime, "timeGetTime");
+
+    if (g_config.high_res_sleep != HIGH_RES_SLEEP_OFF)
+    {
+        success &= create_hook_api(L"kernel32", "Sleep", hook_Sleep, (void **)&real_Sleep, "Sleep");
+    }
+
+    // OverlappedIo needs them too: the kernel never sees data the engine already received
+    if (g_config.select_cache || g_config.overlapped_io)
+    {
+        success &= create_hook_api(L"ws2_32", "select", hook_select, (void **)&real_select, "select");
+        // Optional: WSAPoll() only exists since Windows Vista
+        create_hook_api(L"ws2_32", "WSAPoll", hook_WSAPoll, (void **)&real_WSAPoll, "WSAPoll");
+    }
+
+    // The readiness watcher only takes sockets server.dll made non-blocking
+    if (g_config.select_cache || g_config.recv_wait_us != 0)
+    {
+        success &= create_hook_api(L"ws2_32", "ioctlsocket", hook_ioctlsocket, (void **)&real_ioctlsocket,
+                                   "ioctlsocket");
+    }
 
     return success;
 }
@@ -604,6 +1778,10 @@ BOOL init_hooks(void)
 
     logf("[HOOK] Initialization started (PID: %lu, TID: %lu)", GetCurrentProcessId(), GetCurrentThreadId());
 
+    // Read [NetworkFix] options before any hook can fire
+    load_config(g_hModule);
+    clock_init(GetTickCount());
+
     // Initialize server.dll module (load, detect version, set up ranges)
     if (!init_server_module())
     {
@@ -661,12 +1839,22 @@ void cleanup_hooks(void)
     }
 
     logf("[HOOK] Cleanup started");
+    clock_log_calls();
+    clock_log_sleeps();
+    if (g_config.frame_profiler)
+    {
+        frameprof_log();
+    }
+    readiness_stop();
+    iocp_stop();
 
     MH_STATUS disableStatus = MH_DisableHook(MH_ALL_HOOKS);
     MH_STATUS uninitStatus = MH_Uninitialize();
 
     logf("[HOOK] Cleanup completed (Disable: %d, Uninit: %d)", (int)disableStatus, (int)uninitStatus);
 
+    reset_socket_states();
+
     // Free the globally loaded server.dll
 
     if (g_hServerDll)
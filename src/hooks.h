@@ -14,10 +14,27 @@ void cleanup_hooks(void);
 BOOL is_caller_from_server(uintptr_t caller_addr);
 
 // Hook implementations
-int WSAAPI   hook_recv(SOCKET s, char *buf, int len, int flags);
-int WSAAPI   hook_send(SOCKET s, const char *buf, int len, int flags);
-DWORD WINAPI hook_GetTickCount(void);
-int __cdecl  hook_srv_gameStreamReader(int *ctx, int received, int totalLen);
+int WSAAPI    hook_recv(SOCKET s, char *buf, int len, int flags);
+int WSAAPI    hook_send(SOCKET s, const char *buf, int len, int flags);
+int WSAAPI    hook_closesocket(SOCKET s);
+int WSAAPI    hook_connect(SOCKET s, const struct sockaddr *name, int namelen);
+SOCKET WSAAPI hook_accept(SOCKET s, struct sockaddr *addr, int *addrlen);
+int WSAAPI    hook_listen(SOCKET s, int backlog);
+int WSAAPI    hook_ioctlsocket(SOCKET s, long cmd, u_long *argp);
+int WSAAPI    hook_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+                          const struct timeval *timeout);
+int WSAAPI    hook_WSAPoll(WSAPOLLFD *fds, ULONG nfds, int timeout);
+DWORD WINAPI  hook_GetTickCount(void);
+DWORD WINAPI  hook_timeGetTime(void);
+BOOL WINAPI   hook_QueryPerformanceCounter(LARGE_INTEGER *counter);
+void WINAPI   hook_Sleep(DWORD ms);
+int __cdecl   hook_srv_gameStreamReader(int *ctx, int received, int totalLen);
+
+// Socket I/O with the WSAEWOULDBLOCK fixes applied (used by the peer layer)
+int recv_once(SOCKET s, char *buf, int len, int flags);
+int send_all(SOCKET s, const char *buf, int len, int flags);
+int send_once(SOCKET s, const char *buf, int len, int flags);
+int send_gather(SOCKET s, WSABUF *bufs, DWORD count);
 
 // Configuration
 const char *get_server_path_from_ini(HMODULE hModule);
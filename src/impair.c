@@ -0,0 +1,173 @@
+/*
+ * impair.c: Network impairment simulator for tunnel datagrams.
+ *
+ * Reproducing the loss, delay and reordering of a bad VPN link on a LAN (or
+ * over loopback in the tests) is the only practical way to check that the
+ * UDP tunnel recovers from them. Each datagram is dropped with the
+ * configured probability or held back for the fixed delay plus a random
+ * jitter; independent jitter per datagram also reorders them. A rate limit
+ * serializes datagrams through a simulated bottleneck, so a sender that
+ * outruns it sees its RTT grow with the queue, as on a real VPN link.
+ * Datagrams above the simulated path MTU are split into IP fragments the
+ * way a router would, and the datagram is lost if any fragment is.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "impair.h"
+#include <limits.h>
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+
+/**
+ * Returns the next pseudo-random number (xorshift32, never 0).
+ */
+static uint32_t next_random(impair_queue *queue)
+{
+    uint32_t x = queue->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    queue->rng = x;
+    return x;
+}
+
+BOOL impair_active(const impair_profile *profile)
+{
+    return profile->loss_percent != 0 || profile->delay_ms != 0 || profile->jitter_ms != 0 || profile->rate_kbps != 0 ||
+           profile->mtu != 0;
+}
+
+/**
+ * Returns how many IP packets a datagram travels in on the simulated path.
+ */
+static int fragment_count(const impair_queue *queue, int len)
+{
+    BOOL ipv6 = queue->to.ss_family == AF_INET6;
+    int  ip_header = ipv6 ? 40 : 20;
+    int  udp_len = len + 8;
+    if (queue->profile.mtu == 0 || ip_header + udp_len <= (int)queue->profile.mtu)
+    {
+        return 1;
+    }
+
+    // Every fragment but the last carries a multiple of 8 bytes; IPv6 adds a fragment header to each
+    int per_fragment = ((int)queue->profile.mtu - ip_header - (ipv6 ? 8 : 0)) & ~7;
+    return per_fragment <= 0 ? INT_MAX : (udp_len + per_fragment - 1) / per_fragment;
+}
+
+impair_queue *impair_create(const impair_profile *profile, const struct sockaddr *to, int to_len)
+{
+    HANDLE        heap = GetProcessHeap();
+    impair_queue *queue = (impair_queue *)HeapAlloc(heap, HEAP_ZERO_MEMORY, sizeof(impair_queue));
+    if (!queue)
+    {
+        return NULL;
+    }
+
+    queue->slots = (impair_datagram *)HeapAlloc(heap, 0, IMPAIR_QUEUE_SLOTS * sizeof(impair_datagram));
+    if (!queue->slots || to_len <= 0 || to_len > (int)sizeof(queue->to))
+    {
+        impair_destroy(queue);
+        return NULL;
+    }
+
+    LARGE_INTEGER seed;
+    QueryPerformanceCounter(&seed);
+    queue->profile = *profile;
+    queue->rng = (uint32_t)seed.QuadPart | 1;
+    memcpy(&queue->to, to, to_len);
+    queue->to_len = to_len;
+    return queue;
+}
+
+void impair_sendto(impair_queue *queue, SOCKET s, const uint8_t *buf, int len, BOOL dont_fragment, uint32_t now_us)
+{
+    const impair_profile *profile = &queue->profile;
+    int                   fragments = fragment_count(queue, len);
+
+    if (fragments > 1)
+    {
+        if (dont_fragment || fragments == INT_MAX)
+        {
+            queue->too_big++;
+            return;
+        }
+        queue->fragmented++;
+        queue->fragments += (uint32_t)fragments;
+    }
+
+    for (int i = 0; i < fragments; i++)
+    {
+        if (profile->loss_percent != 0 && next_random(queue) % 100 < profile->loss_percent)
+        {
+            queue->dropped++;
+            return;
+        }
+    }
+
+    uint32_t delay_us = profile->delay_ms * 1000;
+    if (profile->jitter_ms != 0)
+    {
+        delay_us += next_random(queue) % (profile->jitter_ms * 1000 + 1);
+    }
+
+    uint32_t link_free_us = queue->link_free_us;
+    if (profile->rate_kbps != 0)
+    {
+        // The datagram starts once the bottleneck finished the ones queued before it
+        uint32_t start_us = queue->link_busy && (int32_t)(link_free_us - now_us) > 0 ? link_free_us : now_us;
+        link_free_us = start_us + (uint32_t)((uint64_t)len * 8000 / profile->rate_kbps);
+        delay_us += link_free_us - now_us;
+    }
+    if (delay_us == 0 || len > IMPAIR_MAX_DATAGRAM)
+    {
+        sendto(s, (const char *)buf, len, 0, (const struct sockaddr *)&queue->to, queue->to_len);
+        return;
+    }
+
+    for (int i = 0; i < IMPAIR_QUEUE_SLOTS; i++)
+    {
+        if (!queue->used[i])
+        {
+            queue->slots[i].due_us = now_us + delay_us;
+            queue->slots[i].len = len;
+            memcpy(queue->slots[i].data, buf, len);
+            queue->used[i] = TRUE;
+            queue->link_free_us = link_free_us;
+            queue->link_busy = profile->rate_kbps != 0;
+            return;
+        }
+    }
+    queue->dropped++; // Queue overflow
+}
+
+void impair_flush(impair_queue *queue, SOCKET s, uint32_t now_us)
+{
+    if (queue->link_busy && (int32_t)(now_us - queue->link_free_us) >= 0)
+    {
+        queue->link_busy = FALSE; // Idle: the timestamp must not be compared once it wraps
+    }
+    for (int i = 0; i < IMPAIR_QUEUE_SLOTS; i++)
+    {
+        if (queue->used[i] && (int32_t)(now_us - queue->slots[i].due_us) >= 0)
+        {
+            sendto(s, (const char *)queue->slots[i].data, queue->slots[i].len, 0,
+                   (const struct sockaddr *)&queue->to, queue->to_len);
+            queue->used[i] = FALSE;
+        }
+    }
+}
+
+void impair_destroy(impair_queue *queue)
+{
+    if (!queue)
+    {
+        return;
+    }
+    if (queue->slots)
+    {
+        HeapFree(GetProcessHeap(), 0, queue->slots);
+    }
+    HeapFree(GetProcessHeap(), 0, queue);
+}
@@ -0,0 +1,92 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stdint.h>
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#define IMPAIR_QUEUE_SLOTS 512     // Datagrams held back at once; more are dropped like a full router queue
+#define IMPAIR_MAX_DATAGRAM 1500   // Larger datagrams are sent unimpaired
+
+/**
+ * Network conditions to simulate on outgoing datagrams. All zero means the
+ * simulator is off and datagrams go straight to sendto().
+ */
+typedef struct
+{
+    DWORD loss_percent; // Chance of dropping each datagram
+    DWORD delay_ms;     // Fixed one-way delay added to every datagram
+    DWORD jitter_ms;    // Extra random delay of up to this much; reorders datagrams
+    DWORD rate_kbps;    // Bottleneck bandwidth; datagrams queue behind each other like at a slow link
+    DWORD mtu;          // Path MTU; larger datagrams travel as IP fragments, each of which may be lost
+} impair_profile;
+
+typedef struct
+{
+    uint32_t due_us; // Send time
+    int      len;
+    uint8_t  data[IMPAIR_MAX_DATAGRAM];
+} impair_datagram;
+
+/**
+ * Outgoing datagrams waiting for their simulated delay to pass.
+ */
+typedef struct
+{
+    impair_profile          profile;
+    uint32_t                rng;     // xorshift32 state
+    struct sockaddr_storage to;      // Destination of every queued datagram
+    int                     to_len;
+    impair_datagram        *slots;   // IMPAIR_QUEUE_SLOTS entries
+    BOOL                    used[IMPAIR_QUEUE_SLOTS];
+    uint32_t                link_free_us; // When the simulated bottleneck finishes its current datagram
+    BOOL                    link_busy;    // link_free_us is still ahead
+    uint32_t                dropped;      // Datagrams lost on purpose
+    uint32_t                fragmented;   // Datagrams larger than the MTU
+    uint32_t                fragments;    // IP fragments they were split into
+    uint32_t                too_big;      // Datagrams larger than the MTU dropped because fragmenting was forbidden
+} impair_queue;
+
+/**
+ * Returns TRUE if the profile changes anything.
+ */
+BOOL impair_active(const impair_profile *profile);
+
+/**
+ * Creates a queue for one destination.
+ *
+ * @param profile Conditions to simulate
+ * @param to Destination address
+ * @param to_len Size of to in bytes
+ * @return Queue, or NULL if out of memory
+ */
+impair_queue *impair_create(const impair_profile *profile, const struct sockaddr *to, int to_len);
+
+/**
+ * Drops, delays or immediately sends one datagram according to the profile.
+ *
+ * @param queue Queue from impair_create()
+ * @param s UDP socket
+ * @param buf Datagram
+ * @param len Datagram length
+ * @param dont_fragment TRUE to drop the datagram instead of fragmenting it when it exceeds the MTU
+ * @param now_us Current time in microseconds
+ */
+void impair_sendto(impair_queue *queue, SOCKET s, const uint8_t *buf, int len, BOOL dont_fragment, uint32_t now_us);
+
+/**
+ * Sends every queued datagram whose delay has passed.
+ *
+ * @param queue Queue from impair_create()
+ * @param s UDP socket
+ * @param now_us Current time in microseconds
+ */
+void impair_flush(impair_queue *queue, SOCKET s, uint32_t now_us);
+
+/**
+ * Frees a queue. Datagrams still queued are discarded.
+ */
+void impair_destroy(impair_queue *queue);
+
+#endif // IMPAIR_H
@@ -0,0 +1,652 @@
+/*
+ * iocp.c: Overlapped I/O engine behind server.dll's sockets.
+ *
+ * The plain hooks call recv() and send() on the game thread, so every
+ * poll of an idle socket and every write that finds the socket buffer full
+ * is a trip into the kernel while the game waits. With OverlappedIo, each
+ * socket server.dll uses is associated with one I/O completion port and
+ * keeps a WSARecv outstanding into a receive ring, and its writes are
+ * copied into a send ring that a WSASend drains. One worker thread
+ * handles the completions and posts the next operation. The hooks only
+ * copy between the game's buffers and the rings, so what the game sees no
+ * longer depends on the state of the kernel's socket buffers, and a host
+ * with many players pays one wake-up per completion instead of one system
+ * call per poll.
+ *
+ * All rings and counters are guarded by one lock. Each socket has at most
+ * one WSARecv and one WSASend in flight; the WSARecv writes into the free
+ * part of the receive ring and the WSASend reads the oldest part of the
+ * send ring, so the hooks can keep reading and appending while they run.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "iocp.h"
+#include "clock.h"
+#include "logging.h"
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+
+#define IOCP_EOF (-1)                 // rx_error value for a graceful close
+#define IOCP_STOP_KEY ((ULONG_PTR)-1) // Completion key that tells the worker to exit
+
+typedef struct
+{
+    OVERLAPPED ov; // First member, so a completion's OVERLAPPED pointer is the operation
+    BOOL       posted;
+} iocp_op;
+
+typedef struct
+{
+    SOCKET   socket;     // INVALID_SOCKET = free slot
+    BOOL     closing;    // Closed by the game; freed once no operation is in flight
+    iocp_op  rx;
+    iocp_op  tx;
+    uint8_t *rx_buf;     // Ring of IOCP_RX_BYTES
+    int      rx_head;
+    int      rx_len;     // Received bytes not yet read by server.dll
+    int      rx_error;   // IOCP_EOF, a Winsock error, or 0
+    uint8_t *tx_buf;     // Ring of IOCP_TX_BYTES
+    int      tx_head;
+    int      tx_len;     // Buffered bytes, including those of the WSASend in flight
+    int      tx_error;   // Winsock error of a failed WSASend, or 0
+    uint32_t recv_posts;
+    uint32_t send_posts;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} iocp_conn;
+
+static CRITICAL_SECTION s_lock;                  // Guards the connections and the counters
+static volatile LONG    s_lock_init = 0;         // 0 = not initialized, 1 = initializing, 2 = ready
+static volatile LONG    s_started = 0;           // 0 = no worker, 1 = starting, 2 = running, 3 = failed
+static HANDLE           s_port = NULL;
+static HANDLE           s_worker = NULL;
+static volatile LONG    s_generation = 0;        // Completions handled, see iocp_wait_us()
+static volatile LONG    s_waiting[IOCP_WAITERS]; // 1 = held by a thread in iocp_wait_us()
+static HANDLE           s_wake[IOCP_WAITERS];    // Auto-reset; set by the worker for each held slot
+static iocp_conn        s_conns[IOCP_SOCKETS];
+static iocp_stats       s_stats;
+
+/**
+ * Initializes the module lock exactly once (hooks may fire from any thread).
+ */
+static void ensure_lock_initialized(void)
+{
+    if (s_lock_init == 2)
+    {
+        return;
+    }
+    if (InterlockedCompareExchange(&s_lock_init, 1, 0) == 0)
+    {
+        InitializeCriticalSection(&s_lock);
+        for (int i = 0; i < IOCP_SOCKETS; i++)
+        {
+            s_conns[i].socket = INVALID_SOCKET;
+        }
+        InterlockedExchange(&s_lock_init, 2);
+        return;
+    }
+    while (s_lock_init != 2)
+    {
+        Sleep(0);
+    }
+}
+
+/**
+ * Finds an owned socket's connection. Caller holds s_lock.
+ */
+static iocp_conn *find_conn(SOCKET s)
+{
+    for (int i = 0; i < IOCP_SOCKETS; i++)
+    {
+        if (s_conns[i].socket == s && !s_conns[i].closing)
+        {
+            return &s_conns[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Describes the part of a ring from offset start, count bytes long, as up
+ * to two buffers.
+ *
+ * @return Number of buffers used
+ */
+static DWORD ring_bufs(uint8_t *ring, int size, int start, int count, WSABUF bufs[2])
+{
+    int first = count < size - start ? count : size - start;
+
+    bufs[0].buf = (char *)ring + start;
+    bufs[0].len = (u_long)first;
+    if (first == count)
+    {
+        return 1;
+    }
+    bufs[1].buf = (char *)ring;
+    bufs[1].len = (u_long)(count - first);
+    return 2;
+}
+
+/**
+ * Posts a WSARecv into the free part of the receive ring if there is one
+ * and none is in flight. Caller holds s_lock.
+ */
+static void post_recv(iocp_conn *conn)
+{
+    if (conn->rx.posted || conn->rx_error != 0 || conn->closing || conn->rx_len == IOCP_RX_BYTES)
+    {
+        return;
+    }
+
+    WSABUF bufs[2];
+    DWORD  count = ring_bufs(conn->rx_buf, IOCP_RX_BYTES, (conn->rx_head + conn->rx_len) % IOCP_RX_BYTES,
+                             IOCP_RX_BYTES - conn->rx_len, bufs);
+    DWORD  flags = 0;
+    memset(&conn->rx.ov, 0, sizeof(conn->rx.ov));
+    if (WSARecv(conn->socket, bufs, count, NULL, &flags, &conn->rx.ov, NULL) != 0 &&
+        WSAGetLastError() != WSA_IO_PENDING)
+    {
+        conn->rx_error = WSAGetLastError();
+        logf("[IOCP] WSARecv failed on socket %u: %d", (unsigned)conn->socket, conn->rx_error);
+        return;
+    }
+    conn->rx.posted = TRUE;
+    conn->recv_posts++;
+    s_stats.recv_posts++;
+}
+
+/**
+ * Posts a WSASend of everything in the send ring if none is in flight.
+ * Caller holds s_lock.
+ */
+static void post_send(iocp_conn *conn)
+{
+    if (conn->tx.posted || conn->tx_error != 0 || conn->tx_len == 0)
+    {
+        return;
+    }
+
+    WSABUF bufs[2];
+    DWORD  count = ring_bufs(conn->tx_buf, IOCP_TX_BYTES, conn->tx_head, conn->tx_len, bufs);
+    memset(&conn->tx.ov, 0, sizeof(conn->tx.ov));
+    if (WSASend(conn->socket, bufs, count, NULL, 0, &conn->tx.ov, NULL) != 0 && WSAGetLastError() != WSA_IO_PENDING)
+    {
+        conn->tx_error = WSAGetLastError();
+        logf("[IOCP] WSASend failed on socket %u: %d", (unsigned)conn->socket, conn->tx_error);
+        return;
+    }
+    conn->tx.posted = TRUE;
+    conn->send_posts++;
+    s_stats.send_posts++;
+}
+
+/**
+ * Frees a closed connection once neither operation is in flight. Caller
+ * holds s_lock.
+ */
+static void release_if_idle(iocp_conn *conn)
+{
+    if (!conn->closing || conn->rx.posted || conn->tx.posted)
+    {
+        return;
+    }
+    HeapFree(GetProcessHeap(), 0, conn->rx_buf);
+    HeapFree(GetProcessHeap(), 0, conn->tx_buf);
+    memset(conn, 0, sizeof(*conn));
+    conn->socket = INVALID_SOCKET;
+}
+
+/**
+ * Books one completion and posts the connection's next operation.
+ * Caller holds s_lock.
+ */
+static void complete(iocp_conn *conn, iocp_op *op, BOOL ok, DWORD bytes)
+{
+    int error = 0;
+    if (!ok)
+    {
+        DWORD flags;
+        error = WSAGetOverlappedResult(conn->socket, &op->ov, &bytes, FALSE, &flags) ? 0 : WSAGetLastError();
+    }
+
+    op->posted = FALSE;
+    if (op == &conn->rx)
+    {
+        if (error != 0)
+        {
+            conn->rx_error = error;
+        }
+        else if (bytes == 0)
+        {
+            conn->rx_error = IOCP_EOF;
+        }
+        conn->rx_len += (int)bytes;
+        conn->bytes_in += bytes;
+        s_stats.bytes_in += bytes;
+        post_recv(conn);
+    }
+    else
+    {
+        conn->tx_error = error;
+        conn->tx_head = (conn->tx_head + (int)bytes) % IOCP_TX_BYTES;
+        conn->tx_len -= (int)bytes;
+        conn->bytes_out += bytes;
+        s_stats.bytes_out += bytes;
+        if (!conn->closing)
+        {
+            post_send(conn);
+        }
+    }
+    if (error != 0 && !conn->closing && error != WSA_OPERATION_ABORTED)
+    {
+        logf("[IOCP] %s failed on socket %u: %d", op == &conn->rx ? "WSARecv" : "WSASend", (unsigned)conn->socket,
+             error);
+    }
+    release_if_idle(conn);
+}
+
+/**
+ * Handles completion packets until iocp_stop() posts IOCP_STOP_KEY.
+ */
+static DWORD WINAPI worker_thread(LPVOID param)
+{
+    (void)param;
+
+    for (;;)
+    {
+        DWORD        bytes = 0;
+        ULONG_PTR    key = 0;
+        LPOVERLAPPED ov = NULL;
+        BOOL         ok = GetQueuedCompletionStatus(s_port, &bytes, &key, &ov, INFINITE);
+
+        if (key == IOCP_STOP_KEY)
+        {
+            return 0;
+        }
+        if (!ov)
+        {
+            logf_rate_limited("iocp_wait_failed", "[IOCP] GetQueuedCompletionStatus failed: %lu", GetLastError());
+            Sleep(1);
+            continue;
+        }
+
+        EnterCriticalSection(&s_lock);
+        if (key < IOCP_SOCKETS)
+        {
+            complete(&s_conns[key], (iocp_op *)ov, ok, bytes);
+        }
+        s_stats.completions++;
+        InterlockedIncrement(&s_generation);
+        for (int i = 0; i < IOCP_WAITERS; i++)
+        {
+            if (s_waiting[i])
+            {
+                SetEvent(s_wake[i]);
+            }
+        }
+        LeaveCriticalSection(&s_lock);
+    }
+}
+
+/**
+ * Creates the completion port and starts the worker thread once.
+ *
+ * @return FALSE if either could not be created
+ */
+static BOOL ensure_started(void)
+{
+    if (s_started == 2)
+    {
+        return TRUE;
+    }
+    ensure_lock_initialized();
+    if (InterlockedCompareExchange(&s_started, 1, 0) == 0)
+    {
+        s_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        BOOL events = TRUE;
+        for (int i = 0; i < IOCP_WAITERS; i++)
+        {
+            s_wake[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+            events &= s_wake[i] != NULL;
+        }
+        HANDLE thread = s_port && events ? CreateThread(NULL, 0, worker_thread, NULL, 0, NULL) : NULL;
+        if (!thread)
+        {
+            logf("[IOCP] Could not start the completion port worker: %lu", GetLastError());
+            InterlockedExchange(&s_started, 3);
+            return FALSE;
+        }
+        s_worker = thread;
+        logf("[IOCP] Completion port worker started");
+        InterlockedExchange(&s_started, 2);
+        return TRUE;
+    }
+    while (s_started == 1)
+    {
+        Sleep(0);
+    }
+    return s_started == 2;
+}
+
+BOOL iocp_adopt(SOCKET s)
+{
+    if (!ensure_started())
+    {
+        return FALSE;
+    }
+
+    EnterCriticalSection(&s_lock);
+    if (find_conn(s))
+    {
+        LeaveCriticalSection(&s_lock);
+        return TRUE;
+    }
+
+    // The rings are byte streams; datagrams would lose their boundaries in them
+    int type = 0;
+    int type_len = sizeof(type);
+    if (getsockopt(s, SOL_SOCKET, SO_TYPE, (char *)&type, &type_len) == SOCKET_ERROR || type != SOCK_STREAM)
+    {
+        LeaveCriticalSection(&s_lock);
+        return FALSE;
+    }
+
+    int index = 0;
+    while (index < IOCP_SOCKETS && s_conns[index].socket != INVALID_SOCKET)
+    {
+        index++;
+    }
+    if (index == IOCP_SOCKETS)
+    {
+        LeaveCriticalSection(&s_lock);
+        logf_rate_limited("iocp_full", "[IOCP] Cannot take over socket %u: %d sockets already owned", (unsigned)s,
+                          IOCP_SOCKETS);
+        return FALSE;
+    }
+
+    iocp_conn *conn = &s_conns[index];
+    conn->rx_buf = (uint8_t *)HeapAlloc(GetProcessHeap(), 0, IOCP_RX_BYTES);
+    conn->tx_buf = (uint8_t *)HeapAlloc(GetProcessHeap(), 0, IOCP_TX_BYTES);
+    if (!conn->rx_buf || !conn->tx_buf || !CreateIoCompletionPort((HANDLE)s, s_port, (ULONG_PTR)index, 0))
+    {
+        // A socket that cannot be associated now never can; it stays on plain Winsock calls
+        logf_rate_limited("iocp_adopt_failed", "[IOCP] Cannot take over socket %u: %lu", (unsigned)s, GetLastError());
+        HeapFree(GetProcessHeap(), 0, conn->rx_buf);
+        HeapFree(GetProcessHeap(), 0, conn->tx_buf);
+        conn->rx_buf = NULL;
+        conn->tx_buf = NULL;
+        LeaveCriticalSection(&s_lock);
+        return FALSE;
+    }
+
+    conn->socket = s;
+    s_stats.sockets++;
+    post_recv(conn);
+    LeaveCriticalSection(&s_lock);
+    logf("[IOCP] Socket %u now uses overlapped I/O", (unsigned)s);
+    return TRUE;
+}
+
+BOOL iocp_owns(SOCKET s)
+{
+    if (s_started != 2)
+    {
+        return FALSE;
+    }
+    EnterCriticalSection(&s_lock);
+    BOOL owned = find_conn(s) != NULL;
+    LeaveCriticalSection(&s_lock);
+    return owned;
+}
+
+int iocp_recv(SOCKET s, char *buf, int len, int flags)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    iocp_conn *conn = find_conn(s);
+    if (!conn)
+    {
+        LeaveCriticalSection(&s_lock);
+        WSASetLastError(WSAENOTSOCK);
+        return SOCKET_ERROR;
+    }
+
+    s_stats.recv_calls++;
+    if (conn->rx_len == 0)
+    {
+        int error = conn->rx_error;
+        s_stats.recv_empty += error == 0;
+        LeaveCriticalSection(&s_lock);
+        if (error == IOCP_EOF)
+        {
+            return 0;
+        }
+        WSASetLastError(error != 0 ? error : WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+
+    int    count = len < conn->rx_len ? len : conn->rx_len;
+    WSABUF parts[2];
+    DWORD  part_count = ring_bufs(conn->rx_buf, IOCP_RX_BYTES, conn->rx_head, count, parts);
+    memcpy(buf, parts[0].buf, parts[0].len);
+    if (part_count == 2)
+    {
+        memcpy(buf + parts[0].len, parts[1].buf, parts[1].len);
+    }
+    if (!(flags & MSG_PEEK))
+    {
+        conn->rx_head = (conn->rx_head + count) % IOCP_RX_BYTES;
+        conn->rx_len -= count;
+        post_recv(conn); // The ring may have been full
+    }
+    LeaveCriticalSection(&s_lock);
+    return count;
+}
+
+int iocp_send(SOCKET s, const char *buf, int len)
+{
+    int  total = 0;
+    BOOL waited = FALSE;
+
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    while (total < len)
+    {
+        iocp_conn *conn = find_conn(s);
+        if (!conn || conn->tx_error != 0)
+        {
+            int error = conn ? conn->tx_error : WSAENOTSOCK;
+            LeaveCriticalSection(&s_lock);
+            WSASetLastError(error);
+            return total > 0 ? total : SOCKET_ERROR;
+        }
+
+        int room = IOCP_TX_BYTES - conn->tx_len;
+        int count = len - total < room ? len - total : room;
+        if (count > 0)
+        {
+            WSABUF parts[2];
+            DWORD  part_count = ring_bufs(conn->tx_buf, IOCP_TX_BYTES, (conn->tx_head + conn->tx_len) % IOCP_TX_BYTES,
+                                          count, parts);
+            memcpy(parts[0].buf, buf + total, parts[0].len);
+            if (part_count == 2)
+            {
+                memcpy(parts[1].buf, buf + total + parts[0].len, parts[1].len);
+            }
+            conn->tx_len += count;
+            total += count;
+            post_send(conn);
+        }
+        if (total < len)
+        {
+            // A slow receiver: wait for a completed WSASend to make room
+            LONG generation = s_generation;
+            waited = TRUE;
+            LeaveCriticalSection(&s_lock);
+            iocp_wait_us(generation, IOCP_SEND_WAIT_US);
+            EnterCriticalSection(&s_lock);
+        }
+    }
+    s_stats.send_calls++;
+    s_stats.send_waits += waited;
+    LeaveCriticalSection(&s_lock);
+    return len;
+}
+
+/**
+ * Waits up to IOCP_LINGER_MS until the socket's send ring is empty or has
+ * failed. Caller holds s_lock, which is released while waiting.
+ *
+ * @return The connection, or NULL if it is gone
+ */
+static iocp_conn *drain_locked(SOCKET s)
+{
+    int64_t    start = clock_now_us();
+    iocp_conn *conn = find_conn(s);
+
+    while (conn && conn->tx_len > 0 && conn->tx_error == 0 &&
+           clock_now_us() - start < (int64_t)IOCP_LINGER_MS * 1000)
+    {
+        LONG generation = s_generation;
+        LeaveCriticalSection(&s_lock);
+        iocp_wait_us(generation, IOCP_SEND_WAIT_US);
+        EnterCriticalSection(&s_lock);
+        conn = find_conn(s);
+    }
+    return conn;
+}
+
+void iocp_drain(SOCKET s)
+{
+    if (s_started != 2)
+    {
+        return;
+    }
+    EnterCriticalSection(&s_lock);
+    drain_locked(s);
+    LeaveCriticalSection(&s_lock);
+}
+
+BOOL iocp_readable(SOCKET s)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    iocp_conn *conn = find_conn(s);
+    BOOL       readable = conn && (conn->rx_len > 0 || conn->rx_error != 0);
+    LeaveCriticalSection(&s_lock);
+    return readable;
+}
+
+BOOL iocp_writable(SOCKET s)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    iocp_conn *conn = find_conn(s);
+    BOOL       writable = conn && (conn->tx_len < IOCP_TX_BYTES || conn->tx_error != 0);
+    LeaveCriticalSection(&s_lock);
+    return writable;
+}
+
+LONG iocp_generation(void)
+{
+    return s_generation;
+}
+
+BOOL iocp_wait_us(LONG generation, DWORD timeout_us)
+{
+    if (s_started != 2)
+    {
+        return FALSE;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < IOCP_WAITERS && slot < 0; i++)
+    {
+        if (InterlockedCompareExchange(&s_waiting[i], 1, 0) == 0)
+        {
+            slot = i;
+        }
+    }
+    if (slot < 0)
+    {
+        clock_wait_us(NULL, timeout_us < IOCP_POLL_US ? timeout_us : IOCP_POLL_US);
+        return s_generation != generation;
+    }
+
+    // Drops a wake-up meant for the slot's last waiter. The worker bumps the generation before it reads the slots,
+    // so a completion that slips in after the reset is caught by the check below
+    ResetEvent(s_wake[slot]);
+    if (s_generation == generation)
+    {
+        clock_wait_us(s_wake[slot], timeout_us);
+    }
+    InterlockedExchange(&s_waiting[slot], 0);
+    return s_generation != generation;
+}
+
+void iocp_close(SOCKET s)
+{
+    if (s_started != 2)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&s_lock);
+    iocp_conn *conn = drain_locked(s);
+    if (!conn)
+    {
+        LeaveCriticalSection(&s_lock);
+        return;
+    }
+    if (conn->tx_len > 0)
+    {
+        logf("[IOCP] Socket %u closed with %d bytes still unsent", (unsigned)s, conn->tx_len);
+    }
+    logf("[IOCP] Socket %u: %llu bytes in with %lu WSARecv calls, %llu bytes out with %lu WSASend calls", (unsigned)s,
+         (unsigned long long)conn->bytes_in, (unsigned long)conn->recv_posts, (unsigned long long)conn->bytes_out,
+         (unsigned long)conn->send_posts);
+
+    // closesocket() would cancel them too; the worker frees the buffers once both completions are in
+    conn->closing = TRUE;
+    if (conn->rx.posted || conn->tx.posted)
+    {
+        CancelIoEx((HANDLE)s, NULL);
+    }
+    release_if_idle(conn);
+    LeaveCriticalSection(&s_lock);
+}
+
+iocp_stats iocp_get_stats(void)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    iocp_stats stats = s_stats;
+    LeaveCriticalSection(&s_lock);
+    return stats;
+}
+
+void iocp_stop(void)
+{
+    if (s_started != 2)
+    {
+        return;
+    }
+    iocp_stats stats = iocp_get_stats();
+    logf("[IOCP] Sockets: %lu, WSARecv: %lu, WSASend: %lu, completions: %lu, recv calls: %lu (%lu empty), send calls: "
+         "%lu (%lu waited for room), bytes in: %llu, out: %llu",
+         (unsigned long)stats.sockets, (unsigned long)stats.recv_posts, (unsigned long)stats.send_posts,
+         (unsigned long)stats.completions, (unsigned long)stats.recv_calls, (unsigned long)stats.recv_empty,
+         (unsigned long)stats.send_calls, (unsigned long)stats.send_waits, (unsigned long long)stats.bytes_in,
+         (unsigned long long)stats.bytes_out);
+
+    // During DLL detach the exiting worker waits for the loader lock this thread holds, so the wait is bounded; by
+    // then it has left this module's code
+    PostQueuedCompletionStatus(s_port, 0, IOCP_STOP_KEY, NULL);
+    if (WaitForSingleObject(s_worker, IOCP_STOP_WAIT_MS) != WAIT_OBJECT_0)
+    {
+        logf("[IOCP] Worker thread still running after %d ms", IOCP_STOP_WAIT_MS);
+    }
+    CloseHandle(s_worker);
+    s_worker = NULL;
+}
@@ -0,0 +1,121 @@
+#ifndef IOCP_H
+#define IOCP_H
+
+#include <stdint.h>
+#include <windows.h>
+#include <winsock2.h>
+
+#define IOCP_SOCKETS 64          // Sockets the engine can own at once (MAX_TRACKED_SOCKETS)
+#define IOCP_RX_BYTES 65536      // Received data buffered per socket until server.dll reads it
+#define IOCP_TX_BYTES 65536      // Game data buffered per socket until its WSASend completes
+#define IOCP_LINGER_MS 1000      // How long closesocket waits for buffered data to leave
+#define IOCP_STOP_WAIT_MS 500    // How long iocp_stop() waits for the worker thread to exit
+#define IOCP_SEND_WAIT_US 100000 // Longest single wait of a send for buffer room before it checks again
+#define IOCP_WAITERS 16          // Threads that can wait for a completion at once...
+#define IOCP_POLL_US 1000        // ...while more check for one this often
+
+/**
+ * Engine counters for the log and tests.
+ */
+typedef struct
+{
+    uint32_t sockets;     // Sockets taken over
+    uint32_t recv_posts;  // WSARecv calls
+    uint32_t send_posts;  // WSASend calls
+    uint32_t completions; // Completion packets handled by the worker
+    uint32_t recv_calls;  // recv() calls answered from the buffers
+    uint32_t recv_empty;  // Of those, calls that found no data
+    uint32_t send_calls;  // send() calls copied into the buffers
+    uint32_t send_waits;  // Of those, calls that had to wait for room
+    uint64_t bytes_in;    // Bytes received by completed WSARecv calls
+    uint64_t bytes_out;   // Bytes written by completed WSASend calls
+} iocp_stats;
+
+/**
+ * Hands a socket to the engine on its first use: associates it with the
+ * completion port, allocates its buffers and posts the first WSARecv.
+ * Starts the worker thread on first use. Cheap for sockets it already
+ * owns.
+ *
+ * @param s Connected socket
+ * @return FALSE if it is not a stream socket or the engine cannot take it; the caller uses plain Winsock calls
+ */
+BOOL iocp_adopt(SOCKET s);
+
+/**
+ * Returns TRUE if the engine owns the socket.
+ */
+BOOL iocp_owns(SOCKET s);
+
+/**
+ * recv() from the socket's receive buffer. Never enters the kernel except
+ * to post the next WSARecv once the buffer has room again.
+ *
+ * @param flags MSG_PEEK leaves the data in the buffer; other flags are ignored
+ * @return Bytes copied, 0 once the peer closed and the buffer is empty,
+ *         or SOCKET_ERROR with WSAEWOULDBLOCK or the connection's error
+ */
+int iocp_recv(SOCKET s, char *buf, int len, int flags);
+
+/**
+ * send() into the socket's send buffer. Returns once all of buf is
+ * buffered, waiting for completed WSASend calls to make room if needed.
+ *
+ * @return len, the bytes buffered before an error, or SOCKET_ERROR
+ */
+int iocp_send(SOCKET s, const char *buf, int len);
+
+/**
+ * Waits up to IOCP_LINGER_MS for the socket's buffered data to be written.
+ * Used before a send with flags, which bypasses the buffer.
+ */
+void iocp_drain(SOCKET s);
+
+/**
+ * Whether a select() or WSAPoll() on an owned socket would report it.
+ *
+ * @return Readable: data buffered, or the connection ended
+ */
+BOOL iocp_readable(SOCKET s);
+
+/**
+ * @return Writable: the send buffer has room, or the connection failed
+ */
+BOOL iocp_writable(SOCKET s);
+
+/**
+ * Returns the number of completions handled so far, for iocp_wait_us().
+ */
+LONG iocp_generation(void);
+
+/**
+ * Waits until the worker handles a completion after generation was read,
+ * or until timeout_us passes. Each waiting thread gets its own event, so
+ * waiters cannot swallow each other's wake-ups.
+ *
+ * @return TRUE if a completion arrived
+ */
+BOOL iocp_wait_us(LONG generation, DWORD timeout_us);
+
+/**
+ * Gives buffered data up to IOCP_LINGER_MS to leave, logs the socket's
+ * counters and cancels its outstanding operations. The worker frees the
+ * buffers once both have completed. Cheap for sockets the engine never
+ * owned.
+ *
+ * @param s Socket handle about to be closed
+ */
+void iocp_close(SOCKET s);
+
+/**
+ * Returns a copy of the counters.
+ */
+iocp_stats iocp_get_stats(void);
+
+/**
+ * Logs the counters, asks the worker thread to exit and waits up to
+ * IOCP_STOP_WAIT_MS for it.
+ */
+void iocp_stop(void);
+
+#endif // IOCP_H
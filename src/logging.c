@@ -12,6 +12,7 @@
 #include <windows.h>
 #include <winsock2.h>
 
+#include "clock.h"
 #include "logging.h"
 
 logging_context g_logctx = {0};
@@ -193,8 +194,10 @@ void close_logging(void)
 /**
  * Rate-limited logging function to prevent spam.
  * Only logs a message if it hasn't been logged recently.
+ *
+ * @return true if the message was logged, false if it was suppressed
  */
-void logf_rate_limited(const char *key, const char *fmt, ...)
+bool logf_rate_limited(const char *key, const char *fmt, ...)
 {
     static struct
     {
@@ -202,8 +205,9 @@ void logf_rate_limited(const char *key, const char *fmt, ...)
         DWORD last_logged;
     } rate_limit_cache[10] = {0};
 
-    DWORD current_time = GetTickCount();
+    DWORD current_time = clock_ticks();
     int   cache_slot = -1;
+    bool  known = false;
 
     // Find existing entry or empty slot
     for (int i = 0; i < 10; i++)
@@ -211,6 +215,7 @@ void logf_rate_limited(const char *key, const char *fmt, ...)
         if (strcmp(rate_limit_cache[i].key, key) == 0)
         {
             cache_slot = i;
+            known = true;
             break;
         }
         if (cache_slot == -1 && rate_limit_cache[i].key[0] == '\0')
@@ -234,10 +239,10 @@ void logf_rate_limited(const char *key, const char *fmt, ...)
         }
     }
 
-    // Check if enough time has passed
-    if (current_time - rate_limit_cache[cache_slot].last_logged < LOG_RATE_LIMIT_MS)
+    // Check if enough time has passed; a key without an entry was not logged recently
+    if (known && current_time - rate_limit_cache[cache_slot].last_logged < LOG_RATE_LIMIT_MS)
     {
-        return; // Skip logging
+        return false; // Skip logging
     }
 
     // Update cache and log message
@@ -252,4 +257,5 @@ void logf_rate_limited(const char *key, const char *fmt, ...)
     va_end(ap);
 
     logf("%s", buffer);
+    return true;
 }
\ No newline at end of file
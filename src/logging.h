@@ -21,7 +21,7 @@ extern logging_context g_logctx;
 bool                   init_logging(HMODULE hModule);
 void                   close_logging(void);
 void                   logf(const char *fmt, ...);
-void                   logf_rate_limited(const char *key, const char *fmt, ...);
+bool                   logf_rate_limited(const char *key, const char *fmt, ...);
 void                   log_winsock_error(const char *prefix, SOCKET s, int error);
 void                   log_socket_buffer_info(SOCKET s);
 
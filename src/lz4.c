@@ -0,0 +1,254 @@
+/*
+ * lz4.c: Minimal LZ4 block format compressor and safe decompressor.
+ *
+ * Used by the peer protocol to shrink game data on the wire. Only the
+ * block format is implemented (no frame headers or dictionaries); each
+ * block is at most 64 KB so every match offset fits in 16 bits.
+ */
+
+#include "lz4.h"
+#include <string.h>
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // The last 5 bytes of a block are always literals
+#define LZ4_MF_LIMIT 12     // The last match must start at least 12 bytes before the end
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash_u32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/**
+ * Writes a length continuation (the part above the 4-bit token field).
+ *
+ * @return Updated output position, or NULL if out of space
+ */
+static uint8_t *write_length(uint8_t *op, const uint8_t *oend, int len)
+{
+    while (len >= 255)
+    {
+        if (op >= oend)
+        {
+            return NULL;
+        }
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend)
+    {
+        return NULL;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * Emits one sequence: literals followed by an optional match.
+ *
+ * @param match_len Match length in bytes, or 0 for the final literal-only sequence
+ * @return Updated output position, or NULL if out of space
+ */
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *literals, int literal_len,
+                               int offset, int match_len)
+{
+    uint8_t *token = op++;
+    if (token >= oend)
+    {
+        return NULL;
+    }
+
+    int lit_code = literal_len < 15 ? literal_len : 15;
+    int match_code = 0;
+    if (match_len > 0)
+    {
+        match_code = match_len - LZ4_MIN_MATCH < 15 ? match_len - LZ4_MIN_MATCH : 15;
+    }
+    *token = (uint8_t)((lit_code << 4) | match_code);
+
+    if (literal_len >= 15 && (op = write_length(op, oend, literal_len - 15)) == NULL)
+    {
+        return NULL;
+    }
+    if (oend - op < literal_len)
+    {
+        return NULL;
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (match_len == 0)
+    {
+        return op;
+    }
+
+    if (oend - op < 2)
+    {
+        return NULL;
+    }
+    *op++ = (uint8_t)(offset & 0xFF);
+    *op++ = (uint8_t)(offset >> 8);
+
+    if (match_len - LZ4_MIN_MATCH >= 15)
+    {
+        op = write_length(op, oend, match_len - LZ4_MIN_MATCH - 15);
+    }
+    return op;
+}
+
+int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_capacity)
+{
+    if (!src || !dst || src_len < 0 || src_len > LZ4_MAX_INPUT_SIZE || dst_capacity <= 0)
+    {
+        return 0;
+    }
+
+    uint16_t       table[1 << LZ4_HASH_BITS];
+    uint8_t       *op = dst;
+    const uint8_t *oend = dst + dst_capacity;
+    int            anchor = 0;
+    int            ip = 0;
+
+    memset(table, 0, sizeof(table));
+
+    if (src_len > LZ4_MF_LIMIT)
+    {
+        const int mf_limit = src_len - LZ4_MF_LIMIT;
+        const int match_limit = src_len - LZ4_LAST_LITERALS;
+
+        while (ip < mf_limit)
+        {
+            uint32_t seq = read_u32(src + ip);
+            uint32_t h = hash_u32(seq);
+            int      ref = table[h];
+            table[h] = (uint16_t)ip;
+
+            if (ref >= ip || read_u32(src + ref) != seq)
+            {
+                ip++;
+                continue;
+            }
+
+            // Extend the match backwards into pending literals, then forwards
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+            {
+                ip--;
+                ref--;
+            }
+            int match_len = LZ4_MIN_MATCH;
+            while (ip + match_len < match_limit && src[ip + match_len] == src[ref + match_len])
+            {
+                match_len++;
+            }
+
+            op = write_sequence(op, oend, src + anchor, ip - anchor, ip - ref, match_len);
+            if (!op)
+            {
+                return 0;
+            }
+
+            ip += match_len;
+            anchor = ip;
+            if (ip - 2 > 0 && ip - 2 < mf_limit)
+            {
+                table[hash_u32(read_u32(src + ip - 2))] = (uint16_t)(ip - 2);
+            }
+        }
+    }
+
+    op = write_sequence(op, oend, src + anchor, src_len - anchor, 0, 0);
+    return op ? (int)(op - dst) : 0;
+}
+
+/**
+ * Reads a length continuation.
+ *
+ * @return Total length, or -1 if the input ends inside the length
+ */
+static int read_length(const uint8_t *src, int src_len, int *ip, int len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= src_len)
+        {
+            return -1;
+        }
+        b = src[(*ip)++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_capacity)
+{
+    if (!src || !dst || src_len <= 0 || dst_capacity < 0)
+    {
+        return -1;
+    }
+
+    int ip = 0;
+    int op = 0;
+
+    while (ip < src_len)
+    {
+        uint8_t token = src[ip++];
+
+        int literal_len = token >> 4;
+        if (literal_len == 15 && (literal_len = read_length(src, src_len, &ip, literal_len)) < 0)
+        {
+            return -1;
+        }
+        if (literal_len > src_len - ip || literal_len > dst_capacity - op)
+        {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        if (ip == src_len)
+        {
+            break; // Final literal-only sequence
+        }
+
+        if (src_len - ip < 2)
+        {
+            return -1;
+        }
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+        {
+            return -1;
+        }
+
+        int match_len = token & 0x0F;
+        if (match_len == 15 && (match_len = read_length(src, src_len, &ip, match_len)) < 0)
+        {
+            return -1;
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > dst_capacity - op)
+        {
+            return -1;
+        }
+
+        // Byte copy: matches may overlap their own output
+        const uint8_t *match = dst + op - offset;
+        for (int i = 0; i < match_len; i++)
+        {
+            dst[op + i] = match[i];
+        }
+        op += match_len;
+    }
+
+    return op;
+}
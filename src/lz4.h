@@ -0,0 +1,35 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+
+#define LZ4_MAX_INPUT_SIZE 65535 // Blocks are limited so match offsets fit 16 bits
+
+/**
+ * Worst-case compressed size for an input of the given length.
+ */
+#define LZ4_COMPRESS_BOUND(n) ((n) + ((n) / 255) + 16)
+
+/**
+ * Compresses a block into the LZ4 block format.
+ *
+ * @param src Input bytes
+ * @param src_len Input length (at most LZ4_MAX_INPUT_SIZE)
+ * @param dst Output buffer
+ * @param dst_capacity Size of dst in bytes
+ * @return Compressed length, or 0 if the input is too large or dst is too small
+ */
+int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_capacity);
+
+/**
+ * Decompresses an LZ4 block. Malformed input is rejected, never overruns dst.
+ *
+ * @param src Compressed bytes
+ * @param src_len Compressed length
+ * @param dst Output buffer
+ * @param dst_capacity Size of dst in bytes
+ * @return Decompressed length, or -1 if the block is malformed or does not fit
+ */
+int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_capacity);
+
+#endif // LZ4_H
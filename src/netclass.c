@@ -0,0 +1,561 @@
+/*
+ * netclass.c: Automatic LAN/VPN classification of server.dll's connections.
+ *
+ * SocketProfile makes the player say what network the game runs on. With
+ * AutoProfile, every connection is classified on its own instead, and the
+ * class picks the SocketProfile options (TCP_NODELAY, buffer sizes,
+ * keepalive timings) together with two settings of the hooks:
+ *
+ *   class            send retry delay  recv wait budget
+ *   LAN              1 ms              RecvWaitUs
+ *   VPN low latency  2 ms              RecvWaitUs / 2
+ *   VPN lossy        5 ms              none
+ *
+ * A full send buffer drains at the pace of the peer's ACKs, so on a long
+ * round trip retrying every millisecond only burns wakeups. Recv waits
+ * catch data that is microseconds away, which is how a LAN delivers it;
+ * a tunnel delivers in bursts a round trip apart, and on a lossy one a
+ * retransmission holds everything back far longer than any wait.
+ *
+ * A connection starts as a tunnel when its peer or local address lies in
+ * the Hamachi (25.0.0.0/8) or Radmin VPN (26.0.0.0/8) subnet, or when the
+ * adapter carrying it is named like a known VPN. After that, every
+ * NETCLASS_WINDOW_MS, the heartbeat round trip and its variation (between
+ * patched peers) and the share of writes that found the send buffer full
+ * are checked against thresholds with separate enter and leave levels. A
+ * class must win NETCLASS_CONFIRM_WINDOWS windows in a row before the
+ * connection switches, so one bad second does not flap the settings. Every
+ * switch is logged with the metrics that caused it.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "netclass.h"
+#include "clock.h"
+#include "config.h"
+#include "logging.h"
+#include "socket_state.h"
+#include "sockprofile.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include <iphlpapi.h> // Needs winsock2.h first
+
+#define ADAPTER_NAME_LEN 48 // Adapter names kept for the log
+
+/**
+ * Hook settings one class stands for.
+ */
+typedef struct
+{
+    DWORD retry_delay_ms;    // Sleep between retries of a write that found the send buffer full
+    DWORD recv_wait_percent; // Share of RecvWaitUs an empty recv() may wait
+} class_tuning;
+
+typedef struct
+{
+    SOCKET   socket;                    // INVALID_SOCKET = free slot
+    DWORD    cls;                       // SOCKET_PROFILE_* class now
+    DWORD    start_cls;                 // Class from the addresses and adapter
+    char     adapter[ADAPTER_NAME_LEN]; // VPN the addresses or adapter pointed to, "" if none
+    DWORD    window_start;              // Tick count when the current window began
+    uint32_t sends;                     // Writes in the current window, blocked ones included
+    uint32_t blocks;                    // Of those, writes that found the send buffer full
+    DWORD    pending;                   // Class the last windows favored instead, SOCKET_PROFILE_OFF if none
+    uint32_t pending_windows;           // How many windows in a row favored it
+    uint32_t changes;                   // Class changes made
+} netclass_socket;
+
+static const class_tuning s_tuning[] = {
+    {1, 100}, // SOCKET_PROFILE_LAN
+    {2, 50},  // SOCKET_PROFILE_VPN
+    {5, 0},   // SOCKET_PROFILE_VPN_LOSSY
+};
+
+// Adapter names (description or friendly name) that mark a tunnel
+static const char *const s_vpn_adapters[] = {"Hamachi", "Radmin", "ZeroTier", "Tailscale", "WireGuard", "TAP-Windows"};
+
+static CRITICAL_SECTION s_lock;          // Guards the sockets and the counters
+static volatile LONG    s_lock_init = 0; // 0 = not initialized, 1 = initializing, 2 = ready
+static netclass_socket  s_sockets[NETCLASS_SOCKETS];
+static netclass_stats   s_stats;
+
+/**
+ * Initializes the module lock exactly once (hooks may fire from any thread).
+ */
+static void ensure_lock_initialized(void)
+{
+    if (s_lock_init == 2)
+    {
+        return;
+    }
+    if (InterlockedCompareExchange(&s_lock_init, 1, 0) == 0)
+    {
+        InitializeCriticalSection(&s_lock);
+        for (int i = 0; i < NETCLASS_SOCKETS; i++)
+        {
+            s_sockets[i].socket = INVALID_SOCKET;
+        }
+        InterlockedExchange(&s_lock_init, 2);
+        return;
+    }
+    while (s_lock_init != 2)
+    {
+        Sleep(0);
+    }
+}
+
+static const char *class_name(DWORD cls)
+{
+    const socket_profile *profile = sockprofile_get(cls);
+    return profile ? profile->name : "unknown";
+}
+
+const char *netclass_vpn_subnet(const struct sockaddr *addr)
+{
+    uint32_t ip;
+
+    if (addr->sa_family == AF_INET)
+    {
+        ip = ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr);
+    }
+    else if (addr->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *)addr)->sin6_addr))
+    {
+        const uint8_t *bytes = ((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+        ip = (uint32_t)bytes[12] << 24 | (uint32_t)bytes[13] << 16 | (uint32_t)bytes[14] << 8 | bytes[15];
+    }
+    else
+    {
+        return NULL;
+    }
+
+    switch (ip >> 24)
+    {
+    case 25:
+        return "Hamachi";
+    case 26:
+        return "Radmin VPN";
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * Checks an adapter name against s_vpn_adapters, ignoring case.
+ *
+ * @param wide_name Description or friendly name of the adapter
+ * @param name Receives the name for the log
+ * @param name_size Size of name in bytes
+ * @return TRUE if the name contains one of s_vpn_adapters
+ */
+static BOOL is_vpn_adapter_name(const wchar_t *wide_name, char *name, size_t name_size)
+{
+    char lower[ADAPTER_NAME_LEN * 2];
+
+    if (!wide_name || WideCharToMultiByte(CP_ACP, 0, wide_name, -1, lower, (int)sizeof(lower), NULL, NULL) <= 0)
+    {
+        return FALSE;
+    }
+    lower[sizeof(lower) - 1] = '\0';
+    snprintf(name, name_size, "%s", lower);
+    for (char *c = lower; *c; c++)
+    {
+        *c = (char)tolower((unsigned char)*c);
+    }
+
+    for (size_t i = 0; i < sizeof(s_vpn_adapters) / sizeof(s_vpn_adapters[0]); i++)
+    {
+        char keyword[32];
+        snprintf(keyword, sizeof(keyword), "%s", s_vpn_adapters[i]);
+        for (char *c = keyword; *c; c++)
+        {
+            *c = (char)tolower((unsigned char)*c);
+        }
+        if (strstr(lower, keyword))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static BOOL same_address(const struct sockaddr *a, const struct sockaddr *b)
+{
+    if (a->sa_family != b->sa_family)
+    {
+        return FALSE;
+    }
+    if (a->sa_family == AF_INET)
+    {
+        return ((const struct sockaddr_in *)a)->sin_addr.s_addr == ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+    }
+    if (a->sa_family == AF_INET6)
+    {
+        return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr, &((const struct sockaddr_in6 *)b)->sin6_addr,
+                      sizeof(struct in6_addr)) == 0;
+    }
+    return FALSE;
+}
+
+/**
+ * Finds the adapter that owns a local address and checks whether it is
+ * named like a VPN.
+ *
+ * @param local Local address of the connection
+ * @param name Receives the adapter's name if it is a VPN
+ * @param name_size Size of name in bytes
+ * @return TRUE if the adapter is a VPN
+ */
+static BOOL find_vpn_adapter(const struct sockaddr *local, char *name, size_t name_size)
+{
+    ULONG                 size = 16 * 1024;
+    IP_ADAPTER_ADDRESSES *adapters = NULL;
+    ULONG                 result = ERROR_BUFFER_OVERFLOW;
+    BOOL                  found = FALSE;
+    const ULONG           flags = GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_DNS_SERVER;
+
+    for (int attempt = 0; attempt < 2 && result == ERROR_BUFFER_OVERFLOW; attempt++)
+    {
+        free(adapters);
+        adapters = (IP_ADAPTER_ADDRESSES *)malloc(size);
+        if (!adapters)
+        {
+            return FALSE;
+        }
+        result = GetAdaptersAddresses(local->sa_family, flags, NULL, adapters, &size);
+    }
+    if (result != NO_ERROR)
+    {
+        free(adapters);
+        return FALSE;
+    }
+
+    for (IP_ADAPTER_ADDRESSES *adapter = adapters; adapter && !found; adapter = adapter->Next)
+    {
+        for (IP_ADAPTER_UNICAST_ADDRESS *unicast = adapter->FirstUnicastAddress; unicast; unicast = unicast->Next)
+        {
+            if (same_address(unicast->Address.lpSockaddr, local))
+            {
+                found = is_vpn_adapter_name(adapter->Description, name, name_size) ||
+                        is_vpn_adapter_name(adapter->FriendlyName, name, name_size);
+                break;
+            }
+        }
+    }
+    free(adapters);
+    return found;
+}
+
+/**
+ * Finds a socket's entry, starting one if asked. Caller holds s_lock.
+ *
+ * @return Entry, or NULL if the socket is not watched (or every slot is taken)
+ */
+static netclass_socket *find_socket(SOCKET s, BOOL create)
+{
+    netclass_socket *free_slot = NULL;
+    for (int i = 0; i < NETCLASS_SOCKETS; i++)
+    {
+        if (s_sockets[i].socket == s)
+        {
+            return &s_sockets[i];
+        }
+        if (!free_slot && s_sockets[i].socket == INVALID_SOCKET)
+        {
+            free_slot = &s_sockets[i];
+        }
+    }
+    if (!create || !free_slot)
+    {
+        return NULL;
+    }
+
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->socket = s;
+    return free_slot;
+}
+
+/**
+ * Returns the port of an IPv4 or IPv6 address, or 0 for other families.
+ */
+static USHORT address_port(const struct sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET)
+    {
+        return ((const struct sockaddr_in *)addr)->sin_port;
+    }
+    if (addr->sa_family == AF_INET6)
+    {
+        return ((const struct sockaddr_in6 *)addr)->sin6_port;
+    }
+    return 0;
+}
+
+/**
+ * Picks the class a connection starts as from its addresses and adapter.
+ *
+ * @param s Socket, connected or not yet
+ * @param remote Peer address (NULL asks the socket, and for listeners means none)
+ * @param fallback Class for connections that show no sign of a tunnel
+ * @param vpn Receives the VPN's name, or "" if none
+ * @param vpn_size Size of vpn in bytes
+ * @param reason Receives what decided it, for the log
+ * @param reason_size Size of reason in bytes
+ * @return SOCKET_PROFILE_* class
+ */
+static DWORD start_class(SOCKET s, const struct sockaddr *remote, DWORD fallback, char *vpn, size_t vpn_size,
+                         char *reason, size_t reason_size)
+{
+    struct sockaddr_storage local, peer;
+    int                     local_len = sizeof(local), peer_len = sizeof(peer);
+    const char             *subnet = NULL;
+    BOOL                    have_local = getsockname(s, (struct sockaddr *)&local, &local_len) == 0;
+
+    if (!remote && getpeername(s, (struct sockaddr *)&peer, &peer_len) == 0)
+    {
+        remote = (const struct sockaddr *)&peer;
+    }
+    if ((!have_local || address_port((struct sockaddr *)&local) == 0) && remote)
+    {
+        // Not connected yet: the local address is the one the route to the peer would use
+        DWORD returned = 0;
+        int   remote_len = remote->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+        int   result = WSAIoctl(s, SIO_ROUTING_INTERFACE_QUERY, (void *)remote, remote_len, &local, sizeof(local),
+                                &returned, NULL, NULL);
+        have_local = result == 0 && returned > 0;
+    }
+
+    vpn[0] = '\0';
+    if (remote && (subnet = netclass_vpn_subnet(remote)) != NULL)
+    {
+        snprintf(reason, reason_size, "peer address on the %s subnet", subnet);
+    }
+    else if (have_local && (subnet = netclass_vpn_subnet((struct sockaddr *)&local)) != NULL)
+    {
+        snprintf(reason, reason_size, "local address on the %s subnet", subnet);
+    }
+    else if (have_local && find_vpn_adapter((struct sockaddr *)&local, vpn, vpn_size))
+    {
+        snprintf(reason, reason_size, "adapter \"%s\"", vpn);
+    }
+    else
+    {
+        snprintf(reason, reason_size, "no VPN address or adapter");
+    }
+    if (subnet)
+    {
+        snprintf(vpn, vpn_size, "%s", subnet);
+    }
+    return vpn[0] ? SOCKET_PROFILE_VPN : fallback != SOCKET_PROFILE_OFF ? fallback : SOCKET_PROFILE_LAN;
+}
+
+void netclass_start(SOCKET s, const struct sockaddr *remote, DWORD fallback)
+{
+    int  error = WSAGetLastError(); // connect() callers read it after the hook returns
+    char vpn[ADAPTER_NAME_LEN];
+    char reason[128];
+
+    DWORD cls = start_class(s, remote, fallback, vpn, sizeof(vpn), reason, sizeof(reason));
+    logf("[NETCLASS] Socket %u: starts as %s (%s)", (unsigned)s, class_name(cls), reason);
+    sockprofile_apply(s, cls);
+
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    netclass_socket *entry = find_socket(s, TRUE);
+    if (entry)
+    {
+        entry->cls = entry->start_cls = cls;
+        snprintf(entry->adapter, sizeof(entry->adapter), "%s", vpn);
+        entry->window_start = clock_ticks();
+        s_stats.sockets++;
+        if (vpn[0])
+        {
+            s_stats.vpn_starts++;
+        }
+    }
+    LeaveCriticalSection(&s_lock);
+    WSASetLastError(error);
+}
+
+void netclass_prepare_listener(SOCKET s, DWORD fallback)
+{
+    int  error = WSAGetLastError();
+    char vpn[ADAPTER_NAME_LEN];
+    char reason[128];
+    DWORD cls = start_class(s, NULL, fallback, vpn, sizeof(vpn), reason, sizeof(reason));
+    logf("[NETCLASS] Listener %u: accepted connections start as %s (%s)", (unsigned)s, class_name(cls), reason);
+    sockprofile_apply(s, cls);
+    WSASetLastError(error);
+}
+
+/**
+ * Picks the class a window's metrics favor. Each threshold has an enter
+ * and a leave level, so metrics hovering around one do not flap the class.
+ *
+ * @param rtt_known TRUE if rtt_ms and jitter_ms come from heartbeats
+ * @param blocks_known TRUE if the window had enough writes for block_percent
+ */
+static DWORD pick_class(const netclass_socket *entry, BOOL rtt_known, DWORD rtt_ms, DWORD jitter_ms,
+                        BOOL blocks_known, uint32_t block_percent)
+{
+    BOOL tunnel = entry->start_cls != SOCKET_PROFILE_LAN;
+    if (rtt_known)
+    {
+        tunnel = rtt_ms >= (entry->cls == SOCKET_PROFILE_LAN ? NETCLASS_VPN_RTT_MS : NETCLASS_LAN_RTT_MS);
+    }
+    if (!tunnel)
+    {
+        return SOCKET_PROFILE_LAN; // A LAN whose writes block has a slow reader, not a lossy link
+    }
+
+    BOOL     lossy = entry->cls == SOCKET_PROFILE_VPN_LOSSY;
+    uint32_t jitter_limit = lossy ? NETCLASS_STEADY_JITTER_PERCENT : NETCLASS_LOSSY_JITTER_PERCENT;
+    uint32_t block_limit = lossy ? NETCLASS_STEADY_BLOCK_PERCENT : NETCLASS_LOSSY_BLOCK_PERCENT;
+    BOOL     jittery = rtt_known && jitter_ms >= NETCLASS_MIN_JITTER_MS && jitter_ms * 100 >= rtt_ms * jitter_limit;
+    BOOL     blocking = blocks_known && block_percent >= block_limit;
+    return jittery || blocking ? SOCKET_PROFILE_VPN_LOSSY : SOCKET_PROFILE_VPN;
+}
+
+/**
+ * Evaluates a window that has run its course and starts the next one.
+ * Caller holds s_lock.
+ */
+static void check_window(netclass_socket *entry)
+{
+    DWORD elapsed_ms = clock_ticks() - entry->window_start;
+    if (elapsed_ms < NETCLASS_WINDOW_MS)
+    {
+        return;
+    }
+
+    socket_state *state = get_socket_state(entry->socket, FALSE);
+    BOOL          rtt_known = state && state->stats.rtt_samples > 0;
+    DWORD         rtt_ms = rtt_known ? state->stats.srtt_us / 1000 : 0;
+    DWORD         jitter_ms = rtt_known ? state->stats.rttvar_us / 1000 : 0;
+    BOOL          blocks_known = entry->sends >= NETCLASS_MIN_SENDS;
+    uint32_t      block_percent = blocks_known ? entry->blocks * 100 / entry->sends : 0;
+
+    if (rtt_known || blocks_known)
+    {
+        DWORD candidate = pick_class(entry, rtt_known, rtt_ms, jitter_ms, blocks_known, block_percent);
+        s_stats.evaluations++;
+        if (candidate == entry->cls)
+        {
+            entry->pending = SOCKET_PROFILE_OFF;
+            entry->pending_windows = 0;
+        }
+        else
+        {
+            if (candidate != entry->pending)
+            {
+                entry->pending = candidate;
+                entry->pending_windows = 0;
+            }
+            if (++entry->pending_windows < NETCLASS_CONFIRM_WINDOWS)
+            {
+                s_stats.held++;
+            }
+            else
+            {
+                char rtt_text[64];
+                if (rtt_known)
+                {
+                    snprintf(rtt_text, sizeof(rtt_text), "round trip %lu ms, jitter %lu ms", (unsigned long)rtt_ms,
+                             (unsigned long)jitter_ms);
+                }
+                else
+                {
+                    snprintf(rtt_text, sizeof(rtt_text), "no round trip");
+                }
+                logf("[NETCLASS] Socket %u: %s -> %s for %lu windows (%s, %lu of %lu writes blocked, %s)",
+                     (unsigned)entry->socket, class_name(entry->cls), class_name(candidate),
+                     (unsigned long)entry->pending_windows, rtt_text, (unsigned long)entry->blocks,
+                     (unsigned long)entry->sends, entry->adapter[0] ? entry->adapter : "no VPN adapter");
+                entry->cls = candidate;
+                entry->pending = SOCKET_PROFILE_OFF;
+                entry->pending_windows = 0;
+                entry->changes++;
+                s_stats.changes++;
+                sockprofile_apply(entry->socket, candidate);
+            }
+        }
+    }
+
+    entry->window_start += elapsed_ms;
+    entry->sends = 0;
+    entry->blocks = 0;
+}
+
+void netclass_note_send(SOCKET s, BOOL blocked)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    netclass_socket *entry = find_socket(s, FALSE);
+    if (entry)
+    {
+        entry->sends++;
+        if (blocked)
+        {
+            entry->blocks++;
+        }
+        check_window(entry);
+    }
+    LeaveCriticalSection(&s_lock);
+}
+
+DWORD netclass_get(SOCKET s)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    netclass_socket *entry = find_socket(s, FALSE);
+    DWORD            cls = entry ? entry->cls : SOCKET_PROFILE_OFF;
+    LeaveCriticalSection(&s_lock);
+    return cls;
+}
+
+DWORD netclass_retry_delay_ms(SOCKET s, DWORD configured)
+{
+    DWORD cls = netclass_get(s);
+    return cls != SOCKET_PROFILE_OFF ? s_tuning[cls - 1].retry_delay_ms : configured;
+}
+
+DWORD netclass_recv_wait_us(SOCKET s, DWORD configured)
+{
+    DWORD cls = netclass_get(s);
+    return cls != SOCKET_PROFILE_OFF ? configured * s_tuning[cls - 1].recv_wait_percent / 100 : configured;
+}
+
+void netclass_close(SOCKET s)
+{
+    if (s_lock_init != 2)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&s_lock);
+    netclass_socket *entry = find_socket(s, FALSE);
+    if (entry)
+    {
+        if (entry->changes > 0)
+        {
+            logf("[NETCLASS] Socket %u: closed as %s after %lu class changes (started as %s)", (unsigned)s,
+                 class_name(entry->cls), (unsigned long)entry->changes, class_name(entry->start_cls));
+        }
+        entry->socket = INVALID_SOCKET;
+    }
+    LeaveCriticalSection(&s_lock);
+}
+
+netclass_stats netclass_get_stats(void)
+{
+    netclass_stats copy;
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    copy = s_stats;
+    LeaveCriticalSection(&s_lock);
+    return copy;
+}
@@ -0,0 +1,109 @@
+#ifndef NETCLASS_H
+#define NETCLASS_H
+
+#include <stdint.h>
+#include <windows.h>
+#include <winsock2.h>
+
+#define NETCLASS_SOCKETS 64               // Connections classified at once (MAX_TRACKED_SOCKETS)
+#define NETCLASS_WINDOW_MS 1000           // How often a connection's metrics are evaluated
+#define NETCLASS_CONFIRM_WINDOWS 3        // Windows in a row a new class must win before the connection switches
+#define NETCLASS_VPN_RTT_MS 20            // Round trip at which a LAN connection counts as a tunnel...
+#define NETCLASS_LAN_RTT_MS 10            // ...and below which a tunnel counts as a LAN again
+#define NETCLASS_LOSSY_JITTER_PERCENT 50  // Jitter, in percent of the round trip, that marks a lossy tunnel...
+#define NETCLASS_STEADY_JITTER_PERCENT 25 // ...and below which it is steady again
+#define NETCLASS_MIN_JITTER_MS 5          // Jitter below this is never lossy, however short the round trip
+#define NETCLASS_LOSSY_BLOCK_PERCENT 30   // WSAEWOULDBLOCK answers per 100 writes that mark a lossy tunnel...
+#define NETCLASS_STEADY_BLOCK_PERCENT 10  // ...and below which it is steady again
+#define NETCLASS_MIN_SENDS 8              // Windows with fewer writes say nothing about the block rate
+
+/**
+ * Classifier counters for the log and tests.
+ */
+typedef struct
+{
+    uint32_t sockets;     // Connections classified
+    uint32_t vpn_starts;  // Of those, connections that started as a tunnel because of their adapter
+    uint32_t evaluations; // Windows evaluated
+    uint32_t held;        // Windows that favored another class, but not yet for NETCLASS_CONFIRM_WINDOWS in a row
+    uint32_t changes;     // Class changes made
+} netclass_stats;
+
+/**
+ * Returns the name of the VPN whose subnet an address belongs to.
+ *
+ * @param addr IPv4 or IPv6 address
+ * @return "Hamachi" (25.0.0.0/8), "Radmin VPN" (26.0.0.0/8), or NULL
+ */
+const char *netclass_vpn_subnet(const struct sockaddr *addr);
+
+/**
+ * Classifies a new connection from its addresses and network adapter,
+ * sets the matching SocketProfile options and starts watching it. Called
+ * before connect(), it takes the local address the route to the peer
+ * would use, so the buffers are in place before the handshake.
+ *
+ * @param s Accepted socket, or one about to connect
+ * @param remote Peer address (NULL asks the socket)
+ * @param fallback SOCKET_PROFILE_* class for connections that show no sign
+ *                 of a tunnel (SOCKET_PROFILE_OFF counts as SOCKET_PROFILE_LAN)
+ */
+void netclass_start(SOCKET s, const struct sockaddr *remote, DWORD fallback);
+
+/**
+ * Sets the SocketProfile options of the class a listener's local address
+ * suggests, so the connections it accepts inherit them from the start.
+ * netclass_start() still classifies each accepted connection.
+ *
+ * @param s Socket about to listen
+ * @param fallback SOCKET_PROFILE_* class for listeners that show no sign of
+ *                 a tunnel (SOCKET_PROFILE_OFF counts as SOCKET_PROFILE_LAN)
+ */
+void netclass_prepare_listener(SOCKET s, DWORD fallback);
+
+/**
+ * Books one write to a watched socket. Every NETCLASS_WINDOW_MS the
+ * socket's round trip, jitter and block rate are checked, and a class that
+ * wins NETCLASS_CONFIRM_WINDOWS windows in a row replaces the current one.
+ *
+ * @param s Socket written to
+ * @param blocked TRUE if the write failed with WSAEWOULDBLOCK
+ */
+void netclass_note_send(SOCKET s, BOOL blocked);
+
+/**
+ * Returns a socket's current class, or SOCKET_PROFILE_OFF if it is not watched.
+ */
+DWORD netclass_get(SOCKET s);
+
+/**
+ * Returns how long the send hook should sleep before retrying a write that
+ * found a socket's buffer full.
+ *
+ * @param s Socket handle
+ * @param configured Delay for sockets that are not watched
+ */
+DWORD netclass_retry_delay_ms(SOCKET s, DWORD configured);
+
+/**
+ * Returns how long an empty recv() on a socket may wait for data (RecvWaitUs).
+ *
+ * @param s Socket handle
+ * @param configured RecvWaitUs, used as is for LAN and unwatched sockets
+ */
+DWORD netclass_recv_wait_us(SOCKET s, DWORD configured);
+
+/**
+ * Logs a socket's class history and stops watching it. Cheap for sockets
+ * the classifier never saw.
+ *
+ * @param s Socket handle
+ */
+void netclass_close(SOCKET s);
+
+/**
+ * Returns a copy of the counters.
+ */
+netclass_stats netclass_get_stats(void);
+
+#endif // NETCLASS_H
@@ -0,0 +1,236 @@
+/*
+ * pacer.c: Bandwidth estimation and token-bucket pacing for the peer tunnel.
+ *
+ * A sender that transmits whenever its window allows fills the slowest
+ * queue on the path, typically the VPN endpoint's, and every later message
+ * waits behind that queue. Following BBR, this model instead measures the
+ * delivery rate of each acknowledged packet and keeps the maximum over the
+ * last ten round trips as the bottleneck bandwidth, and the minimum RTT as
+ * the path's propagation delay. Packets are released from a token bucket
+ * filled at that rate, and no more than two bandwidth-delay products are
+ * kept in flight. Every eighth RTT the rate is raised by a quarter to
+ * notice added capacity, then lowered by a quarter to drain what the probe
+ * queued.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "pacer.h"
+#include <string.h>
+#include <windows.h>
+
+#define PACER_MAX_REFILL_US 1000000 // Longer idle periods refill the bucket no further
+
+static const uint32_t CYCLE_GAINS[PACER_CYCLE_PHASES] = {125, 75, 100, 100, 100, 100, 100, 100};
+
+void pacer_init(pacer *p, uint32_t burst, uint32_t now_us)
+{
+    memset(p, 0, sizeof(*p));
+    p->mode = PACER_STARTUP;
+    p->pacing_gain = PACER_STARTUP_GAIN;
+    p->cwnd_gain = PACER_STARTUP_GAIN;
+    p->delivered_us = now_us;
+    p->first_sent_us = now_us;
+    p->burst = burst;
+    p->tokens = (uint64_t)burst * 1000000;
+    p->refill_us = now_us;
+}
+
+void pacer_on_send(pacer *p, pacer_stamp *stamp, uint32_t inflight, uint32_t now_us)
+{
+    if (inflight == 0)
+    {
+        // Restarting from idle: the gap before this packet says nothing about the path
+        p->first_sent_us = now_us;
+        p->delivered_us = now_us;
+    }
+    stamp->delivered = p->delivered;
+    stamp->delivered_us = p->delivered_us;
+    stamp->first_sent_us = p->first_sent_us;
+    stamp->app_limited = p->app_limited_until != 0;
+}
+
+void pacer_on_app_limited(pacer *p, uint32_t inflight)
+{
+    uint32_t until = p->delivered + inflight;
+    p->app_limited_until = until != 0 ? until : 1;
+}
+
+/**
+ * Recomputes the bandwidth estimate as the maximum over the window.
+ */
+static void update_btl_bw(pacer *p)
+{
+    uint32_t best = 0;
+    for (int i = 0; i < PACER_BW_WINDOW_ROUNDS; i++)
+    {
+        if (p->bw_rounds[i] > best)
+        {
+            best = p->bw_rounds[i];
+        }
+    }
+    p->btl_bw = best;
+}
+
+void pacer_on_delivered(pacer *p, const pacer_stamp *stamp, uint32_t bytes, uint32_t sent_us, uint32_t now_us)
+{
+    p->delivered += bytes;
+    p->delivered_us = now_us;
+    p->first_sent_us = sent_us;
+    if (p->app_limited_until != 0 && (int32_t)(p->delivered - p->app_limited_until) > 0)
+    {
+        p->app_limited_until = 0;
+    }
+
+    // A round trip ends when a packet sent after the previous round ended is acknowledged
+    if ((int32_t)(stamp->delivered - p->round_end) >= 0)
+    {
+        p->round++;
+        p->round_end = p->delivered;
+        p->round_started = TRUE;
+        p->bw_rounds[p->round % PACER_BW_WINDOW_ROUNDS] = 0;
+    }
+
+    // The slower of the send and ACK spacing: neither a send burst nor an ACK burst may inflate the sample
+    uint32_t send_elapsed = sent_us - stamp->first_sent_us;
+    uint32_t ack_elapsed = now_us - stamp->delivered_us;
+    uint32_t interval = send_elapsed > ack_elapsed ? send_elapsed : ack_elapsed;
+    if (interval == 0 || (int32_t)interval < 0 || (p->min_rtt_us != 0 && interval < p->min_rtt_us))
+    {
+        return;
+    }
+
+    uint64_t rate = (uint64_t)(p->delivered - stamp->delivered) * 1000000 / interval;
+    if (rate > UINT32_MAX)
+    {
+        rate = UINT32_MAX;
+    }
+    if (stamp->app_limited && rate <= p->btl_bw)
+    {
+        return; // The sender, not the path, limited this sample
+    }
+
+    uint32_t *slot = &p->bw_rounds[p->round % PACER_BW_WINDOW_ROUNDS];
+    if ((uint32_t)rate > *slot)
+    {
+        *slot = (uint32_t)rate;
+        update_btl_bw(p);
+    }
+}
+
+void pacer_on_rtt(pacer *p, uint32_t rtt_us, uint32_t now_us)
+{
+    if (rtt_us == 0)
+    {
+        rtt_us = 1;
+    }
+    if (p->min_rtt_us == 0 || rtt_us <= p->min_rtt_us || now_us - p->min_rtt_stamp_us > PACER_MIN_RTT_WINDOW_US)
+    {
+        p->min_rtt_us = rtt_us;
+        p->min_rtt_stamp_us = now_us;
+    }
+}
+
+/**
+ * Returns the bandwidth-delay product in bytes, 0 while either part is unknown.
+ */
+static uint32_t bdp(const pacer *p)
+{
+    return (uint32_t)((uint64_t)p->btl_bw * p->min_rtt_us / 1000000);
+}
+
+void pacer_update(pacer *p, uint32_t inflight, uint32_t now_us)
+{
+    BOOL round_started = p->round_started;
+
+    p->round_started = FALSE;
+    if (p->btl_bw == 0)
+    {
+        return;
+    }
+
+    switch (p->mode)
+    {
+    case PACER_STARTUP:
+        if (!round_started || p->app_limited_until != 0)
+        {
+            return;
+        }
+        if ((uint64_t)p->btl_bw * 100 >= (uint64_t)p->full_bw * PACER_FULL_BW_GROWTH)
+        {
+            p->full_bw = p->btl_bw;
+            p->full_bw_rounds = 0;
+            return;
+        }
+        if (++p->full_bw_rounds >= PACER_FULL_BW_ROUNDS)
+        {
+            p->mode = PACER_DRAIN;
+            p->pacing_gain = PACER_DRAIN_GAIN;
+        }
+        return;
+
+    case PACER_DRAIN:
+        if (inflight <= bdp(p))
+        {
+            p->mode = PACER_PROBE_BW;
+            p->cwnd_gain = PACER_CWND_GAIN;
+            p->cycle_phase = 2; // Start cruising; the next probe comes within a cycle
+            p->cycle_start_us = now_us;
+            p->pacing_gain = CYCLE_GAINS[p->cycle_phase];
+        }
+        return;
+
+    case PACER_PROBE_BW:
+        if (p->min_rtt_us != 0 && now_us - p->cycle_start_us >= p->min_rtt_us)
+        {
+            p->cycle_phase = (p->cycle_phase + 1) % PACER_CYCLE_PHASES;
+            p->cycle_start_us = now_us;
+            p->pacing_gain = CYCLE_GAINS[p->cycle_phase];
+        }
+        return;
+    }
+}
+
+uint32_t pacer_rate(const pacer *p)
+{
+    uint64_t rate = (uint64_t)p->btl_bw * p->pacing_gain / 100;
+    return rate > UINT32_MAX ? UINT32_MAX : (uint32_t)rate;
+}
+
+uint32_t pacer_inflight_limit(const pacer *p)
+{
+    if (p->btl_bw == 0 || p->min_rtt_us == 0)
+    {
+        return 0;
+    }
+    uint64_t limit = (uint64_t)bdp(p) * p->cwnd_gain / 100;
+    if (limit < p->burst)
+    {
+        limit = p->burst;
+    }
+    return limit > UINT32_MAX ? UINT32_MAX : (uint32_t)limit;
+}
+
+BOOL pacer_allow(pacer *p, uint32_t bytes, uint32_t now_us)
+{
+    uint32_t rate = pacer_rate(p);
+    uint32_t elapsed = now_us - p->refill_us;
+    uint64_t capacity = (uint64_t)p->burst * 1000000;
+
+    p->refill_us = now_us;
+    if (rate == 0)
+    {
+        return TRUE;
+    }
+
+    p->tokens += (uint64_t)rate * (elapsed < PACER_MAX_REFILL_US ? elapsed : PACER_MAX_REFILL_US);
+    if (p->tokens > capacity)
+    {
+        p->tokens = capacity;
+    }
+    if (p->tokens < (uint64_t)bytes * 1000000)
+    {
+        return FALSE;
+    }
+    p->tokens -= (uint64_t)bytes * 1000000;
+    return TRUE;
+}
@@ -0,0 +1,126 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+#include <windows.h>
+
+#define PACER_BW_WINDOW_ROUNDS 10       // Round trips the bandwidth estimate remembers its maximum
+#define PACER_MIN_RTT_WINDOW_US 10000000 // Age after which the minimum RTT accepts a larger sample
+#define PACER_STARTUP_GAIN 289          // Percent; doubles the rate every round trip while probing
+#define PACER_DRAIN_GAIN 35             // Percent; empties the queue startup built up
+#define PACER_CWND_GAIN 200             // Percent of the bandwidth-delay product kept in flight
+#define PACER_CYCLE_PHASES 8            // Bandwidth probing cycle, one phase per minimum RTT
+#define PACER_FULL_BW_GROWTH 125        // Percent growth per round that keeps startup going
+#define PACER_FULL_BW_ROUNDS 3          // Rounds without that growth that end startup
+
+typedef enum
+{
+    PACER_STARTUP,  // Rate unknown: grow it until delivery stops growing
+    PACER_DRAIN,    // Below the estimate until the startup queue has drained
+    PACER_PROBE_BW  // At the estimate, briefly above and below it each cycle
+} pacer_mode;
+
+/**
+ * Delivery state recorded when a packet is sent, turned into a delivery
+ * rate sample when it is acknowledged.
+ */
+typedef struct
+{
+    uint32_t delivered;     // Bytes delivered before this packet left
+    uint32_t delivered_us;  // Time of that delivery
+    uint32_t first_sent_us; // Send time of the packet whose delivery that was
+    BOOL     app_limited;   // The sender ran out of data; the sample may underestimate
+} pacer_stamp;
+
+/**
+ * Bandwidth and RTT model of one path in the style of BBR, plus the token
+ * bucket that spaces packets at the resulting pacing rate. Times are
+ * wrapping microsecond timestamps. Not thread-safe; the owner locks.
+ */
+typedef struct
+{
+    pacer_mode mode;
+    uint32_t   delivered;         // Bytes acknowledged so far (wraps)
+    uint32_t   delivered_us;      // Time of the latest acknowledgment
+    uint32_t   first_sent_us;     // Send time of the latest acknowledged packet
+    uint32_t   app_limited_until; // Samples stay app-limited until delivered passes this (0 = not limited)
+    uint32_t   round;             // Round trips counted so far
+    uint32_t   round_end;         // delivered value that ends the current round
+    BOOL       round_started;     // The latest acknowledgment began a new round
+    uint32_t   bw_rounds[PACER_BW_WINDOW_ROUNDS]; // Highest delivery rate seen per round, bytes/s
+    uint32_t   btl_bw;            // Bottleneck bandwidth estimate: maximum of bw_rounds
+    uint32_t   min_rtt_us;        // 0 until the first sample
+    uint32_t   min_rtt_stamp_us;
+    uint32_t   full_bw;           // Startup: estimate at the last 25% growth
+    uint32_t   full_bw_rounds;    // Startup: rounds since then
+    int        cycle_phase;
+    uint32_t   cycle_start_us;
+    uint32_t   pacing_gain;       // Percent of btl_bw
+    uint32_t   cwnd_gain;         // Percent of the bandwidth-delay product
+    uint64_t   tokens;            // Token bucket in bytes x 1000000
+    uint32_t   burst;             // Bucket size in bytes
+    uint32_t   refill_us;
+} pacer;
+
+/**
+ * Starts a model with no estimate; pacer_rate() stays 0 until the first
+ * delivery rate sample.
+ *
+ * @param p Pacer
+ * @param burst Bytes that may leave back to back after an idle period
+ * @param now_us Current time
+ */
+void pacer_init(pacer *p, uint32_t burst, uint32_t now_us);
+
+/**
+ * Stamps a packet that is about to be sent.
+ *
+ * @param inflight Bytes sent and not yet acknowledged, without this packet
+ */
+void pacer_on_send(pacer *p, pacer_stamp *stamp, uint32_t inflight, uint32_t now_us);
+
+/**
+ * Marks the samples of the current flight as limited by the sender, not the path.
+ */
+void pacer_on_app_limited(pacer *p, uint32_t inflight);
+
+/**
+ * Folds the delivery of one packet into the bandwidth estimate.
+ *
+ * @param stamp Stamp from pacer_on_send() for the packet
+ * @param bytes Packet payload
+ * @param sent_us When the packet (last) left
+ */
+void pacer_on_delivered(pacer *p, const pacer_stamp *stamp, uint32_t bytes, uint32_t sent_us, uint32_t now_us);
+
+/**
+ * Folds an RTT sample into the windowed minimum.
+ */
+void pacer_on_rtt(pacer *p, uint32_t rtt_us, uint32_t now_us);
+
+/**
+ * Advances the startup, drain and probing state after an acknowledgment.
+ *
+ * @param inflight Bytes sent and not yet acknowledged
+ */
+void pacer_update(pacer *p, uint32_t inflight, uint32_t now_us);
+
+/**
+ * Returns the pacing rate in bytes per second, or 0 while there is no estimate.
+ */
+uint32_t pacer_rate(const pacer *p);
+
+/**
+ * Returns how many bytes may be in flight, or 0 while there is no estimate.
+ */
+uint32_t pacer_inflight_limit(const pacer *p);
+
+/**
+ * Takes bytes from the token bucket if enough have accumulated at the
+ * pacing rate. Always succeeds while there is no estimate.
+ *
+ * @return TRUE if the packet may be sent now
+ */
+BOOL pacer_allow(pacer *p, uint32_t bytes, uint32_t now_us);
+
+#endif // PACER_H
@@ -0,0 +1,2277 @@
+/*
+ * peer.c: Framed protocol between two patched copies of the network fix.
+ *
+ * Patched peers detect each other with TCP urgent bytes and then exchange
+ * frames instead of raw game bytes. Frames let the hooks add transparent
+ * features (compression first) while server.dll keeps seeing the exact
+ * byte stream it wrote on the other end. Unpatched peers never read the
+ * urgent bytes and the connection simply stays raw. Until such a game
+ * reads past the initiator's HELLO, a select() there lists the socket in
+ * exceptfds (POLLPRI for poll); with SO_OOBINLINE set the game reads the
+ * byte as game data. Our own sockets with SO_OOBINLINE stay raw, since the
+ * marks would otherwise reach server.dll as game bytes.
+ *
+ * Negotiation (the side that called connect() is the initiator):
+ *   initiator -> OOB HELLO                 (initiator stream stays raw)
+ *   responder -> OOB SWITCH + HELLO frame  (responder stream framed from the mark)
+ *   initiator -> OOB SWITCH + HELLO frame  (initiator stream framed from the mark)
+ *
+ * Session resumption (PEER_CAP_RESUME): both sides count the game bytes
+ * they decoded and keep the last ResumeBufferKB bytes they sent. When the
+ * connection drops, the side that called connect() reconnects to the same
+ * address and sends RESUME on the new connection; the accepting side picks
+ * it up in the accept hook, or on the connection's first recv if it came
+ * later. Each side then replays what the other has not received. server.dll keeps its original socket handle throughout and
+ * only sees a stall.
+ *
+ * UDP tunnel (PEER_CAP_TUNNEL): after HELLO both sides offer a UDP port
+ * over TCP and probe the path. Once our datagrams are known to arrive, we
+ * send TUNNEL_SWITCH as our last frame on TCP and write every later frame
+ * to a reliable UDP stream (rudp.c), so one lost packet no longer stalls
+ * the game behind TCP's retransmission timeout. The TCP connection stays
+ * open to report closes and resets. The tunnel is driven by the game's own
+ * send/recv polling; a resumed session continues over TCP only.
+ *
+ * Shared memory (PEER_CAP_SHM): when both ends of the TCP connection have
+ * the same address, each side creates a ring (shm_ring.c) for its frames
+ * and offers its name together with a host id. The receiver answers
+ * whether it could open the ring; after a positive answer the sender
+ * writes SHM_SWITCH as its last frame on the old transport and continues
+ * in the ring. Game instances on one machine then exchange frames without
+ * a kernel copy; the TCP connection again only reports resets.
+ *
+ * Clock sync (PEER_CAP_CLOCK): each side sends TIME_REQUEST frames with its
+ * clock, and the other answers with TIME_REPLY carrying its own receive
+ * and transmit times. timesync.c turns the exchanges into an offset and
+ * drift estimate per peer for the stats log; with ClockSync=2 the side that
+ * called connect() aligns server.dll's clock to the host's.
+ *
+ * Lock order: recv_lock before send_lock. The send path never takes recv_lock.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "peer.h"
+#include "clock.h"
+#include "config.h"
+#include "delta.h"
+#include "hooks.h"
+#include "logging.h"
+#include "lz4.h"
+#include "rudp.h"
+#include "shm_ring.h"
+#include "timesync.h"
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+// Buffer sizes
+#define PEER_TX_BUF_SIZE (PEER_FRAME_HEADER_SIZE + 2 + LZ4_COMPRESS_BOUND(PEER_DATA_CHUNK))
+#define PEER_RX_WIRE_SIZE (PEER_FRAME_HEADER_SIZE + PEER_MAX_FRAME_PAYLOAD)
+#define PEER_RX_PLAIN_SIZE (2 * (PEER_MAX_FRAME_PAYLOAD + 1))
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v & 0xFF);
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    put_u16(p, (uint16_t)(v & 0xFFFF));
+    put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return (uint32_t)get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static void put_u64(uint8_t *p, uint64_t v)
+{
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_u64(const uint8_t *p)
+{
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/**
+ * Returns the current QueryPerformanceCounter value.
+ */
+static uint64_t perf_now(void)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)now.QuadPart;
+}
+
+/**
+ * Converts QueryPerformanceCounter ticks to milliseconds.
+ */
+static double perf_ticks_to_ms(uint64_t ticks)
+{
+    static LARGE_INTEGER frequency = {0};
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    return frequency.QuadPart ? (double)ticks * 1000.0 / (double)frequency.QuadPart : 0.0;
+}
+
+/**
+ * Returns a microsecond timestamp for heartbeats: the low 32 bits of
+ * clock_now_us(), so it wraps every ~71 minutes. Only differences between
+ * two values are ever used, and unsigned subtraction keeps those right
+ * across the wrap.
+ */
+static uint32_t perf_now_us(void)
+{
+    return (uint32_t)((uint64_t)clock_now_us() & 0xFFFFFFFFu);
+}
+
+/**
+ * Capabilities this side offers, derived from the configuration and the
+ * buffers that could actually be allocated for the socket.
+ */
+static uint32_t local_capabilities(const peer_link *peer)
+{
+    uint32_t caps = 0;
+    if (g_config.compression)
+    {
+        caps |= PEER_CAP_LZ4;
+    }
+    if (peer->tx_history.data && peer->rx_history.data)
+    {
+        caps |= PEER_CAP_DELTA;
+    }
+    if (g_config.heartbeat_interval_ms != 0)
+    {
+        caps |= PEER_CAP_HEARTBEAT;
+    }
+    if (peer->replay.data)
+    {
+        caps |= PEER_CAP_RESUME;
+    }
+    if (peer->tunnel)
+    {
+        caps |= PEER_CAP_TUNNEL;
+    }
+    if (peer->shm_out)
+    {
+        caps |= PEER_CAP_SHM;
+    }
+    if (g_config.clock_sync != CLOCK_SYNC_OFF)
+    {
+        caps |= PEER_CAP_CLOCK;
+    }
+    return caps;
+}
+
+/**
+ * Allocates both delta history rings. They must exist before either stream
+ * is framed: the receiver records every incoming message from its first
+ * frame on, because the sender may reference any of them once it learns we
+ * support deltas. Caller must hold send_lock.
+ */
+static void allocate_delta_history(socket_state *state)
+{
+    peer_link *peer = &state->peer;
+    HANDLE     heap = GetProcessHeap();
+    SIZE_T     size = DELTA_HISTORY_SLOTS * DELTA_MAX_MESSAGE;
+
+    peer->tx_history.data = (uint8_t *)HeapAlloc(heap, HEAP_ZERO_MEMORY, size);
+    peer->rx_history.data = (uint8_t *)HeapAlloc(heap, HEAP_ZERO_MEMORY, size);
+    if (!peer->tx_history.data || !peer->rx_history.data)
+    {
+        logf("[PEER] Socket %u: out of memory for delta history, deltas disabled", (unsigned)state->s);
+        if (peer->tx_history.data)
+        {
+            HeapFree(heap, 0, peer->tx_history.data);
+        }
+        if (peer->rx_history.data)
+        {
+            HeapFree(heap, 0, peer->rx_history.data);
+        }
+        memset(&peer->tx_history, 0, sizeof(peer->tx_history));
+        memset(&peer->rx_history, 0, sizeof(peer->rx_history));
+    }
+}
+
+/**
+ * Returns a non-zero id that is unique enough to tell connections on one
+ * host apart. It is not a secret.
+ */
+static uint64_t make_connection_id(const socket_state *state)
+{
+    uint64_t id = perf_now() ^ ((uint64_t)GetCurrentProcessId() << 32) ^ ((uint64_t)state->s << 16) ^ GetTickCount();
+    id ^= id >> 33;
+    id *= 0xFF51AFD7ED558CCDull;
+    id ^= id >> 33;
+    return id ? id : 1;
+}
+
+/**
+ * Allocates the replay buffer and picks a session id. Without the buffer
+ * the session simply is not resumable. Caller must hold send_lock.
+ */
+static void allocate_replay_buffer(socket_state *state)
+{
+    peer_link *peer = &state->peer;
+    int        capacity = (int)g_config.resume_buffer_kb * 1024;
+
+    peer->replay.data = (uint8_t *)HeapAlloc(GetProcessHeap(), 0, capacity);
+    if (!peer->replay.data)
+    {
+        logf("[PEER] Socket %u: out of memory for replay buffer, session resume disabled", (unsigned)state->s);
+        return;
+    }
+    peer->replay.capacity = capacity;
+    peer->replay.end_seq = 0;
+    peer->local_session_id = make_connection_id(state);
+}
+
+/**
+ * Decides which side sends HELLO: the one that called connect(). Both peers
+ * know which of them connected, whatever NAT or port mapping did to the
+ * addresses each of them sees.
+ *
+ * @return TRUE if the role was determined, FALSE if neither the connect nor the accept hook saw the socket
+ */
+static BOOL determine_role(const socket_state *state, BOOL *initiator)
+{
+    if (state->direction == SOCKET_DIRECTION_UNKNOWN)
+    {
+        return FALSE;
+    }
+
+    *initiator = state->direction == SOCKET_DIRECTION_OUTGOING;
+    return TRUE;
+}
+
+/* ---- UDP tunnel ---- */
+
+/**
+ * Opens the UDP socket of the tunnel on the local address of the TCP
+ * connection, before HELLO announces PEER_CAP_TUNNEL. Caller must hold send_lock.
+ */
+static void open_tunnel(socket_state *state)
+{
+    struct sockaddr_storage local_addr;
+    int                     local_len = sizeof(local_addr);
+    impair_profile          impairment;
+
+    impairment.loss_percent = g_config.impair_loss_percent;
+    impairment.delay_ms = g_config.impair_delay_ms;
+    impairment.jitter_ms = g_config.impair_jitter_ms;
+    impairment.rate_kbps = g_config.impair_rate_kbps;
+    impairment.mtu = g_config.impair_mtu;
+    memset(&local_addr, 0, sizeof(local_addr));
+    if (getsockname(state->s, (struct sockaddr *)&local_addr, &local_len) == SOCKET_ERROR)
+    {
+        return;
+    }
+
+    state->peer.tunnel = rudp_open((const struct sockaddr *)&local_addr, local_len,
+                                   (uint32_t)make_connection_id(state), g_config.dead_peer_timeout_ms, &impairment,
+                                   g_config.tunnel_pacing, g_config.tunnel_mtu);
+    if (!state->peer.tunnel)
+    {
+        logf("[PEER] Socket %u: could not open a UDP socket, tunnel disabled", (unsigned)state->s);
+    }
+}
+
+/**
+ * Points the tunnel at the UDP port the peer offered on its TCP address.
+ */
+static void start_tunnel(socket_state *state, uint16_t port, uint32_t token)
+{
+    struct sockaddr_storage remote_addr;
+    int                     remote_len = sizeof(remote_addr);
+
+    memset(&remote_addr, 0, sizeof(remote_addr));
+    if (getpeername(state->transport, (struct sockaddr *)&remote_addr, &remote_len) == SOCKET_ERROR)
+    {
+        return;
+    }
+    if (remote_addr.ss_family == AF_INET6)
+    {
+        ((struct sockaddr_in6 *)&remote_addr)->sin6_port = htons(port);
+    }
+    else
+    {
+        ((struct sockaddr_in *)&remote_addr)->sin_port = htons(port);
+    }
+
+    rudp_set_peer(state->peer.tunnel, (const struct sockaddr *)&remote_addr, remote_len, token);
+    logf("[PEER] Socket %u: peer offered a UDP tunnel on port %u, probing", (unsigned)state->s, port);
+}
+
+/**
+ * Returns TRUE when both offers were exchanged and our datagrams reach the
+ * peer, so the outgoing stream can move to the tunnel.
+ */
+static BOOL tunnel_switch_due(const peer_link *peer)
+{
+    return peer->tunnel && !peer->tunnel_tx && !peer->shm_accepted && peer->tx_framed && peer->peer_hello_received &&
+           (peer->peer_caps & PEER_CAP_TUNNEL) && !peer->tunnel_offer_pending && rudp_path_confirmed(peer->tunnel);
+}
+
+/**
+ * Queues bytes on the tunnel, waiting while its send buffer is full the way
+ * send_all() waits for a full socket buffer. Caller must hold send_lock.
+ *
+ * @return len, or SOCKET_ERROR (WSAECONNRESET) once the tunnel or the peer is gone
+ */
+static int tunnel_write_all(socket_state *state, const uint8_t *buf, int len)
+{
+    rudp_conn *tunnel = state->peer.tunnel;
+    DWORD      stall_start = clock_ticks();
+    int        done = 0;
+
+    for (;;)
+    {
+        int written = rudp_write(tunnel, buf + done, len - done);
+        rudp_poll(tunnel);
+        done += written;
+        if (done == len)
+        {
+            return len;
+        }
+        if (written > 0)
+        {
+            stall_start = clock_ticks();
+        }
+        if (rudp_failed(tunnel) || peer_send_stalled(state->transport, clock_ticks() - stall_start))
+        {
+            WSASetLastError(WSAECONNRESET);
+            return SOCKET_ERROR;
+        }
+        clock_wait_us(NULL, 1000);
+    }
+}
+
+/* ---- Shared memory ---- */
+
+/**
+ * Returns an id for this machine (FNV-1a of the computer name). Two peers
+ * that report the same id and address are running on the same host.
+ */
+static uint64_t local_host_id(void)
+{
+    static uint64_t host_id = 0;
+    if (host_id == 0)
+    {
+        char  name[MAX_COMPUTERNAME_LENGTH + 1];
+        DWORD name_len = sizeof(name);
+        if (!GetComputerNameA(name, &name_len))
+        {
+            name_len = 0;
+        }
+
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for (DWORD i = 0; i < name_len; i++)
+        {
+            hash = (hash ^ (uint8_t)name[i]) * 0x100000001B3ull;
+        }
+        host_id = hash ? hash : 1;
+    }
+    return host_id;
+}
+
+/**
+ * Returns TRUE if both endpoints of the connection have the same IP
+ * address, as they do for loopback or for a connection to the host's own
+ * LAN address. Only then is a shared-memory ring worth offering.
+ */
+static BOOL endpoints_share_host(SOCKET s)
+{
+    struct sockaddr_storage local_addr;
+    struct sockaddr_storage remote_addr;
+    int                     local_len = sizeof(local_addr);
+    int                     remote_len = sizeof(remote_addr);
+
+    memset(&local_addr, 0, sizeof(local_addr));
+    memset(&remote_addr, 0, sizeof(remote_addr));
+    if (getsockname(s, (struct sockaddr *)&local_addr, &local_len) == SOCKET_ERROR ||
+        getpeername(s, (struct sockaddr *)&remote_addr, &remote_len) == SOCKET_ERROR ||
+        local_addr.ss_family != remote_addr.ss_family)
+    {
+        return FALSE;
+    }
+
+    if (local_addr.ss_family == AF_INET6)
+    {
+        return memcmp(&((struct sockaddr_in6 *)&local_addr)->sin6_addr,
+                      &((struct sockaddr_in6 *)&remote_addr)->sin6_addr, sizeof(struct in6_addr)) == 0;
+    }
+    return ((struct sockaddr_in *)&local_addr)->sin_addr.s_addr ==
+           ((struct sockaddr_in *)&remote_addr)->sin_addr.s_addr;
+}
+
+/**
+ * Creates the ring for our frames before HELLO announces PEER_CAP_SHM.
+ * Caller must hold send_lock.
+ */
+static void open_shm(socket_state *state)
+{
+    char name[SHM_RING_NAME_MAX];
+
+    if (!endpoints_share_host(state->s))
+    {
+        return;
+    }
+
+    uint64_t id = make_connection_id(state);
+    snprintf(name, sizeof(name), "Local\\NetworkFix-%08lX-%08lX%08lX", (unsigned long)GetCurrentProcessId(),
+             (unsigned long)(id >> 32), (unsigned long)(id & 0xFFFFFFFF));
+    state->peer.shm_out = shm_ring_create(name);
+    if (!state->peer.shm_out)
+    {
+        logf("[PEER] Socket %u: could not create a shared-memory ring, staying on the network", (unsigned)state->s);
+    }
+}
+
+/**
+ * Opens the ring the peer offered if it runs on this host. The answer is
+ * sent either way so the peer knows whether to switch.
+ */
+static void accept_shm_offer(socket_state *state, const uint8_t *payload, int payload_len)
+{
+    peer_link *peer = &state->peer;
+    char       name[SHM_RING_NAME_MAX];
+    int        name_len = payload_len - 8;
+
+    if (!peer->shm_out || peer->shm_in || name_len <= 0 || name_len >= SHM_RING_NAME_MAX)
+    {
+        return;
+    }
+
+    peer->shm_answer_pending = TRUE;
+    uint64_t host_id = (uint64_t)get_u32(payload) | ((uint64_t)get_u32(payload + 4) << 32);
+    if (host_id != local_host_id())
+    {
+        logf("[PEER] Socket %u: peer shares our address but not our host, no shared memory", (unsigned)state->s);
+        return;
+    }
+
+    memcpy(name, payload + 8, name_len);
+    name[name_len] = '\0';
+    peer->shm_in = shm_ring_open(name);
+    logf("[PEER] Socket %u: peer offered shared-memory ring %s: %s", (unsigned)state->s, name,
+         peer->shm_in ? "mapped" : "could not map it");
+}
+
+/**
+ * Returns TRUE when the peer mapped our ring, so the outgoing stream can
+ * move there.
+ */
+static BOOL shm_switch_due(const peer_link *peer)
+{
+    return peer->shm_out && peer->shm_accepted && !peer->shm_tx && peer->tx_framed && !peer->shm_offer_pending;
+}
+
+/**
+ * Checks the TCP connection for a reset while frames travel elsewhere.
+ * Nothing but a close or reset is expected on it any more.
+ *
+ * @return TRUE if the connection failed (the Winsock error is preserved)
+ */
+static BOOL transport_reset(socket_state *state)
+{
+    char probe;
+    return recv_once(state->transport, &probe, 1, MSG_PEEK) == SOCKET_ERROR;
+}
+
+/**
+ * Copies bytes into our ring, waiting on its space event while the reader
+ * falls behind. Caller must hold send_lock.
+ *
+ * @return len, or SOCKET_ERROR (WSAECONNRESET) once the reader or the connection is gone
+ */
+static int shm_write_all(socket_state *state, const uint8_t *buf, int len)
+{
+    shm_ring *ring = state->peer.shm_out;
+    DWORD     stall_start = clock_ticks();
+    int       done = 0;
+
+    for (;;)
+    {
+        int written = shm_ring_write(ring, buf + done, len - done);
+        done += written;
+        if (done == len)
+        {
+            return len;
+        }
+        if (written > 0)
+        {
+            stall_start = clock_ticks();
+        }
+        if (shm_ring_peer_closed(ring) || peer_send_stalled(state->transport, clock_ticks() - stall_start))
+        {
+            WSASetLastError(WSAECONNRESET);
+            return SOCKET_ERROR;
+        }
+        if (!shm_ring_wait_writable(ring, PEER_SHM_CHECK_MS) && transport_reset(state))
+        {
+            return SOCKET_ERROR;
+        }
+    }
+}
+
+/**
+ * Returns TRUE if server.dll asked for urgent bytes inline with the data.
+ */
+static BOOL oob_inline(SOCKET s)
+{
+    BOOL inline_oob = FALSE;
+    int  len = sizeof(inline_oob);
+    return getsockopt(s, SOL_SOCKET, SO_OOBINLINE, (char *)&inline_oob, &len) == 0 && inline_oob;
+}
+
+/**
+ * Starts negotiation the first time the peer layer sees a socket.
+ * Caller must hold send_lock.
+ */
+static void begin_negotiation(socket_state *state)
+{
+    peer_link *peer = &state->peer;
+    if (peer->state != PEER_STATE_NEW)
+    {
+        return;
+    }
+
+    if (!determine_role(state, &peer->initiator))
+    {
+        logf("[PEER] Socket %u: connection direction unknown, using raw mode", (unsigned)state->s);
+        peer->state = PEER_STATE_RAW;
+        return;
+    }
+    if (oob_inline(state->s))
+    {
+        logf("[PEER] Socket %u: SO_OOBINLINE is set, using raw mode", (unsigned)state->s);
+        peer->state = PEER_STATE_RAW;
+        return;
+    }
+
+    peer->state = PEER_STATE_NEGOTIATING;
+    peer->negotiate_start = clock_ticks();
+    if (g_config.delta_encoding)
+    {
+        allocate_delta_history(state);
+    }
+    if (g_config.session_resume)
+    {
+        allocate_replay_buffer(state);
+    }
+    if (g_config.udp_tunnel)
+    {
+        open_tunnel(state);
+    }
+    if (g_config.shared_memory)
+    {
+        open_shm(state);
+    }
+
+    if (peer->initiator)
+    {
+        char hello = (char)PEER_OOB_HELLO;
+        if (send_all(state->s, &hello, 1, MSG_OOB) != 1)
+        {
+            logf("[PEER] Socket %u: failed to send HELLO, using raw mode", (unsigned)state->s);
+            peer->state = PEER_STATE_RAW;
+            return;
+        }
+    }
+
+    logf("[PEER] Socket %u: negotiating as %s", (unsigned)state->s, peer->initiator ? "initiator" : "responder");
+}
+
+/**
+ * Writes one frame. Caller must hold send_lock and own tx_buf.
+ *
+ * @return Bytes written (header included), or the short/failed send_all result
+ */
+static int write_frame(socket_state *state, uint8_t type, const uint8_t *payload, int payload_len, int flags)
+{
+    uint8_t *frame = state->peer.tx_buf;
+    frame[0] = type;
+    put_u16(frame + 1, (uint16_t)payload_len);
+    if (payload_len > 0 && payload != frame + PEER_FRAME_HEADER_SIZE)
+    {
+        memcpy(frame + PEER_FRAME_HEADER_SIZE, payload, payload_len);
+    }
+
+    int frame_len = PEER_FRAME_HEADER_SIZE + payload_len;
+    int sent = state->peer.shm_tx      ? shm_write_all(state, frame, frame_len)
+               : state->peer.tunnel_tx ? tunnel_write_all(state, frame, frame_len)
+                                       : send_all(state->transport, (const char *)frame, frame_len, flags);
+    if (sent == frame_len)
+    {
+        state->stats.wire_bytes_out += (uint64_t)frame_len;
+        state->stats.frames_out++;
+    }
+    return sent;
+}
+
+/**
+ * Sends our urgent SWITCH mark followed by the HELLO frame. Everything we
+ * write after the mark is framed. Caller must hold send_lock.
+ */
+static void send_switch_mark(socket_state *state)
+{
+    peer_link *peer = &state->peer;
+    peer->switch_pending = FALSE;
+
+    if (!peer->tx_buf)
+    {
+        peer->tx_buf = (uint8_t *)HeapAlloc(GetProcessHeap(), 0, PEER_TX_BUF_SIZE);
+        if (!peer->tx_buf)
+        {
+            // Our direction simply stays raw; the peer keeps decoding raw bytes
+            logf("[PEER] Socket %u: out of memory, outgoing stream stays raw", (unsigned)state->s);
+            return;
+        }
+    }
+
+    char mark = (char)PEER_OOB_SWITCH;
+    if (send_all(state->s, &mark, 1, MSG_OOB) != 1)
+    {
+        logf("[PEER] Socket %u: failed to send SWITCH mark", (unsigned)state->s);
+        return;
+    }
+    peer->tx_framed = TRUE;
+
+    uint8_t hello[13];
+    hello[0] = PEER_PROTOCOL_VERSION;
+    put_u32(hello + 1, local_capabilities(peer));
+    put_u32(hello + 5, (uint32_t)peer->local_session_id);
+    put_u32(hello + 9, (uint32_t)(peer->local_session_id >> 32));
+    write_frame(state, PEER_FRAME_HELLO, hello, (peer->replay.data ? 13 : 5), 0);
+
+    logf("[PEER] Socket %u: outgoing stream framed (capabilities 0x%X)", (unsigned)state->s,
+         (unsigned)local_capabilities(peer));
+}
+
+/**
+ * Returns TRUE if a heartbeat PING is due on a framed outgoing stream.
+ */
+static BOOL heartbeat_due(const peer_link *peer)
+{
+    return peer->tx_framed && g_config.heartbeat_interval_ms != 0 && (peer->peer_caps & PEER_CAP_HEARTBEAT) &&
+           clock_ticks() - peer->last_ping_sent >= g_config.heartbeat_interval_ms;
+}
+
+/**
+ * Returns TRUE if the next clock sync exchange is due on a framed outgoing stream.
+ */
+static BOOL time_request_due(const peer_link *peer)
+{
+    return peer->tx_framed && g_config.clock_sync != CLOCK_SYNC_OFF && (peer->peer_caps & PEER_CAP_CLOCK) &&
+           clock_ticks() - peer->last_time_request >= timesync_interval_ms(&peer->clock);
+}
+
+/**
+ * Returns TRUE if the send side owes the peer a control frame or mark.
+ */
+static BOOL control_pending(const peer_link *peer)
+{
+    if (peer->suspended)
+    {
+        return FALSE;
+    }
+    return peer->switch_pending ||
+           (peer->tx_framed && (peer->pong_pending || peer->tunnel_offer_pending || peer->shm_offer_pending ||
+                                peer->shm_answer_pending || peer->time_reply_pending)) ||
+           heartbeat_due(peer) || time_request_due(peer) || tunnel_switch_due(peer) || shm_switch_due(peer);
+}
+
+/**
+ * Sends whatever control traffic is owed: our SWITCH mark, the tunnel and
+ * shared-memory handshakes, PONG and TIME_REPLY answers, a heartbeat PING
+ * and a TIME_REQUEST when their intervals elapsed. Caller must hold
+ * send_lock.
+ */
+static void flush_control_frames(socket_state *state)
+{
+    peer_link *peer = &state->peer;
+    uint8_t    payload[4];
+
+    if (peer->switch_pending)
+    {
+        send_switch_mark(state);
+    }
+    if (!peer->tx_framed || peer->suspended)
+    {
+        return;
+    }
+
+    if (peer->tunnel_offer_pending)
+    {
+        uint8_t offer[6];
+        peer->tunnel_offer_pending = FALSE;
+        put_u16(offer, rudp_local_port(peer->tunnel));
+        put_u32(offer + 2, peer->tunnel->local_token);
+        write_frame(state, PEER_FRAME_TUNNEL_OFFER, offer, sizeof(offer), 0);
+    }
+    if (tunnel_switch_due(peer) &&
+        write_frame(state, PEER_FRAME_TUNNEL_SWITCH, NULL, 0, 0) == PEER_FRAME_HEADER_SIZE)
+    {
+        peer->tunnel_tx = TRUE;
+        logf("[PEER] Socket %u: outgoing stream moved to the UDP tunnel", (unsigned)state->s);
+    }
+
+    if (peer->shm_offer_pending)
+    {
+        uint8_t  offer[8 + SHM_RING_NAME_MAX];
+        uint64_t host_id = local_host_id();
+        int      name_len = (int)strlen(peer->shm_out->name);
+        peer->shm_offer_pending = FALSE;
+        put_u32(offer, (uint32_t)host_id);
+        put_u32(offer + 4, (uint32_t)(host_id >> 32));
+        memcpy(offer + 8, peer->shm_out->name, name_len);
+        write_frame(state, PEER_FRAME_SHM_OFFER, offer, 8 + name_len, 0);
+    }
+    if (peer->shm_answer_pending)
+    {
+        uint8_t mapped = peer->shm_in ? 1 : 0;
+        peer->shm_answer_pending = FALSE;
+        write_frame(state, PEER_FRAME_SHM_ACCEPT, &mapped, 1, 0);
+    }
+    if (shm_switch_due(peer) && write_frame(state, PEER_FRAME_SHM_SWITCH, NULL, 0, 0) == PEER_FRAME_HEADER_SIZE)
+    {
+        peer->shm_tx = TRUE;
+        logf("[PEER] Socket %u: outgoing stream moved to shared memory", (unsigned)state->s);
+    }
+
+    if (peer->pong_pending)
+    {
+        peer->pong_pending = FALSE;
+        put_u32(payload, peer->pong_echo);
+        write_frame(state, PEER_FRAME_PONG, payload, sizeof(payload), 0);
+    }
+
+    if (heartbeat_due(peer))
+    {
+        peer->last_ping_sent = clock_ticks();
+        put_u32(payload, perf_now_us());
+        write_frame(state, PEER_FRAME_PING, payload, sizeof(payload), 0);
+    }
+
+    if (peer->time_reply_pending)
+    {
+        uint8_t reply[24];
+        peer->time_reply_pending = FALSE;
+        put_u64(reply, (uint64_t)peer->time_origin_us);
+        put_u64(reply + 8, (uint64_t)peer->time_received_us);
+        put_u64(reply + 16, (uint64_t)clock_now_us());
+        write_frame(state, PEER_FRAME_TIME_REPLY, reply, sizeof(reply), 0);
+    }
+    if (time_request_due(peer))
+    {
+        uint8_t request[8];
+        peer->last_time_request = clock_ticks();
+        put_u64(request, (uint64_t)clock_now_us());
+        write_frame(state, PEER_FRAME_TIME_REQUEST, request, sizeof(request), 0);
+    }
+}
+
+/**
+ * Flushes control traffic from the recv path without waiting for a sender
+ * that is blocked in its retry loop; the next send picks it up.
+ */
+static void try_flush_control_frames(socket_state *state)
+{
+    if (control_pending(&state->peer) && TryEnterCriticalSection(&state->send_lock))
+    {
+        flush_control_frames(state);
+        LeaveCriticalSection(&state->send_lock);
+    }
+}
+
+/**
+ * Folds one RTT sample into the smoothed estimate (RFC 6298 weights).
+ */
+static void record_rtt_sample(socket_state *state, uint32_t sample_us)
+{
+    socket_stats *stats = &state->stats;
+
+    if (stats->rtt_samples == 0)
+    {
+        stats->srtt_us = sample_us;
+        stats->rttvar_us = sample_us / 2;
+        stats->rtt_min_us = sample_us;
+    }
+    else
+    {
+        uint32_t deviation = stats->srtt_us > sample_us ? stats->srtt_us - sample_us : sample_us - stats->srtt_us;
+        stats->rttvar_us = (3 * stats->rttvar_us + deviation) / 4;
+        stats->srtt_us = (7 * stats->srtt_us + sample_us) / 8;
+        if (sample_us < stats->rtt_min_us)
+        {
+            stats->rtt_min_us = sample_us;
+        }
+    }
+    stats->rtt_samples++;
+}
+
+/**
+ * Folds one clock sync exchange into the peer's estimate. With ClockSync=2,
+ * the side that called connect() aligns server.dll's clock to the host.
+ */
+static void record_time_reply(socket_state *state, int64_t origin_us, int64_t receive_us, int64_t transmit_us)
+{
+    timesync *sync = &state->peer.clock;
+    int64_t   arrival_us = clock_now_us();
+    BOOL      first = !sync->valid;
+
+    if (!timesync_add(sync, origin_us, receive_us, transmit_us, arrival_us))
+    {
+        return;
+    }
+    if (first)
+    {
+        logf("[PEER] Socket %u: peer clock is %+.2f ms from ours (round trip %.2f ms)", (unsigned)state->s,
+             (double)sync->best.offset_us / 1000.0, (double)sync->best.delay_us / 1000.0);
+    }
+    if (g_config.clock_sync == CLOCK_SYNC_ALIGN && state->direction == SOCKET_DIRECTION_OUTGOING)
+    {
+        clock_set_alignment(timesync_offset_at(sync, arrival_us));
+    }
+}
+
+/**
+ * Returns TRUE if the remote side promised heartbeats, so silence means it is gone.
+ */
+static BOOL liveness_tracked(const peer_link *peer)
+{
+    return peer->rx_framed && (peer->peer_caps & PEER_CAP_HEARTBEAT) && g_config.dead_peer_timeout_ms != 0;
+}
+
+/* ---- Session resumption ---- */
+
+/**
+ * Returns TRUE if a lost connection can be re-established transparently.
+ */
+static BOOL session_resumable(const socket_state *state)
+{
+    const peer_link *peer = &state->peer;
+    return peer->replay.data && (peer->peer_caps & PEER_CAP_RESUME) && peer->tx_framed && peer->rx_framed &&
+           peer->peer_session_id != 0 && state->direction != SOCKET_DIRECTION_UNKNOWN && !peer->dead;
+}
+
+/**
+ * Returns TRUE if an errno from the transport means the connection dropped
+ * (as opposed to a local mistake or a graceful close).
+ */
+static BOOL is_connection_loss(int error)
+{
+    return error == WSAECONNRESET || error == WSAECONNABORTED || error == WSAENETRESET || error == WSAETIMEDOUT ||
+           error == WSAENETDOWN || error == WSAENETUNREACH || error == WSAEHOSTUNREACH;
+}
+
+/**
+ * Builds a RESUME frame: the session the receiver should look up and how
+ * many game bytes we already have from it.
+ */
+static void build_resume_frame(uint8_t *frame, uint64_t session_id, uint64_t received)
+{
+    frame[0] = PEER_FRAME_RESUME;
+    put_u16(frame + 1, 16);
+    put_u32(frame + 3, (uint32_t)session_id);
+    put_u32(frame + 7, (uint32_t)(session_id >> 32));
+    put_u32(frame + 11, (uint32_t)received);
+    put_u32(frame + 15, (uint32_t)(received >> 32));
+}
+
+/**
+ * Parses a RESUME frame.
+ *
+ * @return FALSE if the bytes are not a RESUME frame
+ */
+static BOOL parse_resume_frame(const uint8_t *frame, uint64_t *session_id, uint64_t *received)
+{
+    if (frame[0] != PEER_FRAME_RESUME || get_u16(frame + 1) != 16)
+    {
+        return FALSE;
+    }
+    *session_id = (uint64_t)get_u32(frame + 3) | ((uint64_t)get_u32(frame + 7) << 32);
+    *received = (uint64_t)get_u32(frame + 11) | ((uint64_t)get_u32(frame + 15) << 32);
+    return TRUE;
+}
+
+/**
+ * Waits until a socket is readable.
+ *
+ * @return TRUE if readable within timeout_ms
+ */
+static BOOL wait_readable(SOCKET s, DWORD timeout_ms)
+{
+    fd_set         read_fds;
+    struct timeval timeout = {(long)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000};
+
+    FD_ZERO(&read_fds);
+    FD_SET(s, &read_fds);
+    return select(0, &read_fds, NULL, NULL, &timeout) > 0;
+}
+
+/**
+ * Gives up on a session: later recv and send calls fail with WSAECONNRESET
+ * so server.dll runs its normal disconnect handling.
+ */
+static void fail_session(socket_state *state, const char *reason)
+{
+    peer_link *peer = &state->peer;
+    if (!peer->dead)
+    {
+        peer->dead = TRUE;
+        logf("[PEER] Socket %u: %s, connection closed", (unsigned)state->s, reason);
+    }
+    InterlockedExchange(&peer->suspended, 0);
+}
+
+static DWORD WINAPI reconnect_thread(LPVOID param);
+
+/**
+ * Job handed to the reconnect thread. The thread looks the socket up again
+ * on every step and stops once the session resumed, failed or was closed.
+ */
+typedef struct
+{
+    SOCKET s;
+    LONG   generation;
+} reconnect_job;
+
+/**
+ * Marks a session as waiting for a new connection. The side that originally
+ * connected starts reconnecting; the accepting side waits for RESUME on
+ * the connections it accepts.
+ */
+static void suspend_session(socket_state *state, const char *reason)
+{
+    peer_link *peer = &state->peer;
+
+    if (InterlockedCompareExchange(&peer->suspended, 1, 0) != 0)
+    {
+        return;
+    }
+    peer->suspend_start = clock_ticks();
+    peer->suspend_seq = peer->replay.end_seq;
+    LONG generation = InterlockedIncrement(&peer->resume_generation);
+
+    logf("[PEER] Socket %u: %s, waiting up to %lu ms to resume (sent %llu, received %llu)", (unsigned)state->s,
+         reason, g_config.resume_timeout_ms, (unsigned long long)peer->replay.end_seq,
+         (unsigned long long)peer->rx_seq);
+
+    if (state->direction != SOCKET_DIRECTION_OUTGOING)
+    {
+        return;
+    }
+
+    reconnect_job *job = (reconnect_job *)HeapAlloc(GetProcessHeap(), 0, sizeof(reconnect_job));
+    HANDLE         thread = NULL;
+    if (job)
+    {
+        job->s = state->s;
+        job->generation = generation;
+        thread = CreateThread(NULL, 0, reconnect_thread, job, 0, NULL);
+    }
+    if (!thread)
+    {
+        if (job)
+        {
+            HeapFree(GetProcessHeap(), 0, job);
+        }
+        fail_session(state, "could not start reconnect thread");
+        return;
+    }
+    CloseHandle(thread);
+}
+
+/**
+ * Handles a lost connection: suspends resumable sessions, closes the rest.
+ */
+static void connection_lost(socket_state *state, const char *reason)
+{
+    if (session_resumable(state))
+    {
+        suspend_session(state, reason);
+    }
+    else
+    {
+        fail_session(state, reason);
+    }
+}
+
+/**
+ * Fails a suspended session once ResumeTimeoutMs passed without a reconnect.
+ *
+ * @return TRUE if the session is still suspended
+ */
+static BOOL check_suspension(socket_state *state)
+{
+    if (!state->peer.suspended)
+    {
+        return FALSE;
+    }
+    if (clock_ticks() - state->peer.suspend_start > g_config.resume_timeout_ms)
+    {
+        fail_session(state, "session did not resume in time");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Closes a connection a session no longer uses. A connection server.dll
+ * still holds, because a late RESUME took it over after accept, is only
+ * shut down; server.dll's own closesocket() then releases the handle.
+ */
+static void drop_transport(SOCKET transport)
+{
+    socket_state *holder = get_socket_state(transport, FALSE);
+    if (holder && InterlockedExchange(&holder->peer.handed_over, 0))
+    {
+        shutdown(transport, SD_BOTH);
+        return;
+    }
+    closesocket(transport);
+}
+
+/**
+ * Switches a session to a new connection and replays every game byte the
+ * peer has not received. Caller must hold recv_lock and send_lock.
+ *
+ * @param transport New connection (owned by the session afterwards)
+ * @param peer_received Game bytes the peer already decoded
+ * @param answer_frame RESUME answer to send before the replay, or NULL
+ * @return TRUE if the session resumed; on FALSE transport was closed
+ */
+static BOOL install_transport(socket_state *state, SOCKET transport, uint64_t peer_received,
+                              const uint8_t *answer_frame)
+{
+    peer_link *peer = &state->peer;
+
+    if (peer_received < replay_oldest_seq(&peer->replay) || peer_received > peer->replay.end_seq)
+    {
+        drop_transport(transport);
+        fail_session(state, "replay buffer no longer holds the bytes the peer is missing");
+        return FALSE;
+    }
+
+    if (state->transport != state->s)
+    {
+        drop_transport(state->transport); // server.dll still owns and closes the original socket
+    }
+    state->transport = transport;
+
+    // Frames still in the tunnel or ring are covered by the replay; the session continues over TCP only
+    rudp_close(peer->tunnel);
+    peer->tunnel = NULL;
+    peer->tunnel_offer_pending = FALSE;
+    peer->tunnel_tx = FALSE;
+    peer->tunnel_rx = FALSE;
+    shm_ring_close(peer->shm_out);
+    shm_ring_close(peer->shm_in);
+    peer->shm_out = NULL;
+    peer->shm_in = NULL;
+    peer->shm_offer_pending = FALSE;
+    peer->shm_answer_pending = FALSE;
+    peer->shm_accepted = FALSE;
+    peer->shm_tx = FALSE;
+    peer->shm_rx = FALSE;
+
+    // Partial frames from the old connection are lost; deltas restart from scratch on both ends
+    peer->rx_wire_len = 0;
+    peer->pong_pending = FALSE;
+    memset(peer->tx_history.len, 0, sizeof(peer->tx_history.len));
+    memset(peer->rx_history.len, 0, sizeof(peer->rx_history.len));
+    peer->tx_history.next = 0;
+    peer->rx_history.next = 0;
+
+    if (answer_frame && send_all(transport, (const char *)answer_frame, PEER_RESUME_FRAME_SIZE, 0) !=
+                            PEER_RESUME_FRAME_SIZE)
+    {
+        fail_session(state, "failed to answer RESUME");
+        return TRUE;
+    }
+
+    uint64_t replayed = 0;
+    uint64_t seq = peer_received;
+    while (seq < peer->replay.end_seq)
+    {
+        int len = replay_copy(&peer->replay, seq, peer->tx_buf + PEER_FRAME_HEADER_SIZE, PEER_DATA_CHUNK);
+        int sent = write_frame(state, PEER_FRAME_DATA, peer->tx_buf + PEER_FRAME_HEADER_SIZE, len, 0);
+        if (len <= 0 || sent != PEER_FRAME_HEADER_SIZE + len)
+        {
+            fail_session(state, "replay after reconnect failed");
+            return TRUE;
+        }
+        seq += (uint64_t)len;
+        replayed += (uint64_t)len;
+    }
+
+    peer->last_rx = clock_ticks();
+    peer->last_ping_sent = 0;
+    state->stats.resumes++;
+    InterlockedExchange(&peer->suspended, 0);
+    logf("[PEER] Socket %u: session resumed after %lu ms, replayed %llu bytes", (unsigned)state->s,
+         clock_ticks() - peer->suspend_start, (unsigned long long)replayed);
+    return TRUE;
+}
+
+/**
+ * Returns TRUE if the session behind a reconnect job is still waiting for it.
+ */
+static BOOL job_still_pending(const socket_state *state, const reconnect_job *job)
+{
+    return state && state->in_use && state->s == job->s && state->peer.suspended &&
+           state->peer.resume_generation == job->generation;
+}
+
+/**
+ * Opens a connection to the address server.dll originally connected to.
+ *
+ * @return Connected non-blocking socket, or INVALID_SOCKET
+ */
+static SOCKET connect_with_timeout(const socket_state *state, DWORD timeout_ms)
+{
+    SOCKET s = socket(state->remote_addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET)
+    {
+        return INVALID_SOCKET;
+    }
+
+    u_long non_blocking = 1;
+    ioctlsocket(s, FIONBIO, &non_blocking);
+    if (connect(s, (const struct sockaddr *)&state->remote_addr, state->remote_addr_len) == SOCKET_ERROR &&
+        WSAGetLastError() != WSAEWOULDBLOCK)
+    {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+
+    fd_set         write_fds;
+    fd_set         except_fds;
+    struct timeval timeout = {(long)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000};
+    int            error = 0;
+    int            error_len = sizeof(error);
+
+    FD_ZERO(&write_fds);
+    FD_ZERO(&except_fds);
+    FD_SET(s, &write_fds);
+    FD_SET(s, &except_fds);
+    if (select(0, NULL, &write_fds, &except_fds, &timeout) <= 0 || FD_ISSET(s, &except_fds) ||
+        getsockopt(s, SOL_SOCKET, SO_ERROR, (char *)&error, &error_len) == SOCKET_ERROR || error != 0)
+    {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+/**
+ * Reads exactly one RESUME frame from a new connection.
+ */
+static BOOL read_resume_frame(SOCKET s, uint8_t *frame, DWORD timeout_ms)
+{
+    DWORD start = clock_ticks();
+    int   have = 0;
+
+    while (have < PEER_RESUME_FRAME_SIZE)
+    {
+        DWORD elapsed = clock_ticks() - start;
+        if (elapsed >= timeout_ms || !wait_readable(s, timeout_ms - elapsed))
+        {
+            return FALSE;
+        }
+        int received = recv_once(s, (char *)frame + have, PEER_RESUME_FRAME_SIZE - have, 0);
+        if (received == SOCKET_ERROR)
+        {
+            return FALSE;
+        }
+        have += received;
+    }
+    return TRUE;
+}
+
+/**
+ * Reconnects a suspended outgoing session until it resumes, fails or times out.
+ */
+static void reconnect_session(const reconnect_job *job)
+{
+    for (;;)
+    {
+        socket_state *state = get_socket_state(job->s, FALSE);
+        if (!job_still_pending(state, job) ||
+            clock_ticks() - state->peer.suspend_start > g_config.resume_timeout_ms)
+        {
+            return; // The hooks report the timeout on the next call
+        }
+
+        SOCKET transport = connect_with_timeout(state, PEER_RECONNECT_TIMEOUT_MS);
+        if (transport != INVALID_SOCKET)
+        {
+            uint8_t  frame[PEER_RESUME_FRAME_SIZE];
+            uint64_t session_id;
+            uint64_t peer_received;
+
+            // rx_seq cannot change while suspended: nothing is read from the old connection
+            build_resume_frame(frame, state->peer.peer_session_id, state->peer.rx_seq);
+            if (send_all(transport, (const char *)frame, sizeof(frame), 0) == sizeof(frame) &&
+                read_resume_frame(transport, frame, PEER_RECONNECT_TIMEOUT_MS) &&
+                parse_resume_frame(frame, &session_id, &peer_received) &&
+                session_id == state->peer.local_session_id)
+            {
+                EnterCriticalSection(&state->recv_lock);
+                EnterCriticalSection(&state->send_lock);
+                if (job_still_pending(state, job))
+                {
+                    install_transport(state, transport, peer_received, NULL);
+                    transport = INVALID_SOCKET;
+                }
+                LeaveCriticalSection(&state->send_lock);
+                LeaveCriticalSection(&state->recv_lock);
+                if (transport == INVALID_SOCKET)
+                {
+                    return;
+                }
+            }
+            else
+            {
+                logf("[PEER] Socket %u: reconnected but the peer did not resume the session", (unsigned)job->s);
+            }
+            closesocket(transport);
+        }
+
+        clock_wait_us(NULL, PEER_RECONNECT_INTERVAL_MS * 1000);
+    }
+}
+
+/**
+ * Thread body around reconnect_session().
+ */
+static DWORD WINAPI reconnect_thread(LPVOID param)
+{
+    reconnect_job job = *(reconnect_job *)param;
+    HeapFree(GetProcessHeap(), 0, param);
+
+    reconnect_session(&job);
+    clock_thread_exit(); // The thread is gone for good, its wait timer with it
+    return 0;
+}
+
+/**
+ * find_socket_state() predicate: session currently carried by the given connection.
+ */
+static BOOL match_transport(const socket_state *state, void *context)
+{
+    return state->transport == *(const SOCKET *)context;
+}
+
+/**
+ * find_socket_state() predicate: accepted session with the given id, or any
+ * resumable accepted session for id 0.
+ */
+static BOOL match_accepted_session(const socket_state *state, void *context)
+{
+    const uint64_t *session_id = (const uint64_t *)context;
+    return state->direction == SOCKET_DIRECTION_ACCEPTED && state->peer.replay.data &&
+           (*session_id == 0 ? state->peer.peer_session_id != 0 : state->peer.local_session_id == *session_id);
+}
+
+/**
+ * What take_resume() found at the start of a new accepted connection.
+ */
+typedef enum
+{
+    RESUME_ABSENT,  // Not a resuming peer: the connection belongs to server.dll
+    RESUME_NOT_YET, // Nothing to read yet
+    RESUME_TAKEN    // The connection resumed a session or was rejected
+} resume_check;
+
+/**
+ * Looks for a RESUME frame at the start of a new accepted connection and
+ * moves the suspended session it names onto the connection. A resuming
+ * peer writes the frame in one piece right after connecting, so a shorter
+ * start is game data.
+ *
+ * @param s Newly accepted socket
+ * @param holder s's state once server.dll holds the handle, or NULL while accept still owns it
+ * @param wait TRUE to read the first bytes the way server.dll's own recv would, blocking sockets included
+ * @return RESUME_TAKEN if s now belongs to a session (with a holder, s only reports WSAECONNRESET to server.dll)
+ */
+static resume_check take_resume(SOCKET s, socket_state *holder, BOOL wait)
+{
+    uint64_t any_session = 0;
+    if (!g_config.session_resume || !find_socket_state(match_accepted_session, &any_session))
+    {
+        return RESUME_ABSENT; // No session could be resumed, nothing to look for
+    }
+    if (!wait && !wait_readable(s, 0))
+    {
+        return RESUME_NOT_YET;
+    }
+
+    uint8_t  frame[PEER_RESUME_FRAME_SIZE];
+    uint64_t session_id;
+    uint64_t peer_received;
+    int      peeked = recv_once(s, (char *)frame, sizeof(frame), MSG_PEEK);
+    if (peeked <= 0)
+    {
+        return RESUME_NOT_YET; // recv_once() reports WSAEWOULDBLOCK as 0 as well
+    }
+    if (peeked < PEER_RESUME_FRAME_SIZE || !parse_resume_frame(frame, &session_id, &peer_received))
+    {
+        return RESUME_ABSENT;
+    }
+
+    recv_once(s, (char *)frame, sizeof(frame), 0);
+    if (holder)
+    {
+        // server.dll's next call fails and its closesocket() leaves the connection to the session
+        holder->peer.dead = TRUE;
+        InterlockedExchange(&holder->peer.handed_over, 1);
+    }
+
+    socket_state *state = session_id ? find_socket_state(match_accepted_session, &session_id) : NULL;
+    if (!state)
+    {
+        logf("[PEER] Rejecting RESUME for unknown session");
+        drop_transport(s);
+        return RESUME_TAKEN;
+    }
+
+    EnterCriticalSection(&state->recv_lock);
+    EnterCriticalSection(&state->send_lock);
+    if (!state->peer.suspended)
+    {
+        // The peer noticed the drop first
+        connection_lost(state, "peer reconnected");
+    }
+    if (state->peer.suspended)
+    {
+        u_long non_blocking = 1;
+        ioctlsocket(s, FIONBIO, &non_blocking);
+        build_resume_frame(frame, state->peer.peer_session_id, state->peer.rx_seq);
+        install_transport(state, s, peer_received, frame);
+    }
+    else
+    {
+        drop_transport(s);
+    }
+    LeaveCriticalSection(&state->send_lock);
+    LeaveCriticalSection(&state->recv_lock);
+    return RESUME_TAKEN;
+}
+
+/**
+ * Declares the connection lost after heartbeats stopped. Resumable sessions
+ * wait for a reconnect; the rest fail with WSAECONNRESET so server.dll runs
+ * its normal disconnect handling.
+ */
+static void mark_peer_dead(socket_state *state, DWORD silent_ms, const char *reason)
+{
+    if (!state->peer.dead && !state->peer.suspended)
+    {
+        logf("[PEER] Socket %u: %s for %lu ms", (unsigned)state->s, reason, silent_ms);
+        connection_lost(state, "peer unresponsive");
+    }
+}
+
+/**
+ * Drives the tunnel from the hooks (receive, acknowledge, retransmit) and
+ * treats its failure like a lost connection.
+ */
+static void poll_tunnel(socket_state *state)
+{
+    peer_link *peer = &state->peer;
+    if (!peer->tunnel || peer->suspended || peer->dead)
+    {
+        return;
+    }
+
+    rudp_poll(peer->tunnel);
+    if ((peer->tunnel_tx || peer->tunnel_rx) && rudp_failed(peer->tunnel))
+    {
+        connection_lost(state, "UDP tunnel stopped responding");
+    }
+}
+
+/**
+ * Reads frame bytes from the tunnel once the peer moved its stream there.
+ * The silent TCP connection is only checked for a reset.
+ */
+static int read_tunnel(socket_state *state, uint8_t *buf, int len)
+{
+    int received = rudp_read(state->peer.tunnel, buf, len);
+    if (received == 0 && transport_reset(state))
+    {
+        return SOCKET_ERROR;
+    }
+    return received;
+}
+
+/**
+ * Reads frame bytes from the peer's ring once it moved its stream there.
+ * An empty ring checks the TCP connection only every PEER_SHM_CHECK_MS so
+ * polling stays free of system calls.
+ */
+static int read_shm(socket_state *state, uint8_t *buf, int len)
+{
+    peer_link *peer = &state->peer;
+    int        received = shm_ring_read(peer->shm_in, buf, len);
+    DWORD      now = clock_ticks();
+
+    if (received == 0 && now - peer->shm_last_check >= PEER_SHM_CHECK_MS)
+    {
+        peer->shm_last_check = now;
+        if (transport_reset(state))
+        {
+            return SOCKET_ERROR;
+        }
+    }
+    return received;
+}
+
+/**
+ * Returns TRUE if urgent data is waiting on the socket (zero-timeout select).
+ */
+static BOOL oob_data_pending(SOCKET s)
+{
+    fd_set         except_fds;
+    struct timeval timeout = {0, 0};
+
+    FD_ZERO(&except_fds);
+    FD_SET(s, &except_fds);
+    return select(0, NULL, NULL, &except_fds, &timeout) > 0;
+}
+
+/**
+ * Returns TRUE if every byte before the pending urgent mark has been read.
+ */
+static BOOL at_oob_mark(SOCKET s)
+{
+    u_long at_mark = 0;
+    if (ioctlsocket(s, SIOCATMARK, &at_mark) == SOCKET_ERROR)
+    {
+        return FALSE;
+    }
+    return at_mark != 0;
+}
+
+/**
+ * Allocates the receive-side frame buffers. Caller must hold recv_lock.
+ */
+static BOOL ensure_rx_buffers(socket_state *state)
+{
+    peer_link *peer = &state->peer;
+    HANDLE     heap = GetProcessHeap();
+
+    if (!peer->rx_wire)
+    {
+        peer->rx_wire = (uint8_t *)HeapAlloc(heap, 0, PEER_RX_WIRE_SIZE);
+    }
+    if (!peer->rx_plain)
+    {
+        peer->rx_plain = (uint8_t *)HeapAlloc(heap, 0, PEER_RX_PLAIN_SIZE);
+    }
+    return peer->rx_wire && peer->rx_plain;
+}
+
+/**
+ * Handles an urgent byte read at its mark. Caller must hold recv_lock.
+ */
+static void handle_oob_byte(socket_state *state, uint8_t mark)
+{
+    peer_link *peer = &state->peer;
+
+    switch (mark)
+    {
+    case PEER_OOB_HELLO:
+        if (peer->initiator || peer->state != PEER_STATE_NEGOTIATING)
+        {
+            logf("[PEER] Socket %u: unexpected HELLO ignored", (unsigned)state->s);
+            return;
+        }
+        logf("[PEER] Socket %u: patched peer detected", (unsigned)state->s);
+        peer->state = PEER_STATE_FRAMED;
+        peer->rx_mark_expected = TRUE;
+        peer->switch_pending = TRUE;
+        try_flush_control_frames(state);
+        return;
+
+    case PEER_OOB_SWITCH:
+        if (!ensure_rx_buffers(state))
+        {
+            logf("[PEER] Socket %u: out of memory for incoming frames", (unsigned)state->s);
+        }
+        peer->rx_framed = TRUE;
+        peer->rx_mark_expected = FALSE;
+        logf("[PEER] Socket %u: incoming stream framed", (unsigned)state->s);
+        if (peer->state == PEER_STATE_NEGOTIATING)
+        {
+            // Initiator: the responder's mark doubles as its answer to our HELLO
+            logf("[PEER] Socket %u: patched peer detected", (unsigned)state->s);
+            peer->state = PEER_STATE_FRAMED;
+            peer->switch_pending = TRUE;
+            try_flush_control_frames(state);
+        }
+        return;
+
+    default:
+        logf("[PEER] Socket %u: ignoring unknown urgent byte 0x%02X", (unsigned)state->s, mark);
+        return;
+    }
+}
+
+/**
+ * Drives negotiation from the recv path: flushes a pending mark, times out
+ * silent peers and reads an urgent byte once all data before it is consumed.
+ * Caller must hold recv_lock.
+ */
+static void advance_negotiation(socket_state *state)
+{
+    peer_link *peer = &state->peer;
+
+    try_flush_control_frames(state);
+
+    if (peer->state == PEER_STATE_NEGOTIATING)
+    {
+        // The initiator waits twice as long so a late answer is never dropped
+        DWORD limit = g_config.negotiate_timeout_ms * (peer->initiator ? 2 : 1);
+        if (clock_ticks() - peer->negotiate_start > limit)
+        {
+            logf("[PEER] Socket %u: no patched peer answered within %lu ms, using raw mode", (unsigned)state->s,
+                 limit);
+            peer->state = PEER_STATE_RAW;
+            return;
+        }
+    }
+    else if (!peer->rx_mark_expected || peer->rx_framed)
+    {
+        return;
+    }
+
+    if (!oob_data_pending(state->s) || !at_oob_mark(state->s))
+    {
+        return; // Nothing urgent, or raw bytes before the mark still need to be read
+    }
+
+    char mark;
+    if (recv_once(state->s, &mark, 1, MSG_OOB) == 1)
+    {
+        handle_oob_byte(state, (uint8_t)mark);
+    }
+}
+
+/**
+ * Decodes one received frame into rx_plain. Caller must hold recv_lock.
+ *
+ * @return FALSE if the frame is malformed and the stream cannot continue
+ */
+static BOOL handle_frame(socket_state *state, uint8_t type, const uint8_t *payload, int payload_len)
+{
+    peer_link *peer = &state->peer;
+    uint8_t   *out = peer->rx_plain + peer->rx_plain_end;
+
+    switch (type)
+    {
+    case PEER_FRAME_DATA:
+        memcpy(out, payload, payload_len);
+        delta_history_push(&peer->rx_history, out, payload_len);
+        peer->rx_plain_end += payload_len;
+        peer->rx_seq += (uint64_t)payload_len;
+        return TRUE;
+
+    case PEER_FRAME_DATA_LZ4: {
+        if (payload_len < 2)
+        {
+            return FALSE;
+        }
+        int      original_len = get_u16(payload);
+        uint64_t start = perf_now();
+        int      decoded = lz4_decompress(payload + 2, payload_len - 2, out, original_len);
+        state->stats.decompress_ticks += perf_now() - start;
+        if (decoded != original_len)
+        {
+            logf("[PEER] Socket %u: corrupt compressed frame (%d bytes, expected %d)", (unsigned)state->s, decoded,
+                 original_len);
+            return FALSE;
+        }
+        delta_history_push(&peer->rx_history, out, decoded);
+        peer->rx_plain_end += decoded;
+        peer->rx_seq += (uint64_t)decoded;
+        return TRUE;
+    }
+
+    case PEER_FRAME_DATA_DELTA: {
+        int slot = payload_len >= 1 ? payload[0] : DELTA_HISTORY_SLOTS;
+        if (!peer->rx_history.data || slot >= DELTA_HISTORY_SLOTS || peer->rx_history.len[slot] == 0)
+        {
+            logf("[PEER] Socket %u: delta frame references unknown message", (unsigned)state->s);
+            return FALSE;
+        }
+        int original_len = peer->rx_history.len[slot];
+        if (delta_apply(DELTA_HISTORY_SLOT(&peer->rx_history, slot), original_len, payload + 1, payload_len - 1,
+                        out) != original_len)
+        {
+            logf("[PEER] Socket %u: corrupt delta frame", (unsigned)state->s);
+            return FALSE;
+        }
+        delta_history_push(&peer->rx_history, out, original_len);
+        peer->rx_plain_end += original_len;
+        peer->rx_seq += (uint64_t)original_len;
+        return TRUE;
+    }
+
+    case PEER_FRAME_HELLO:
+        if (payload_len >= 5)
+        {
+            peer->peer_caps = get_u32(payload + 1);
+            peer->peer_hello_received = TRUE;
+            peer->last_rx = clock_ticks();
+            if (payload_len >= 13)
+            {
+                peer->peer_session_id = (uint64_t)get_u32(payload + 5) | ((uint64_t)get_u32(payload + 9) << 32);
+            }
+            peer->tunnel_offer_pending = peer->tunnel && (peer->peer_caps & PEER_CAP_TUNNEL);
+            peer->shm_offer_pending = peer->shm_out && (peer->peer_caps & PEER_CAP_SHM);
+            logf("[PEER] Socket %u: peer protocol v%u, capabilities 0x%X", (unsigned)state->s, payload[0],
+                 (unsigned)peer->peer_caps);
+        }
+        return TRUE;
+
+    case PEER_FRAME_PING:
+        if (payload_len >= 4)
+        {
+            peer->pong_echo = get_u32(payload);
+            peer->pong_pending = TRUE;
+        }
+        return TRUE;
+
+    case PEER_FRAME_PONG:
+        if (payload_len >= 4)
+        {
+            record_rtt_sample(state, perf_now_us() - get_u32(payload));
+        }
+        return TRUE;
+
+    case PEER_FRAME_TIME_REQUEST:
+        if (payload_len >= 8)
+        {
+            peer->time_origin_us = (int64_t)get_u64(payload);
+            peer->time_received_us = clock_now_us();
+            peer->time_reply_pending = TRUE;
+        }
+        return TRUE;
+
+    case PEER_FRAME_TIME_REPLY:
+        if (payload_len >= 24)
+        {
+            record_time_reply(state, (int64_t)get_u64(payload), (int64_t)get_u64(payload + 8),
+                              (int64_t)get_u64(payload + 16));
+        }
+        return TRUE;
+
+    case PEER_FRAME_TUNNEL_OFFER:
+        if (payload_len >= 6 && peer->tunnel)
+        {
+            start_tunnel(state, get_u16(payload), get_u32(payload + 2));
+        }
+        return TRUE;
+
+    case PEER_FRAME_TUNNEL_SWITCH:
+        if (!peer->tunnel)
+        {
+            logf("[PEER] Socket %u: peer switched to a tunnel we never offered", (unsigned)state->s);
+            return FALSE;
+        }
+        peer->tunnel_rx = TRUE;
+        logf("[PEER] Socket %u: incoming stream moved to the UDP tunnel", (unsigned)state->s);
+        return TRUE;
+
+    case PEER_FRAME_SHM_OFFER:
+        accept_shm_offer(state, payload, payload_len);
+        return TRUE;
+
+    case PEER_FRAME_SHM_ACCEPT:
+        if (payload_len >= 1 && peer->shm_out)
+        {
+            peer->shm_accepted = payload[0] != 0;
+            if (!peer->shm_accepted)
+            {
+                logf("[PEER] Socket %u: peer could not map our ring, staying on the network", (unsigned)state->s);
+            }
+        }
+        return TRUE;
+
+    case PEER_FRAME_SHM_SWITCH:
+        if (!peer->shm_in)
+        {
+            logf("[PEER] Socket %u: peer switched to a ring we never mapped", (unsigned)state->s);
+            return FALSE;
+        }
+        peer->shm_rx = TRUE;
+        logf("[PEER] Socket %u: incoming stream moved to shared memory", (unsigned)state->s);
+        return TRUE;
+
+    default:
+        // Newer peers only send types we announced, but stay tolerant
+        logf_rate_limited("peer_unknown_frame", "[PEER] Socket %u: skipping unknown frame type 0x%02X",
+                          (unsigned)state->s, type);
+        return TRUE;
+    }
+}
+
+/**
+ * Parses every complete frame in rx_wire while rx_plain has room for a
+ * full decoded frame. Caller must hold recv_lock.
+ *
+ * @return FALSE on a malformed frame
+ */
+static BOOL parse_frames(socket_state *state)
+{
+    peer_link *peer = &state->peer;
+    int        pos = 0;
+
+    if (peer->rx_plain_start > 0)
+    {
+        memmove(peer->rx_plain, peer->rx_plain + peer->rx_plain_start, peer->rx_plain_end - peer->rx_plain_start);
+        peer->rx_plain_end -= peer->rx_plain_start;
+        peer->rx_plain_start = 0;
+    }
+
+    while (peer->rx_wire_len - pos >= PEER_FRAME_HEADER_SIZE)
+    {
+        uint8_t type = peer->rx_wire[pos];
+        int     payload_len = get_u16(peer->rx_wire + pos + 1);
+
+        if (peer->rx_wire_len - pos - PEER_FRAME_HEADER_SIZE < payload_len)
+        {
+            break; // Incomplete frame
+        }
+        if (PEER_RX_PLAIN_SIZE - peer->rx_plain_end < PEER_MAX_FRAME_PAYLOAD)
+        {
+            break; // Let server.dll drain decoded bytes first
+        }
+
+        if (!handle_frame(state, type, peer->rx_wire + pos + PEER_FRAME_HEADER_SIZE, payload_len))
+        {
+            return FALSE;
+        }
+        pos += PEER_FRAME_HEADER_SIZE + payload_len;
+        state->stats.frames_in++;
+    }
+
+    if (pos > 0)
+    {
+        memmove(peer->rx_wire, peer->rx_wire + pos, peer->rx_wire_len - pos);
+        peer->rx_wire_len -= pos;
+    }
+    return TRUE;
+}
+
+/**
+ * Receives from a socket whose incoming stream is framed. Caller must hold
+ * recv_lock.
+ */
+static int recv_framed(socket_state *state, char *buf, int len, int flags)
+{
+    peer_link *peer = &state->peer;
+
+    if (!buf || len <= 0)
+    {
+        return recv_once(state->transport, buf, len, flags); // Let Winsock report the bad parameters
+    }
+    if (!peer->rx_wire || !peer->rx_plain)
+    {
+        WSASetLastError(WSAENOBUFS);
+        return SOCKET_ERROR;
+    }
+
+    if (peer->rx_plain_start == peer->rx_plain_end && !peer->suspended)
+    {
+        int space = PEER_RX_WIRE_SIZE - peer->rx_wire_len;
+        if (space > 0)
+        {
+            uint8_t *wire = peer->rx_wire + peer->rx_wire_len;
+            int      received = peer->shm_rx      ? read_shm(state, wire, space)
+                                : peer->tunnel_rx ? read_tunnel(state, wire, space)
+                                                  : recv_once(state->transport, (char *)wire, space, flags & ~MSG_PEEK);
+            if (received == SOCKET_ERROR)
+            {
+                int error = WSAGetLastError();
+                if (!is_connection_loss(error) || !session_resumable(state))
+                {
+                    return SOCKET_ERROR;
+                }
+                suspend_session(state, "connection lost");
+                received = 0; // server.dll sees a stall and keeps polling
+            }
+            peer->rx_wire_len += received;
+            state->stats.wire_bytes_in += (uint64_t)received;
+            if (received > 0)
+            {
+                peer->last_rx = clock_ticks();
+            }
+        }
+
+        if (!parse_frames(state))
+        {
+            log_socket_buffer_info(state->transport);
+            WSASetLastError(WSAECONNABORTED);
+            return SOCKET_ERROR;
+        }
+    }
+
+    int available = peer->rx_plain_end - peer->rx_plain_start;
+    int n = available < len ? available : len;
+    memcpy(buf, peer->rx_plain + peer->rx_plain_start, n);
+
+    if (!(flags & MSG_PEEK))
+    {
+        peer->rx_plain_start += n;
+        if (peer->rx_plain_start == peer->rx_plain_end)
+        {
+            peer->rx_plain_start = peer->rx_plain_end = 0;
+        }
+        state->stats.app_bytes_in += (uint64_t)n;
+    }
+
+    WSASetLastError(NO_ERROR);
+    return n;
+}
+
+/**
+ * Encodes a message as XOR runs against the closest recent message when both
+ * sides support deltas and the runs are clearly smaller. Caller must hold
+ * send_lock.
+ *
+ * @return Payload length written to payload, or 0 if a delta is not worth it
+ */
+static int encode_delta_payload(socket_state *state, const uint8_t *data, int len, uint8_t *payload)
+{
+    peer_link *peer = &state->peer;
+    int        diff;
+
+    if (!(peer->peer_caps & PEER_CAP_DELTA) || !peer->tx_history.data || len < DELTA_MIN_MESSAGE ||
+        len > DELTA_MAX_MESSAGE)
+    {
+        return 0;
+    }
+
+    int slot = delta_history_find(&peer->tx_history, data, len, &diff);
+    if (slot < 0 || diff > len / 2)
+    {
+        return 0;
+    }
+
+    // Runs must beat the raw message by a quarter, or plain/LZ4 framing is used
+    int encoded = delta_encode(data, DELTA_HISTORY_SLOT(&peer->tx_history, slot), len, payload + 1, len * 3 / 4);
+    if (encoded < 0)
+    {
+        return 0;
+    }
+    payload[0] = (uint8_t)slot;
+    return encoded + 1;
+}
+
+/**
+ * Builds one data frame in tx_buf: a delta against a recent message, LZ4
+ * compressed, or raw, whichever negotiated option actually saves bytes.
+ * Every message is recorded in the send history afterwards, exactly as the
+ * receiver will record it. Caller must hold send_lock.
+ *
+ * @return Frame payload length and the frame type through *type
+ */
+static int encode_data_payload(socket_state *state, const char *data, int len, uint8_t *type)
+{
+    peer_link *peer = &state->peer;
+    uint8_t   *payload = peer->tx_buf + PEER_FRAME_HEADER_SIZE;
+
+    int delta_len = encode_delta_payload(state, (const uint8_t *)data, len, payload);
+    delta_history_push(&peer->tx_history, (const uint8_t *)data, len);
+    if (delta_len > 0)
+    {
+        state->stats.delta_frames_out++;
+        *type = PEER_FRAME_DATA_DELTA;
+        return delta_len;
+    }
+
+    if (g_config.compression && peer->peer_hello_received && (peer->peer_caps & PEER_CAP_LZ4) &&
+        len >= PEER_MIN_COMPRESS_SIZE)
+    {
+        uint64_t start = perf_now();
+        int      compressed =
+            lz4_compress((const uint8_t *)data, len, payload + 2, PEER_TX_BUF_SIZE - PEER_FRAME_HEADER_SIZE - 2);
+        state->stats.compress_ticks += perf_now() - start;
+
+        if (compressed > 0 && compressed + 2 < len)
+        {
+            put_u16(payload, (uint16_t)len);
+            state->stats.compressed_frames_out++;
+            *type = PEER_FRAME_DATA_LZ4;
+            return compressed + 2;
+        }
+    }
+
+    memcpy(payload, data, len);
+    *type = PEER_FRAME_DATA;
+    return len;
+}
+
+/**
+ * Sends game data as frames of at most PEER_DATA_CHUNK bytes each.
+ * Caller must hold send_lock.
+ */
+static int send_framed(socket_state *state, const char *buf, int len, int flags)
+{
+    int done = 0;
+
+    while (done < len)
+    {
+        int     chunk = len - done < PEER_DATA_CHUNK ? len - done : PEER_DATA_CHUNK;
+        uint8_t type;
+        int     payload_len = encode_data_payload(state, buf + done, chunk, &type);
+        int     frame_len = PEER_FRAME_HEADER_SIZE + payload_len;
+
+        replay_append(&state->peer.replay, (const uint8_t *)buf + done, chunk);
+        int sent = write_frame(state, type, state->peer.tx_buf + PEER_FRAME_HEADER_SIZE, payload_len, flags);
+        if (sent != frame_len && (state->peer.suspended ||
+                                  (is_connection_loss(WSAGetLastError()) && session_resumable(state))))
+        {
+            // The chunk is in the replay buffer; queue the rest there too and report success
+            suspend_session(state, "connection lost");
+            replay_append(&state->peer.replay, (const uint8_t *)buf + done + chunk, len - done - chunk);
+            state->stats.app_bytes_out += (uint64_t)(len - done);
+            return len;
+        }
+        if (sent != frame_len)
+        {
+            // Connection failed mid-stream; report the game bytes fully framed so far
+            if (sent == SOCKET_ERROR && done == 0)
+            {
+                return SOCKET_ERROR;
+            }
+            return done;
+        }
+
+        state->stats.app_bytes_out += (uint64_t)chunk;
+        done += chunk;
+    }
+
+    return len;
+}
+
+void peer_log_stats(const socket_state *state, const char *reason)
+{
+    const socket_stats *stats = &state->stats;
+    double              ratio =
+        stats->app_bytes_out ? 100.0 * (double)stats->wire_bytes_out / (double)stats->app_bytes_out : 100.0;
+
+    logf("[PEER] Socket %u %s stats: out %.1f KB -> %.1f KB on wire (%.1f%%, %lu/%lu frames compressed, %lu delta), "
+         "in %.1f KB on wire -> %.1f KB, compress %.2f ms, decompress %.2f ms, rtt %.2f ms (min %.2f, %lu samples), "
+         "%lu resumes",
+         (unsigned)state->s, reason, (double)stats->app_bytes_out / 1024.0, (double)stats->wire_bytes_out / 1024.0,
+         ratio, (unsigned long)stats->compressed_frames_out, (unsigned long)stats->frames_out,
+         (unsigned long)stats->delta_frames_out,
+         (double)stats->wire_bytes_in / 1024.0, (double)stats->app_bytes_in / 1024.0,
+         perf_ticks_to_ms(stats->compress_ticks), perf_ticks_to_ms(stats->decompress_ticks),
+         (double)stats->srtt_us / 1000.0, (double)stats->rtt_min_us / 1000.0, (unsigned long)stats->rtt_samples,
+         (unsigned long)stats->resumes);
+
+    rudp_conn *tunnel = state->peer.tunnel;
+    if (tunnel && (state->peer.tunnel_tx || state->peer.tunnel_rx))
+    {
+        logf("[PEER] Socket %u %s tunnel: %lu segments sent, %lu fast retransmits, %lu timeouts, %lu duplicates "
+             "received, srtt %.2f ms, cwnd %lu, segment size %u (%lu MTU probes%s)",
+             (unsigned)state->s, reason, (unsigned long)tunnel->stats.segments_sent,
+             (unsigned long)tunnel->stats.fast_retransmits, (unsigned long)tunnel->stats.timeouts,
+             (unsigned long)tunnel->stats.duplicates_in, (double)tunnel->srtt_us / 1000.0,
+             (unsigned long)tunnel->cwnd, (unsigned)tunnel->mss, (unsigned long)tunnel->stats.mtu_probes,
+             tunnel->mtu_searching ? ", searching" : "");
+        if (tunnel->impair && tunnel->impair->fragmented != 0)
+        {
+            logf("[PEER] Socket %u %s tunnel: %lu datagrams fragmented into %lu pieces by the simulated path",
+                 (unsigned)state->s, reason, (unsigned long)tunnel->impair->fragmented,
+                 (unsigned long)tunnel->impair->fragments);
+        }
+        if (tunnel->paced)
+        {
+            logf("[PEER] Socket %u %s tunnel pacing: bandwidth %.1f KB/s, min RTT %.2f ms, rate %.1f KB/s",
+                 (unsigned)state->s, reason, (double)tunnel->pacer.btl_bw / 1024.0,
+                 (double)tunnel->pacer.min_rtt_us / 1000.0, (double)pacer_rate(&tunnel->pacer) / 1024.0);
+        }
+    }
+    const timesync *sync = &state->peer.clock;
+    if (sync->valid)
+    {
+        logf("[PEER] Socket %u %s clock: peer offset %+.2f ms, round trip %.2f ms, drift %+.1f ppm, %lu exchanges "
+             "(%lu rejected)",
+             (unsigned)state->s, reason, (double)timesync_offset_at(sync, clock_now_us()) / 1000.0,
+             (double)sync->best.delay_us / 1000.0, sync->drift_ppm, (unsigned long)sync->exchanges,
+             (unsigned long)sync->rejected);
+    }
+    if (state->peer.shm_tx || state->peer.shm_rx)
+    {
+        logf("[PEER] Socket %u %s shared memory: outgoing %s, incoming %s, %lu writes waited for the reader",
+             (unsigned)state->s, reason, state->peer.shm_tx ? "ring" : "network",
+             state->peer.shm_rx ? "ring" : "network",
+             (unsigned long)(state->peer.shm_out ? state->peer.shm_out->full_waits : 0));
+    }
+}
+
+/**
+ * Logs a periodic statistics line when the configured interval elapsed.
+ */
+static void maybe_log_periodic_stats(socket_state *state)
+{
+    DWORD now = clock_ticks();
+    if (g_config.stats_interval_ms == 0 || now - state->stats.last_report < g_config.stats_interval_ms)
+    {
+        return;
+    }
+    state->stats.last_report = now;
+    if (state->peer.tx_framed || state->peer.rx_framed)
+    {
+        peer_log_stats(state, "periodic");
+    }
+}
+
+int peer_send(SOCKET s, const char *buf, int len, int flags)
+{
+    socket_state *state = get_socket_state(s, TRUE);
+    if (!state || (flags & MSG_OOB))
+    {
+        return send_all(s, buf, len, flags);
+    }
+
+    EnterCriticalSection(&state->send_lock);
+
+    // While suspended, game data only goes to the replay buffer. Block once
+    // half of it is queued so the bytes the peer still misses are not overwritten.
+    while (check_suspension(state) && buf && len > 0 &&
+           state->peer.replay.end_seq - state->peer.suspend_seq + (uint64_t)len >
+               (uint64_t)state->peer.replay.capacity / 2)
+    {
+        LeaveCriticalSection(&state->send_lock);
+        clock_wait_us(NULL, PEER_RECONNECT_INTERVAL_MS / 10 * 1000);
+        EnterCriticalSection(&state->send_lock);
+    }
+
+    poll_tunnel(state);
+    if (state->peer.dead)
+    {
+        LeaveCriticalSection(&state->send_lock);
+        WSASetLastError(WSAECONNRESET);
+        return SOCKET_ERROR;
+    }
+
+    if (state->peer.state == PEER_STATE_NEW && state->direction == SOCKET_DIRECTION_ACCEPTED &&
+        take_resume(s, state, FALSE) == RESUME_TAKEN)
+    {
+        LeaveCriticalSection(&state->send_lock);
+        WSASetLastError(WSAECONNRESET);
+        return SOCKET_ERROR;
+    }
+    begin_negotiation(state);
+    flush_control_frames(state);
+
+    int result;
+    if (state->peer.suspended && buf && len > 0)
+    {
+        replay_append(&state->peer.replay, (const uint8_t *)buf, len);
+        state->stats.app_bytes_out += (uint64_t)len;
+        result = len;
+    }
+    else if (state->peer.state == PEER_STATE_RAW && g_config.send_queue_kb != 0)
+    {
+        // Unpatched receiver: the bytes go out unchanged, so they can wait in the queue
+        result = send_queue_write(&state->queue, s, buf, len, flags);
+        if (result > 0)
+        {
+            state->stats.app_bytes_out += (uint64_t)result;
+            state->stats.wire_bytes_out += (uint64_t)result;
+        }
+    }
+    else if (!state->peer.tx_framed || !buf || len <= 0)
+    {
+        result = send_all(s, buf, len, flags);
+        if (result > 0)
+        {
+            state->stats.app_bytes_out += (uint64_t)result;
+            state->stats.wire_bytes_out += (uint64_t)result;
+        }
+    }
+    else
+    {
+        result = send_framed(state, buf, len, flags);
+    }
+
+    maybe_log_periodic_stats(state);
+    LeaveCriticalSection(&state->send_lock);
+    return result;
+}
+
+int peer_recv(SOCKET s, char *buf, int len, int flags)
+{
+    socket_state *state = get_socket_state(s, TRUE);
+    if (!state || (flags & MSG_OOB))
+    {
+        return recv_once(s, buf, len, flags);
+    }
+
+    EnterCriticalSection(&state->recv_lock);
+
+    check_suspension(state);
+    poll_tunnel(state);
+    if (state->peer.dead)
+    {
+        LeaveCriticalSection(&state->recv_lock);
+        WSASetLastError(WSAECONNRESET);
+        return SOCKET_ERROR;
+    }
+
+    if (state->peer.state == PEER_STATE_NEW)
+    {
+        // A reconnect that accept() could not tell yet is the first thing read; this waits no longer than recv would
+        resume_check resume =
+            state->direction == SOCKET_DIRECTION_ACCEPTED ? take_resume(s, state, TRUE) : RESUME_ABSENT;
+        if (resume == RESUME_TAKEN)
+        {
+            LeaveCriticalSection(&state->recv_lock);
+            WSASetLastError(WSAECONNRESET);
+            return SOCKET_ERROR;
+        }
+        if (resume == RESUME_NOT_YET)
+        {
+            LeaveCriticalSection(&state->recv_lock);
+            return 0; // What recv_once() reports for no data yet; negotiation waits for the first bytes
+        }
+
+        EnterCriticalSection(&state->send_lock);
+        begin_negotiation(state);
+        LeaveCriticalSection(&state->send_lock);
+    }
+    advance_negotiation(state);
+
+    int result;
+    if (!state->peer.rx_framed)
+    {
+        result = recv_once(s, buf, len, flags);
+        if (result > 0 && !(flags & MSG_PEEK))
+        {
+            state->stats.app_bytes_in += (uint64_t)result;
+            state->stats.wire_bytes_in += (uint64_t)result;
+        }
+    }
+    else
+    {
+        result = recv_framed(state, buf, len, flags);
+    }
+
+    // The peer pings at least every HeartbeatIntervalMs, so silence means it is gone
+    DWORD silent_ms = clock_ticks() - state->peer.last_rx;
+    if (result == 0 && liveness_tracked(&state->peer) && !state->peer.suspended &&
+        silent_ms > g_config.dead_peer_timeout_ms)
+    {
+        mark_peer_dead(state, silent_ms, "peer silent");
+        if (state->peer.dead)
+        {
+            WSASetLastError(WSAECONNRESET);
+            result = SOCKET_ERROR;
+        }
+    }
+
+    LeaveCriticalSection(&state->recv_lock);
+    return result;
+}
+
+BOOL peer_send_stalled(SOCKET s, DWORD stalled_ms)
+{
+    if (g_config.dead_peer_timeout_ms == 0 || stalled_ms < g_config.dead_peer_timeout_ms)
+    {
+        return FALSE;
+    }
+
+    // The retry loop sees the connection actually written to, which differs from server.dll's after a resume
+    socket_state *state = find_socket_state(match_transport, &s);
+    if (!state || !liveness_tracked(&state->peer) || state->peer.suspended)
+    {
+        return FALSE;
+    }
+
+    mark_peer_dead(state, stalled_ms, "send stalled");
+    return TRUE;
+}
+
+void peer_note_connection(SOCKET s, socket_direction direction, const struct sockaddr *addr, int addr_len)
+{
+    socket_state *state = get_socket_state(s, TRUE);
+    if (!state)
+    {
+        return;
+    }
+
+    state->direction = direction;
+    if (addr && addr_len > 0 && addr_len <= (int)sizeof(state->remote_addr))
+    {
+        memcpy(&state->remote_addr, addr, addr_len);
+        state->remote_addr_len = addr_len;
+    }
+}
+
+BOOL peer_accept_resume(SOCKET s)
+{
+    return take_resume(s, NULL, FALSE) == RESUME_TAKEN;
+}
+
+BOOL peer_close(SOCKET s)
+{
+    socket_state *state = get_socket_state(s, FALSE);
+    if (!state)
+    {
+        return FALSE;
+    }
+    if (InterlockedExchange(&state->peer.handed_over, 0))
+    {
+        release_socket_state(s);
+        return TRUE; // The resumed session closes the connection once it is done with it
+    }
+
+    if (state->peer.tunnel_tx)
+    {
+        // TCP would still deliver what the game sent last; give the tunnel the same chance
+        EnterCriticalSection(&state->send_lock);
+        DWORD start = clock_ticks();
+        while (state->peer.tunnel && !state->peer.dead && rudp_unacked(state->peer.tunnel) > 0 &&
+               !rudp_failed(state->peer.tunnel) && clock_ticks() - start < PEER_TUNNEL_LINGER_MS)
+        {
+            rudp_poll(state->peer.tunnel);
+            clock_wait_us(NULL, 1000);
+        }
+        LeaveCriticalSection(&state->send_lock);
+    }
+
+    if (state->peer.tx_framed || state->peer.rx_framed)
+    {
+        peer_log_stats(state, "close");
+    }
+
+    SOCKET transport = state->transport;
+    release_socket_state(s);
+    if (transport != s && transport != INVALID_SOCKET)
+    {
+        drop_transport(transport); // Connection opened by a session resume
+    }
+    return FALSE;
+}
@@ -0,0 +1,134 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include "socket_state.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <windows.h>
+#include <winsock2.h>
+
+/*
+ * Patched peers find each other with single TCP urgent (MSG_OOB) bytes.
+ * Unpatched peers never read urgent data, so these bytes are invisible to
+ * their server.dll. The urgent byte also marks the exact stream position
+ * where the sender switches from raw game bytes to frames.
+ */
+#define PEER_OOB_HELLO 0xE7  // Initiator: "I am patched"
+#define PEER_OOB_SWITCH 0xE8 // Either side: "my stream is framed after this mark"
+
+#define PEER_PROTOCOL_VERSION 1
+
+// Frame layout: [type u8][payload length u16 LE][payload]
+#define PEER_FRAME_HEADER_SIZE 3
+#define PEER_MAX_FRAME_PAYLOAD 65535
+#define PEER_DATA_CHUNK 16384 // Game writes are split into frames of at most this many bytes
+
+// Frame types
+#define PEER_FRAME_DATA 0x01    // Raw game bytes
+#define PEER_FRAME_DATA_LZ4 0x02 // [original length u16][LZ4 block]
+#define PEER_FRAME_DATA_DELTA 0x03 // [history slot u8][XOR runs], see delta.h
+#define PEER_FRAME_HELLO 0x10   // [version u8][capabilities u32][session id u64, with PEER_CAP_RESUME]
+#define PEER_FRAME_PING 0x11    // [sender timestamp us u32]
+#define PEER_FRAME_PONG 0x12    // [echoed PING timestamp u32]
+#define PEER_FRAME_RESUME 0x13  // [session id u64][game bytes received u64], first frame on a new connection
+#define PEER_FRAME_TUNNEL_OFFER 0x14  // [UDP port u16][tunnel token u32]
+#define PEER_FRAME_TUNNEL_SWITCH 0x15 // Last frame on TCP: the sender's frames continue on the UDP tunnel
+#define PEER_FRAME_SHM_OFFER 0x16     // [host id u64][ring name], sent only when both endpoints share an address
+#define PEER_FRAME_SHM_ACCEPT 0x17    // [mapped u8]: 1 if the offered ring was opened on this host
+#define PEER_FRAME_SHM_SWITCH 0x18    // Last frame on the old transport: the sender's frames continue in the ring
+#define PEER_FRAME_TIME_REQUEST 0x1A  // [origin us u64], sender's clock_now_us()
+#define PEER_FRAME_TIME_REPLY 0x1B    // [origin us u64][receive us u64][transmit us u64], see timesync.h
+
+// Capabilities announced in PEER_FRAME_HELLO
+#define PEER_CAP_LZ4 0x00000001u
+#define PEER_CAP_DELTA 0x00000002u
+#define PEER_CAP_HEARTBEAT 0x00000004u // Sends PING at least every HeartbeatIntervalMs
+#define PEER_CAP_RESUME 0x00000008u    // Keeps a replay buffer and resumes after reconnects
+#define PEER_CAP_TUNNEL 0x00000010u    // Can carry its frames over a reliable UDP tunnel
+#define PEER_CAP_SHM 0x00000020u       // Can carry its frames through a shared-memory ring on the same host
+#define PEER_CAP_CLOCK 0x00000080u     // Answers TIME_REQUEST frames
+
+#define PEER_MIN_COMPRESS_SIZE 64 // Shorter writes are never worth compressing
+
+#define PEER_RESUME_FRAME_SIZE (PEER_FRAME_HEADER_SIZE + 16)
+#define PEER_RECONNECT_INTERVAL_MS 500 // Pause between reconnect attempts
+#define PEER_RECONNECT_TIMEOUT_MS 2000 // Limit for one connect attempt or RESUME answer
+
+#define PEER_TUNNEL_LINGER_MS 1000 // How long closesocket waits for the tunnel to deliver queued frames
+#define PEER_SHM_CHECK_MS 10       // How often an idle ring reader checks the TCP connection for a reset
+
+/**
+ * Sends game data through the peer layer. Behaves like the plain send hook
+ * (blocking retry until everything is written) and returns len on success.
+ *
+ * @param s Socket handle
+ * @param buf Game data
+ * @param len Number of bytes
+ * @param flags Send flags (MSG_*)
+ * @return Game bytes consumed, or SOCKET_ERROR on failure
+ */
+int peer_send(SOCKET s, const char *buf, int len, int flags);
+
+/**
+ * Receives game data through the peer layer. Frames are decoded and only
+ * game bytes reach the caller; WSAEWOULDBLOCK becomes a 0-byte read.
+ *
+ * @param s Socket handle
+ * @param buf Output buffer
+ * @param len Buffer size
+ * @param flags Recv flags (MSG_PEEK honored for decoded data)
+ * @return Number of bytes received, 0 if none, SOCKET_ERROR on error
+ */
+int peer_recv(SOCKET s, char *buf, int len, int flags);
+
+/**
+ * Remembers how server.dll connected a socket so a lost session can be
+ * re-established later.
+ *
+ * @param s Socket handle
+ * @param direction SOCKET_DIRECTION_OUTGOING or SOCKET_DIRECTION_ACCEPTED
+ * @param addr Remote address for outgoing sockets (NULL for accepted ones)
+ * @param addr_len Size of addr in bytes
+ */
+void peer_note_connection(SOCKET s, socket_direction direction, const struct sockaddr *addr, int addr_len);
+
+/**
+ * Checks whether a freshly accepted connection is a patched peer resuming
+ * a lost session. If it is, the connection is attached to that session and
+ * must not be handed to server.dll. Only a RESUME frame that already
+ * arrived is seen, accept never waits for one; a later one is taken from
+ * the connection's first recv instead, which then reports WSAECONNRESET.
+ *
+ * @param s Newly accepted socket
+ * @return TRUE if the connection was consumed by a session resume
+ */
+BOOL peer_accept_resume(SOCKET s);
+
+/**
+ * Called by the send retry loop while the socket buffer stays full. On a
+ * connection whose peer promised heartbeats, a stall longer than
+ * DeadPeerTimeoutMs marks the peer dead so the send can be aborted.
+ *
+ * @param s Socket handle
+ * @param stalled_ms Time since the send last made progress
+ * @return TRUE if the send should fail with WSAECONNRESET
+ */
+BOOL peer_send_stalled(SOCKET s, DWORD stalled_ms);
+
+/**
+ * Logs final statistics for a socket and forgets its peer state.
+ *
+ * @param s Socket handle being closed
+ * @return TRUE if a late RESUME gave the connection to a session, which must stay open
+ */
+BOOL peer_close(SOCKET s);
+
+/**
+ * Logs the traffic counters for one socket.
+ *
+ * @param state Socket state
+ * @param reason Short tag for the log line ("periodic", "close")
+ */
+void peer_log_stats(const socket_state *state, const char *reason);
+
+#endif // PEER_H
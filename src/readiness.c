@@ -0,0 +1,446 @@
+/*
+ * readiness.c: Cached socket readiness for server.dll's select() and
+ * WSAPoll() calls.
+ *
+ * A game that polls its sockets with a zero timeout asks Winsock hundreds
+ * of thousands of times a minute whether data arrived, and almost always
+ * hears no. With SelectCache, a watcher thread registers each polled
+ * socket with WSAEventSelect and waits for its network events instead.
+ * Polls of sockets that had no event since the last poll are answered
+ * without a Winsock call, and polls with a timeout sleep until the watcher
+ * signals an event rather than until the scheduler's next tick, using
+ * clock_wait_us() for timeouts finer than a millisecond.
+ *
+ * The flags only ever err towards "maybe readable": a socket is marked
+ * when the watcher sees FD_READ, FD_ACCEPT or FD_CLOSE, and unmarked only
+ * right before the caller asks Winsock, which then has the final word.
+ * Winsock posts FD_READ again after each recv() that leaves data behind,
+ * so data that arrives while the game is reading is not missed.
+ *
+ * WSAEventSelect also makes a socket non-blocking, and Winsock has no way
+ * to ask a socket which mode it is in. Only sockets server.dll itself made
+ * non-blocking are watched, so a blocking recv(), send() or accept() never
+ * sees WSAEWOULDBLOCK because of the watcher; polls of other sockets go to
+ * Winsock. A forgotten socket's event selection is cancelled at once.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "readiness.h"
+#include "clock.h"
+#include "logging.h"
+#include "socket_state.h"
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+
+typedef struct
+{
+    SOCKET        socket;  // INVALID_SOCKET = free slot
+    WSAEVENT      event;
+    volatile LONG ready;   // An event arrived since the last poll
+    BOOL          closing; // Forgotten; the watcher closes the event once it no longer waits on it
+} readiness_slot;
+
+static CRITICAL_SECTION s_lock;                       // Guards the slots and the counters
+static volatile LONG    s_lock_init = 0;              // 0 = not initialized, 1 = initializing, 2 = ready
+static volatile LONG    s_started = 0;                // 0 = no watcher, 1 = starting, 2 = running, 3 = failed
+static volatile LONG    s_stop = 0;
+static HANDLE           s_wake = NULL;                // Tells the watcher that the slots changed
+static volatile LONG    s_waiting[READINESS_WAITERS]; // 1 = held by a thread in readiness_wait()
+static HANDLE           s_changed[READINESS_WAITERS]; // Auto-reset; set by the watcher for each held slot on news
+static readiness_slot   s_slots[READINESS_SOCKETS];
+static readiness_stats  s_stats;
+
+/**
+ * Initializes the module lock exactly once (hooks may fire from any thread).
+ */
+static void ensure_lock_initialized(void)
+{
+    if (s_lock_init == 2)
+    {
+        return;
+    }
+    if (InterlockedCompareExchange(&s_lock_init, 1, 0) == 0)
+    {
+        InitializeCriticalSection(&s_lock);
+        for (int i = 0; i < READINESS_SOCKETS; i++)
+        {
+            s_slots[i].socket = INVALID_SOCKET;
+        }
+        InterlockedExchange(&s_lock_init, 2);
+        return;
+    }
+    while (s_lock_init != 2)
+    {
+        Sleep(0);
+    }
+}
+
+/**
+ * Waits for network events on every watched socket and marks the sockets
+ * they belong to. Rebuilds its handle list whenever s_wake is set.
+ */
+static DWORD WINAPI watcher_thread(LPVOID param)
+{
+    (void)param;
+    HANDLE events[READINESS_SOCKETS + 1];
+    int    slots[READINESS_SOCKETS + 1];
+
+    while (!s_stop)
+    {
+        DWORD count = 0;
+        events[count++] = s_wake;
+
+        EnterCriticalSection(&s_lock);
+        for (int i = 0; i < READINESS_SOCKETS; i++)
+        {
+            readiness_slot *slot = &s_slots[i];
+            if (slot->closing)
+            {
+                WSACloseEvent(slot->event);
+                memset(slot, 0, sizeof(*slot));
+                slot->socket = INVALID_SOCKET;
+            }
+            else if (slot->socket != INVALID_SOCKET)
+            {
+                slots[count] = i;
+                events[count++] = slot->event;
+            }
+        }
+        LeaveCriticalSection(&s_lock);
+
+        DWORD result = WaitForMultipleObjects(count, events, FALSE, INFINITE);
+        if (result == WAIT_FAILED)
+        {
+            logf_rate_limited("readiness_wait_failed", "[SELECT] Watcher wait failed: %lu", GetLastError());
+            Sleep(1);
+            continue;
+        }
+
+        // Several sockets may have fired at once; look at all of them
+        BOOL readable = FALSE;
+        EnterCriticalSection(&s_lock);
+        for (DWORD i = 1; i < count; i++)
+        {
+            readiness_slot  *slot = &s_slots[slots[i]];
+            WSANETWORKEVENTS network_events;
+            if (slot->closing || slot->event != events[i] ||
+                WSAEnumNetworkEvents(slot->socket, slot->event, &network_events) != 0)
+            {
+                continue;
+            }
+            if (network_events.lNetworkEvents & READINESS_EVENTS)
+            {
+                InterlockedExchange(&slot->ready, 1);
+                readable = TRUE;
+            }
+        }
+        for (int i = 0; readable && i < READINESS_WAITERS; i++)
+        {
+            if (s_waiting[i])
+            {
+                SetEvent(s_changed[i]);
+            }
+        }
+        LeaveCriticalSection(&s_lock);
+    }
+    return 0;
+}
+
+/**
+ * Starts the watcher thread once.
+ *
+ * @return FALSE if it could not be started
+ */
+static BOOL ensure_started(void)
+{
+    if (s_started == 2)
+    {
+        return TRUE;
+    }
+    ensure_lock_initialized();
+    if (InterlockedCompareExchange(&s_started, 1, 0) == 0)
+    {
+        s_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+        BOOL events = s_wake != NULL;
+        for (int i = 0; i < READINESS_WAITERS; i++)
+        {
+            s_changed[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+            events &= s_changed[i] != NULL;
+        }
+        HANDLE thread = events ? CreateThread(NULL, 0, watcher_thread, NULL, 0, NULL) : NULL;
+        if (!thread)
+        {
+            logf("[SELECT] Could not start the readiness watcher: %lu", GetLastError());
+            InterlockedExchange(&s_started, 3);
+            return FALSE;
+        }
+        CloseHandle(thread);
+        logf("[SELECT] Readiness watcher started");
+        InterlockedExchange(&s_started, 2);
+        return TRUE;
+    }
+    while (s_started == 1)
+    {
+        Sleep(0);
+    }
+    return s_started == 2;
+}
+
+/**
+ * Finds a socket's slot. Caller holds s_lock.
+ */
+static readiness_slot *find_slot(SOCKET s)
+{
+    for (int i = 0; i < READINESS_SOCKETS; i++)
+    {
+        if (s_slots[i].socket == s && !s_slots[i].closing)
+        {
+            return &s_slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Registers a socket with WSAEventSelect. Caller holds s_lock.
+ *
+ * @return Slot, or NULL if the socket may be blocking, the table is full or Winsock refused
+ */
+static readiness_slot *watch_socket(SOCKET s)
+{
+    socket_state *state = get_socket_state(s, FALSE);
+    if (!state || !state->nonblocking)
+    {
+        // The event selection would make server.dll's blocking calls on it fail with WSAEWOULDBLOCK
+        logf_rate_limited("readiness_blocking", "[SELECT] Not watching socket %u: not known to be non-blocking",
+                          (unsigned)s);
+        return NULL;
+    }
+
+    readiness_slot *slot = NULL;
+    for (int i = 0; i < READINESS_SOCKETS && !slot; i++)
+    {
+        if (s_slots[i].socket == INVALID_SOCKET)
+        {
+            slot = &s_slots[i];
+        }
+    }
+    if (!slot)
+    {
+        logf_rate_limited("readiness_full", "[SELECT] Cannot watch socket %u: %d sockets already watched", (unsigned)s,
+                          READINESS_SOCKETS);
+        return NULL;
+    }
+
+    WSAEVENT event = WSACreateEvent();
+    if (event == WSA_INVALID_EVENT)
+    {
+        return NULL;
+    }
+    if (WSAEventSelect(s, event, READINESS_EVENTS) != 0)
+    {
+        logf("[SELECT] WSAEventSelect failed on socket %u: %d", (unsigned)s, WSAGetLastError());
+        WSACloseEvent(event);
+        return NULL;
+    }
+
+    slot->socket = s;
+    slot->event = event;
+    slot->ready = 1; // Data may have arrived before the registration
+    slot->closing = FALSE;
+    s_stats.watched++;
+    SetEvent(s_wake);
+    logf("[SELECT] Watching socket %u", (unsigned)s);
+    return slot;
+}
+
+/**
+ * Checks the sockets' flags and clears them if any is set. Caller holds
+ * s_lock.
+ *
+ * @return READINESS_MAYBE if one was set, READINESS_QUIET otherwise, or
+ *         READINESS_UNWATCHED if a socket could not be registered
+ */
+static readiness_state take_ready(const SOCKET *sockets, int count)
+{
+    readiness_slot *found[READINESS_SOCKETS];
+    BOOL            ready = FALSE;
+
+    if (count > READINESS_SOCKETS)
+    {
+        return READINESS_UNWATCHED;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        found[i] = find_slot(sockets[i]);
+        if (!found[i])
+        {
+            found[i] = watch_socket(sockets[i]);
+            if (!found[i])
+            {
+                return READINESS_UNWATCHED;
+            }
+        }
+        ready |= found[i]->ready != 0;
+    }
+    if (ready)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            InterlockedExchange(&found[i]->ready, 0);
+        }
+        return READINESS_MAYBE;
+    }
+    return READINESS_QUIET;
+}
+
+/**
+ * Claims a waiter slot, whose event the watcher sets when a socket becomes
+ * readable. A slot per thread keeps one waiter from resetting an event
+ * another is about to wait on.
+ *
+ * @return Slot index, or -1 if all READINESS_WAITERS are held
+ */
+static int claim_waiter(void)
+{
+    for (int i = 0; i < READINESS_WAITERS; i++)
+    {
+        if (InterlockedCompareExchange(&s_waiting[i], 1, 0) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+readiness_state readiness_wait(const SOCKET *sockets, int count, DWORD timeout_us)
+{
+    if (!ensure_started())
+    {
+        return READINESS_UNWATCHED;
+    }
+
+    BOOL  waited = FALSE;
+    DWORD remaining = timeout_us;
+    int   slot = timeout_us > 0 ? claim_waiter() : -1;
+    for (;;)
+    {
+        EnterCriticalSection(&s_lock);
+        readiness_state state = take_ready(sockets, count);
+        if (state == READINESS_MAYBE)
+        {
+            s_stats.polls++;
+            s_stats.wakeups += waited;
+        }
+        else if (state == READINESS_UNWATCHED)
+        {
+            s_stats.unwatched++;
+        }
+        else if (timeout_us == 0)
+        {
+            s_stats.cached++;
+        }
+        else if (!waited)
+        {
+            s_stats.waits++;
+        }
+        if (state == READINESS_QUIET && slot >= 0)
+        {
+            ResetEvent(s_changed[slot]); // Under the lock, so the watcher cannot set a flag in between
+        }
+        LeaveCriticalSection(&s_lock);
+
+        if (state != READINESS_QUIET || remaining == 0)
+        {
+            if (slot >= 0)
+            {
+                InterlockedExchange(&s_waiting[slot], 0);
+            }
+            return state;
+        }
+
+        // The event also fires for other sockets' events, and threads without a slot poll; keep waiting out the rest
+        int64_t start = clock_now_us();
+        DWORD   wait_us = slot >= 0 || remaining < READINESS_POLL_US ? remaining : READINESS_POLL_US;
+        if (!clock_wait_us(slot >= 0 ? s_changed[slot] : NULL, wait_us) && wait_us == remaining)
+        {
+            remaining = 0;
+        }
+        else
+        {
+            int64_t elapsed = clock_now_us() - start;
+            remaining = elapsed >= (int64_t)remaining ? 0 : remaining - (DWORD)elapsed;
+        }
+        waited = TRUE;
+    }
+}
+
+void readiness_mark(SOCKET s)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    readiness_slot *slot = find_slot(s);
+    if (slot)
+    {
+        InterlockedExchange(&slot->ready, 1);
+    }
+    LeaveCriticalSection(&s_lock);
+}
+
+void readiness_forget(SOCKET s)
+{
+    if (s_started != 2)
+    {
+        return;
+    }
+    EnterCriticalSection(&s_lock);
+    readiness_slot *slot = find_slot(s);
+    if (slot)
+    {
+        WSAEventSelect(s, NULL, 0);
+        slot->closing = TRUE;
+        SetEvent(s_wake);
+    }
+    LeaveCriticalSection(&s_lock);
+}
+
+void readiness_accepted(SOCKET listener, SOCKET s)
+{
+    if (s_started != 2)
+    {
+        return;
+    }
+    EnterCriticalSection(&s_lock);
+    if (find_slot(listener))
+    {
+        WSAEventSelect(s, NULL, 0); // Winsock copies the listener's selection, which would signal its event
+    }
+    LeaveCriticalSection(&s_lock);
+}
+
+readiness_stats readiness_get_stats(void)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    readiness_stats stats = s_stats;
+    LeaveCriticalSection(&s_lock);
+    return stats;
+}
+
+void readiness_stop(void)
+{
+    if (s_started != 2)
+    {
+        return;
+    }
+    readiness_stats stats = readiness_get_stats();
+    logf("[SELECT] Polls answered from cache: %lu, waits: %lu (%lu ended by an event), passed to Winsock: %lu, "
+         "unwatched: %lu, sockets watched: %lu",
+         (unsigned long)stats.cached, (unsigned long)stats.waits, (unsigned long)stats.wakeups,
+         (unsigned long)stats.polls, (unsigned long)stats.unwatched, (unsigned long)stats.watched);
+
+    // The thread may be waiting on the loader lock during DLL detach, so it is not joined
+    InterlockedExchange(&s_stop, 1);
+    SetEvent(s_wake);
+}
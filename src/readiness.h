@@ -0,0 +1,88 @@
+#ifndef READINESS_H
+#define READINESS_H
+
+#include <stdint.h>
+#include <windows.h>
+#include <winsock2.h>
+
+#define READINESS_SOCKETS 63                              // WSA_MAXIMUM_WAIT_EVENTS minus the watcher's wake event
+#define READINESS_EVENTS (FD_READ | FD_ACCEPT | FD_CLOSE) // Network events that make a socket readable for select()
+#define READINESS_MAX_TIMEOUT_S 3600                      // Longer poll timeouts go to Winsock (so microseconds fit)
+#define READINESS_WAITERS 16                              // Threads that can wait for the watcher at once...
+#define READINESS_POLL_US 1000                            // ...while more check their sockets this often
+
+/**
+ * What the watcher knows about a set of sockets.
+ */
+typedef enum
+{
+    READINESS_QUIET,     // None became readable; a poll would report nothing
+    READINESS_MAYBE,     // One may be readable; ask Winsock
+    READINESS_UNWATCHED, // A socket could not be watched; ask Winsock with the caller's own timeout
+} readiness_state;
+
+/**
+ * Counters for the log and tests.
+ */
+typedef struct
+{
+    uint32_t cached;    // Zero-timeout polls answered without a Winsock call
+    uint32_t waits;     // Polls with a timeout that waited for the watcher
+    uint32_t wakeups;   // Of those, waits ended by a network event
+    uint32_t polls;     // Polls passed on to Winsock
+    uint32_t unwatched; // Polls passed on because a socket could not be watched
+    uint32_t watched;   // Sockets registered with WSAEventSelect
+} readiness_stats;
+
+/**
+ * Checks whether any of the sockets may have become readable since the
+ * last poll and, if not, waits up to timeout_us for the watcher thread to
+ * see a network event on one of them. Unknown sockets are registered with
+ * WSAEventSelect and count as readable until the first poll; as that makes
+ * them non-blocking, only sockets server.dll set non-blocking itself
+ * (socket_state.nonblocking) are taken. READINESS_MAYBE clears the
+ * sockets' flags, so the caller must poll Winsock and readiness_mark()
+ * whatever it reports readable. Starts the watcher thread on first use.
+ *
+ * @param sockets Sockets the caller polls for reading
+ * @param count Number of sockets
+ * @param timeout_us How long to wait while all are quiet (0 = answer from the cache)
+ * @return Whether the caller has to poll Winsock
+ */
+readiness_state readiness_wait(const SOCKET *sockets, int count, DWORD timeout_us);
+
+/**
+ * Keeps a socket marked readable after a poll reported it, so the next
+ * poll asks Winsock again instead of waiting for a new event.
+ */
+void readiness_mark(SOCKET s);
+
+/**
+ * Stops watching a socket that is about to be closed or switched back to
+ * blocking mode, and cancels its event selection, which Winsock requires
+ * before FIONBIO can clear the non-blocking mode. Cheap when the watcher
+ * was never started.
+ */
+void readiness_forget(SOCKET s);
+
+/**
+ * Cancels the event selection an accepted socket copies from a watched
+ * listener, which would signal the listener's event and make Winsock
+ * refuse to switch the socket to blocking mode.
+ *
+ * @param listener Listening socket
+ * @param s Socket accept() returned
+ */
+void readiness_accepted(SOCKET listener, SOCKET s);
+
+/**
+ * Returns a copy of the counters.
+ */
+readiness_stats readiness_get_stats(void);
+
+/**
+ * Logs the counters and asks the watcher thread to exit.
+ */
+void readiness_stop(void);
+
+#endif // READINESS_H
@@ -0,0 +1,53 @@
+/*
+ * replay.c: Bounded ring of recently sent game bytes for session resumption.
+ *
+ * Byte i of the stream lives at data[i % capacity], so the ring needs no
+ * separate head pointer: end_seq alone says which bytes are still held.
+ */
+
+#include "replay.h"
+#include <string.h>
+
+void replay_append(replay_buffer *replay, const uint8_t *buf, int len)
+{
+    if (!replay->data || replay->capacity <= 0 || len <= 0)
+    {
+        return;
+    }
+
+    // Only the last capacity bytes can survive anyway
+    if (len > replay->capacity)
+    {
+        replay->end_seq += (uint64_t)(len - replay->capacity);
+        buf += len - replay->capacity;
+        len = replay->capacity;
+    }
+
+    int pos = (int)(replay->end_seq % (uint64_t)replay->capacity);
+    int first = replay->capacity - pos < len ? replay->capacity - pos : len;
+    memcpy(replay->data + pos, buf, first);
+    memcpy(replay->data, buf + first, len - first);
+    replay->end_seq += (uint64_t)len;
+}
+
+uint64_t replay_oldest_seq(const replay_buffer *replay)
+{
+    return replay->end_seq > (uint64_t)replay->capacity ? replay->end_seq - (uint64_t)replay->capacity : 0;
+}
+
+int replay_copy(const replay_buffer *replay, uint64_t from_seq, uint8_t *out, int max_len)
+{
+    if (!replay->data || from_seq < replay_oldest_seq(replay) || from_seq > replay->end_seq)
+    {
+        return -1;
+    }
+
+    uint64_t held = replay->end_seq - from_seq;
+    int      len = held < (uint64_t)max_len ? (int)held : max_len;
+    int      pos = (int)(from_seq % (uint64_t)replay->capacity);
+    int      first = replay->capacity - pos < len ? replay->capacity - pos : len;
+
+    memcpy(out, replay->data + pos, first);
+    memcpy(out + first, replay->data, len - first);
+    return len;
+}
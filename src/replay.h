@@ -0,0 +1,43 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+
+/**
+ * Ring of the most recently sent game bytes, addressed by stream sequence
+ * number (total game bytes sent so far). After a reconnect the bytes the
+ * peer has not received yet are replayed from here.
+ */
+typedef struct
+{
+    uint8_t *data;
+    int      capacity; // Size of data in bytes
+    uint64_t end_seq;  // Sequence number one past the newest byte
+} replay_buffer;
+
+/**
+ * Appends bytes, overwriting the oldest ones once the ring is full.
+ *
+ * @param replay Ring with allocated data
+ * @param buf Bytes to append
+ * @param len Number of bytes
+ */
+void replay_append(replay_buffer *replay, const uint8_t *buf, int len);
+
+/**
+ * Returns the sequence number of the oldest byte still held.
+ */
+uint64_t replay_oldest_seq(const replay_buffer *replay);
+
+/**
+ * Copies held bytes starting at a sequence number.
+ *
+ * @param replay Ring with allocated data
+ * @param from_seq Sequence number of the first byte to copy
+ * @param out Output buffer
+ * @param max_len Size of out in bytes
+ * @return Bytes copied (0 when from_seq is the end), or -1 if from_seq is no longer held or in the future
+ */
+int replay_copy(const replay_buffer *replay, uint64_t from_seq, uint8_t *out, int max_len);
+
+#endif // REPLAY_H
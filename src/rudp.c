@@ -0,0 +1,955 @@
+/*
+ * rudp.c: Reliable ordered byte stream over UDP for the peer tunnel.
+ *
+ * TCP stalls every byte behind a lost segment and waits a full
+ * retransmission timeout far too often on lossy VPN links. This stream
+ * numbers fixed-size segments and lets the receiver report out-of-order
+ * arrivals as selective ACK ranges. A segment is resent as soon as one sent
+ * after it is acknowledged and it is older than one smoothed RTT plus a
+ * quarter (fast retransmit, in the spirit of RACK); the retransmission
+ * timeout only covers the tail. New segments are limited by an AIMD
+ * congestion window and the receiver's window, and paced at about
+ * 1.25 x cwnd / srtt instead of leaving in bursts. A paced stream replaces
+ * the window with a bandwidth and minimum RTT model (pacer.c), which keeps
+ * the queue at the bottleneck short instead of filling it until loss.
+ *
+ * Before any data flows both ends exchange PROBE datagrams, so a firewall
+ * or NAT that blocks UDP is noticed before the stream is relied upon.
+ *
+ * VPN encapsulation shrinks the path MTU, and a datagram above it is split
+ * into IP fragments; losing any one loses the whole segment, so a lossy
+ * link loses fragmented segments several times as often. Once the path is
+ * confirmed, each end searches the largest segment that gets through
+ * unfragmented (in the spirit of DPLPMTUD, RFC 8899): it sends padded
+ * MTU_PROBE datagrams with fragmentation forbidden, bisecting between the
+ * largest size the peer acknowledged and the smallest one that went
+ * unanswered, and new segments use the largest acknowledged size.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "rudp.h"
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#define RUDP_ACK_SIZE (RUDP_HEADER_SIZE + 11 + RUDP_MAX_SACK_BLOCKS * 8)
+#define RUDP_MAX_DATAGRAMS_PER_POLL 256 // Bounds the time one poll spends receiving
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v & 0xFF);
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    put_u16(p, (uint16_t)(v & 0xFFFF));
+    put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return (uint32_t)get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+/**
+ * Returns a wrapping microsecond timestamp; only differences are used.
+ */
+static uint32_t now_us(void)
+{
+    static LARGE_INTEGER frequency = {0};
+    LARGE_INTEGER        now;
+
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&now);
+    uint64_t ticks = (uint64_t)now.QuadPart;
+    uint64_t hz = (uint64_t)frequency.QuadPart;
+    return (uint32_t)(ticks / hz * 1000000ull + ticks % hz * 1000000ull / hz);
+}
+
+/**
+ * Returns TRUE if sequence number (or timestamp) a comes before b, across wraparound.
+ */
+static BOOL seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+static BOOL same_address(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+    if (a->ss_family != b->ss_family)
+    {
+        return FALSE;
+    }
+    if (a->ss_family == AF_INET)
+    {
+        const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+        const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+        return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    }
+    if (a->ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+        const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+        return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+    }
+    return FALSE;
+}
+
+static void send_datagram(rudp_conn *conn, const uint8_t *buf, int len, uint32_t now)
+{
+    if (conn->impair)
+    {
+        impair_sendto(conn->impair, conn->udp, buf, len, FALSE, now);
+        return;
+    }
+    sendto(conn->udp, (const char *)buf, len, 0, (const struct sockaddr *)&conn->peer_addr, conn->peer_addr_len);
+}
+
+static void write_header(uint8_t *p, uint8_t type, uint32_t token)
+{
+    p[0] = type;
+    put_u32(p + 1, token);
+}
+
+static void send_probe(rudp_conn *conn, uint32_t now)
+{
+    uint8_t probe[RUDP_HEADER_SIZE + 1];
+
+    write_header(probe, RUDP_PKT_PROBE, conn->peer_token);
+    probe[RUDP_HEADER_SIZE] = (uint8_t)((conn->peer_heard ? RUDP_PROBE_HEARD : 0) |
+                                        (conn->path_confirmed ? RUDP_PROBE_CONFIRMED : 0));
+    send_datagram(conn, probe, sizeof(probe), now);
+    conn->last_probe_us = now;
+}
+
+/**
+ * Forbids or allows IP fragmentation of the datagrams sent next.
+ */
+static void set_dont_fragment(rudp_conn *conn, BOOL on)
+{
+    DWORD value = on ? 1 : 0;
+
+    if (conn->peer_addr.ss_family == AF_INET6)
+    {
+#ifdef IPV6_DONTFRAG
+        setsockopt(conn->udp, IPPROTO_IPV6, IPV6_DONTFRAG, (const char *)&value, sizeof(value));
+#endif
+        return;
+    }
+#ifdef IP_DONTFRAGMENT
+    setsockopt(conn->udp, IPPROTO_IP, IP_DONTFRAGMENT, (const char *)&value, sizeof(value));
+#endif
+    (void)value;
+}
+
+/**
+ * Returns the segment payload that fills an IP packet of mtu bytes.
+ */
+static uint16_t payload_for_mtu(const rudp_conn *conn, DWORD mtu)
+{
+    int payload = (int)(mtu < RUDP_LINK_MTU ? mtu : RUDP_LINK_MTU) - conn->ip_overhead - RUDP_DATA_HEADER_SIZE;
+    return (uint16_t)(payload < RUDP_MIN_PAYLOAD ? RUDP_MIN_PAYLOAD : payload);
+}
+
+/**
+ * Moves the search to the middle of the remaining range, or ends it.
+ */
+static void next_mtu_probe(rudp_conn *conn)
+{
+    conn->mtu_probe_tries = 0;
+    if (conn->mtu_high - conn->mtu_low < RUDP_MTU_SEARCH_STEP)
+    {
+        conn->mtu_searching = FALSE;
+        return;
+    }
+    conn->mtu_probe_size = (uint16_t)((conn->mtu_low + conn->mtu_high + 1) / 2);
+}
+
+/**
+ * Records that the probed size does not get through unfragmented.
+ */
+static void mtu_probe_failed(rudp_conn *conn)
+{
+    conn->mtu_high = (uint16_t)(conn->mtu_probe_size - 1);
+    if (conn->mss > conn->mtu_high)
+    {
+        conn->mss = conn->mtu_low;
+    }
+    next_mtu_probe(conn);
+}
+
+/**
+ * Sends a probe as long as a DATA datagram carrying the probed size, with
+ * fragmentation forbidden, so it only arrives if such a segment fits the
+ * path MTU. Repeats an unanswered probe after one retransmission timeout.
+ */
+static void probe_path_mtu(rudp_conn *conn, uint32_t now)
+{
+    uint8_t datagram[RUDP_MAX_DATAGRAM];
+    int     len = RUDP_DATA_HEADER_SIZE + conn->mtu_probe_size;
+
+    if (conn->mtu_probe_tries > 0 && now - conn->mtu_probe_us < conn->rto_us)
+    {
+        return;
+    }
+    if (conn->mtu_probe_tries >= RUDP_MTU_PROBE_TRIES)
+    {
+        mtu_probe_failed(conn);
+        return; // The next poll probes the new size
+    }
+
+    write_header(datagram, RUDP_PKT_MTU_PROBE, conn->peer_token);
+    put_u16(datagram + RUDP_HEADER_SIZE, conn->mtu_probe_size);
+    memset(datagram + RUDP_HEADER_SIZE + 2, 0, len - RUDP_HEADER_SIZE - 2);
+    conn->mtu_probe_tries++;
+    conn->mtu_probe_us = now;
+    conn->stats.mtu_probes++;
+    if (conn->impair)
+    {
+        impair_sendto(conn->impair, conn->udp, datagram, len, TRUE, now);
+        return;
+    }
+
+    set_dont_fragment(conn, TRUE);
+    int sent = sendto(conn->udp, (const char *)datagram, len, 0, (const struct sockaddr *)&conn->peer_addr,
+                      conn->peer_addr_len);
+    BOOL too_big = sent == SOCKET_ERROR && WSAGetLastError() == WSAEMSGSIZE;
+    set_dont_fragment(conn, FALSE);
+    if (too_big)
+    {
+        mtu_probe_failed(conn); // The local interface MTU alone rules this size out
+    }
+}
+
+static void handle_mtu_ack(rudp_conn *conn, const uint8_t *datagram, int len)
+{
+    if (len < RUDP_HEADER_SIZE + 2 || !conn->mtu_searching ||
+        get_u16(datagram + RUDP_HEADER_SIZE) != conn->mtu_probe_size)
+    {
+        return; // Late answer to an earlier probe
+    }
+    conn->mtu_low = conn->mtu_probe_size;
+    conn->mss = conn->mtu_probe_size;
+    next_mtu_probe(conn);
+}
+
+/**
+ * Approximate bytes in flight, counting every unacknowledged segment as full.
+ */
+static uint32_t inflight_bytes(const rudp_conn *conn)
+{
+    return (conn->snd_nxt - conn->snd_una) * conn->mss;
+}
+
+/**
+ * Segments the receive buffer can still take beyond rcv_nxt.
+ */
+static uint32_t receive_window(const rudp_conn *conn)
+{
+    return conn->rcv_read + RUDP_WINDOW - conn->rcv_nxt;
+}
+
+static BOOL rx_present(const rudp_conn *conn, uint32_t seq)
+{
+    const rudp_segment *seg = &conn->rx[seq % RUDP_WINDOW];
+    return seg->state == RUDP_SEG_PRESENT && seg->seq == seq;
+}
+
+/**
+ * Acknowledges everything before rcv_nxt and reports the ranges already
+ * received beyond it.
+ */
+static void send_ack(rudp_conn *conn, uint32_t now)
+{
+    uint8_t  ack[RUDP_ACK_SIZE];
+    uint32_t window = receive_window(conn);
+    uint32_t limit = conn->rcv_read + RUDP_WINDOW;
+    uint32_t seq = conn->rcv_nxt + 1;
+    int      blocks = 0;
+
+    write_header(ack, RUDP_PKT_ACK, conn->peer_token);
+    put_u32(ack + 5, conn->rcv_nxt);
+    put_u16(ack + 9, (uint16_t)window);
+    put_u32(ack + 11, conn->ts_echo);
+    conn->ts_echo = 0; // Later ACKs (window updates) must not produce stale RTT samples
+
+    while (seq_before(seq, limit) && blocks < RUDP_MAX_SACK_BLOCKS)
+    {
+        if (!rx_present(conn, seq))
+        {
+            seq++;
+            continue;
+        }
+        uint32_t start = seq;
+        while (seq_before(seq, limit) && rx_present(conn, seq))
+        {
+            seq++;
+        }
+        put_u32(ack + 16 + blocks * 8, start);
+        put_u32(ack + 20 + blocks * 8, seq);
+        blocks++;
+    }
+    ack[15] = (uint8_t)blocks;
+
+    send_datagram(conn, ack, 16 + blocks * 8, now);
+    conn->ack_pending = FALSE;
+    conn->advertised_window = window;
+}
+
+static void transmit(rudp_conn *conn, rudp_segment *seg, uint32_t now)
+{
+    uint8_t datagram[RUDP_MAX_DATAGRAM];
+
+    if (conn->snd_una == conn->snd_nxt)
+    {
+        // Nothing was in flight: the timers start now
+        conn->rto_deadline_us = now + conn->rto_us;
+        conn->last_heard_us = now;
+    }
+
+    write_header(datagram, RUDP_PKT_DATA, conn->peer_token);
+    put_u32(datagram + 5, seg->seq);
+    put_u32(datagram + 9, now);
+    memcpy(datagram + RUDP_DATA_HEADER_SIZE, seg->data, seg->len);
+    send_datagram(conn, datagram, RUDP_DATA_HEADER_SIZE + seg->len, now);
+
+    if (conn->paced)
+    {
+        pacer_on_send(&conn->pacer, &seg->stamp, inflight_bytes(conn), now);
+    }
+    seg->sent_us = now;
+    seg->state = RUDP_SEG_IN_FLIGHT;
+    if (seg->transmissions < 255)
+    {
+        seg->transmissions++;
+    }
+}
+
+/**
+ * Shrinks the congestion window by 30% once per window of data that saw
+ * losses. VPN links drop packets at random, so halving like TCP would
+ * throttle the game far below what the link carries.
+ */
+static void enter_recovery(rudp_conn *conn, uint32_t lost_seq)
+{
+    if (seq_before(lost_seq, conn->recovery_seq))
+    {
+        return;
+    }
+    conn->cwnd = conn->cwnd * 7 / 10 > RUDP_MIN_CWND ? conn->cwnd * 7 / 10 : RUDP_MIN_CWND;
+    conn->cwnd_credit = 0;
+    conn->recovery_seq = conn->snd_nxt;
+}
+
+/**
+ * Folds one RTT sample into the smoothed estimate (RFC 6298 weights) and
+ * derives the retransmission timeout from it.
+ */
+static void record_rtt(rudp_conn *conn, uint32_t sample_us, uint32_t now)
+{
+    if (!conn->rtt_known)
+    {
+        conn->srtt_us = sample_us;
+        conn->rttvar_us = sample_us / 2;
+        conn->rtt_known = TRUE;
+    }
+    else
+    {
+        uint32_t deviation = conn->srtt_us > sample_us ? conn->srtt_us - sample_us : sample_us - conn->srtt_us;
+        conn->rttvar_us = (3 * conn->rttvar_us + deviation) / 4;
+        conn->srtt_us = (7 * conn->srtt_us + sample_us) / 8;
+    }
+
+    if (conn->paced)
+    {
+        pacer_on_rtt(&conn->pacer, sample_us, now);
+    }
+
+    uint32_t rto = conn->srtt_us + 4 * conn->rttvar_us;
+    conn->rto_us = rto < RUDP_MIN_RTO_US ? RUDP_MIN_RTO_US : rto > RUDP_MAX_RTO_US ? RUDP_MAX_RTO_US : rto;
+}
+
+/**
+ * Notes that a segment reached the peer: it anchors loss detection, earns
+ * congestion window credit and yields a delivery rate sample.
+ */
+static void segment_delivered(rudp_conn *conn, const rudp_segment *seg, uint32_t now)
+{
+    if (conn->paced)
+    {
+        pacer_on_delivered(&conn->pacer, &seg->stamp, seg->len, seg->sent_us, now);
+    }
+    if (seq_before(conn->rack_sent_us, seg->sent_us))
+    {
+        conn->rack_sent_us = seg->sent_us;
+    }
+    if (++conn->cwnd_credit >= conn->cwnd && conn->cwnd < RUDP_WINDOW)
+    {
+        conn->cwnd_credit = 0;
+        conn->cwnd++;
+    }
+}
+
+static void handle_ack(rudp_conn *conn, const uint8_t *ack, int len, uint32_t now)
+{
+    if (len < 16 || len < 16 + ack[15] * 8)
+    {
+        return;
+    }
+
+    uint32_t cum = get_u32(ack + 5);
+    uint32_t echo = get_u32(ack + 11);
+    int      blocks = ack[15];
+    if (seq_before(conn->snd_nxt, cum))
+    {
+        return; // Acknowledges data never sent
+    }
+
+    if (echo != 0 && (int32_t)(now - echo) >= 0)
+    {
+        record_rtt(conn, now - echo, now);
+    }
+
+    BOOL progress = FALSE;
+    while (seq_before(conn->snd_una, cum))
+    {
+        rudp_segment *seg = &conn->tx[conn->snd_una % RUDP_WINDOW];
+        if (seg->state != RUDP_SEG_SACKED)
+        {
+            segment_delivered(conn, seg, now);
+        }
+        seg->state = RUDP_SEG_FREE;
+        conn->snd_una++;
+        progress = TRUE;
+    }
+
+    for (int i = 0; i < blocks; i++)
+    {
+        uint32_t start = get_u32(ack + 16 + i * 8);
+        uint32_t end = get_u32(ack + 20 + i * 8);
+        if (seq_before(start, conn->snd_una))
+        {
+            start = conn->snd_una;
+        }
+        if (seq_before(conn->snd_nxt, end))
+        {
+            end = conn->snd_nxt;
+        }
+        for (uint32_t seq = start; seq_before(seq, end); seq++)
+        {
+            rudp_segment *seg = &conn->tx[seq % RUDP_WINDOW];
+            if (seg->state == RUDP_SEG_IN_FLIGHT)
+            {
+                seg->state = RUDP_SEG_SACKED;
+                segment_delivered(conn, seg, now);
+            }
+        }
+    }
+
+    conn->peer_window = get_u16(ack + 9);
+    if (conn->paced)
+    {
+        pacer_update(&conn->pacer, inflight_bytes(conn), now);
+    }
+    if (progress)
+    {
+        conn->rto_deadline_us = now + conn->rto_us;
+    }
+}
+
+static void handle_data(rudp_conn *conn, const uint8_t *datagram, int len)
+{
+    int payload_len = len - RUDP_DATA_HEADER_SIZE;
+    if (payload_len <= 0 || payload_len > RUDP_MAX_PAYLOAD)
+    {
+        return;
+    }
+
+    uint32_t seq = get_u32(datagram + 5);
+    conn->ts_echo = get_u32(datagram + 9);
+    conn->ack_pending = TRUE; // Even duplicates: our previous ACK may have been lost
+
+    if (seq_before(seq, conn->rcv_nxt) || rx_present(conn, seq))
+    {
+        conn->stats.duplicates_in++;
+        return;
+    }
+    if (!seq_before(seq, conn->rcv_read + RUDP_WINDOW))
+    {
+        return; // Beyond our window (a window probe): the ACK tells the sender to wait
+    }
+
+    rudp_segment *seg = &conn->rx[seq % RUDP_WINDOW];
+    seg->seq = seq;
+    seg->len = (uint16_t)payload_len;
+    seg->state = RUDP_SEG_PRESENT;
+    memcpy(seg->data, datagram + RUDP_DATA_HEADER_SIZE, payload_len);
+
+    while (seq_before(conn->rcv_nxt, conn->rcv_read + RUDP_WINDOW) && rx_present(conn, conn->rcv_nxt))
+    {
+        conn->rcv_nxt++;
+    }
+}
+
+static void handle_datagram(rudp_conn *conn, const uint8_t *datagram, int len, uint32_t now)
+{
+    conn->last_heard_us = now;
+
+    switch (datagram[0])
+    {
+    case RUDP_PKT_PROBE:
+        if (len < RUDP_HEADER_SIZE + 1)
+        {
+            return;
+        }
+        conn->peer_heard = TRUE;
+        if (datagram[RUDP_HEADER_SIZE] & RUDP_PROBE_HEARD)
+        {
+            conn->path_confirmed = TRUE;
+        }
+        if (!(datagram[RUDP_HEADER_SIZE] & RUDP_PROBE_CONFIRMED))
+        {
+            send_probe(conn, now); // Tell the peer its datagrams arrive
+        }
+        return;
+
+    case RUDP_PKT_DATA:
+        conn->path_confirmed = TRUE; // The peer only sends data after hearing from us
+        handle_data(conn, datagram, len);
+        return;
+
+    case RUDP_PKT_ACK:
+        conn->path_confirmed = TRUE;
+        handle_ack(conn, datagram, len, now);
+        return;
+
+    case RUDP_PKT_MTU_PROBE:
+        if (len >= RUDP_HEADER_SIZE + 2 && len == RUDP_DATA_HEADER_SIZE + get_u16(datagram + RUDP_HEADER_SIZE))
+        {
+            uint8_t ack[RUDP_HEADER_SIZE + 2];
+            write_header(ack, RUDP_PKT_MTU_ACK, conn->peer_token);
+            memcpy(ack + RUDP_HEADER_SIZE, datagram + RUDP_HEADER_SIZE, 2);
+            send_datagram(conn, ack, sizeof(ack), now);
+        }
+        return;
+
+    case RUDP_PKT_MTU_ACK:
+        handle_mtu_ack(conn, datagram, len);
+        return;
+
+    default:
+        return;
+    }
+}
+
+static void receive_datagrams(rudp_conn *conn, uint32_t now)
+{
+    uint8_t datagram[RUDP_MAX_DATAGRAM];
+
+    for (int i = 0; i < RUDP_MAX_DATAGRAMS_PER_POLL; i++)
+    {
+        struct sockaddr_storage from;
+        int                     from_len = sizeof(from);
+
+        memset(&from, 0, sizeof(from));
+        int received = recvfrom(conn->udp, (char *)datagram, sizeof(datagram), 0, (struct sockaddr *)&from, &from_len);
+        if (received == SOCKET_ERROR)
+        {
+            if (WSAGetLastError() == WSAEWOULDBLOCK)
+            {
+                return;
+            }
+            continue; // ICMP errors from earlier sends surface here as WSAECONNRESET
+        }
+
+        if (received < RUDP_HEADER_SIZE || get_u32(datagram + 1) != conn->local_token ||
+            !same_address(&from, &conn->peer_addr))
+        {
+            continue;
+        }
+        handle_datagram(conn, datagram, received, now);
+    }
+}
+
+/**
+ * Resends in-flight segments that a later acknowledged segment overtook
+ * by more than a quarter RTT, and the oldest one when the timer expires.
+ */
+static void retransmit_lost(rudp_conn *conn, uint32_t now)
+{
+    uint32_t srtt = conn->rtt_known ? conn->srtt_us : RUDP_MIN_RTO_US;
+    uint32_t threshold = srtt + (srtt / 4 > 1000 ? srtt / 4 : 1000);
+
+    for (uint32_t seq = conn->snd_una; seq_before(seq, conn->snd_nxt); seq++)
+    {
+        rudp_segment *seg = &conn->tx[seq % RUDP_WINDOW];
+        if (seg->state == RUDP_SEG_IN_FLIGHT && seq_before(seg->sent_us, conn->rack_sent_us) &&
+            now - seg->sent_us >= threshold)
+        {
+            enter_recovery(conn, seq);
+            transmit(conn, seg, now);
+            conn->stats.fast_retransmits++;
+        }
+    }
+
+    if (conn->snd_una == conn->snd_nxt || seq_before(now, conn->rto_deadline_us))
+    {
+        return;
+    }
+
+    for (uint32_t seq = conn->snd_una; seq_before(seq, conn->snd_nxt); seq++)
+    {
+        rudp_segment *seg = &conn->tx[seq % RUDP_WINDOW];
+        if (seg->state == RUDP_SEG_IN_FLIGHT)
+        {
+            enter_recovery(conn, seq);
+            transmit(conn, seg, now);
+            conn->stats.timeouts++;
+            break;
+        }
+    }
+    conn->rto_us = conn->rto_us * 2 < RUDP_MAX_RTO_US ? conn->rto_us * 2 : RUDP_MAX_RTO_US;
+    conn->rto_deadline_us = now + conn->rto_us;
+}
+
+/**
+ * Sends queued segments within the receive window and the paced stream's
+ * inflight limit, as fast as the token bucket refills. Until the first
+ * delivery rate sample this falls back to the congestion window.
+ */
+static BOOL send_paced_segments(rudp_conn *conn, uint32_t now)
+{
+    uint32_t inflight_limit = pacer_inflight_limit(&conn->pacer);
+    if (pacer_rate(&conn->pacer) == 0 || inflight_limit == 0)
+    {
+        return FALSE;
+    }
+
+    uint32_t limit = inflight_limit / conn->mss;
+    limit = limit < RUDP_MIN_CWND ? RUDP_MIN_CWND : limit;
+    limit = limit < conn->peer_window ? limit : conn->peer_window;
+    if (limit == 0 && conn->snd_una == conn->snd_nxt)
+    {
+        limit = 1;
+    }
+
+    while (conn->snd_nxt != conn->snd_end && conn->snd_nxt - conn->snd_una < limit)
+    {
+        rudp_segment *seg = &conn->tx[conn->snd_nxt % RUDP_WINDOW];
+        if (!pacer_allow(&conn->pacer, seg->len, now))
+        {
+            return TRUE;
+        }
+        transmit(conn, seg, now);
+        conn->snd_nxt++;
+        conn->stats.segments_sent++;
+    }
+    if (conn->snd_nxt == conn->snd_end && conn->snd_nxt - conn->snd_una < limit)
+    {
+        pacer_on_app_limited(&conn->pacer, inflight_bytes(conn));
+    }
+    return TRUE;
+}
+
+/**
+ * Sends queued segments within the congestion and receive windows, spaced
+ * at the pacing rate once an RTT estimate exists.
+ */
+static void send_new_segments(rudp_conn *conn, uint32_t now)
+{
+    if (conn->paced && send_paced_segments(conn, now))
+    {
+        return;
+    }
+
+    uint32_t limit = conn->cwnd < conn->peer_window ? conn->cwnd : conn->peer_window;
+    if (limit == 0 && conn->snd_una == conn->snd_nxt)
+    {
+        limit = 1; // Zero window: one segment probes it, the retransmission timer repeats the probe
+    }
+
+    // Pace at 1.25 x cwnd / srtt, allowing a short burst after idle periods
+    uint32_t interval = (uint32_t)((uint64_t)conn->srtt_us * 4 / (5 * (uint64_t)conn->cwnd));
+    uint32_t earliest = now - RUDP_PACING_BURST * interval;
+    if (!conn->rtt_known || seq_before(conn->pacing_next_us, earliest))
+    {
+        conn->pacing_next_us = earliest;
+    }
+
+    while (conn->snd_nxt != conn->snd_end && conn->snd_nxt - conn->snd_una < limit)
+    {
+        if (seq_before(now, conn->pacing_next_us))
+        {
+            return;
+        }
+
+        transmit(conn, &conn->tx[conn->snd_nxt % RUDP_WINDOW], now);
+        conn->snd_nxt++;
+        conn->stats.segments_sent++;
+        conn->pacing_next_us += interval;
+    }
+    if (conn->paced && conn->snd_nxt == conn->snd_end && conn->snd_nxt - conn->snd_una < limit)
+    {
+        pacer_on_app_limited(&conn->pacer, inflight_bytes(conn));
+    }
+}
+
+rudp_conn *rudp_open(const struct sockaddr *local, int local_len, uint32_t local_token, DWORD give_up_ms,
+                     const impair_profile *impairment, BOOL paced, DWORD mtu)
+{
+    struct sockaddr_storage bind_addr;
+
+    if (local_len <= 0 || local_len > (int)sizeof(bind_addr) ||
+        (local->sa_family != AF_INET && local->sa_family != AF_INET6))
+    {
+        return NULL;
+    }
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    memcpy(&bind_addr, local, local_len);
+    if (bind_addr.ss_family == AF_INET)
+    {
+        ((struct sockaddr_in *)&bind_addr)->sin_port = 0;
+    }
+    else
+    {
+        ((struct sockaddr_in6 *)&bind_addr)->sin6_port = 0;
+    }
+
+    rudp_conn *conn = (rudp_conn *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(rudp_conn));
+    if (!conn)
+    {
+        return NULL;
+    }
+
+    conn->udp = socket(bind_addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    u_long non_blocking = 1;
+    if (conn->udp == INVALID_SOCKET || bind(conn->udp, (struct sockaddr *)&bind_addr, local_len) == SOCKET_ERROR ||
+        ioctlsocket(conn->udp, FIONBIO, &non_blocking) == SOCKET_ERROR)
+    {
+        if (conn->udp != INVALID_SOCKET)
+        {
+            closesocket(conn->udp);
+        }
+        HeapFree(GetProcessHeap(), 0, conn);
+        return NULL;
+    }
+
+    uint32_t now = now_us();
+    InitializeCriticalSection(&conn->lock);
+    conn->local_token = local_token;
+    conn->give_up_ms = give_up_ms;
+    if (impairment)
+    {
+        conn->impairment = *impairment;
+    }
+    conn->peer_window = RUDP_WINDOW;
+    conn->cwnd = RUDP_INITIAL_CWND;
+    conn->rto_us = RUDP_INITIAL_RTO_US;
+    conn->rack_sent_us = now;
+    conn->advertised_window = RUDP_WINDOW;
+    conn->paced = paced;
+    pacer_init(&conn->pacer, RUDP_PACING_BURST * RUDP_BASE_PAYLOAD, now);
+    conn->ip_overhead = (bind_addr.ss_family == AF_INET6 ? 40 : 20) + RUDP_UDP_OVERHEAD;
+    if (mtu != 0)
+    {
+        conn->mss = payload_for_mtu(conn, mtu);
+    }
+    else
+    {
+        conn->mss = RUDP_BASE_PAYLOAD;
+        conn->mtu_searching = TRUE;
+        conn->mtu_low = RUDP_MIN_PAYLOAD;
+        conn->mtu_high = payload_for_mtu(conn, RUDP_LINK_MTU);
+        conn->mtu_probe_size = RUDP_BASE_PAYLOAD;
+    }
+    return conn;
+}
+
+uint16_t rudp_local_port(rudp_conn *conn)
+{
+    struct sockaddr_storage addr;
+    int                     addr_len = sizeof(addr);
+
+    if (getsockname(conn->udp, (struct sockaddr *)&addr, &addr_len) == SOCKET_ERROR)
+    {
+        return 0;
+    }
+    return ntohs(addr.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&addr)->sin6_port
+                                            : ((struct sockaddr_in *)&addr)->sin_port);
+}
+
+void rudp_set_peer(rudp_conn *conn, const struct sockaddr *addr, int addr_len, uint32_t peer_token)
+{
+    if (addr_len <= 0 || addr_len > (int)sizeof(conn->peer_addr))
+    {
+        return;
+    }
+
+    EnterCriticalSection(&conn->lock);
+    memset(&conn->peer_addr, 0, sizeof(conn->peer_addr));
+    memcpy(&conn->peer_addr, addr, addr_len);
+    conn->peer_addr_len = addr_len;
+    conn->peer_token = peer_token;
+    conn->peer_known = TRUE;
+    conn->last_probe_us = now_us() - RUDP_PROBE_INTERVAL_US;
+    if (!conn->impair && impair_active(&conn->impairment))
+    {
+        conn->impair = impair_create(&conn->impairment, addr, addr_len);
+    }
+    LeaveCriticalSection(&conn->lock);
+}
+
+void rudp_poll(rudp_conn *conn)
+{
+    EnterCriticalSection(&conn->lock);
+    uint32_t now = now_us();
+
+    if (conn->peer_known && !conn->failed)
+    {
+        receive_datagrams(conn, now);
+
+        if (!conn->path_confirmed && now - conn->last_probe_us >= RUDP_PROBE_INTERVAL_US)
+        {
+            send_probe(conn, now);
+        }
+        if (conn->path_confirmed && conn->mtu_searching)
+        {
+            probe_path_mtu(conn, now);
+        }
+        retransmit_lost(conn, now);
+        send_new_segments(conn, now);
+        if (conn->ack_pending)
+        {
+            send_ack(conn, now);
+        }
+        if (conn->impair)
+        {
+            impair_flush(conn->impair, conn->udp, now);
+        }
+
+        if (conn->give_up_ms != 0 && conn->snd_una != conn->snd_nxt &&
+            now - conn->last_heard_us > conn->give_up_ms * 1000)
+        {
+            conn->failed = TRUE;
+        }
+    }
+
+    LeaveCriticalSection(&conn->lock);
+}
+
+BOOL rudp_path_confirmed(rudp_conn *conn)
+{
+    EnterCriticalSection(&conn->lock);
+    BOOL confirmed = conn->path_confirmed;
+    LeaveCriticalSection(&conn->lock);
+    return confirmed;
+}
+
+BOOL rudp_failed(rudp_conn *conn)
+{
+    EnterCriticalSection(&conn->lock);
+    BOOL failed = conn->failed;
+    LeaveCriticalSection(&conn->lock);
+    return failed;
+}
+
+int rudp_write(rudp_conn *conn, const uint8_t *buf, int len)
+{
+    int done = 0;
+
+    EnterCriticalSection(&conn->lock);
+    while (done < len)
+    {
+        // Top up the last segment while it has not left yet
+        if (conn->snd_end != conn->snd_nxt)
+        {
+            rudp_segment *last = &conn->tx[(conn->snd_end - 1) % RUDP_WINDOW];
+            int           room = conn->mss - last->len;
+            if (room > 0)
+            {
+                int n = len - done < room ? len - done : room;
+                memcpy(last->data + last->len, buf + done, n);
+                last->len = (uint16_t)(last->len + n);
+                done += n;
+                continue;
+            }
+        }
+
+        if (conn->snd_end - conn->snd_una >= RUDP_WINDOW)
+        {
+            break; // Send buffer full
+        }
+        rudp_segment *seg = &conn->tx[conn->snd_end % RUDP_WINDOW];
+        seg->seq = conn->snd_end;
+        seg->len = 0;
+        seg->state = RUDP_SEG_QUEUED;
+        seg->transmissions = 0;
+        conn->snd_end++;
+    }
+    LeaveCriticalSection(&conn->lock);
+    return done;
+}
+
+int rudp_read(rudp_conn *conn, uint8_t *buf, int len)
+{
+    int done = 0;
+
+    EnterCriticalSection(&conn->lock);
+    while (done < len && conn->rcv_read != conn->rcv_nxt)
+    {
+        rudp_segment *seg = &conn->rx[conn->rcv_read % RUDP_WINDOW];
+        int           n = seg->len - conn->rcv_read_offset;
+        if (n > len - done)
+        {
+            n = len - done;
+        }
+        memcpy(buf + done, seg->data + conn->rcv_read_offset, n);
+        conn->rcv_read_offset += n;
+        done += n;
+
+        if (conn->rcv_read_offset == seg->len)
+        {
+            seg->state = RUDP_SEG_FREE;
+            conn->rcv_read++;
+            conn->rcv_read_offset = 0;
+        }
+    }
+
+    // Reopen a window the sender may be waiting on
+    if (done > 0 && conn->advertised_window < RUDP_WINDOW / 2 && receive_window(conn) >= RUDP_WINDOW / 2)
+    {
+        conn->ack_pending = TRUE;
+    }
+    LeaveCriticalSection(&conn->lock);
+    return done;
+}
+
+int rudp_unacked(rudp_conn *conn)
+{
+    EnterCriticalSection(&conn->lock);
+    int unacked = (int)(conn->snd_end - conn->snd_una);
+    LeaveCriticalSection(&conn->lock);
+    return unacked;
+}
+
+void rudp_close(rudp_conn *conn)
+{
+    if (!conn)
+    {
+        return;
+    }
+    closesocket(conn->udp);
+    impair_destroy(conn->impair);
+    DeleteCriticalSection(&conn->lock);
+    HeapFree(GetProcessHeap(), 0, conn);
+}
@@ -0,0 +1,210 @@
+#ifndef RUDP_H
+#define RUDP_H
+
+#include "impair.h"
+#include "pacer.h"
+#include <stdint.h>
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#define RUDP_LINK_MTU 1500     // Largest IP packet the path MTU search tries (Ethernet)
+#define RUDP_MAX_PAYLOAD 1459  // Largest segment: a full RUDP_LINK_MTU IPv4 packet
+#define RUDP_BASE_PAYLOAD 1200 // Segment size until the path MTU is known; fits the IPv6 minimum MTU with headers
+#define RUDP_MIN_PAYLOAD 512   // Segment size when even the base size does not get through unfragmented
+#define RUDP_WINDOW 256        // Segments buffered per direction (~370 KB)
+#define RUDP_MAX_SACK_BLOCKS 4 // Out-of-order ranges reported per ACK
+#define RUDP_INITIAL_CWND 16   // Segments in flight before the first loss
+#define RUDP_MIN_CWND 4        // Enough in flight for a later ACK to reveal a loss
+#define RUDP_INITIAL_RTO_US 200000 // Retransmission timeout before the first RTT sample
+#define RUDP_MIN_RTO_US 20000      // Retransmission timeout bounds
+#define RUDP_MAX_RTO_US 1000000
+#define RUDP_PROBE_INTERVAL_US 50000 // Path probes until the peer answered
+#define RUDP_PACING_BURST 4          // Segments that may leave back to back
+#define RUDP_MTU_PROBE_TRIES 3       // Unanswered probes after which a size counts as too large
+#define RUDP_MTU_SEARCH_STEP 16      // The path MTU search stops once its bounds are this close
+#define RUDP_UDP_OVERHEAD 8
+
+/*
+ * Datagrams: [type u8][receiver token u32][...], little endian.
+ *   PROBE [flags u8]                                  RUDP_PROBE_HEARD / RUDP_PROBE_CONFIRMED
+ *   DATA  [seq u32][send time us u32][payload]
+ *   ACK   [next expected seq u32][window u16][echoed send time u32][blocks u8][blocks x (start u32, end u32)]
+ *   MTU_PROBE [segment size u16][padding], as long as a DATA datagram carrying that many bytes; never fragmented
+ *   MTU_ACK   [segment size u16]
+ */
+#define RUDP_PKT_PROBE 1
+#define RUDP_PKT_DATA 2
+#define RUDP_PKT_ACK 3
+#define RUDP_PKT_MTU_PROBE 4
+#define RUDP_PKT_MTU_ACK 5
+#define RUDP_PROBE_HEARD 0x01     // Sender received a datagram from us: our path works
+#define RUDP_PROBE_CONFIRMED 0x02 // Sender knows its own path works and needs no answer
+#define RUDP_HEADER_SIZE 5
+#define RUDP_DATA_HEADER_SIZE (RUDP_HEADER_SIZE + 8)
+#define RUDP_MAX_DATAGRAM (RUDP_DATA_HEADER_SIZE + RUDP_MAX_PAYLOAD)
+
+typedef struct
+{
+    uint32_t    seq;
+    uint16_t    len;
+    uint8_t     state;         // RUDP_SEG_* below
+    uint8_t     transmissions; // Times sent so far
+    uint32_t    sent_us;       // Time of the last transmission
+    pacer_stamp stamp;         // Delivery state at the last transmission (paced streams)
+    uint8_t     data[RUDP_MAX_PAYLOAD];
+} rudp_segment;
+
+#define RUDP_SEG_FREE 0
+#define RUDP_SEG_QUEUED 1    // Send side: not transmitted yet
+#define RUDP_SEG_IN_FLIGHT 2 // Send side: transmitted, not acknowledged
+#define RUDP_SEG_SACKED 3    // Send side: selectively acknowledged
+#define RUDP_SEG_PRESENT 4   // Receive side: arrived, not read yet
+
+/**
+ * Counters for the statistics log line.
+ */
+typedef struct
+{
+    uint32_t segments_sent;    // First transmissions
+    uint32_t fast_retransmits; // Resent because later segments were acknowledged first
+    uint32_t timeouts;         // Resent after the retransmission timeout
+    uint32_t duplicates_in;    // Segments received twice
+    uint32_t mtu_probes;       // Path MTU probes sent
+} rudp_stats;
+
+/**
+ * One reliable, ordered byte stream over a UDP socket. Nothing runs in the
+ * background: rudp_poll() receives, acknowledges and (re)transmits, so the
+ * owner must call it regularly. All functions are thread-safe.
+ */
+typedef struct
+{
+    SOCKET                  udp;
+    CRITICAL_SECTION        lock;
+    struct sockaddr_storage peer_addr;
+    int                     peer_addr_len;
+    uint32_t                local_token;    // Expected in every datagram we accept
+    uint32_t                peer_token;     // Stamped on every datagram we send
+    DWORD                   give_up_ms;     // Silence with data in flight that fails the stream (0 = never)
+    BOOL                    peer_known;
+    BOOL                    peer_heard;     // A PROBE arrived from the peer
+    BOOL                    path_confirmed; // The peer received our datagrams: safe to send data
+    BOOL                    failed;
+    uint32_t                last_probe_us;
+    uint32_t                last_heard_us;  // Last valid datagram from the peer, or start of the current flight
+    impair_profile          impairment;
+    impair_queue           *impair;         // Outgoing datagram impairment, NULL when off
+    int                     ip_overhead;    // IP and UDP header bytes per datagram
+
+    // Path MTU search: segment sizes up to mtu_low get through unfragmented, sizes above mtu_high do not
+    uint16_t mss;            // Payload of new segments
+    BOOL     mtu_searching;  // FALSE once the bounds met or the MTU was configured
+    uint16_t mtu_low;        // RUDP_MIN_PAYLOAD until a probe was answered
+    uint16_t mtu_high;
+    uint16_t mtu_probe_size; // Size being probed
+    int      mtu_probe_tries;
+    uint32_t mtu_probe_us;   // When the last probe left
+
+    // Send side: segments [snd_una, snd_end) are held, [snd_una, snd_nxt) were transmitted
+    rudp_segment tx[RUDP_WINDOW];
+    uint32_t     snd_una;
+    uint32_t     snd_nxt;
+    uint32_t     snd_end;
+    uint32_t     peer_window;    // Segments the receiver accepts beyond snd_una
+    uint32_t     cwnd;           // Congestion window in segments
+    uint32_t     cwnd_credit;    // Acknowledged segments towards the next cwnd increase
+    uint32_t     recovery_seq;   // Losses below this belong to the current reduction
+    uint32_t     srtt_us;
+    uint32_t     rttvar_us;
+    uint32_t     rto_us;
+    uint32_t     rto_deadline_us;
+    uint32_t     rack_sent_us;   // Send time of the most recently sent acknowledged segment
+    uint32_t     pacing_next_us; // Earliest time the next new segment may leave
+    BOOL         rtt_known;
+    BOOL         paced;          // Pace at the estimated bandwidth instead of cwnd / srtt
+    pacer        pacer;
+
+    // Receive side: [rcv_read, rcv_nxt) is contiguous and unread, later segments may be present out of order
+    rudp_segment rx[RUDP_WINDOW];
+    uint32_t     rcv_read;
+    int          rcv_read_offset; // Bytes of segment rcv_read already read
+    uint32_t     rcv_nxt;
+    BOOL         ack_pending;
+    uint32_t     ts_echo;         // Send time of the last DATA received, echoed in the next ACK
+    uint32_t     advertised_window;
+
+    rudp_stats   stats;
+} rudp_conn;
+
+/**
+ * Opens a UDP socket on the given local address (port 0 picks a free one).
+ *
+ * @param local Local address to bind
+ * @param local_len Size of local in bytes
+ * @param local_token Token the peer must put in every datagram
+ * @param give_up_ms Silence with data in flight after which the stream fails (0 = never)
+ * @param impairment Conditions to simulate on outgoing datagrams, or NULL
+ * @param paced TRUE to pace at the measured bottleneck bandwidth (see pacer.h)
+ * @param mtu Path MTU in bytes to size segments for, or 0 to discover it with probes
+ * @return Stream, or NULL on failure
+ */
+rudp_conn *rudp_open(const struct sockaddr *local, int local_len, uint32_t local_token, DWORD give_up_ms,
+                     const impair_profile *impairment, BOOL paced, DWORD mtu);
+
+/**
+ * Returns the bound UDP port in host byte order.
+ */
+uint16_t rudp_local_port(rudp_conn *conn);
+
+/**
+ * Sets the remote endpoint and starts probing the path to it.
+ *
+ * @param conn Stream
+ * @param addr Remote UDP address
+ * @param addr_len Size of addr in bytes
+ * @param peer_token Token the peer expects in our datagrams
+ */
+void rudp_set_peer(rudp_conn *conn, const struct sockaddr *addr, int addr_len, uint32_t peer_token);
+
+/**
+ * Receives pending datagrams and sends whatever is due: probes, ACKs,
+ * retransmissions and new segments within the congestion window and pacing rate.
+ */
+void rudp_poll(rudp_conn *conn);
+
+/**
+ * Returns TRUE once datagrams are known to reach the peer.
+ */
+BOOL rudp_path_confirmed(rudp_conn *conn);
+
+/**
+ * Returns TRUE if the peer stopped acknowledging for give_up_ms.
+ */
+BOOL rudp_failed(rudp_conn *conn);
+
+/**
+ * Queues stream bytes for sending. Does not transmit; rudp_poll() does.
+ *
+ * @return Bytes accepted (less than len when the send buffer is full)
+ */
+int rudp_write(rudp_conn *conn, const uint8_t *buf, int len);
+
+/**
+ * Reads in-order stream bytes.
+ *
+ * @return Bytes copied to buf (0 if none are available)
+ */
+int rudp_read(rudp_conn *conn, uint8_t *buf, int len);
+
+/**
+ * Returns the number of written segments the peer has not acknowledged yet.
+ */
+int rudp_unacked(rudp_conn *conn);
+
+/**
+ * Closes the socket and frees the stream.
+ */
+void rudp_close(rudp_conn *conn);
+
+#endif // RUDP_H
@@ -0,0 +1,414 @@
+/*
+ * send_queue.c: Non-blocking per-socket send queues for hosts.
+ *
+ * server.dll on the host writes each update to every player socket in a
+ * row, and the plain send hook retries until each write is complete. One
+ * player with a full socket buffer therefore delays the update for every
+ * player after it. With SendQueueKB set, a send that does not fit is
+ * copied to the socket's queue and reported as complete; the queue drains
+ * from later hook calls. Consecutive identical sends share one
+ * reference-counted copy, so a broadcast costs one copy no matter how many
+ * slow players it waits for. A flush gathers the oldest entries straight
+ * from their copies into one WSASend(), so a queue of many small updates
+ * drains with a few calls and no further copying.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "send_queue.h"
+#include "clock.h"
+#include "config.h"
+#include "hooks.h"
+#include "logging.h"
+#include "peer.h"
+#include "socket_state.h"
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+
+static CRITICAL_SECTION s_lock; // Guards the pending list and the last payload
+static volatile LONG    s_lock_init = 0; // 0 = not initialized, 1 = initializing, 2 = ready
+static SOCKET           s_pending[MAX_TRACKED_SOCKETS];
+static volatile LONG    s_pending_count = 0;
+static send_payload    *s_last_payload = NULL; // Most recently queued send, shared by an identical next one
+
+/**
+ * Initializes the module lock exactly once (hooks may fire from any thread).
+ */
+static void ensure_lock_initialized(void)
+{
+    if (s_lock_init == 2)
+    {
+        return;
+    }
+    if (InterlockedCompareExchange(&s_lock_init, 1, 0) == 0)
+    {
+        InitializeCriticalSection(&s_lock);
+        InterlockedExchange(&s_lock_init, 2);
+        return;
+    }
+    while (s_lock_init != 2)
+    {
+        Sleep(0);
+    }
+}
+
+static void release_payload(send_payload *payload)
+{
+    if (payload && InterlockedDecrement(&payload->refs) == 0)
+    {
+        HeapFree(GetProcessHeap(), 0, payload);
+    }
+}
+
+/**
+ * Returns a referenced copy of buf, reusing the previous send's copy when
+ * the bytes are identical.
+ *
+ * @param shared Set to TRUE if the copy was reused
+ * @return Payload, or NULL if out of memory
+ */
+static send_payload *acquire_payload(const char *buf, int len, BOOL *shared)
+{
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+
+    send_payload *payload = s_last_payload;
+    *shared = payload && payload->len == len && memcmp(payload->data, buf, len) == 0;
+    if (*shared)
+    {
+        InterlockedIncrement(&payload->refs);
+    }
+    else
+    {
+        payload = (send_payload *)HeapAlloc(GetProcessHeap(), 0, sizeof(send_payload) + len);
+        if (payload)
+        {
+            payload->refs = 2; // The caller's reference and the cache's
+            payload->len = len;
+            memcpy(payload->data, buf, len);
+            release_payload(s_last_payload);
+            s_last_payload = payload;
+        }
+    }
+
+    LeaveCriticalSection(&s_lock);
+    return payload;
+}
+
+/**
+ * Adds or removes a socket from the list send_queue_poll() walks.
+ */
+static void set_pending(send_queue *queue, SOCKET s, BOOL pending)
+{
+    if (queue->pending == pending)
+    {
+        return;
+    }
+
+    ensure_lock_initialized();
+    EnterCriticalSection(&s_lock);
+    if (pending && s_pending_count < MAX_TRACKED_SOCKETS)
+    {
+        s_pending[s_pending_count] = s;
+        InterlockedIncrement(&s_pending_count);
+        queue->pending = TRUE;
+    }
+    else if (!pending)
+    {
+        for (int i = 0; i < s_pending_count; i++)
+        {
+            if (s_pending[i] == s)
+            {
+                s_pending[i] = s_pending[s_pending_count - 1];
+                InterlockedDecrement(&s_pending_count);
+                break;
+            }
+        }
+        queue->pending = FALSE;
+    }
+    LeaveCriticalSection(&s_lock);
+}
+
+/**
+ * Drops every queued entry without sending it.
+ */
+static void drop_entries(send_queue *queue)
+{
+    while (queue->count > 0)
+    {
+        release_payload(queue->entries[queue->head].payload);
+        queue->head = (queue->head + 1) % SEND_QUEUE_ENTRIES;
+        queue->count--;
+    }
+    queue->head = 0;
+    queue->bytes = 0;
+}
+
+/**
+ * Writes queued entries until the socket buffer is full, up to
+ * SEND_QUEUE_BATCH of them per WSASend(). Caller must hold the socket's
+ * send_lock.
+ *
+ * @return FALSE if the socket failed; the error is kept for the next send
+ */
+static BOOL flush_queue(send_queue *queue, SOCKET s)
+{
+    while (queue->count > 0)
+    {
+        int batch = queue->count < SEND_QUEUE_BATCH ? queue->count : SEND_QUEUE_BATCH;
+        int batch_bytes = 0;
+        for (int i = 0; i < batch; i++)
+        {
+            send_queue_entry *entry = &queue->entries[(queue->head + i) % SEND_QUEUE_ENTRIES];
+            queue->batch[i].buf = (char *)entry->payload->data + entry->offset;
+            queue->batch[i].len = (u_long)(entry->payload->len - entry->offset);
+            batch_bytes += entry->payload->len - entry->offset;
+        }
+        int sent = send_gather(s, queue->batch, (DWORD)batch);
+
+        if (sent == SOCKET_ERROR)
+        {
+            queue->error = WSAGetLastError();
+            logf("[QUEUE] Socket %u: dropping %d queued bytes after error %d", (unsigned)s, queue->bytes,
+                 queue->error);
+            drop_entries(queue);
+            break;
+        }
+        if (sent == 0)
+        {
+            return TRUE; // Socket buffer full
+        }
+
+        queue->flush_calls++;
+        queue->flushed_bytes += sent;
+        queue->bytes -= sent;
+        for (int left = sent; left > 0;)
+        {
+            send_queue_entry *entry = &queue->entries[queue->head];
+            int               taken = entry->payload->len - entry->offset;
+            if (taken > left)
+            {
+                taken = left;
+            }
+            entry->offset += taken;
+            left -= taken;
+            if (entry->offset == entry->payload->len)
+            {
+                release_payload(entry->payload);
+                queue->head = (queue->head + 1) % SEND_QUEUE_ENTRIES;
+                queue->count--;
+            }
+        }
+        if (sent < batch_bytes)
+        {
+            return TRUE; // Socket buffer full
+        }
+    }
+
+    set_pending(queue, s, FALSE);
+    return queue->error == 0;
+}
+
+/**
+ * Reports the error a background flush ran into, once.
+ */
+static BOOL take_deferred_error(send_queue *queue)
+{
+    if (queue->error == 0)
+    {
+        return FALSE;
+    }
+    WSASetLastError(queue->error);
+    queue->error = 0;
+    return TRUE;
+}
+
+/**
+ * Waits until the queue can take len more bytes (or is empty), keeping the
+ * other queues moving meanwhile. This bounds memory for a receiver that
+ * stopped reading; the send then blocks like the plain hook would.
+ *
+ * @return FALSE if the socket failed or the peer layer declared it dead
+ */
+static BOOL wait_for_room(send_queue *queue, SOCKET s, int len, BOOL until_empty)
+{
+    int   limit = (int)g_config.send_queue_kb * 1024;
+    DWORD stall_start = clock_ticks();
+    int   last_bytes = queue->bytes;
+
+    while (queue->count > 0 &&
+           (until_empty || queue->count == SEND_QUEUE_ENTRIES || queue->bytes + len > limit))
+    {
+        if (!flush_queue(queue, s))
+        {
+            return FALSE;
+        }
+        if (queue->bytes != last_bytes)
+        {
+            last_bytes = queue->bytes;
+            stall_start = clock_ticks();
+        }
+        if (queue->count == 0)
+        {
+            break;
+        }
+        if (peer_send_stalled(s, clock_ticks() - stall_start))
+        {
+            WSASetLastError(WSAECONNRESET);
+            return FALSE;
+        }
+        send_queue_poll();
+        clock_wait_us(NULL, 1000);
+    }
+    return TRUE;
+}
+
+int send_queue_write(send_queue *queue, SOCKET s, const char *buf, int len, int flags)
+{
+    if (take_deferred_error(queue))
+    {
+        return SOCKET_ERROR;
+    }
+    if (!buf || len <= 0 || flags != 0)
+    {
+        // Urgent or unusual sends must not overtake queued data
+        if (!wait_for_room(queue, s, 0, TRUE))
+        {
+            take_deferred_error(queue);
+            return SOCKET_ERROR;
+        }
+        return send_all(s, buf, len, flags);
+    }
+
+    if (!flush_queue(queue, s))
+    {
+        take_deferred_error(queue);
+        return SOCKET_ERROR;
+    }
+
+    int sent = 0;
+    if (queue->count == 0)
+    {
+        sent = send_once(s, buf, len, 0);
+        if (sent == SOCKET_ERROR || sent == len)
+        {
+            return sent;
+        }
+    }
+
+    // The rest waits in the queue; a full queue makes this send wait like the plain hook
+    int remaining = len - sent;
+    if (queue->count == SEND_QUEUE_ENTRIES || queue->bytes + remaining > (int)g_config.send_queue_kb * 1024)
+    {
+        queue->blocked_sends++;
+        if (!wait_for_room(queue, s, remaining, FALSE))
+        {
+            take_deferred_error(queue);
+            return SOCKET_ERROR;
+        }
+    }
+
+    BOOL          shared;
+    send_payload *payload = acquire_payload(buf, len, &shared);
+    if (!payload)
+    {
+        int rest = send_all(s, buf + sent, remaining, 0);
+        return rest == SOCKET_ERROR ? SOCKET_ERROR : sent + rest;
+    }
+
+    send_queue_entry *entry = &queue->entries[(queue->head + queue->count) % SEND_QUEUE_ENTRIES];
+    entry->payload = payload;
+    entry->offset = sent;
+    queue->count++;
+    queue->bytes += remaining;
+    queue->queued_sends++;
+    if (shared)
+    {
+        queue->shared_payloads++;
+    }
+    else
+    {
+        queue->copied_bytes += len;
+    }
+    if (queue->bytes > queue->peak_bytes)
+    {
+        queue->peak_bytes = queue->bytes;
+    }
+    set_pending(queue, s, TRUE);
+    return len;
+}
+
+int send_queue_send(SOCKET s, const char *buf, int len, int flags)
+{
+    socket_state *state = get_socket_state(s, TRUE);
+    if (!state)
+    {
+        return send_all(s, buf, len, flags);
+    }
+
+    EnterCriticalSection(&state->send_lock);
+    int result = send_queue_write(&state->queue, s, buf, len, flags);
+    LeaveCriticalSection(&state->send_lock);
+    return result;
+}
+
+void send_queue_poll(void)
+{
+    SOCKET pending[MAX_TRACKED_SOCKETS];
+    int    count;
+
+    if (s_pending_count == 0)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&s_lock);
+    count = s_pending_count;
+    memcpy(pending, s_pending, count * sizeof(SOCKET));
+    LeaveCriticalSection(&s_lock);
+
+    for (int i = 0; i < count; i++)
+    {
+        socket_state *state = get_socket_state(pending[i], FALSE);
+        if (state && TryEnterCriticalSection(&state->send_lock))
+        {
+            flush_queue(&state->queue, pending[i]);
+            LeaveCriticalSection(&state->send_lock);
+        }
+    }
+}
+
+void send_queue_linger(SOCKET s)
+{
+    socket_state *state = get_socket_state(s, FALSE);
+    if (!state)
+    {
+        return;
+    }
+
+    EnterCriticalSection(&state->send_lock);
+    send_queue *queue = &state->queue;
+    DWORD       start = clock_ticks();
+    while (queue->count > 0 && flush_queue(queue, s) && queue->count > 0 &&
+           clock_ticks() - start < SEND_QUEUE_LINGER_MS)
+    {
+        clock_wait_us(NULL, 1000);
+    }
+    if (queue->queued_sends > 0)
+    {
+        logf("[QUEUE] Socket %u: %lu sends queued (%lu sharing the previous copy, %lu waited for room), peak %.1f KB, "
+             "%.1f KB copied, %.1f KB flushed in %lu WSASend calls, %d bytes unsent at close",
+             (unsigned)s, (unsigned long)queue->queued_sends, (unsigned long)queue->shared_payloads,
+             (unsigned long)queue->blocked_sends, (double)queue->peak_bytes / 1024.0,
+             (double)queue->copied_bytes / 1024.0, (double)queue->flushed_bytes / 1024.0,
+             (unsigned long)queue->flush_calls, queue->bytes);
+    }
+    LeaveCriticalSection(&state->send_lock);
+}
+
+void send_queue_clear(send_queue *queue, SOCKET s)
+{
+    drop_entries(queue);
+    set_pending(queue, s, FALSE);
+    memset(queue, 0, sizeof(*queue));
+}
@@ -0,0 +1,93 @@
+#ifndef SEND_QUEUE_H
+#define SEND_QUEUE_H
+
+#include <stdint.h>
+#include <windows.h>
+#include <winsock2.h>
+
+#define SEND_QUEUE_ENTRIES 256     // Queued sends per socket; one more makes the send wait
+#define SEND_QUEUE_BATCH 16        // Queued sends written by one WSASend() call
+#define SEND_QUEUE_LINGER_MS 1000  // How long closesocket waits for queued data to leave
+
+/**
+ * A copy of one game send. Identical consecutive sends (the same update
+ * written to every player in a row) share one copy; the last queue entry
+ * to finish with it frees it.
+ */
+typedef struct
+{
+    volatile LONG refs;
+    int           len;
+    uint8_t       data[1]; // len bytes
+} send_payload;
+
+typedef struct
+{
+    send_payload *payload;
+    int           offset; // Bytes of the payload already written to the socket
+} send_queue_entry;
+
+/**
+ * Game data that was accepted from server.dll but did not fit into the
+ * socket buffer yet. Guarded by the socket's send_lock.
+ */
+typedef struct
+{
+    send_queue_entry entries[SEND_QUEUE_ENTRIES]; // Ring, oldest at head
+    WSABUF           batch[SEND_QUEUE_BATCH];     // The oldest entries' unsent bytes, gathered for one WSASend()
+    int              head;
+    int              count;
+    int              bytes;           // Unsent bytes across all entries
+    int              error;           // Winsock error from a background flush, reported by the next send
+    BOOL             pending;         // Registered for send_queue_poll()
+    uint32_t         queued_sends;    // Sends that could not be written at once
+    uint32_t         shared_payloads; // Of those, sends that reused the previous send's copy
+    uint32_t         blocked_sends;   // Sends that had to wait because the queue was full
+    int              peak_bytes;
+    uint32_t         flush_calls;     // WSASend() calls that wrote queued data
+    uint64_t         flushed_bytes;   // Bytes they wrote
+    uint64_t         copied_bytes;    // Bytes copied into payloads (shared copies count once)
+} send_queue;
+
+/**
+ * Sends game data without waiting for a slow receiver: whatever does not
+ * fit into the socket buffer is queued and written by later hook calls.
+ * Looks up the socket state and takes its send_lock.
+ *
+ * @param s Socket handle
+ * @param buf Game data
+ * @param len Number of bytes
+ * @param flags Send flags (MSG_*); anything but 0 drains the queue first and sends directly
+ * @return len, or SOCKET_ERROR on failure
+ */
+int send_queue_send(SOCKET s, const char *buf, int len, int flags);
+
+/**
+ * Same as send_queue_send() for a caller that already holds the socket's send_lock.
+ */
+int send_queue_write(send_queue *queue, SOCKET s, const char *buf, int len, int flags);
+
+/**
+ * Writes queued data on every socket whose send_lock is free. Called from
+ * the hooks, so queues drain while the game keeps polling. Cheap when
+ * nothing is queued.
+ */
+void send_queue_poll(void);
+
+/**
+ * Gives queued data up to SEND_QUEUE_LINGER_MS to leave before a socket is
+ * closed and logs the queue counters.
+ *
+ * @param s Socket handle being closed
+ */
+void send_queue_linger(SOCKET s);
+
+/**
+ * Drops all queued data and unregisters the queue.
+ *
+ * @param queue Queue of the socket
+ * @param s Socket handle
+ */
+void send_queue_clear(send_queue *queue, SOCKET s);
+
+#endif // SEND_QUEUE_H
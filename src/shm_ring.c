@@ -0,0 +1,257 @@
+/*
+ * shm_ring.c: Single-producer, single-consumer byte ring in shared memory.
+ *
+ * Two game instances on one host otherwise talk through loopback TCP,
+ * paying two kernel copies and a WSAEWOULDBLOCK round trip per poll. A
+ * ring in a named file mapping moves the bytes with one memcpy on each
+ * side. Publishing is ordered by interlocked counter updates; the events
+ * only wake an end that announced it is waiting, so the fast path makes
+ * no system call at all.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "shm_ring.h"
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+
+#define SHM_RING_MASK (SHM_RING_SIZE - 1)
+#define SHM_MAPPING_SIZE (sizeof(shm_ring_header) + SHM_RING_SIZE)
+
+/**
+ * Builds the name of one of the ring's events from the mapping name.
+ */
+static void event_name(char *out, size_t out_size, const char *name, const char *suffix)
+{
+    snprintf(out, out_size, "%s-%s", name, suffix);
+}
+
+/**
+ * Allocates the per-process end and maps the view. Caller fills in the events.
+ */
+static shm_ring *map_ring(HANDLE mapping, const char *name, BOOL producer)
+{
+    shm_ring *ring = (shm_ring *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(shm_ring));
+    if (!ring)
+    {
+        CloseHandle(mapping);
+        return NULL;
+    }
+
+    ring->mapping = mapping;
+    ring->producer = producer;
+    ring->header = (shm_ring_header *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, SHM_MAPPING_SIZE);
+    if (!ring->header)
+    {
+        shm_ring_close(ring);
+        return NULL;
+    }
+    ring->data = (uint8_t *)(ring->header + 1);
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    return ring;
+}
+
+shm_ring *shm_ring_create(const char *name)
+{
+    char events[2][SHM_RING_NAME_MAX + 8];
+
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)SHM_MAPPING_SIZE, name);
+    if (!mapping)
+    {
+        return NULL;
+    }
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        CloseHandle(mapping); // Someone else's ring; never write into it
+        return NULL;
+    }
+
+    shm_ring *ring = map_ring(mapping, name, TRUE);
+    if (!ring)
+    {
+        return NULL;
+    }
+
+    event_name(events[0], sizeof(events[0]), name, "data");
+    event_name(events[1], sizeof(events[1]), name, "space");
+    ring->data_event = CreateEventA(NULL, FALSE, FALSE, events[0]);
+    ring->space_event = CreateEventA(NULL, FALSE, FALSE, events[1]);
+    if (!ring->data_event || !ring->space_event)
+    {
+        shm_ring_close(ring);
+        return NULL;
+    }
+
+    // A fresh mapping is zeroed; the magic tells the consumer the header is complete
+    ring->header->size = SHM_RING_SIZE;
+    InterlockedExchange(&ring->header->magic, (LONG)SHM_RING_MAGIC);
+    return ring;
+}
+
+shm_ring *shm_ring_open(const char *name)
+{
+    char events[2][SHM_RING_NAME_MAX + 8];
+
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (!mapping)
+    {
+        return NULL;
+    }
+
+    shm_ring *ring = map_ring(mapping, name, FALSE);
+    if (!ring)
+    {
+        return NULL;
+    }
+    if ((DWORD)ring->header->magic != SHM_RING_MAGIC || ring->header->size != SHM_RING_SIZE)
+    {
+        shm_ring_close(ring);
+        return NULL;
+    }
+
+    event_name(events[0], sizeof(events[0]), name, "data");
+    event_name(events[1], sizeof(events[1]), name, "space");
+    ring->data_event = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, events[0]);
+    ring->space_event = OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, events[1]);
+    if (!ring->data_event || !ring->space_event)
+    {
+        shm_ring_close(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+/**
+ * Returns the bytes currently stored. Only the caller's own counter is
+ * stable; the other one may move on right after the read.
+ */
+static uint32_t ring_used(const shm_ring *ring)
+{
+    uint32_t used = (uint32_t)ring->header->head - (uint32_t)ring->header->tail;
+    MemoryBarrier(); // Data reads and writes must not move above the counter reads
+    return used;
+}
+
+int shm_ring_write(shm_ring *ring, const uint8_t *buf, int len)
+{
+    shm_ring_header *header = ring->header;
+    uint32_t         space = SHM_RING_SIZE - ring_used(ring);
+    uint32_t         n = len > 0 ? (uint32_t)len : 0;
+
+    if (n > space)
+    {
+        n = space;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    uint32_t head = (uint32_t)header->head;
+    uint32_t offset = head & SHM_RING_MASK;
+    uint32_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+    memcpy(ring->data + offset, buf, first);
+    memcpy(ring->data, buf + first, n - first);
+
+    InterlockedExchange(&header->head, (LONG)(head + n)); // Full barrier: the bytes are visible before the count
+    if (header->consumer_waiting)
+    {
+        SetEvent(ring->data_event);
+    }
+    return (int)n;
+}
+
+int shm_ring_read(shm_ring *ring, uint8_t *buf, int len)
+{
+    shm_ring_header *header = ring->header;
+    uint32_t         used = ring_used(ring);
+    uint32_t         n = len > 0 ? (uint32_t)len : 0;
+
+    if (n > used)
+    {
+        n = used;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+
+    uint32_t tail = (uint32_t)header->tail;
+    uint32_t offset = tail & SHM_RING_MASK;
+    uint32_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+    memcpy(buf, ring->data + offset, first);
+    memcpy(buf + first, ring->data, n - first);
+
+    InterlockedExchange(&header->tail, (LONG)(tail + n)); // The producer may reuse the space only after the copy
+    if (header->producer_waiting)
+    {
+        SetEvent(ring->space_event);
+    }
+    return (int)n;
+}
+
+BOOL shm_ring_wait_writable(shm_ring *ring, DWORD timeout_ms)
+{
+    shm_ring_header *header = ring->header;
+
+    // Announce the wait before re-checking, so a read in between either sees the flag or leaves space we see
+    InterlockedExchange(&header->producer_waiting, 1);
+    if (ring_used(ring) == SHM_RING_SIZE && !header->consumer_closed)
+    {
+        ring->full_waits++;
+        WaitForSingleObject(ring->space_event, timeout_ms);
+    }
+    InterlockedExchange(&header->producer_waiting, 0);
+    return ring_used(ring) < SHM_RING_SIZE;
+}
+
+BOOL shm_ring_wait_readable(shm_ring *ring, DWORD timeout_ms)
+{
+    shm_ring_header *header = ring->header;
+
+    InterlockedExchange(&header->consumer_waiting, 1);
+    if (ring_used(ring) == 0 && !header->producer_closed)
+    {
+        WaitForSingleObject(ring->data_event, timeout_ms);
+    }
+    InterlockedExchange(&header->consumer_waiting, 0);
+    return ring_used(ring) > 0;
+}
+
+BOOL shm_ring_peer_closed(const shm_ring *ring)
+{
+    return ring->producer ? ring->header->consumer_closed != 0 : ring->header->producer_closed != 0;
+}
+
+void shm_ring_close(shm_ring *ring)
+{
+    if (!ring)
+    {
+        return;
+    }
+
+    if (ring->header)
+    {
+        // Wake the other end so it notices the close instead of sleeping out its timeout
+        HANDLE wake = ring->producer ? ring->data_event : ring->space_event;
+        InterlockedExchange(ring->producer ? &ring->header->producer_closed : &ring->header->consumer_closed, 1);
+        if (wake)
+        {
+            SetEvent(wake);
+        }
+        UnmapViewOfFile(ring->header);
+    }
+    if (ring->data_event)
+    {
+        CloseHandle(ring->data_event);
+    }
+    if (ring->space_event)
+    {
+        CloseHandle(ring->space_event);
+    }
+    if (ring->mapping)
+    {
+        CloseHandle(ring->mapping);
+    }
+    HeapFree(GetProcessHeap(), 0, ring);
+}
@@ -0,0 +1,105 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <windows.h>
+
+#define SHM_RING_SIZE (1024 * 1024) // Data bytes per ring; must be a power of two
+#define SHM_RING_NAME_MAX 64        // Mapping name length including the terminator
+#define SHM_RING_MAGIC 0x4E46524Eu  // "NRFN", written last by the creator
+#define SHM_CACHE_LINE 64
+
+/**
+ * Start of the shared mapping, followed by SHM_RING_SIZE data bytes. The
+ * producer and consumer counters sit on separate cache lines so the two
+ * processes do not invalidate each other's line on every update.
+ */
+typedef struct
+{
+    volatile LONG magic;
+    volatile LONG size;
+    volatile LONG producer_closed;  // Producer detached; nothing more will be written
+    volatile LONG consumer_closed;  // Consumer detached; writes would never be read
+    uint8_t       pad0[SHM_CACHE_LINE - 4 * sizeof(LONG)];
+    volatile LONG head;             // Bytes written so far (wraps), advanced by the producer only
+    volatile LONG producer_waiting; // Producer sleeps on the space event
+    uint8_t       pad1[SHM_CACHE_LINE - 2 * sizeof(LONG)];
+    volatile LONG tail;             // Bytes read so far (wraps), advanced by the consumer only
+    volatile LONG consumer_waiting; // Consumer sleeps on the data event
+    uint8_t       pad2[SHM_CACHE_LINE - 2 * sizeof(LONG)];
+} shm_ring_header;
+
+/**
+ * One end of a single-producer, single-consumer byte ring in a named file
+ * mapping shared by two processes on the same host. Each side only ever
+ * advances its own counter, so no lock is shared between the processes.
+ * The events are only signaled while the other side announced it waits.
+ */
+typedef struct
+{
+    HANDLE           mapping;
+    shm_ring_header *header;
+    uint8_t         *data;
+    HANDLE           data_event;  // Signaled by the producer after writing
+    HANDLE           space_event; // Signaled by the consumer after reading
+    BOOL             producer;    // TRUE on the end that created the ring
+    uint32_t         full_waits;  // Writes that had to wait for the consumer
+    char             name[SHM_RING_NAME_MAX];
+} shm_ring;
+
+/**
+ * Creates a ring as its producer.
+ *
+ * @param name Mapping name, also used to derive the event names
+ * @return Ring, or NULL if the mapping or events could not be created
+ */
+shm_ring *shm_ring_create(const char *name);
+
+/**
+ * Opens a ring another process created, as its consumer.
+ *
+ * @param name Mapping name the producer announced
+ * @return Ring, or NULL if no valid ring exists under that name
+ */
+shm_ring *shm_ring_open(const char *name);
+
+/**
+ * Copies bytes into the ring without waiting.
+ *
+ * @return Bytes written (less than len when the ring is full)
+ */
+int shm_ring_write(shm_ring *ring, const uint8_t *buf, int len);
+
+/**
+ * Copies bytes out of the ring without waiting.
+ *
+ * @return Bytes read (0 if the ring is empty)
+ */
+int shm_ring_read(shm_ring *ring, uint8_t *buf, int len);
+
+/**
+ * Waits until the ring has free space, the consumer detached or the timeout passed.
+ *
+ * @return TRUE if there is space to write
+ */
+BOOL shm_ring_wait_writable(shm_ring *ring, DWORD timeout_ms);
+
+/**
+ * Waits until the ring holds data, the producer detached or the timeout passed.
+ *
+ * @return TRUE if there is data to read
+ */
+BOOL shm_ring_wait_readable(shm_ring *ring, DWORD timeout_ms);
+
+/**
+ * Returns TRUE once the other end closed its side of the ring.
+ */
+BOOL shm_ring_peer_closed(const shm_ring *ring);
+
+/**
+ * Detaches from the ring and frees this end. The mapping lives on until
+ * the other end closes too, so bytes already written can still be read.
+ */
+void shm_ring_close(shm_ring *ring);
+
+#endif // SHM_RING_H
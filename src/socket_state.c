@@ -0,0 +1,188 @@
+/*
+ * socket_state.c: Fixed-size table of per-socket state for server.dll sockets.
+ *
+ * The hooks only ever see socket handles, so any feature that needs memory
+ * across calls (peer protocol buffers, statistics) keeps it here. The table
+ * is small and scanned linearly; server.dll never has more than a handful
+ * of sockets open.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "socket_state.h"
+#include "clock.h"
+#include "logging.h"
+#include <string.h>
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+static socket_state     s_sockets[MAX_TRACKED_SOCKETS];
+static CRITICAL_SECTION s_table_lock;
+static volatile LONG    s_table_init = 0; // 0 = not initialized, 1 = initializing, 2 = ready
+
+/**
+ * Initializes the table lock and per-slot locks exactly once.
+ * Hooks can fire from any thread before init_hooks() finishes, so this
+ * is done lazily with an interlocked handshake instead of in DllMain.
+ */
+static void ensure_table_initialized(void)
+{
+    if (s_table_init == 2)
+    {
+        return;
+    }
+
+    if (InterlockedCompareExchange(&s_table_init, 1, 0) == 0)
+    {
+        InitializeCriticalSection(&s_table_lock);
+        for (int i = 0; i < MAX_TRACKED_SOCKETS; i++)
+        {
+            InitializeCriticalSection(&s_sockets[i].send_lock);
+            InitializeCriticalSection(&s_sockets[i].recv_lock);
+        }
+        InterlockedExchange(&s_table_init, 2);
+        return;
+    }
+
+    while (s_table_init != 2)
+    {
+        Sleep(0);
+    }
+}
+
+/**
+ * Frees the heap buffers of a slot and clears everything but its locks.
+ */
+static void clear_slot(socket_state *state)
+{
+    HANDLE heap = GetProcessHeap();
+
+    if (state->peer.tx_buf)
+    {
+        HeapFree(heap, 0, state->peer.tx_buf);
+    }
+    if (state->peer.rx_wire)
+    {
+        HeapFree(heap, 0, state->peer.rx_wire);
+    }
+    if (state->peer.rx_plain)
+    {
+        HeapFree(heap, 0, state->peer.rx_plain);
+    }
+    if (state->peer.tx_history.data)
+    {
+        HeapFree(heap, 0, state->peer.tx_history.data);
+    }
+    if (state->peer.rx_history.data)
+    {
+        HeapFree(heap, 0, state->peer.rx_history.data);
+    }
+    if (state->peer.replay.data)
+    {
+        HeapFree(heap, 0, state->peer.replay.data);
+    }
+    rudp_close(state->peer.tunnel);
+    shm_ring_close(state->peer.shm_out);
+    shm_ring_close(state->peer.shm_in);
+    send_queue_clear(&state->queue, state->s);
+
+    memset(&state->peer, 0, sizeof(state->peer));
+    memset(&state->stats, 0, sizeof(state->stats));
+    state->s = INVALID_SOCKET;
+    state->transport = INVALID_SOCKET;
+    state->direction = SOCKET_DIRECTION_UNKNOWN;
+    memset(&state->remote_addr, 0, sizeof(state->remote_addr));
+    state->remote_addr_len = 0;
+    state->recv_streak = 0;
+    state->first_seen = 0;
+    state->in_use = FALSE;
+}
+
+socket_state *get_socket_state(SOCKET s, BOOL create)
+{
+    socket_state *found = NULL;
+    socket_state *free_slot = NULL;
+
+    ensure_table_initialized();
+    EnterCriticalSection(&s_table_lock);
+
+    for (int i = 0; i < MAX_TRACKED_SOCKETS; i++)
+    {
+        if (s_sockets[i].in_use && s_sockets[i].s == s)
+        {
+            found = &s_sockets[i];
+            break;
+        }
+        if (!free_slot && !s_sockets[i].in_use)
+        {
+            free_slot = &s_sockets[i];
+        }
+    }
+
+    if (!found && create)
+    {
+        if (free_slot)
+        {
+            free_slot->s = s;
+            free_slot->transport = s;
+            free_slot->in_use = TRUE;
+            free_slot->first_seen = clock_ticks();
+            free_slot->stats.last_report = free_slot->first_seen;
+            found = free_slot;
+        }
+        else
+        {
+            logf_rate_limited("socket_table_full", "[HOOK] Socket table full, socket %u is not tracked", (unsigned)s);
+        }
+    }
+
+    LeaveCriticalSection(&s_table_lock);
+    return found;
+}
+
+socket_state *find_socket_state(BOOL (*match)(const socket_state *state, void *context), void *context)
+{
+    socket_state *found = NULL;
+
+    ensure_table_initialized();
+    EnterCriticalSection(&s_table_lock);
+    for (int i = 0; i < MAX_TRACKED_SOCKETS && !found; i++)
+    {
+        if (s_sockets[i].in_use && match(&s_sockets[i], context))
+        {
+            found = &s_sockets[i];
+        }
+    }
+    LeaveCriticalSection(&s_table_lock);
+    return found;
+}
+
+void release_socket_state(SOCKET s)
+{
+    socket_state *state = get_socket_state(s, FALSE);
+    if (!state)
+    {
+        return;
+    }
+
+    // Take both I/O locks so no hook is still using the buffers
+    EnterCriticalSection(&state->recv_lock);
+    EnterCriticalSection(&state->send_lock);
+    EnterCriticalSection(&s_table_lock);
+    clear_slot(state);
+    LeaveCriticalSection(&s_table_lock);
+    LeaveCriticalSection(&state->send_lock);
+    LeaveCriticalSection(&state->recv_lock);
+}
+
+void reset_socket_states(void)
+{
+    ensure_table_initialized();
+    for (int i = 0; i < MAX_TRACKED_SOCKETS; i++)
+    {
+        if (s_sockets[i].in_use)
+        {
+            release_socket_state(s_sockets[i].s);
+        }
+    }
+}
@@ -0,0 +1,174 @@
+#ifndef SOCKET_STATE_H
+#define SOCKET_STATE_H
+
+#include "delta.h"
+#include "replay.h"
+#include "rudp.h"
+#include "send_queue.h"
+#include "shm_ring.h"
+#include "timesync.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#define MAX_TRACKED_SOCKETS 64 // server.dll uses one socket per player plus the listener
+
+/**
+ * Negotiation state of the framed peer protocol on one connection.
+ */
+typedef enum
+{
+    PEER_STATE_NEW = 0,     // Socket not yet seen by the peer layer
+    PEER_STATE_NEGOTIATING, // Waiting to learn whether the remote side is patched
+    PEER_STATE_FRAMED,      // Remote side is patched, framing active or about to be
+    PEER_STATE_RAW          // Remote side is unpatched (or negotiation failed): pass-through
+} peer_state;
+
+/**
+ * Framed peer protocol state. Outgoing and incoming directions switch to
+ * framing independently, each at an urgent-data mark in its own stream.
+ */
+typedef struct
+{
+    peer_state    state;
+    BOOL          initiator;            // This side sends HELLO; the other side answers with its mark
+    DWORD         negotiate_start;      // Tick count when negotiation began
+    BOOL          switch_pending;       // Our mark must be sent as soon as the send lock is free
+    BOOL          tx_framed;            // Our mark is sent: outgoing data is framed
+    BOOL          rx_mark_expected;     // Remote side is patched and its mark is on the way
+    BOOL          rx_framed;            // Remote mark passed: incoming data is framed
+    BOOL          peer_hello_received;
+    uint32_t      peer_caps;            // Capabilities announced in the remote HELLO frame
+    uint8_t      *tx_buf;               // Frame assembly buffer
+    uint8_t      *rx_wire;              // Received, not yet parsed frame bytes
+    int           rx_wire_len;
+    uint8_t      *rx_plain;             // Decoded game bytes not yet handed to server.dll
+    int           rx_plain_start;
+    int           rx_plain_end;
+    delta_history tx_history;           // Messages we sent, for delta encoding
+    delta_history rx_history;           // Messages we received, for delta decoding
+    DWORD         last_rx;              // Tick count of the last bytes received while framed
+    DWORD         last_ping_sent;       // Tick count of our last heartbeat PING
+    BOOL          pong_pending;         // A PONG answer is owed to the peer
+    uint32_t      pong_echo;            // Timestamp to echo in that PONG
+    volatile BOOL dead;                 // Heartbeats stopped: socket reports WSAECONNRESET
+    volatile LONG handed_over;          // A late RESUME gave the handle to a session; server.dll's close leaves it open
+    uint64_t      local_session_id;     // Announced in our HELLO, names this connection in a RESUME
+    uint64_t      peer_session_id;      // Announced in the remote HELLO
+    uint64_t      rx_seq;               // Game bytes decoded from incoming frames so far
+    replay_buffer replay;               // Recently sent game bytes, tx sequence is replay.end_seq
+    volatile LONG suspended;            // Connection lost, waiting for a reconnect
+    DWORD         suspend_start;        // Tick count when the connection was lost
+    uint64_t      suspend_seq;          // Send sequence at that moment
+    volatile LONG resume_generation;    // Bumped on every suspension, stops stale reconnect threads
+    rudp_conn    *tunnel;               // Reliable UDP stream to the peer, NULL unless UdpTunnel is on
+    BOOL          tunnel_offer_pending; // Our TUNNEL_OFFER must still be sent
+    BOOL          tunnel_tx;            // Our TUNNEL_SWITCH is sent: outgoing frames use the tunnel
+    BOOL          tunnel_rx;            // Remote TUNNEL_SWITCH received: incoming frames come from the tunnel
+    shm_ring     *shm_out;              // Our frames' ring, NULL unless SharedMemory is on and the peer may be local
+    shm_ring     *shm_in;               // Peer's ring, opened when its offer named a ring on this host
+    BOOL          shm_offer_pending;    // Our SHM_OFFER must still be sent
+    BOOL          shm_answer_pending;   // Our SHM_ACCEPT answer must still be sent
+    BOOL          shm_accepted;         // Peer mapped our ring
+    BOOL          shm_tx;               // Our SHM_SWITCH is sent: outgoing frames use our ring
+    BOOL          shm_rx;               // Remote SHM_SWITCH received: incoming frames come from the peer's ring
+    DWORD         shm_last_check;       // Tick count of the last TCP reset check while the ring was empty
+    timesync      clock;                // Offset of the peer's clock to ours (ClockSync)
+    DWORD         last_time_request;    // Tick count of our last TIME_REQUEST
+    BOOL          time_reply_pending;   // A TIME_REPLY answer is owed to the peer
+    int64_t       time_origin_us;       // Origin timestamp to echo in that reply
+    int64_t       time_received_us;     // Our clock when that request arrived
+} peer_link;
+
+/**
+ * Per-socket traffic counters. Tick values are QueryPerformanceCounter units.
+ */
+typedef struct
+{
+    uint64_t app_bytes_out;    // Bytes server.dll asked to send
+    uint64_t wire_bytes_out;   // Bytes written to the socket for them
+    uint64_t app_bytes_in;     // Bytes handed to server.dll
+    uint64_t wire_bytes_in;    // Bytes read from the socket
+    uint64_t compress_ticks;   // Time spent compressing
+    uint64_t decompress_ticks; // Time spent decompressing
+    uint32_t frames_out;
+    uint32_t frames_in;
+    uint32_t compressed_frames_out;
+    uint32_t delta_frames_out;
+    uint32_t srtt_us;          // Smoothed heartbeat round-trip time
+    uint32_t rttvar_us;        // Round-trip time variation
+    uint32_t rtt_min_us;       // Lowest round-trip time seen
+    uint32_t rtt_samples;
+    uint32_t resumes;          // Successful reconnects
+    uint32_t recv_empty_calls; // recv() calls from server.dll that found no data (RecvWaitUs)
+    uint32_t recv_waits;       // Of those, calls that waited for data
+    uint32_t recv_wait_hits;   // Waits that ended with data
+    uint64_t recv_wait_us;     // Time spent in all waits
+    uint64_t recv_hit_us;      // Time spent in waits that ended with data
+    DWORD    last_report;      // Tick count of the last periodic stats line
+} socket_stats;
+
+/**
+ * How a socket came to be connected, as seen by the connect/accept hooks.
+ */
+typedef enum
+{
+    SOCKET_DIRECTION_UNKNOWN = 0,
+    SOCKET_DIRECTION_OUTGOING, // server.dll called connect()
+    SOCKET_DIRECTION_ACCEPTED  // Returned by accept() on a listener
+} socket_direction;
+
+/**
+ * Everything the hooks track about one server.dll socket.
+ */
+typedef struct
+{
+    SOCKET                  s;
+    SOCKET                  transport;   // Connection carrying the frames; replaced when a session resumes
+    BOOL                    in_use;
+    DWORD                   first_seen;
+    CRITICAL_SECTION        send_lock;   // Serializes writes to the socket
+    CRITICAL_SECTION        recv_lock;   // Serializes reads from the socket
+    socket_direction        direction;
+    struct sockaddr_storage remote_addr; // connect() target, used to reconnect
+    int                     remote_addr_len;
+    peer_link               peer;
+    send_queue              queue;       // Game data waiting for a slow receiver (SendQueueKB)
+    uint32_t                recv_streak; // Empty recv() calls in a row (RecvWaitUs)
+    BOOL                    nonblocking; // server.dll made the socket non-blocking: the readiness watcher may take it
+    socket_stats            stats;
+} socket_state;
+
+/**
+ * Looks up the state for a socket, optionally creating it.
+ *
+ * @param s Socket handle
+ * @param create TRUE to allocate a slot if the socket is not tracked yet
+ * @return Socket state, or NULL if not tracked (or the table is full)
+ */
+socket_state *get_socket_state(SOCKET s, BOOL create);
+
+/**
+ * Calls a predicate on every tracked socket until it returns TRUE.
+ *
+ * @param match Predicate receiving a tracked state and the caller's context
+ * @param context Passed through to match
+ * @return First state the predicate accepted, or NULL
+ */
+socket_state *find_socket_state(BOOL (*match)(const socket_state *state, void *context), void *context);
+
+/**
+ * Frees the state for a socket (buffers included). Safe for untracked sockets.
+ *
+ * @param s Socket handle
+ */
+void release_socket_state(SOCKET s);
+
+/**
+ * Releases every tracked socket. Used on cleanup and between tests.
+ */
+void reset_socket_states(void);
+
+#endif // SOCKET_STATE_H
@@ -0,0 +1,137 @@
+/*
+ * sockprofile.c: Socket options for server.dll's connections.
+ *
+ * Every socket starts on Windows defaults, which suit neither side of a
+ * multiplayer game: Nagle's algorithm holds each small update back until
+ * the previous one is acknowledged, the default buffers are sized for a
+ * LAN round trip, and keepalives only start after two hours of silence.
+ * With SocketProfile, the hooks set one profile's options on every new
+ * connection before its handshake: before connect(), and on listeners
+ * before listen(), whose accepted sockets inherit them. The handshake
+ * fixes the receive window scale, so buffers set later cannot use it:
+ *
+ *   TCP_NODELAY         updates leave as soon as server.dll writes them
+ *   SO_SNDBUF/SO_RCVBUF sized for the profile's round trip
+ *   SIO_KEEPALIVE_VALS  a silent peer is noticed within seconds, not hours
+ *   SO_LINGER           off in every profile: closesocket() returns at once
+ *                       and unsent data drains in the background. A linger
+ *                       timeout makes closesocket() fail on server.dll's
+ *                       non-blocking sockets, and a zero timeout resets the
+ *                       connection and drops the last updates.
+ *
+ * Each application is logged; options the stack refuses are logged and
+ * skipped. BufferTuning may still grow the buffers later, and with it on,
+ * a profile set afterwards (an AutoProfile switch) keeps a buffer that is
+ * already larger than the profile's instead of shrinking it.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "sockprofile.h"
+#include "config.h"
+#include "logging.h"
+#include <mstcpip.h>
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+static const socket_profile s_profiles[] = {
+    {"LAN", TRUE, 64 * 1024, 10000, 1000},
+    {"VPN low latency", TRUE, 256 * 1024, 20000, 2000},
+    {"VPN lossy", TRUE, 512 * 1024, 60000, 5000},
+};
+
+static volatile LONG s_applied = 0;
+static volatile LONG s_failed = 0;
+
+const socket_profile *sockprofile_get(DWORD profile)
+{
+    if (profile == SOCKET_PROFILE_OFF || profile > SOCKET_PROFILE_VPN_LOSSY)
+    {
+        return NULL;
+    }
+    return &s_profiles[profile - 1];
+}
+
+/**
+ * Sets one option, logging a refusal.
+ *
+ * @return TRUE if the option was set
+ */
+static BOOL set_option(SOCKET s, int level, int option, const char *name, const void *value, int value_len)
+{
+    if (setsockopt(s, level, option, (const char *)value, value_len) == SOCKET_ERROR)
+    {
+        logf_rate_limited("sockprofile_failed", "[PROFILE] Socket %u: setting %s failed: %d", (unsigned)s, name,
+                          WSAGetLastError());
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Sets SO_SNDBUF or SO_RCVBUF to a profile's size. With BufferTuning, a
+ * buffer that is already at least that large is left alone.
+ *
+ * @param kept Set to TRUE if the buffer kept a larger size
+ * @return TRUE if the buffer has at least the profile's size
+ */
+static BOOL set_buffer(SOCKET s, int option, const char *name, int bytes, BOOL *kept)
+{
+    int current = 0;
+    int current_len = sizeof(current);
+    if (g_config.buffer_tuning && getsockopt(s, SOL_SOCKET, option, (char *)&current, &current_len) == 0 &&
+        current >= bytes)
+    {
+        *kept |= current > bytes;
+        return TRUE;
+    }
+    return set_option(s, SOL_SOCKET, option, name, &bytes, sizeof(bytes));
+}
+
+BOOL sockprofile_apply(SOCKET s, DWORD profile)
+{
+    const socket_profile *p = sockprofile_get(profile);
+    if (!p)
+    {
+        return TRUE;
+    }
+
+    int  error = WSAGetLastError(); // connect() callers read it after the hook returns
+    BOOL ok = TRUE;
+    BOOL kept = FALSE;
+
+    int  no_delay = p->no_delay ? 1 : 0;
+    ok &= set_option(s, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", &no_delay, sizeof(no_delay));
+    ok &= set_buffer(s, SO_SNDBUF, "SO_SNDBUF", p->buffer_bytes, &kept);
+    ok &= set_buffer(s, SO_RCVBUF, "SO_RCVBUF", p->buffer_bytes, &kept);
+
+    struct linger no_linger = {0};
+    ok &= set_option(s, SOL_SOCKET, SO_LINGER, "SO_LINGER", &no_linger, sizeof(no_linger));
+
+    struct tcp_keepalive keepalive = {1, p->keepalive_idle_ms, p->keepalive_interval_ms};
+    DWORD                returned = 0;
+    if (WSAIoctl(s, SIO_KEEPALIVE_VALS, &keepalive, sizeof(keepalive), NULL, 0, &returned, NULL, NULL) ==
+        SOCKET_ERROR)
+    {
+        logf_rate_limited("sockprofile_failed", "[PROFILE] Socket %u: setting SIO_KEEPALIVE_VALS failed: %d",
+                          (unsigned)s, WSAGetLastError());
+        ok = FALSE;
+    }
+
+    logf("[PROFILE] Socket %u: %s profile%s (TCP_NODELAY=%d, buffers %d KB%s, keepalive after %lu ms every %lu ms, "
+         "no linger)",
+         (unsigned)s, p->name, ok ? "" : " partly applied", no_delay, p->buffer_bytes / 1024,
+         kept ? " or the larger tuned size" : "", (unsigned long)p->keepalive_idle_ms,
+         (unsigned long)p->keepalive_interval_ms);
+    InterlockedIncrement(ok ? &s_applied : &s_failed);
+    WSASetLastError(error);
+    return ok;
+}
+
+sockprofile_stats sockprofile_get_stats(void)
+{
+    sockprofile_stats stats;
+    stats.applied = (uint32_t)s_applied;
+    stats.failed = (uint32_t)s_failed;
+    return stats;
+}
@@ -0,0 +1,54 @@
+#ifndef SOCKPROFILE_H
+#define SOCKPROFILE_H
+
+#include <stdint.h>
+#include <windows.h>
+#include <winsock2.h>
+
+/**
+ * Socket options one profile sets on every new connection.
+ */
+typedef struct
+{
+    const char *name;
+    BOOL        no_delay;              // TCP_NODELAY: send small messages at once instead of waiting for an ACK
+    int         buffer_bytes;          // SO_SNDBUF and SO_RCVBUF
+    DWORD       keepalive_idle_ms;     // SIO_KEEPALIVE_VALS: silence before the first keepalive probe
+    DWORD       keepalive_interval_ms; // ...and between unanswered probes
+} socket_profile;
+
+/**
+ * Counters for the log and tests.
+ */
+typedef struct
+{
+    uint32_t applied; // Connections that got every option of their profile
+    uint32_t failed;  // Connections on which at least one option was refused
+} sockprofile_stats;
+
+/**
+ * Returns the options of a profile, or NULL for SOCKET_PROFILE_OFF and
+ * unknown values.
+ *
+ * @param profile One of the SOCKET_PROFILE_* values (config.h)
+ */
+const socket_profile *sockprofile_get(DWORD profile);
+
+/**
+ * Sets a profile's options on a socket about to connect or listen, or on
+ * an accepted one, and logs them. Options the stack refuses are logged and
+ * skipped; the socket stays usable either way. With BufferTuning, buffers
+ * larger than the profile's are kept.
+ *
+ * @param s Socket handle
+ * @param profile One of the SOCKET_PROFILE_* values (SOCKET_PROFILE_OFF does nothing)
+ * @return TRUE if every option was set
+ */
+BOOL sockprofile_apply(SOCKET s, DWORD profile);
+
+/**
+ * Returns a copy of the counters.
+ */
+sockprofile_stats sockprofile_get_stats(void);
+
+#endif // SOCKPROFILE_H
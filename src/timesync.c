@@ -0,0 +1,80 @@
+/*
+ * timesync.c: Clock offset estimation between patched peers.
+ *
+ * Each machine's GetTickCount() counts from its own boot, and its crystal
+ * runs a few parts per million fast or slow. The peers exchange
+ * timestamps over the framed protocol like NTP does: with our send time
+ * t1, the peer's receive and reply times t2 and t3, and our receive time
+ * t4, the peer's clock is ahead of ours by ((t2 - t1) + (t3 - t4)) / 2,
+ * exact if both directions took equally long. The round trip
+ * (t4 - t1) - (t3 - t2) bounds the error, so the least delayed recent
+ * exchange is the most trustworthy.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include "timesync.h"
+#include <windows.h>
+
+BOOL timesync_add(timesync *sync, int64_t origin_us, int64_t receive_us, int64_t transmit_us, int64_t arrival_us)
+{
+    int64_t round_trip = arrival_us - origin_us;
+    int64_t held = transmit_us - receive_us;
+
+    if (round_trip < 0 || held < 0 || held > round_trip)
+    {
+        sync->rejected++;
+        return FALSE;
+    }
+
+    timesync_sample sample;
+    sample.offset_us = ((receive_us - origin_us) + (transmit_us - arrival_us)) / 2;
+    sample.delay_us = (uint32_t)(round_trip - held);
+    sample.local_us = origin_us + round_trip / 2;
+
+    sync->samples[sync->sample_next] = sample;
+    sync->sample_next = (sync->sample_next + 1) % TIMESYNC_FILTER_SAMPLES;
+    if (sync->sample_count < TIMESYNC_FILTER_SAMPLES)
+    {
+        sync->sample_count++;
+    }
+    sync->exchanges++;
+
+    // A newer sample wins a tie: its offset has drifted less
+    const timesync_sample *best = &sync->samples[0];
+    for (int i = 1; i < sync->sample_count; i++)
+    {
+        const timesync_sample *candidate = &sync->samples[i];
+        if (candidate->delay_us < best->delay_us ||
+            (candidate->delay_us == best->delay_us && candidate->local_us > best->local_us))
+        {
+            best = candidate;
+        }
+    }
+    sync->best = *best;
+
+    if (!sync->valid)
+    {
+        sync->valid = TRUE;
+        sync->anchor = sync->best;
+    }
+    else if (sync->best.local_us - sync->anchor.local_us >= TIMESYNC_DRIFT_MIN_US)
+    {
+        sync->drift_ppm = (double)(sync->best.offset_us - sync->anchor.offset_us) * 1000000.0 /
+                          (double)(sync->best.local_us - sync->anchor.local_us);
+    }
+    return TRUE;
+}
+
+int64_t timesync_offset_at(const timesync *sync, int64_t local_us)
+{
+    if (!sync->valid)
+    {
+        return 0;
+    }
+    return sync->best.offset_us + (int64_t)(sync->drift_ppm * (double)(local_us - sync->best.local_us) / 1000000.0);
+}
+
+DWORD timesync_interval_ms(const timesync *sync)
+{
+    return sync->exchanges < TIMESYNC_FILTER_SAMPLES ? TIMESYNC_STARTUP_INTERVAL_MS : TIMESYNC_INTERVAL_MS;
+}
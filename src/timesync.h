@@ -0,0 +1,68 @@
+#ifndef TIMESYNC_H
+#define TIMESYNC_H
+
+#include <stdint.h>
+#include <windows.h>
+
+#define TIMESYNC_FILTER_SAMPLES 8         // Recent exchanges; the one with the shortest round trip sets the offset
+#define TIMESYNC_INTERVAL_MS 2000         // Pause between exchanges once the filter is full
+#define TIMESYNC_STARTUP_INTERVAL_MS 100  // Pause between the first TIMESYNC_FILTER_SAMPLES exchanges
+#define TIMESYNC_DRIFT_MIN_US 30000000    // Span of estimates needed before a drift is computed
+
+/**
+ * One completed exchange.
+ */
+typedef struct
+{
+    int64_t  offset_us; // Peer clock minus ours
+    uint32_t delay_us;  // Round trip without the peer's time between receiving and answering
+    int64_t  local_us;  // Our clock halfway through the exchange
+} timesync_sample;
+
+/**
+ * Clock offset and drift estimate for one peer, NTP style: each exchange
+ * carries our send time, the peer's receive and reply times, and our
+ * receive time. Queuing on a VPN delays one direction more than the other,
+ * which biases an exchange's offset by up to half the extra delay, so the
+ * estimate uses the exchange with the shortest round trip among the last
+ * TIMESYNC_FILTER_SAMPLES. Drift is the slope between the first estimate
+ * and the latest one. Times are microseconds of clock_now_us(). Not
+ * thread-safe; the owner locks.
+ */
+typedef struct
+{
+    timesync_sample samples[TIMESYNC_FILTER_SAMPLES];
+    int             sample_count;
+    int             sample_next;   // Slot the next exchange replaces
+    BOOL            valid;         // At least one exchange completed
+    timesync_sample best;          // Filtered estimate
+    timesync_sample anchor;        // First estimate, start of the drift measurement
+    double          drift_ppm;     // Peer clock rate minus ours, parts per million (0 until measurable)
+    uint32_t        exchanges;
+    uint32_t        rejected;      // Exchanges with impossible timestamps
+} timesync;
+
+/**
+ * Adds one exchange.
+ *
+ * @param sync Estimate to update
+ * @param origin_us Our clock when the request left
+ * @param receive_us Peer clock when the request arrived
+ * @param transmit_us Peer clock when the reply left
+ * @param arrival_us Our clock when the reply arrived
+ * @return FALSE if the timestamps were inconsistent and the exchange was ignored
+ */
+BOOL timesync_add(timesync *sync, int64_t origin_us, int64_t receive_us, int64_t transmit_us, int64_t arrival_us);
+
+/**
+ * Returns the estimated offset (peer clock minus ours) at a moment of our
+ * clock, extrapolated with the drift.
+ */
+int64_t timesync_offset_at(const timesync *sync, int64_t local_us);
+
+/**
+ * Returns how long to wait before the next exchange.
+ */
+DWORD timesync_interval_ms(const timesync *sync);
+
+#endif // TIMESYNC_H
@@ -8,8 +8,26 @@
  */
 
 #define WIN32_LEAN_AND_MEAN
+#include "buftune.h"
+#include "clock.h"
+#include "config.h"
+#include "delta.h"
+#include "frameprof.h"
 #include "hooks.h"
+#include "iocp.h"
+#include "logging.h"
+#include "netclass.h"
+#include "lz4.h"
+#include "pacer.h"
 #include "pattern_matcher.h"
+#include "peer.h"
+#include "readiness.h"
+#include "replay.h"
+#include "rudp.h"
+#include "shm_ring.h"
+#include "socket_state.h"
+#include "sockprofile.h"
+#include "timesync.h"
 #include "versions.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,11 +39,26 @@
 /* hooks.c globals exposed under NETWORKFIX_TEST */
 extern int(WSAAPI *real_recv)(SOCKET, char *, int, int);
 extern int(WSAAPI *real_send)(SOCKET, const char *, int, int);
+extern int(WSAAPI *real_WSASend)(SOCKET, LPWSABUF, DWORD, LPDWORD, DWORD, LPWSAOVERLAPPED,
+                                 LPWSAOVERLAPPED_COMPLETION_ROUTINE);
+extern int(WSAAPI *real_closesocket)(SOCKET);
+extern int(WSAAPI *real_connect)(SOCKET, const struct sockaddr *, int);
+extern SOCKET(WSAAPI *real_accept)(SOCKET, struct sockaddr *, int *);
+extern int(WSAAPI *real_listen)(SOCKET, int);
+extern int(WSAAPI *real_ioctlsocket)(SOCKET, long, u_long *);
+extern int(WSAAPI *real_select)(int, fd_set *, fd_set *, fd_set *, const struct timeval *);
+extern int(WSAAPI *real_WSAPoll)(WSAPOLLFD *, ULONG, int);
+extern DWORD(WINAPI *real_GetTickCount)(void);
+extern DWORD(WINAPI *real_timeGetTime)(void);
+extern BOOL(WINAPI *real_QueryPerformanceCounter)(LARGE_INTEGER *);
+extern void(WINAPI *real_Sleep)(DWORD);
 
 typedef int(__cdecl *srv_gameStreamReader_t)(int *ctx, int received, int totalLen);
 extern srv_gameStreamReader_t real_srv_gameStreamReader;
 int __cdecl                   hook_srv_gameStreamReader(int *ctx, int received, int totalLen);
 
+/* clock.c internals exposed under NETWORKFIX_TEST */
+
 /* pattern_matcher.c internals exposed under NETWORKFIX_TEST */
 long find_pattern_in_memory(const unsigned char *haystack, size_t haystack_size, const unsigned char *needle,
                             const unsigned char *mask, size_t needle_size);
@@ -44,6 +77,7 @@ void       test_sleep(DWORD ms)
 {
     g_sleep_calls++;
     g_sleep_total_ms += (int)ms;
+    clock_advance(ms); /* Moves virtual time only */
 }
 
 /* ---- Scriptable recv mock ---- */
@@ -136,17 +170,66 @@ static int WSAAPI mock_send(SOCKET s, const char *buf, int len, int flags)
     return chunk;
 }
 
+/* ---- Scriptable WSASend mock (gathered queue flushes) ---- */
+typedef struct
+{
+    int   accept;         /* bytes to accept per call, across buffer boundaries (0 -> WSAEWOULDBLOCK) */
+    int   call_count;
+    DWORD last_count;     /* buffers passed to the last call */
+    char *last_first;     /* first buffer's data pointer in the last call */
+    char  written[1024];  /* everything accepted so far, in order */
+    int   written_len;
+} wsasend_script;
+
+static wsasend_script g_wsasend_script;
+
+static int WSAAPI mock_WSASend(SOCKET s, LPWSABUF bufs, DWORD count, LPDWORD sent, DWORD flags,
+                               LPWSAOVERLAPPED overlapped, LPWSAOVERLAPPED_COMPLETION_ROUTINE routine)
+{
+    (void)s;
+    (void)flags;
+    (void)overlapped;
+    (void)routine;
+    g_wsasend_script.call_count++;
+    g_wsasend_script.last_count = count;
+    g_wsasend_script.last_first = count > 0 ? bufs[0].buf : NULL;
+
+    if (g_wsasend_script.accept <= 0)
+    {
+        WSASetLastError(WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+
+    int left = g_wsasend_script.accept;
+    *sent = 0;
+    for (DWORD i = 0; i < count && left > 0; i++)
+    {
+        int take = (int)bufs[i].len < left ? (int)bufs[i].len : left;
+        if (take > (int)sizeof(g_wsasend_script.written) - g_wsasend_script.written_len)
+            take = (int)sizeof(g_wsasend_script.written) - g_wsasend_script.written_len;
+        memcpy(g_wsasend_script.written + g_wsasend_script.written_len, bufs[i].buf, take);
+        g_wsasend_script.written_len += take;
+        *sent += take;
+        left -= take;
+    }
+    return 0;
+}
+
 /* ---- Helpers ---- */
 static void reset_state(void)
 {
     memset(&g_recv_script, 0, sizeof(g_recv_script));
     memset(&g_send_script, 0, sizeof(g_send_script));
+    memset(&g_wsasend_script, 0, sizeof(g_wsasend_script));
     g_send_script.abort_after = -1;
     g_send_script.zero_at = -1;
     g_sleep_calls = 0;
     g_sleep_total_ms = 0;
     real_recv = mock_recv;
     real_send = mock_send;
+    real_WSASend = NULL;
+    reset_config();
+    reset_socket_states();
     WSASetLastError(0);
 }
 
@@ -778,6 +861,2515 @@ static void test_pattern_matcher_does_not_match_unrelated_dll(void)
     /* Do NOT FreeLibrary(ntdll): handle is shared system-wide. */
 }
 
+/* ---- LZ4 block codec tests ---- */
+
+static void test_lz4_roundtrip_compressible(void)
+{
+    static uint8_t src[8192], packed[LZ4_COMPRESS_BOUND(8192)], unpacked[8192];
+    for (int i = 0; i < (int)sizeof(src); i++)
+        src[i] = (uint8_t)((i % 64) < 8 ? i : 0); /* repetitive, like game state records */
+
+    int packed_len = lz4_compress(src, sizeof(src), packed, sizeof(packed));
+    CHECK(packed_len > 0 && packed_len < (int)sizeof(src) / 4, "expected strong compression, got %d", packed_len);
+
+    int unpacked_len = lz4_decompress(packed, packed_len, unpacked, sizeof(unpacked));
+    CHECK(unpacked_len == (int)sizeof(src), "expected %d bytes back, got %d", (int)sizeof(src), unpacked_len);
+    CHECK(memcmp(src, unpacked, sizeof(src)) == 0, "roundtrip data mismatch");
+}
+
+static void test_lz4_roundtrip_incompressible(void)
+{
+    static uint8_t src[3000], packed[LZ4_COMPRESS_BOUND(3000)], unpacked[3000];
+    uint32_t       x = 12345;
+    for (int i = 0; i < (int)sizeof(src); i++)
+    {
+        x = x * 1103515245u + 12345u;
+        src[i] = (uint8_t)(x >> 16);
+    }
+
+    int packed_len = lz4_compress(src, sizeof(src), packed, sizeof(packed));
+    CHECK(packed_len > 0, "compress failed");
+    int unpacked_len = lz4_decompress(packed, packed_len, unpacked, sizeof(unpacked));
+    CHECK(unpacked_len == (int)sizeof(src), "expected %d bytes back, got %d", (int)sizeof(src), unpacked_len);
+    CHECK(memcmp(src, unpacked, sizeof(src)) == 0, "roundtrip data mismatch");
+}
+
+static void test_lz4_rejects_malformed_input(void)
+{
+    uint8_t out[64];
+    /* match offset 5 points before the start of the output */
+    const uint8_t bad_offset[] = {0x14, 'a', 0x05, 0x00, 0x00};
+    /* literal run claims more bytes than the block holds */
+    const uint8_t truncated[] = {0xF0, 0x20, 'a'};
+
+    CHECK(lz4_decompress(bad_offset, sizeof(bad_offset), out, sizeof(out)) == -1, "bad offset accepted");
+    CHECK(lz4_decompress(truncated, sizeof(truncated), out, sizeof(out)) == -1, "truncated literals accepted");
+    CHECK(lz4_decompress(bad_offset, sizeof(bad_offset), out, 0) == -1, "output overrun accepted");
+}
+
+/* ---- Delta codec tests ---- */
+
+static void test_delta_roundtrip_sparse_changes(void)
+{
+    static uint8_t ref[1000], msg[1000], runs[1000], rebuilt[1000];
+    for (int i = 0; i < (int)sizeof(ref); i++)
+        ref[i] = msg[i] = (uint8_t)(i * 7);
+    msg[0] ^= 0x01; /* first byte */
+    msg[17] ^= 0x80;
+    msg[19] ^= 0x80; /* short gap, merged into one run */
+    msg[500] ^= 0xFF;
+    msg[999] ^= 0x42; /* last byte */
+
+    CHECK(delta_count_diff(msg, ref, sizeof(msg)) == 5, "expected 5 differing bytes, got %d",
+          delta_count_diff(msg, ref, sizeof(msg)));
+
+    int runs_len = delta_encode(msg, ref, sizeof(msg), runs, sizeof(runs));
+    CHECK(runs_len > 0 && runs_len <= 4 * DELTA_RUN_HEADER_SIZE + 7, "unexpected delta size %d", runs_len);
+    CHECK(delta_apply(ref, sizeof(ref), runs, runs_len, rebuilt) == (int)sizeof(ref), "apply failed");
+    CHECK(memcmp(rebuilt, msg, sizeof(msg)) == 0, "rebuilt message differs");
+
+    CHECK(delta_encode(ref, ref, sizeof(ref), runs, sizeof(runs)) == 0, "identical messages need no runs");
+    CHECK(delta_encode(msg, ref, sizeof(msg), runs, 8) == -1, "runs overflowed a small output buffer");
+}
+
+static void test_delta_rejects_malformed_runs(void)
+{
+    uint8_t ref[32] = {0}, out[32];
+    /* skip 30, count 4: runs past the end of the message */
+    const uint8_t past_end[] = {30, 0, 4, 0, 1, 2, 3, 4};
+    /* count 3 but only 1 XOR byte present */
+    const uint8_t truncated[] = {0, 0, 3, 0, 1};
+    /* zero-length run */
+    const uint8_t empty_run[] = {1, 0, 0, 0};
+
+    CHECK(delta_apply(ref, sizeof(ref), past_end, sizeof(past_end), out) == -1, "run past end accepted");
+    CHECK(delta_apply(ref, sizeof(ref), truncated, sizeof(truncated), out) == -1, "truncated run accepted");
+    CHECK(delta_apply(ref, sizeof(ref), empty_run, sizeof(empty_run), out) == -1, "empty run accepted");
+}
+
+static void test_delta_history_finds_closest_message(void)
+{
+    static uint8_t storage[DELTA_HISTORY_SLOTS * DELTA_MAX_MESSAGE];
+    delta_history  history;
+    uint8_t        a[64], b[64], probe[64];
+    int            diff = -1;
+
+    memset(&history, 0, sizeof(history));
+    history.data = storage;
+    memset(a, 'a', sizeof(a));
+    memset(b, 'b', sizeof(b));
+    memcpy(probe, b, sizeof(probe));
+    probe[10] = 'x';
+
+    CHECK(delta_history_find(&history, probe, sizeof(probe), &diff) == -1, "empty history matched");
+    delta_history_push(&history, a, sizeof(a));
+    delta_history_push(&history, b, sizeof(b));
+    delta_history_push(&history, b, 32); /* different length, never a candidate */
+
+    CHECK(delta_history_find(&history, probe, sizeof(probe), &diff) == 1, "expected slot 1");
+    CHECK(diff == 1, "expected 1 differing byte, got %d", diff);
+
+    for (int i = 0; i < DELTA_HISTORY_SLOTS; i++)
+        delta_history_push(&history, a, sizeof(a));
+    CHECK(delta_history_find(&history, b, sizeof(b), &diff) >= 0 && diff == (int)sizeof(b),
+          "overwritten message still matched exactly");
+}
+
+static void test_replay_buffer_wraps_and_rejects_stale(void)
+{
+    uint8_t       storage[8];
+    replay_buffer replay = {storage, sizeof(storage), 0};
+    uint8_t       out[16];
+
+    replay_append(&replay, (const uint8_t *)"abcdef", 6);
+    CHECK(replay_copy(&replay, 2, out, sizeof(out)) == 4 && memcmp(out, "cdef", 4) == 0, "copy before wrap");
+    replay_append(&replay, (const uint8_t *)"ghijk", 5);
+    CHECK(replay_oldest_seq(&replay) == 3, "oldest seq %llu", (unsigned long long)replay_oldest_seq(&replay));
+    CHECK(replay_copy(&replay, 3, out, sizeof(out)) == 8 && memcmp(out, "defghijk", 8) == 0, "copy across wrap");
+    CHECK(replay_copy(&replay, 9, out, 1) == 1 && out[0] == 'j', "copy limited by max_len");
+    CHECK(replay_copy(&replay, 11, out, sizeof(out)) == 0, "copy at end not empty");
+    CHECK(replay_copy(&replay, 2, out, sizeof(out)) == -1, "overwritten byte still copied");
+    CHECK(replay_copy(&replay, 12, out, sizeof(out)) == -1, "future byte copied");
+}
+
+/* ---- Peer protocol tests over a real loopback connection ---- */
+
+/* Points the hooks at the real Winsock functions instead of the mocks. */
+static void use_real_winsock(void)
+{
+    real_recv = recv;
+    real_send = send;
+    real_WSASend = WSASend;
+    real_closesocket = closesocket;
+    real_connect = connect;
+    real_accept = accept;
+    real_listen = listen;
+    real_ioctlsocket = ioctlsocket;
+}
+
+/* Creates a connected, non-blocking loopback TCP pair, noted the way the connect and accept hooks would. */
+static BOOL make_tcp_pair(SOCKET *client, SOCKET *server)
+{
+    struct sockaddr_in addr;
+    int                addr_len = sizeof(addr);
+    u_long             non_blocking = 1;
+
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET)
+        return FALSE;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR || listen(listener, 1) == SOCKET_ERROR ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) == SOCKET_ERROR)
+    {
+        closesocket(listener);
+        return FALSE;
+    }
+
+    *client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (*client == INVALID_SOCKET || connect(*client, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+    {
+        closesocket(listener);
+        return FALSE;
+    }
+    *server = accept(listener, NULL, NULL);
+    closesocket(listener);
+    if (*server == INVALID_SOCKET)
+        return FALSE;
+
+    ioctlsocket(*client, FIONBIO, &non_blocking);
+    ioctlsocket(*server, FIONBIO, &non_blocking);
+    peer_note_connection(*client, SOCKET_DIRECTION_OUTGOING, (struct sockaddr *)&addr, sizeof(addr));
+    peer_note_connection(*server, SOCKET_DIRECTION_ACCEPTED, NULL, 0);
+    return TRUE;
+}
+
+/* Connects a pair through the connect/accept hooks, keeping the listener open for reconnects. */
+static BOOL make_hooked_pair(SOCKET *listener, SOCKET *client, SOCKET *server)
+{
+    struct sockaddr_in addr;
+    int                addr_len = sizeof(addr);
+    u_long             non_blocking = 1;
+
+    *listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (*listener == INVALID_SOCKET || bind(*listener, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        hook_listen(*listener, 4) == SOCKET_ERROR ||
+        getsockname(*listener, (struct sockaddr *)&addr, &addr_len) == SOCKET_ERROR)
+        return FALSE;
+    ioctlsocket(*listener, FIONBIO, &non_blocking);
+
+    *client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (*client == INVALID_SOCKET || hook_connect(*client, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR)
+        return FALSE;
+
+    DWORD start = GetTickCount();
+    *server = INVALID_SOCKET;
+    while (*server == INVALID_SOCKET && GetTickCount() - start < 1000)
+        *server = hook_accept(*listener, NULL, NULL);
+    if (*server == INVALID_SOCKET)
+        return FALSE;
+
+    ioctlsocket(*client, FIONBIO, &non_blocking);
+    ioctlsocket(*server, FIONBIO, &non_blocking);
+    return TRUE;
+}
+
+/* Accumulates what server.dll would receive on one side of the pair. */
+typedef struct
+{
+    SOCKET s;
+    BOOL   hooked; /* FALSE simulates an unpatched peer calling plain recv */
+    char   data[65536];
+    int    len;
+} peer_end;
+
+static void pump_end(peer_end *end)
+{
+    char chunk[4096];
+    int  r = end->hooked ? hook_recv(end->s, chunk, sizeof(chunk), 0) : recv(end->s, chunk, sizeof(chunk), 0);
+    if (r > 0 && end->len + r <= (int)sizeof(end->data))
+    {
+        memcpy(end->data + end->len, chunk, r);
+        end->len += r;
+    }
+}
+
+/* Pumps both ends until each has received at least the wanted byte counts. */
+static void pump_until(peer_end *a, int a_wanted, peer_end *b, int b_wanted, DWORD timeout_ms)
+{
+    DWORD start = GetTickCount();
+    while (GetTickCount() - start < timeout_ms)
+    {
+        pump_end(a);
+        pump_end(b);
+        if (a->len >= a_wanted && b->len >= b_wanted)
+            return;
+        Sleep(1);
+    }
+}
+
+static BOOL both_framed(SOCKET a, SOCKET b)
+{
+    socket_state *sa = get_socket_state(a, FALSE);
+    socket_state *sb = get_socket_state(b, FALSE);
+    return sa && sb && sa->peer.tx_framed && sa->peer.rx_framed && sb->peer.tx_framed && sb->peer.rx_framed &&
+           sa->peer.peer_hello_received && sb->peer.peer_hello_received;
+}
+
+/* Pumps both ends until negotiation finished in both directions. */
+static BOOL wait_until_framed(peer_end *a, peer_end *b)
+{
+    DWORD start = GetTickCount();
+    while (!both_framed(a->s, b->s) && GetTickCount() - start < 3000)
+    {
+        pump_end(a);
+        pump_end(b);
+        Sleep(1);
+    }
+    return both_framed(a->s, b->s);
+}
+
+/* Two patched ends negotiate framing and compression; game bytes survive intact. */
+static void test_peer_negotiates_and_compresses(void)
+{
+    static peer_end a, b;
+    static char     msg[6000];
+
+    use_real_winsock();
+    g_config.compression = TRUE;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    CHECK(make_tcp_pair(&a.s, &b.s) == TRUE, "could not create loopback pair");
+    a.hooked = b.hooked = TRUE;
+
+    /* Raw bytes sent before negotiation completes must still arrive in order. */
+    CHECK(hook_send(a.s, "early", 5, 0) == 5, "early send failed");
+
+    CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode");
+
+    for (int i = 0; i < (int)sizeof(msg); i++)
+        msg[i] = (char)((i % 100) < 10 ? 'A' + i % 7 : ' ');
+    CHECK(hook_send(a.s, msg, sizeof(msg), 0) == (int)sizeof(msg), "framed send failed");
+    CHECK(hook_send(b.s, "pong", 4, 0) == 4, "framed reply failed");
+
+    pump_until(&a, 4, &b, 5 + (int)sizeof(msg), 3000);
+    CHECK(b.len == 5 + (int)sizeof(msg), "expected %d bytes at b, got %d", 5 + (int)sizeof(msg), b.len);
+    CHECK(memcmp(b.data, "early", 5) == 0, "pre-negotiation bytes corrupted");
+    CHECK(memcmp(b.data + 5, msg, sizeof(msg)) == 0, "framed payload corrupted");
+    CHECK(a.len == 4 && memcmp(a.data, "pong", 4) == 0, "reply corrupted (len %d)", a.len);
+
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    CHECK(sa && sa->stats.compressed_frames_out >= 1, "expected a compressed frame");
+    CHECK(sa && sa->stats.wire_bytes_out < sa->stats.app_bytes_out, "wire bytes not reduced");
+
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+    CHECK(get_socket_state(a.s, FALSE) == NULL, "state not released on close");
+}
+
+/* The side that connected sends HELLO, whichever way its addresses compare; an unseen socket stays raw. */
+static void test_peer_role_follows_connect_direction(void)
+{
+    static peer_end a, b;
+
+    use_real_winsock();
+    g_config.compression = TRUE;
+    for (int swapped = 0; swapped < 2; swapped++)
+    {
+        memset(&a, 0, sizeof(a));
+        memset(&b, 0, sizeof(b));
+        CHECK(make_tcp_pair(&a.s, &b.s) == TRUE, "could not create loopback pair");
+        a.hooked = b.hooked = TRUE;
+        if (swapped)
+        {
+            /* As if the accepting end had connected: the roles follow, the address order does not matter. */
+            peer_note_connection(a.s, SOCKET_DIRECTION_ACCEPTED, NULL, 0);
+            peer_note_connection(b.s, SOCKET_DIRECTION_OUTGOING, NULL, 0);
+        }
+        CHECK(hook_send(a.s, "x", 1, 0) == 1, "initial send failed");
+        CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode (swapped %d)", swapped);
+        socket_state *sa = get_socket_state(a.s, FALSE);
+        socket_state *sb = get_socket_state(b.s, FALSE);
+        CHECK(sa && sb && sa->peer.initiator == !swapped && sb->peer.initiator == swapped,
+              "initiator does not follow the connect direction (swapped %d)", swapped);
+        hook_closesocket(a.s);
+        hook_closesocket(b.s);
+    }
+
+    memset(&a, 0, sizeof(a));
+    CHECK(make_tcp_pair(&a.s, &b.s) == TRUE, "could not create loopback pair");
+    peer_note_connection(a.s, SOCKET_DIRECTION_UNKNOWN, NULL, 0);
+    CHECK(hook_send(a.s, "x", 1, 0) == 1, "send on an unseen socket failed");
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    CHECK(sa && sa->peer.state == PEER_STATE_RAW, "socket without a direction did not stay raw");
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+}
+
+/* Repeated messages with small changes travel as deltas and decode exactly. */
+static void test_peer_delta_encodes_repeated_messages(void)
+{
+    static peer_end a, b;
+    static char     sent[20 * 200];
+
+    use_real_winsock();
+    g_config.delta_encoding = TRUE;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    CHECK(make_tcp_pair(&a.s, &b.s) == TRUE, "could not create loopback pair");
+    a.hooked = b.hooked = TRUE;
+    CHECK(hook_send(a.s, "x", 1, 0) == 1, "initial send failed");
+    CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode");
+
+    /* Periodic state update: same layout, a counter and one field change. */
+    for (int n = 0; n < 20; n++)
+    {
+        char *msg = sent + n * 200;
+        for (int i = 0; i < 200; i++)
+            msg[i] = (char)(i * 13);
+        msg[4] = (char)n;
+        msg[150 + n % 10] = 'D';
+        CHECK(hook_send(a.s, msg, 200, 0) == 200, "send %d failed", n);
+    }
+
+    pump_until(&a, 0, &b, 1 + (int)sizeof(sent), 3000);
+    CHECK(b.len == 1 + (int)sizeof(sent), "expected %d bytes, got %d", 1 + (int)sizeof(sent), b.len);
+    CHECK(memcmp(b.data + 1, sent, sizeof(sent)) == 0, "delta-decoded stream corrupted");
+
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    CHECK(sa && sa->stats.delta_frames_out >= 19, "expected deltas, got %u",
+          sa ? (unsigned)sa->stats.delta_frames_out : 0);
+    CHECK(sa && sa->stats.wire_bytes_out < sa->stats.app_bytes_out / 4, "deltas did not shrink the stream");
+
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+}
+
+/* Heartbeats feed the RTT estimate, never reach server.dll, and silence is detected. */
+static void test_peer_heartbeat_measures_rtt_and_detects_silence(void)
+{
+    static peer_end a, b;
+
+    use_real_winsock();
+    g_config.heartbeat_interval_ms = 20;
+    g_config.dead_peer_timeout_ms = 300;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    CHECK(make_tcp_pair(&a.s, &b.s) == TRUE, "could not create loopback pair");
+    a.hooked = b.hooked = TRUE;
+    CHECK(hook_send(a.s, "x", 1, 0) == 1, "initial send failed");
+    CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode");
+
+    DWORD start = GetTickCount();
+    while (GetTickCount() - start < 200)
+    {
+        pump_end(&a);
+        pump_end(&b);
+        Sleep(2);
+    }
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    socket_state *sb = get_socket_state(b.s, FALSE);
+    CHECK(sa && sa->stats.rtt_samples > 0, "no RTT samples at a");
+    CHECK(sb && sb->stats.rtt_samples > 0, "no RTT samples at b");
+    CHECK(a.len == 0 && b.len == 1, "heartbeats leaked to server.dll (a %d, b %d bytes)", a.len, b.len);
+
+    /* b stops calling the hooks: a must notice within the dead-peer timeout. */
+    char  chunk[64];
+    int   r = 0;
+    start = GetTickCount();
+    while (GetTickCount() - start < 2000 && (r = hook_recv(a.s, chunk, sizeof(chunk), 0)) != SOCKET_ERROR)
+        Sleep(5);
+    CHECK(r == SOCKET_ERROR && WSAGetLastError() == WSAECONNRESET, "silent peer not detected (r=%d)", r);
+    CHECK(GetTickCount() - start >= 250, "peer declared dead too early");
+    CHECK(hook_send(a.s, "y", 1, 0) == SOCKET_ERROR, "send on dead connection succeeded");
+
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+}
+
+/* On virtual time, a heartbeat goes out every interval and silence counts from the last arrival to the millisecond. */
+static void test_peer_heartbeat_follows_virtual_time(void)
+{
+    static peer_end a, b;
+    char            chunk[64];
+
+    use_real_winsock();
+    g_config.heartbeat_interval_ms = 1000;
+    g_config.dead_peer_timeout_ms = 5000;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    CHECK(make_tcp_pair(&a.s, &b.s) == TRUE, "could not create loopback pair");
+    a.hooked = b.hooked = TRUE;
+    CHECK(hook_send(a.s, "x", 1, 0) == 1, "initial send failed");
+    CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode");
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    CHECK(sa != NULL, "socket state missing");
+    if (!sa)
+        return;
+
+    /* Ten virtual seconds, each answered before the next: one round trip per interval */
+    clock_set_virtual(TRUE);
+    uint32_t samples = sa->stats.rtt_samples;
+    for (int second = 1; second <= 10; second++)
+    {
+        clock_advance(1000);
+        DWORD start = GetTickCount();
+        while (sa->stats.rtt_samples < samples + (uint32_t)second && GetTickCount() - start < 1000)
+        {
+            pump_end(&a);
+            pump_end(&b);
+            Sleep(1);
+        }
+    }
+    CHECK(sa->stats.rtt_samples - samples == 10, "%lu heartbeats answered in 10 virtual seconds",
+          (unsigned long)(sa->stats.rtt_samples - samples));
+    pump_end(&a);
+
+    /* b goes quiet: a holds on until DeadPeerTimeoutMs passed since the last arrival, and not a millisecond less */
+    clock_advance(sa->peer.last_rx + g_config.dead_peer_timeout_ms - clock_ticks());
+    CHECK(hook_recv(a.s, chunk, sizeof(chunk), 0) != SOCKET_ERROR, "peer declared dead at the timeout");
+    clock_advance(1);
+    int r = hook_recv(a.s, chunk, sizeof(chunk), 0);
+    CHECK(r == SOCKET_ERROR && WSAGetLastError() == WSAECONNRESET, "silent peer not detected (r=%d)", r);
+    CHECK(a.len == 0 && b.len == 1, "heartbeats leaked to server.dll (a %d, b %d bytes)", a.len, b.len);
+
+    clock_set_virtual(FALSE);
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+}
+
+/* A send stuck on a full buffer is aborted once the heartbeat peer is overdue. */
+static void test_peer_stalled_send_is_aborted(void)
+{
+    static peer_end a, b;
+    static char     big[1 << 20];
+
+    use_real_winsock();
+    g_config.heartbeat_interval_ms = 20;
+    g_config.dead_peer_timeout_ms = 200;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    CHECK(make_tcp_pair(&a.s, &b.s) == TRUE, "could not create loopback pair");
+    a.hooked = b.hooked = TRUE;
+    CHECK(hook_send(a.s, "x", 1, 0) == 1, "initial send failed");
+    CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode");
+
+    /* b never reads again, so the socket buffers fill up. */
+    DWORD start = GetTickCount();
+    int   r = 0;
+    for (int i = 0; i < 64 && r != SOCKET_ERROR && GetTickCount() - start < 5000; i++)
+        r = hook_send(a.s, big, sizeof(big), 0);
+    CHECK(r != (int)sizeof(big), "send never stalled");
+    CHECK(GetTickCount() - start < 5000, "stalled send was not aborted");
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    CHECK(sa && sa->peer.dead, "peer not marked dead");
+
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+}
+
+/* The negotiation timeout and the close linger run on the plugin clock, so virtual time fast-forwards them. */
+static void test_peer_deadlines_follow_virtual_time(void)
+{
+    static char big[262144];
+    SOCKET      a, b, host, player;
+    int         small_buffer = 4096;
+    char        chunk[16];
+
+    use_real_winsock();
+    g_config.compression = TRUE;
+    g_config.send_queue_kb = 512;
+    g_config.negotiate_timeout_ms = 60000;
+    CHECK(make_tcp_pair(&a, &b) == TRUE, "could not create loopback pair");
+    CHECK(make_tcp_pair(&player, &host) == TRUE, "could not create second loopback pair");
+    setsockopt(host, SOL_SOCKET, SO_SNDBUF, (const char *)&small_buffer, sizeof(small_buffer));
+    setsockopt(player, SOL_SOCKET, SO_RCVBUF, (const char *)&small_buffer, sizeof(small_buffer));
+    clock_set_virtual(TRUE);
+
+    /* b never answers the HELLO: a minute of virtual time ends the negotiation. */
+    CHECK(hook_send(a, "x", 1, 0) == 1, "initial send failed");
+    socket_state *sa = get_socket_state(a, FALSE);
+    CHECK(sa && sa->peer.state == PEER_STATE_NEGOTIATING, "negotiation did not start");
+    clock_advance(2 * g_config.negotiate_timeout_ms + 1);
+    hook_recv(a, chunk, sizeof(chunk), 0);
+    CHECK(sa->peer.state == PEER_STATE_RAW, "negotiation did not time out on virtual time");
+
+    /* The player never reads: closing the host gives up on the queue after a virtual second. */
+    g_config.compression = FALSE;
+    CHECK(hook_send(host, big, sizeof(big), 0) == (int)sizeof(big), "send was not queued");
+    socket_state *sh = get_socket_state(host, FALSE);
+    CHECK(sh && sh->queue.count > 0, "nothing left in the queue");
+    DWORD start = GetTickCount();
+    DWORD virtual_start = clock_ticks();
+    hook_closesocket(host);
+    CHECK(clock_ticks() - virtual_start >= SEND_QUEUE_LINGER_MS, "linger ended after %lu virtual ms",
+          (unsigned long)(clock_ticks() - virtual_start));
+    CHECK(GetTickCount() - start < SEND_QUEUE_LINGER_MS / 2, "linger took %lu real ms",
+          (unsigned long)(GetTickCount() - start));
+
+    clock_set_virtual(FALSE);
+    hook_closesocket(a);
+    closesocket(b);
+    closesocket(player);
+}
+
+/* A silent drop suspends the session; the reconnect replays unreceived and queued bytes exactly once. */
+static void test_peer_session_resumes_after_drop(void)
+{
+    static peer_end a, b;
+    SOCKET          listener;
+
+    use_real_winsock();
+    g_config.session_resume = TRUE;
+    g_config.heartbeat_interval_ms = 20;
+    g_config.dead_peer_timeout_ms = 200;
+    g_config.resume_timeout_ms = 5000;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    CHECK(make_hooked_pair(&listener, &a.s, &b.s) == TRUE, "could not create hooked pair");
+    a.hooked = b.hooked = TRUE;
+    CHECK(hook_send(a.s, "x", 1, 0) == 1, "initial send failed");
+    CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode");
+
+    /* b stops reading: these bytes stay in the old connection and must be replayed. */
+    CHECK(hook_send(a.s, "before-drop", 11, 0) == 11, "send before drop failed");
+
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    DWORD         start = GetTickCount();
+    while (sa && !sa->peer.suspended && GetTickCount() - start < 2000)
+    {
+        pump_end(&a);
+        Sleep(5);
+    }
+    CHECK(sa && sa->peer.suspended, "silent peer did not suspend the session");
+    CHECK(hook_send(a.s, "queued", 6, 0) == 6, "send while suspended was not queued");
+
+    /* The accepting side attaches the reconnect in accept, or on its first recv if the RESUME came later. */
+    SOCKET extra = INVALID_SOCKET;
+    SOCKET pending = INVALID_SOCKET;
+    start = GetTickCount();
+    while (sa->peer.suspended && GetTickCount() - start < 3000)
+    {
+        SOCKET r = hook_accept(listener, NULL, NULL);
+        if (r != INVALID_SOCKET)
+            pending = r;
+        if (pending != INVALID_SOCKET)
+        {
+            char probe;
+            int  got = hook_recv(pending, &probe, 1, 0);
+            if (got > 0)
+                extra = pending;
+            if (got == SOCKET_ERROR && WSAGetLastError() == WSAECONNRESET)
+            {
+                hook_closesocket(pending);
+                pending = INVALID_SOCKET;
+            }
+        }
+        pump_end(&a);
+        Sleep(5);
+    }
+    CHECK(!sa->peer.suspended && !sa->peer.dead, "session did not resume");
+    CHECK(extra == INVALID_SOCKET, "resume connection leaked to server.dll");
+    if (pending != INVALID_SOCKET)
+        hook_closesocket(pending);
+
+    CHECK(hook_send(a.s, "after", 5, 0) == 5, "send after resume failed");
+    pump_until(&a, 0, &b, 23, 2000);
+    CHECK(b.len == 23 && memcmp(b.data, "xbefore-dropqueuedafter", 23) == 0, "b saw %d bytes: %.*s", b.len, b.len,
+          b.data);
+    socket_state *sb = get_socket_state(b.s, FALSE);
+    CHECK(sb && sb->stats.resumes == 1 && sa->stats.resumes == 1, "resume not counted on both ends");
+
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+    closesocket(listener);
+}
+
+/* Opens a plain connection to a listener, as an unpatched client or a hand-made reconnect would. */
+static SOCKET connect_raw(SOCKET listener)
+{
+    struct sockaddr_in addr;
+    int                addr_len = sizeof(addr);
+    SOCKET             s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    getsockname(listener, (struct sockaddr *)&addr, &addr_len);
+    if (s != INVALID_SOCKET && connect(s, (struct sockaddr *)&addr, addr_len) == SOCKET_ERROR)
+    {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+/* Pumps the accepting end alone until its silent peer suspends the session. */
+static BOOL wait_until_suspended(peer_end *end)
+{
+    socket_state *state = get_socket_state(end->s, FALSE);
+    DWORD         start = GetTickCount();
+    while (state && !state->peer.suspended && GetTickCount() - start < 2000)
+    {
+        pump_end(end);
+        Sleep(5);
+    }
+    return state && state->peer.suspended;
+}
+
+/* accept never waits for a RESUME: a late one is taken on the first recv, and an attached one lets accept go on. */
+static void test_peer_accept_never_waits_for_resume(void)
+{
+    static peer_end a, b, late, early;
+    SOCKET          listener;
+    u_long          blocking = 0;
+    u_long          non_blocking = 1;
+    uint8_t         frame[PEER_RESUME_FRAME_SIZE] = {PEER_FRAME_RESUME, 16, 0};
+    char            chunk[16];
+
+    use_real_winsock();
+    g_config.session_resume = TRUE;
+    g_config.heartbeat_interval_ms = 20;
+    g_config.dead_peer_timeout_ms = 200;
+    g_config.resume_timeout_ms = 5000;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    memset(&late, 0, sizeof(late));
+    memset(&early, 0, sizeof(early));
+    CHECK(make_hooked_pair(&listener, &a.s, &b.s) == TRUE, "could not create hooked pair");
+    a.hooked = b.hooked = TRUE;
+    CHECK(hook_send(a.s, "x", 1, 0) == 1, "initial send failed");
+    CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode");
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    socket_state *sb = get_socket_state(b.s, FALSE);
+    memcpy(frame + 3, &sb->peer.local_session_id, 8);
+    memcpy(frame + 11, &sa->peer.rx_seq, 8);
+
+    /* a stops answering, so b waits for a reconnect from now on; the game's listener blocks. */
+    CHECK(wait_until_suspended(&b), "silent peer did not suspend the accepting side");
+    ioctlsocket(listener, FIONBIO, &blocking);
+
+    /* An unpatched client that has not sent yet is handed over at once. */
+    SOCKET plain = connect_raw(listener);
+    DWORD  start = GetTickCount();
+    SOCKET accepted = hook_accept(listener, NULL, NULL);
+    CHECK(accepted != INVALID_SOCKET && GetTickCount() - start < 100, "accept waited %lu ms for a RESUME",
+          (unsigned long)(GetTickCount() - start));
+    send(plain, "hi", 2, 0);
+    CHECK(hook_recv(accepted, chunk, sizeof(chunk), 0) == 2 && memcmp(chunk, "hi", 2) == 0,
+          "unpatched client's bytes did not reach server.dll");
+    hook_closesocket(accepted);
+    closesocket(plain);
+
+    /* A RESUME sent after accept is taken on the first recv; server.dll's close leaves the connection open. */
+    late.s = connect_raw(listener);
+    accepted = hook_accept(listener, NULL, NULL);
+    CHECK(accepted != INVALID_SOCKET, "accept did not return the connection");
+    send(late.s, (const char *)frame, sizeof(frame), 0);
+    int r = hook_recv(accepted, chunk, sizeof(chunk), 0);
+    CHECK(r == SOCKET_ERROR && WSAGetLastError() == WSAECONNRESET, "late RESUME reached server.dll (r=%d)", r);
+    CHECK(!sb->peer.suspended && !sb->peer.dead, "late RESUME did not resume the session");
+    CHECK(hook_closesocket(accepted) == 0, "closing the handed-over handle failed");
+    ioctlsocket(late.s, FIONBIO, &non_blocking);
+    CHECK(hook_send(b.s, "late", 4, 0) == 4, "send after the late resume failed");
+    pump_until(&late, PEER_RESUME_FRAME_SIZE + 1, &b, 0, 1000);
+    CHECK(late.len > PEER_RESUME_FRAME_SIZE && (uint8_t)late.data[0] == PEER_FRAME_RESUME,
+          "connection closed with server.dll's handle (%d bytes)", late.len);
+
+    /* The reconnect drops again; this time its RESUME is there before accept, which goes on to the next client. */
+    struct linger abort_close = {1, 0};
+    setsockopt(late.s, SOL_SOCKET, SO_LINGER, (const char *)&abort_close, sizeof(abort_close));
+    closesocket(late.s);
+    CHECK(wait_until_suspended(&b), "reset did not suspend the session again");
+    early.s = connect_raw(listener);
+    send(early.s, (const char *)frame, sizeof(frame), 0);
+    plain = connect_raw(listener);
+    Sleep(50);
+    accepted = hook_accept(listener, NULL, NULL);
+    CHECK(!sb->peer.suspended && !sb->peer.dead, "RESUME before accept did not resume the session");
+    send(plain, "next", 4, 0);
+    CHECK(accepted != INVALID_SOCKET && hook_recv(accepted, chunk, sizeof(chunk), 0) == 4 &&
+              memcmp(chunk, "next", 4) == 0,
+          "accept did not go on to the next connection");
+    ioctlsocket(early.s, FIONBIO, &non_blocking);
+    pump_until(&early, PEER_RESUME_FRAME_SIZE, &b, 0, 1000);
+    CHECK(early.len >= PEER_RESUME_FRAME_SIZE && (uint8_t)early.data[0] == PEER_FRAME_RESUME,
+          "reconnect got no RESUME answer");
+
+    hook_closesocket(accepted);
+    closesocket(plain);
+    closesocket(early.s);
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+    closesocket(listener);
+}
+
+/* The reliable UDP stream delivers every byte in order through 15% loss, delay and reordering. */
+static void test_rudp_recovers_from_loss_and_reordering(void)
+{
+    static uint8_t     sent[200000], received[sizeof(sent)];
+    struct sockaddr_in local;
+    int                local_len = sizeof(local);
+    impair_profile     impairment = {15, 2, 4};
+    int                written = 0, got = 0;
+
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    rudp_conn *a = rudp_open((struct sockaddr *)&local, local_len, 0x1111, 5000, &impairment, FALSE, 0);
+    rudp_conn *b = rudp_open((struct sockaddr *)&local, local_len, 0x2222, 5000, &impairment, FALSE, 0);
+    CHECK(a && b, "could not open UDP sockets");
+    if (!a || !b)
+        return;
+
+    local.sin_port = htons(rudp_local_port(b));
+    rudp_set_peer(a, (struct sockaddr *)&local, local_len, 0x2222);
+    local.sin_port = htons(rudp_local_port(a));
+    rudp_set_peer(b, (struct sockaddr *)&local, local_len, 0x1111);
+
+    for (int i = 0; i < (int)sizeof(sent); i++)
+        sent[i] = (uint8_t)(i * 7 + i / 251);
+
+    DWORD start = GetTickCount();
+    while (got < (int)sizeof(sent) && GetTickCount() - start < 20000 && !rudp_failed(a))
+    {
+        if (written < (int)sizeof(sent) && rudp_path_confirmed(a))
+            written += rudp_write(a, sent + written, (int)sizeof(sent) - written);
+        rudp_poll(a);
+        rudp_poll(b);
+        got += rudp_read(b, received + got, (int)sizeof(received) - got);
+        Sleep(0);
+    }
+
+    CHECK(got == (int)sizeof(sent), "received %d of %d bytes", got, (int)sizeof(sent));
+    CHECK(memcmp(sent, received, got) == 0, "stream corrupted or reordered");
+    CHECK(a->stats.fast_retransmits > 0, "losses were not repaired by fast retransmit");
+    CHECK(a->stats.fast_retransmits > a->stats.timeouts, "timeouts (%u) outnumber fast retransmits (%u)",
+          (unsigned)a->stats.timeouts, (unsigned)a->stats.fast_retransmits);
+    rudp_close(a);
+    rudp_close(b);
+}
+
+/* A simulated 100 KB/s bottleneck with a 20 ms RTT: the model finds both and paces without building a queue. */
+static void test_pacer_estimates_bandwidth_and_spaces_packets(void)
+{
+    enum
+    {
+        PACKET = 1000,
+        SERVICE_MS = 10, /* The bottleneck forwards one packet per 10 ms */
+        PROP_MS = 20,
+        SLOTS = 256
+    };
+    static struct
+    {
+        pacer_stamp stamp;
+        uint32_t    sent_us;
+        uint32_t    ack_us; /* 0 while still queued at the bottleneck */
+    } packets[SLOTS];
+    pacer    p;
+    uint32_t head = 0, tail = 0; /* [tail, head) sent and not acknowledged */
+    uint32_t link_free_ms = 0;
+    int      max_queue = 0;
+
+    pacer_init(&p, 2 * PACKET, 0);
+    for (uint32_t ms = 0; ms < 3000; ms++)
+    {
+        uint32_t now = ms * 1000;
+
+        /* Acknowledgments arrive in order */
+        while (tail != head && packets[tail % SLOTS].ack_us != 0 && packets[tail % SLOTS].ack_us <= now)
+        {
+            pacer_on_rtt(&p, now - packets[tail % SLOTS].sent_us, now);
+            pacer_on_delivered(&p, &packets[tail % SLOTS].stamp, PACKET, packets[tail % SLOTS].sent_us, now);
+            tail++;
+            pacer_update(&p, (head - tail) * PACKET, now);
+        }
+
+        /* Sender: always has data; before an estimate exists it keeps ten packets in flight */
+        uint32_t limit = pacer_inflight_limit(&p) != 0 ? pacer_inflight_limit(&p) : 10 * PACKET;
+        while ((head - tail) * PACKET < limit && head - tail < SLOTS && pacer_allow(&p, PACKET, now))
+        {
+            pacer_on_send(&p, &packets[head % SLOTS].stamp, (head - tail) * PACKET, now);
+            packets[head % SLOTS].sent_us = now;
+            link_free_ms = (link_free_ms > ms ? link_free_ms : ms) + SERVICE_MS;
+            packets[head % SLOTS].ack_us = (link_free_ms + PROP_MS) * 1000;
+            head++;
+        }
+
+        /* Packets waiting at the bottleneck beyond the one being forwarded */
+        int queued = link_free_ms > ms ? (int)((link_free_ms - ms) / SERVICE_MS) : 0;
+        if (ms >= 2000 && queued > max_queue)
+            max_queue = queued;
+    }
+
+    CHECK(p.btl_bw >= 90000 && p.btl_bw <= 110000, "bandwidth estimate %u B/s, expected ~100000", (unsigned)p.btl_bw);
+    CHECK(p.min_rtt_us >= 20000 && p.min_rtt_us <= 31000, "min RTT %u us, expected ~30000", (unsigned)p.min_rtt_us);
+    CHECK(p.mode == PACER_PROBE_BW, "pacer stuck in mode %d", (int)p.mode);
+    CHECK(max_queue <= 4, "bottleneck queue reached %d packets", max_queue);
+}
+
+/* The same bulk transfer over a tunnel with a rate-limited, delayed link, once unpaced and once paced. */
+static void test_rudp_pacing_keeps_bottleneck_queue_short(void)
+{
+    static uint8_t     chunk[RUDP_MAX_PAYLOAD * 8], sink[65536];
+    struct sockaddr_in local;
+    int                local_len = sizeof(local);
+    impair_profile     link = {0, 10, 0, 8000}; /* 1 MB/s, 10 ms one way */
+    uint32_t           srtt_us[2];
+    int                received[2];
+
+    memset(chunk, 'p', sizeof(chunk));
+    for (int paced = 0; paced < 2; paced++)
+    {
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        rudp_conn *a = rudp_open((struct sockaddr *)&local, local_len, 0x1111, 5000, &link, paced, 0);
+        rudp_conn *b = rudp_open((struct sockaddr *)&local, local_len, 0x2222, 5000, &link, paced, 0);
+        CHECK(a && b, "could not open UDP sockets");
+        if (!a || !b)
+            return;
+        local.sin_port = htons(rudp_local_port(b));
+        rudp_set_peer(a, (struct sockaddr *)&local, local_len, 0x2222);
+        local.sin_port = htons(rudp_local_port(a));
+        rudp_set_peer(b, (struct sockaddr *)&local, local_len, 0x1111);
+
+        received[paced] = 0;
+        DWORD start = GetTickCount();
+        while (GetTickCount() - start < 2000 && !rudp_failed(a))
+        {
+            if (rudp_path_confirmed(a))
+                rudp_write(a, chunk, sizeof(chunk));
+            rudp_poll(a);
+            rudp_poll(b);
+            received[paced] += rudp_read(b, sink, sizeof(sink));
+            Sleep(0);
+        }
+        srtt_us[paced] = a->srtt_us;
+        rudp_close(a);
+        rudp_close(b);
+    }
+
+    /* The link alone accounts for 20 ms; the rest is time spent queued at the bottleneck. */
+    CHECK(srtt_us[0] > 20000 && srtt_us[1] < 20000 + (srtt_us[0] - 20000) / 2,
+          "pacing did not shorten the queue: srtt %u us paced, %u us unpaced", (unsigned)srtt_us[1],
+          (unsigned)srtt_us[0]);
+    CHECK(received[1] * 10 >= received[0] * 8, "pacing cost throughput: %d bytes paced, %d bytes unpaced",
+          received[1], received[0]);
+}
+
+/* Over a lossy path with a 576-byte MTU, probing finds a segment size that avoids fragmentation and its extra loss. */
+static void test_rudp_discovers_path_mtu(void)
+{
+    static uint8_t     sent[300000], received[sizeof(sent)];
+    struct sockaddr_in local;
+    int                local_len = sizeof(local);
+    impair_profile     link = {4, 0, 0, 0, 576};
+    uint32_t           fragmented[2], segments[2], retransmits[2];
+    uint16_t           mss = 0;
+
+    for (int i = 0; i < (int)sizeof(sent); i++)
+        sent[i] = (uint8_t)(i * 13 + i / 509);
+
+    /* Run 0 assumes a 1500-byte path, run 1 discovers it */
+    for (int discover = 0; discover < 2; discover++)
+    {
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        DWORD      mtu = discover ? 0 : 1500;
+        rudp_conn *a = rudp_open((struct sockaddr *)&local, local_len, 0x1111, 5000, &link, FALSE, mtu);
+        rudp_conn *b = rudp_open((struct sockaddr *)&local, local_len, 0x2222, 5000, &link, FALSE, mtu);
+        CHECK(a && b, "could not open UDP sockets");
+        if (!a || !b)
+            return;
+        local.sin_port = htons(rudp_local_port(b));
+        rudp_set_peer(a, (struct sockaddr *)&local, local_len, 0x2222);
+        local.sin_port = htons(rudp_local_port(a));
+        rudp_set_peer(b, (struct sockaddr *)&local, local_len, 0x1111);
+
+        /* Let the search settle before the transfer, as the game's handshake would */
+        DWORD start = GetTickCount();
+        while ((!rudp_path_confirmed(a) || a->mtu_searching) && GetTickCount() - start < 10000)
+        {
+            rudp_poll(a);
+            rudp_poll(b);
+            Sleep(0);
+        }
+        CHECK(!a->mtu_searching, "path MTU search did not finish");
+
+        int written = 0, got = 0;
+        start = GetTickCount();
+        while (got < (int)sizeof(sent) && GetTickCount() - start < 20000 && !rudp_failed(a))
+        {
+            if (written < (int)sizeof(sent))
+                written += rudp_write(a, sent + written, (int)sizeof(sent) - written);
+            rudp_poll(a);
+            rudp_poll(b);
+            got += rudp_read(b, received + got, (int)sizeof(received) - got);
+            Sleep(0);
+        }
+        CHECK(got == (int)sizeof(sent) && memcmp(sent, received, got) == 0, "received %d of %d bytes intact", got,
+              (int)sizeof(sent));
+
+        fragmented[discover] = a->impair ? a->impair->fragmented : 0;
+        segments[discover] = a->stats.segments_sent;
+        retransmits[discover] = a->stats.fast_retransmits + a->stats.timeouts;
+        if (discover)
+            mss = a->mss;
+        rudp_close(a);
+        rudp_close(b);
+    }
+
+    /* 576 - 20 (IP) - 8 (UDP) - 13 (tunnel header) = 535 bytes fit unfragmented */
+    CHECK(mss <= 535 && mss > 535 - RUDP_MTU_SEARCH_STEP, "discovered segment size %u, expected just below 536",
+          (unsigned)mss);
+    CHECK(fragmented[0] >= segments[0] && fragmented[1] == 0,
+          "fragmented datagrams: %u of %u segments at 1500, %u after discovery", (unsigned)fragmented[0],
+          (unsigned)segments[0], (unsigned)fragmented[1]);
+    CHECK((uint64_t)retransmits[1] * segments[0] < (uint64_t)retransmits[0] * segments[1],
+          "discovery did not lower the retransmission rate: %u/%u segments vs %u/%u fragmented",
+          (unsigned)retransmits[1], (unsigned)segments[1], (unsigned)retransmits[0], (unsigned)segments[0]);
+}
+
+/* With UdpTunnel on both ends the game stream moves to UDP and survives an impaired link. */
+static void test_peer_tunnel_carries_game_stream(void)
+{
+    static peer_end a, b;
+    static char     msg[20000];
+
+    use_real_winsock();
+    g_config.udp_tunnel = TRUE;
+    g_config.impair_loss_percent = 10;
+    g_config.impair_jitter_ms = 3;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    CHECK(make_tcp_pair(&a.s, &b.s) == TRUE, "could not create loopback pair");
+    a.hooked = b.hooked = TRUE;
+    CHECK(hook_send(a.s, "tcp", 3, 0) == 3, "initial send failed");
+    CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode");
+
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    socket_state *sb = get_socket_state(b.s, FALSE);
+    DWORD         start = GetTickCount();
+    while (!(sa->peer.tunnel_tx && sa->peer.tunnel_rx && sb->peer.tunnel_tx && sb->peer.tunnel_rx) &&
+           GetTickCount() - start < 3000)
+    {
+        pump_end(&a);
+        pump_end(&b);
+        Sleep(1);
+    }
+    CHECK(sa->peer.tunnel_tx && sa->peer.tunnel_rx && sb->peer.tunnel_tx && sb->peer.tunnel_rx,
+          "tunnel not active in both directions");
+
+    for (int i = 0; i < (int)sizeof(msg); i++)
+        msg[i] = (char)(i * 31);
+    uint64_t tcp_bytes_before = sa->stats.wire_bytes_out;
+    for (int n = 0; n < 10; n++)
+        CHECK(hook_send(a.s, msg + n * 2000, 2000, 0) == 2000, "tunnel send %d failed", n);
+    CHECK(hook_send(b.s, "reply", 5, 0) == 5, "tunnel reply failed");
+
+    pump_until(&a, 5, &b, 3 + (int)sizeof(msg), 10000);
+    CHECK(b.len == 3 + (int)sizeof(msg), "expected %d bytes at b, got %d", 3 + (int)sizeof(msg), b.len);
+    CHECK(memcmp(b.data, "tcp", 3) == 0 && memcmp(b.data + 3, msg, sizeof(msg)) == 0, "tunnelled stream corrupted");
+    CHECK(a.len == 5 && memcmp(a.data, "reply", 5) == 0, "reply corrupted (len %d)", a.len);
+    CHECK(sa->peer.tunnel->stats.segments_sent >= sizeof(msg) / RUDP_MAX_PAYLOAD, "data did not use the tunnel");
+    CHECK(sa->stats.wire_bytes_out > tcp_bytes_before, "frame counters not updated");
+
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+}
+
+/* The shared-memory ring wraps around, refuses writes when full and reports a closed producer. */
+static void test_shm_ring_wraps_and_detects_close(void)
+{
+    static uint8_t chunk[SHM_RING_SIZE / 4 + 100];
+    static uint8_t out[sizeof(chunk)];
+
+    shm_ring *producer = shm_ring_create("Local\\NetworkFix-test-ring");
+    CHECK(producer != NULL, "could not create ring");
+    if (!producer)
+        return;
+    CHECK(shm_ring_create("Local\\NetworkFix-test-ring") == NULL, "second ring created under the same name");
+    shm_ring *consumer = shm_ring_open("Local\\NetworkFix-test-ring");
+    CHECK(consumer != NULL, "could not open ring");
+    if (!consumer)
+    {
+        shm_ring_close(producer);
+        return;
+    }
+
+    /* Five passes of a quarter ring plus a bit cross the end of the buffer at an odd offset. */
+    for (int pass = 0; pass < 5; pass++)
+    {
+        for (int i = 0; i < (int)sizeof(chunk); i++)
+            chunk[i] = (uint8_t)(i * 7 + pass);
+        CHECK(shm_ring_write(producer, chunk, sizeof(chunk)) == (int)sizeof(chunk), "pass %d write short", pass);
+        CHECK(shm_ring_wait_readable(consumer, 0), "pass %d data not readable", pass);
+        CHECK(shm_ring_read(consumer, out, sizeof(out)) == (int)sizeof(out), "pass %d read short", pass);
+        CHECK(memcmp(chunk, out, sizeof(chunk)) == 0, "pass %d data corrupted", pass);
+    }
+    CHECK(shm_ring_read(consumer, out, sizeof(out)) == 0, "empty ring returned data");
+
+    /* A full ring accepts only what fits and the writer times out waiting for space. */
+    int total = 0;
+    for (int i = 0; i < 5; i++)
+        total += shm_ring_write(producer, chunk, sizeof(chunk));
+    CHECK(total == SHM_RING_SIZE, "full ring holds %d bytes", total);
+    CHECK(!shm_ring_wait_writable(producer, 5), "full ring reported space");
+    CHECK(shm_ring_read(consumer, out, 100) == 100, "read from full ring failed");
+    CHECK(shm_ring_wait_writable(producer, 0), "space not reported after read");
+
+    CHECK(!shm_ring_peer_closed(consumer), "producer reported closed too early");
+    shm_ring_close(producer);
+    CHECK(shm_ring_peer_closed(consumer), "closed producer not detected");
+    CHECK(shm_ring_read(consumer, out, sizeof(out)) > 0, "bytes written before the close were lost");
+    shm_ring_close(consumer);
+}
+
+/* Peers on one host move both directions into shared-memory rings; game bytes arrive intact. */
+static void test_peer_shared_memory_carries_game_stream(void)
+{
+    static peer_end a, b;
+    static char     msg[20000];
+
+    use_real_winsock();
+    g_config.shared_memory = TRUE;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    CHECK(make_tcp_pair(&a.s, &b.s) == TRUE, "could not create loopback pair");
+    a.hooked = b.hooked = TRUE;
+    CHECK(hook_send(a.s, "tcp", 3, 0) == 3, "initial send failed");
+    CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode");
+
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    socket_state *sb = get_socket_state(b.s, FALSE);
+    DWORD         start = GetTickCount();
+    while (!(sa->peer.shm_tx && sa->peer.shm_rx && sb->peer.shm_tx && sb->peer.shm_rx) &&
+           GetTickCount() - start < 3000)
+    {
+        pump_end(&a);
+        pump_end(&b);
+        Sleep(1);
+    }
+    CHECK(sa->peer.shm_tx && sa->peer.shm_rx && sb->peer.shm_tx && sb->peer.shm_rx,
+          "shared memory not active in both directions");
+    if (!sa->peer.shm_tx || !sb->peer.shm_rx)
+        return;
+
+    for (int i = 0; i < (int)sizeof(msg); i++)
+        msg[i] = (char)(i * 31);
+    LONG ring_bytes_before = sa->peer.shm_out->header->head;
+    for (int n = 0; n < 10; n++)
+        CHECK(hook_send(a.s, msg + n * 2000, 2000, 0) == 2000, "ring send %d failed", n);
+    CHECK(hook_send(b.s, "reply", 5, 0) == 5, "ring reply failed");
+
+    pump_until(&a, 5, &b, 3 + (int)sizeof(msg), 3000);
+    CHECK(b.len == 3 + (int)sizeof(msg), "expected %d bytes at b, got %d", 3 + (int)sizeof(msg), b.len);
+    CHECK(memcmp(b.data, "tcp", 3) == 0 && memcmp(b.data + 3, msg, sizeof(msg)) == 0, "ring stream corrupted");
+    CHECK(a.len == 5 && memcmp(a.data, "reply", 5) == 0, "reply corrupted (len %d)", a.len);
+    CHECK(sa->peer.shm_out->header->head - ring_bytes_before >= (LONG)sizeof(msg), "data did not use the ring");
+
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+}
+
+/* A patched end talking to an unpatched end falls back to raw bytes both ways. */
+static void test_peer_falls_back_for_unpatched_peer(void)
+{
+    static peer_end patched, plain;
+
+    use_real_winsock();
+    g_config.compression = TRUE;
+    g_config.negotiate_timeout_ms = 100;
+
+    /* Run once with each end as the patched one so both roles are covered. */
+    for (int round = 0; round < 2; round++)
+    {
+        memset(&patched, 0, sizeof(patched));
+        memset(&plain, 0, sizeof(plain));
+        SOCKET c, s;
+        CHECK(make_tcp_pair(&c, &s) == TRUE, "could not create loopback pair");
+        patched.s = round == 0 ? c : s;
+        plain.s = round == 0 ? s : c;
+        patched.hooked = TRUE;
+
+        CHECK(hook_send(patched.s, "hello", 5, 0) == 5, "send to unpatched peer failed");
+        CHECK(send(plain.s, "world", 5, 0) == 5, "unpatched send failed");
+
+        /* Only the connecting end sends HELLO; until read past, the unpatched end sees it as urgent data. */
+        fd_set         except_fds;
+        struct timeval wait = {0, round == 0 ? 500000 : 50000};
+        FD_ZERO(&except_fds);
+        FD_SET(plain.s, &except_fds);
+        CHECK((select(0, NULL, NULL, &except_fds, &wait) == 1) == (round == 0),
+              "urgent HELLO at the unpatched end does not match the role (round %d)", round);
+
+        pump_until(&patched, 5, &plain, 5, 2000);
+
+        DWORD start = GetTickCount();
+        while (GetTickCount() - start < 500)
+        {
+            pump_end(&patched);
+            pump_end(&plain);
+            Sleep(5);
+        }
+
+        CHECK(plain.len == 5 && memcmp(plain.data, "hello", 5) == 0, "unpatched peer saw %d bytes", plain.len);
+        CHECK(patched.len == 5 && memcmp(patched.data, "world", 5) == 0, "patched end saw %d bytes", patched.len);
+        socket_state *state = get_socket_state(patched.s, FALSE);
+        CHECK(state && state->peer.state == PEER_STATE_RAW, "expected raw mode after timeout");
+        CHECK(state && !state->peer.tx_framed, "outgoing stream must stay raw");
+
+        hook_closesocket(patched.s);
+        closesocket(plain.s);
+    }
+}
+
+/* A socket with SO_OOBINLINE stays raw and never sends an urgent byte the other game would read inline. */
+static void test_peer_skips_oob_inline_sockets(void)
+{
+    static peer_end patched, plain;
+    BOOL            inline_oob = TRUE;
+    fd_set          except_fds;
+    struct timeval  wait = {0, 100000};
+
+    use_real_winsock();
+    g_config.compression = TRUE;
+    memset(&patched, 0, sizeof(patched));
+    memset(&plain, 0, sizeof(plain));
+    CHECK(make_tcp_pair(&patched.s, &plain.s) == TRUE, "could not create loopback pair");
+    patched.hooked = TRUE;
+    setsockopt(patched.s, SOL_SOCKET, SO_OOBINLINE, (const char *)&inline_oob, sizeof(inline_oob));
+
+    CHECK(hook_send(patched.s, "hello", 5, 0) == 5, "send failed");
+    socket_state *state = get_socket_state(patched.s, FALSE);
+    CHECK(state && state->peer.state == PEER_STATE_RAW, "socket with SO_OOBINLINE negotiated");
+    FD_ZERO(&except_fds);
+    FD_SET(plain.s, &except_fds);
+    CHECK(select(0, NULL, NULL, &except_fds, &wait) == 0, "an urgent byte was sent");
+    pump_until(&patched, 0, &plain, 5, 1000);
+    CHECK(plain.len == 5 && memcmp(plain.data, "hello", 5) == 0, "other end saw %d bytes", plain.len);
+
+    hook_closesocket(patched.s);
+    closesocket(plain.s);
+}
+
+/* The host writes the same update to every player; slow players queue one shared copy instead of stalling the rest. */
+static void test_send_queue_fans_out_without_stalling(void)
+{
+    enum
+    {
+        PLAYERS = 5,
+        SLOW_PLAYERS = 2, /* The first two players never read until the end */
+        UPDATE_SIZE = 4096,
+        ROUNDS = 40
+    };
+    static char received[SLOW_PLAYERS][UPDATE_SIZE * ROUNDS];
+    static char update[UPDATE_SIZE];
+    SOCKET      host[PLAYERS], player[PLAYERS];
+    int         small_buffer = 4096;
+    int         got[SLOW_PLAYERS] = {0};
+
+    use_real_winsock();
+    g_config.send_queue_kb = 512;
+    for (int i = 0; i < PLAYERS; i++)
+    {
+        CHECK(make_tcp_pair(&player[i], &host[i]) == TRUE, "could not create loopback pair %d", i);
+        if (i < SLOW_PLAYERS)
+        {
+            setsockopt(host[i], SOL_SOCKET, SO_SNDBUF, (const char *)&small_buffer, sizeof(small_buffer));
+            setsockopt(player[i], SOL_SOCKET, SO_RCVBUF, (const char *)&small_buffer, sizeof(small_buffer));
+        }
+    }
+
+    g_sleep_calls = 0;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (int j = 0; j < UPDATE_SIZE; j++)
+            update[j] = (char)(round * 7 + j * 13);
+        for (int i = 0; i < PLAYERS; i++)
+            CHECK(hook_send(host[i], update, UPDATE_SIZE, 0) == UPDATE_SIZE, "send to player %d failed", i);
+        for (int i = SLOW_PLAYERS; i < PLAYERS; i++)
+        {
+            int total = 0;
+            while (total < UPDATE_SIZE)
+            {
+                int r = recv(player[i], update, UPDATE_SIZE - total, 0);
+                if (r > 0)
+                    total += r;
+            }
+        }
+    }
+
+    CHECK(g_sleep_calls == 0, "host waited %d times for a slow player", g_sleep_calls);
+    socket_state *slow = get_socket_state(host[SLOW_PLAYERS - 1], FALSE);
+    CHECK(slow && slow->queue.queued_sends > 0, "slow player's sends were not queued");
+    CHECK(slow && slow->queue.shared_payloads > 0, "identical updates did not share a copy");
+    CHECK(slow && slow->queue.blocked_sends == 0, "queue filled up");
+    socket_state *fast = get_socket_state(host[PLAYERS - 1], FALSE);
+    CHECK(fast && fast->queue.queued_sends == 0, "fast player's sends were queued");
+
+    /* The slow players catch up; polling the host sockets drains the queues in order. */
+    DWORD start = GetTickCount();
+    char  scratch[64];
+    while ((got[0] < (int)sizeof(received[0]) || got[1] < (int)sizeof(received[1])) && GetTickCount() - start < 5000)
+    {
+        for (int i = 0; i < SLOW_PLAYERS; i++)
+        {
+            int r = recv(player[i], received[i] + got[i], (int)sizeof(received[i]) - got[i], 0);
+            if (r > 0)
+                got[i] += r;
+            hook_recv(host[i], scratch, sizeof(scratch), 0);
+        }
+    }
+    for (int i = 0; i < SLOW_PLAYERS; i++)
+    {
+        CHECK(got[i] == (int)sizeof(received[i]), "slow player %d received %d bytes", i, got[i]);
+        BOOL intact = TRUE;
+        for (int k = 0; k < got[i] && intact; k++)
+            intact = received[i][k] == (char)((k / UPDATE_SIZE) * 7 + (k % UPDATE_SIZE) * 13);
+        CHECK(intact, "slow player %d received corrupted or reordered data", i);
+    }
+
+    for (int i = 0; i < PLAYERS; i++)
+    {
+        hook_closesocket(host[i]);
+        closesocket(player[i]);
+    }
+}
+
+/* A queue of many small sends drains with one WSASend per SEND_QUEUE_BATCH entries, straight from their copies */
+static void test_send_queue_flush_gathers_entries(void)
+{
+    enum
+    {
+        UPDATES = 64,
+        UPDATE_SIZE = 100
+    };
+    static char filler[65536];
+    char        update[UPDATE_SIZE];
+    char        received[UPDATES * UPDATE_SIZE];
+    SOCKET      host, player;
+    int         small_buffer = 4096;
+    int         filled = 0;
+
+    use_real_winsock();
+    g_config.send_queue_kb = 512;
+    CHECK(make_tcp_pair(&player, &host) == TRUE, "could not create loopback pair");
+    setsockopt(host, SOL_SOCKET, SO_SNDBUF, (const char *)&small_buffer, sizeof(small_buffer));
+    setsockopt(player, SOL_SOCKET, SO_RCVBUF, (const char *)&small_buffer, sizeof(small_buffer));
+
+    /* Fill the socket buffer behind the hook's back so every update is queued */
+    for (int r; (r = send(host, filler, sizeof(filler), 0)) > 0;)
+        filled += r;
+    for (int i = 0; i < UPDATES; i++)
+    {
+        memset(update, i, sizeof(update));
+        CHECK(hook_send(host, update, UPDATE_SIZE, 0) == UPDATE_SIZE, "update %d not accepted", i);
+    }
+    socket_state *state = get_socket_state(host, FALSE);
+    CHECK(state && state->queue.count == UPDATES, "%d updates queued", state ? state->queue.count : -1);
+    if (!state)
+        return;
+    CHECK(state->queue.copied_bytes == UPDATES * UPDATE_SIZE, "%llu bytes copied",
+          (unsigned long long)state->queue.copied_bytes);
+
+    /* Once the player has read the filler, one poll writes the whole queue */
+    DWORD start = GetTickCount();
+    for (int got = 0; got < filled && GetTickCount() - start < 5000;)
+    {
+        int r = recv(player, filler, sizeof(filler), 0);
+        if (r > 0)
+            got += r;
+    }
+    Sleep(10);
+    send_queue_poll();
+    CHECK(state->queue.count == 0, "%d updates left after one poll", state->queue.count);
+    CHECK(state->queue.flush_calls == UPDATES / SEND_QUEUE_BATCH, "%lu WSASend calls for %d updates",
+          (unsigned long)state->queue.flush_calls, UPDATES);
+    CHECK(state->queue.flushed_bytes == UPDATES * UPDATE_SIZE, "%llu bytes flushed",
+          (unsigned long long)state->queue.flushed_bytes);
+
+    int got = 0;
+    start = GetTickCount();
+    while (got < (int)sizeof(received) && GetTickCount() - start < 5000)
+    {
+        int r = recv(player, received + got, (int)sizeof(received) - got, 0);
+        if (r > 0)
+            got += r;
+    }
+    BOOL intact = got == (int)sizeof(received);
+    for (int k = 0; k < got && intact; k++)
+        intact = received[k] == (char)(k / UPDATE_SIZE);
+    CHECK(intact, "queued updates arrived corrupted or reordered (%d bytes)", got);
+
+    hook_closesocket(host);
+    closesocket(player);
+}
+
+/* A WSASend that stops inside a later buffer completes the entries before it and resumes mid-entry */
+static void test_send_queue_partial_gather_keeps_offsets(void)
+{
+    enum
+    {
+        UPDATE_SIZE = 100
+    };
+    const SOCKET  s = (SOCKET)0x5150;
+    char          a[UPDATE_SIZE], b[UPDATE_SIZE], c[UPDATE_SIZE];
+    send_queue   *queue;
+    send_payload *shared, *last;
+
+    g_config.send_queue_kb = 64;
+    g_send_script.block_count = 1 << 30; /* Every direct send finds the socket buffer full */
+    real_WSASend = mock_WSASend;
+    memset(a, 'a', sizeof(a));
+    memset(b, 'b', sizeof(b));
+    memset(c, 'c', sizeof(c));
+
+    /* a, b, b (sharing one copy), c */
+    CHECK(send_queue_send(s, a, UPDATE_SIZE, 0) == UPDATE_SIZE, "a not accepted");
+    CHECK(send_queue_send(s, b, UPDATE_SIZE, 0) == UPDATE_SIZE, "first b not accepted");
+    CHECK(send_queue_send(s, b, UPDATE_SIZE, 0) == UPDATE_SIZE, "second b not accepted");
+    CHECK(send_queue_send(s, c, UPDATE_SIZE, 0) == UPDATE_SIZE, "c not accepted");
+    socket_state *state = get_socket_state(s, FALSE);
+    CHECK(state && state->queue.count == 4, "%d entries queued", state ? state->queue.count : -1);
+    if (!state || state->queue.count != 4)
+        return;
+    queue = &state->queue;
+    shared = queue->entries[(queue->head + 1) % SEND_QUEUE_ENTRIES].payload;
+    last = queue->entries[(queue->head + 3) % SEND_QUEUE_ENTRIES].payload;
+    CHECK(queue->entries[(queue->head + 2) % SEND_QUEUE_ENTRIES].payload == shared, "identical sends not shared");
+    CHECK(shared->refs == 2 && last->refs == 2, "refs %ld/%ld before the flush", (long)shared->refs, (long)last->refs);
+
+    /* 150 bytes: a is done, the first b stops halfway */
+    g_wsasend_script.accept = 150;
+    send_queue_poll();
+    CHECK(g_wsasend_script.last_count == 4, "%lu buffers gathered", (unsigned long)g_wsasend_script.last_count);
+    CHECK(queue->count == 3 && queue->bytes == 250, "%d entries, %d bytes left", queue->count, queue->bytes);
+    CHECK(queue->entries[queue->head].payload == shared && queue->entries[queue->head].offset == 50,
+          "head entry offset %d", queue->entries[queue->head].offset);
+    CHECK(shared->refs == 2, "shared copy refs %ld after a partial write", (long)shared->refs);
+
+    /* 120 bytes: the first b is done, the second stops 70 bytes in; the next flush starts there */
+    g_wsasend_script.accept = 120;
+    send_queue_poll();
+    CHECK(g_wsasend_script.last_first == (char *)shared->data + 50, "flush did not resume mid-entry");
+    CHECK(queue->count == 2 && queue->bytes == 130, "%d entries, %d bytes left", queue->count, queue->bytes);
+    CHECK(queue->entries[queue->head].payload == shared && queue->entries[queue->head].offset == 70,
+          "head entry offset %d", queue->entries[queue->head].offset);
+    CHECK(shared->refs == 1, "shared copy refs %ld after one entry finished", (long)shared->refs);
+
+    /* A full socket buffer leaves everything in place */
+    g_wsasend_script.accept = 0;
+    send_queue_poll();
+    CHECK(queue->count == 2 && queue->entries[queue->head].offset == 70, "blocked flush moved the queue");
+
+    g_wsasend_script.accept = 1000;
+    send_queue_poll();
+    CHECK(queue->count == 0 && queue->bytes == 0, "%d entries, %d bytes left", queue->count, queue->bytes);
+    CHECK(last->refs == 1, "last copy refs %ld; only the cache should hold it", (long)last->refs);
+    CHECK(queue->flush_calls == 3 && queue->flushed_bytes == 4 * UPDATE_SIZE, "%lu calls, %llu bytes flushed",
+          (unsigned long)queue->flush_calls, (unsigned long long)queue->flushed_bytes);
+
+    BOOL intact = g_wsasend_script.written_len == 4 * UPDATE_SIZE;
+    for (int k = 0; k < g_wsasend_script.written_len && intact; k++)
+        intact = g_wsasend_script.written[k] == "abbc"[k / UPDATE_SIZE];
+    CHECK(intact, "gathered writes arrived corrupted or reordered (%d bytes)", g_wsasend_script.written_len);
+}
+
+/* With HighResClock, GetTickCount follows QueryPerformanceCounter to the millisecond instead of in timer steps. */
+static void test_high_res_clock_tracks_qpc(void)
+{
+    LARGE_INTEGER frequency, before, after;
+    double        spread[2];
+    DWORD         last = 0;
+    BOOL          monotonic = TRUE;
+
+    QueryPerformanceFrequency(&frequency);
+    real_GetTickCount = GetTickCount;
+    for (int mode = 0; mode < 2; mode++)
+    {
+        double lowest = 1e18, highest = -1e18;
+        DWORD  start = GetTickCount();
+
+        g_config.high_res_clock = mode;
+        while (GetTickCount() - start < 300)
+        {
+            QueryPerformanceCounter(&before);
+            DWORD value = hook_GetTickCount();
+            QueryPerformanceCounter(&after);
+            double before_us = (double)before.QuadPart * 1000000.0 / (double)frequency.QuadPart;
+            double after_us = (double)after.QuadPart * 1000000.0 / (double)frequency.QuadPart;
+            if (after_us - before_us > 50.0)
+                continue; /* Preempted between the readings: the sample says nothing */
+
+            /* A clock that tracks QPC keeps this offset constant to within its 1 ms resolution */
+            double offset = (double)value * 1000.0 - before_us;
+            lowest = offset < lowest ? offset : lowest;
+            highest = offset > highest ? offset : highest;
+            if (mode == 1 && last != 0 && (int32_t)(value - last) < 0)
+                monotonic = FALSE;
+            last = mode == 1 ? value : 0;
+        }
+        spread[mode] = highest - lowest;
+    }
+    real_GetTickCount = NULL;
+
+    printf("  offset to QPC varies by %.0f us with GetTickCount, %.0f us with HighResClock\n", spread[0], spread[1]);
+    CHECK(monotonic, "HighResClock went backwards");
+    CHECK(spread[1] <= 1500.0, "HighResClock strayed %.0f us from QPC", spread[1]);
+    CHECK(spread[1] <= spread[0] + 500.0, "HighResClock jitters more than GetTickCount: %.0f vs %.0f us", spread[1],
+          spread[0]);
+}
+
+/* With TimeDilationMs, server.dll's clock falls behind while nothing arrives and catches up after data does. */
+static void test_time_dilation_absorbs_stall(void)
+{
+    char  buf[16];
+    DWORD last, first, max_step = 0;
+    BOOL  monotonic = TRUE;
+
+    real_GetTickCount = GetTickCount;
+    g_config.high_res_clock = TRUE;
+    g_config.time_dilation_ms = 200;
+    first = last = hook_GetTickCount();
+
+    /* 500 ms of silence start the stall; at 25% speed the 200 ms lag is reached 267 ms later */
+    DWORD start = clock_now_ms();
+    while (clock_now_ms() - start < 1000)
+    {
+        DWORD value = hook_GetTickCount();
+        monotonic &= (int32_t)(value - last) >= 0;
+        last = value;
+        Sleep(1);
+    }
+    DWORD lag = clock_now_ms() - hook_GetTickCount();
+    CHECK(clock_dilation_ms() == 200 && lag >= 199 && lag <= 201, "lag %lu ms after the stall, expected 200",
+          (unsigned long)lag);
+    CHECK(last - first >= 1000 - 200 - 50, "dilated clock froze: advanced %lu ms in 1000 ms",
+          (unsigned long)(last - first));
+
+    /* Data arrives: at 150% speed the lag is repaid within 400 ms */
+    g_recv_script.payload = "turn";
+    CHECK(hook_recv((SOCKET)1, buf, sizeof(buf), 0) == 4, "mock recv failed");
+    start = clock_now_ms();
+    while (clock_now_ms() - start < 500)
+    {
+        DWORD value = hook_GetTickCount();
+        monotonic &= (int32_t)(value - last) >= 0;
+        max_step = value - last > max_step ? value - last : max_step;
+        last = value;
+        if (clock_now_ms() - start < 450)
+            hook_recv((SOCKET)1, buf, sizeof(buf), 0); /* Keep the data flowing */
+        Sleep(1);
+    }
+    CHECK(clock_dilation_ms() == 0 && hook_GetTickCount() == clock_now_ms(), "clock did not catch up: lag %lu ms",
+          (unsigned long)clock_dilation_ms());
+    CHECK(monotonic, "dilated clock went backwards");
+    CHECK(max_step <= 50, "catching up jumped %lu ms at once", (unsigned long)max_step);
+    real_GetTickCount = NULL;
+}
+
+static DWORD WINAPI mock_timeGetTime(void)
+{
+    return GetTickCount() + 123456; /* timeGetTime counts from a different base */
+}
+
+static void test_clock_hooks_share_one_clock(void)
+{
+    LARGE_INTEGER frequency, real, shaped;
+    DWORD         calls[CLOCK_SOURCES];
+
+    QueryPerformanceFrequency(&frequency);
+    real_GetTickCount = GetTickCount;
+    real_timeGetTime = mock_timeGetTime;
+    real_QueryPerformanceCounter = QueryPerformanceCounter;
+    for (int i = 0; i < CLOCK_SOURCES; i++)
+        calls[i] = clock_call_count((clock_source)i);
+
+    /* Unshaped: every source passes through, but server.dll's calls are counted */
+    CHECK(hook_timeGetTime() - GetTickCount() >= 123456, "timeGetTime was shaped with no clock option");
+    CHECK(hook_QueryPerformanceCounter(&shaped) && shaped.QuadPart != 0, "QueryPerformanceCounter failed");
+
+    /* HighResClock: the millisecond sources read the same clock */
+    g_config.high_res_clock = TRUE;
+    DWORD tick = hook_GetTickCount();
+    DWORD time = hook_timeGetTime();
+    CHECK(time - tick <= 1, "GetTickCount %lu and timeGetTime %lu disagree", (unsigned long)tick, (unsigned long)time);
+
+    /* TimeDilationMs: a stall holds every source back by the same lag */
+    g_config.time_dilation_ms = 1000;
+    clock_note_progress();
+    hook_GetTickCount();
+    Sleep(CLOCK_STALL_MS + 300);
+    tick = hook_GetTickCount();
+    time = hook_timeGetTime();
+    QueryPerformanceCounter(&real);
+    hook_QueryPerformanceCounter(&shaped);
+    DWORD  lag = clock_dilation_ms();
+    double counter_lag = (double)(real.QuadPart - shaped.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    printf("  lag %lu ms, QueryPerformanceCounter behind by %.1f ms\n", (unsigned long)lag, counter_lag);
+    CHECK(lag >= 100, "no lag after a %d ms stall", CLOCK_STALL_MS + 300);
+    CHECK(time - tick <= 1, "dilated sources disagree: %lu vs %lu", (unsigned long)tick, (unsigned long)time);
+    CHECK(counter_lag >= lag - 2.0 && counter_lag <= lag + 2.0, "counter lags %.1f ms, clock %lu ms", counter_lag,
+          (unsigned long)lag);
+    clock_note_progress();
+
+    CHECK(clock_call_count(CLOCK_SOURCE_TICK_COUNT) - calls[CLOCK_SOURCE_TICK_COUNT] == 3,
+          "counted %lu GetTickCount calls, expected 3",
+          (unsigned long)(clock_call_count(CLOCK_SOURCE_TICK_COUNT) - calls[CLOCK_SOURCE_TICK_COUNT]));
+    CHECK(clock_call_count(CLOCK_SOURCE_TIME_GET_TIME) - calls[CLOCK_SOURCE_TIME_GET_TIME] == 3,
+          "counted %lu timeGetTime calls, expected 3",
+          (unsigned long)(clock_call_count(CLOCK_SOURCE_TIME_GET_TIME) - calls[CLOCK_SOURCE_TIME_GET_TIME]));
+    CHECK(clock_call_count(CLOCK_SOURCE_PERF_COUNTER) - calls[CLOCK_SOURCE_PERF_COUNTER] == 2,
+          "counted %lu QueryPerformanceCounter calls, expected 2",
+          (unsigned long)(clock_call_count(CLOCK_SOURCE_PERF_COUNTER) - calls[CLOCK_SOURCE_PERF_COUNTER]));
+
+    real_GetTickCount = NULL;
+    real_timeGetTime = NULL;
+    real_QueryPerformanceCounter = NULL;
+}
+
+/* On virtual time, server.dll's QueryPerformanceCounter moves with its GetTickCount, lag and alignment included. */
+static void test_virtual_clock_drives_query_performance_counter(void)
+{
+    LARGE_INTEGER frequency, before, after;
+
+    QueryPerformanceFrequency(&frequency);
+    real_GetTickCount = GetTickCount;
+    real_QueryPerformanceCounter = QueryPerformanceCounter;
+    clock_reset_shaping();
+    clock_set_virtual(TRUE);
+
+    /* HighResClock: a virtual hour is an hour of counter ticks */
+    g_config.high_res_clock = TRUE;
+    DWORD tick = hook_GetTickCount();
+    hook_QueryPerformanceCounter(&before);
+    clock_advance(3600000);
+    hook_QueryPerformanceCounter(&after);
+    CHECK(hook_GetTickCount() - tick == 3600000, "GetTickCount moved %lu ms in a virtual hour",
+          (unsigned long)(hook_GetTickCount() - tick));
+    CHECK(after.QuadPart - before.QuadPart == 3600 * frequency.QuadPart, "counter moved %.3f s in a virtual hour",
+          (double)(after.QuadPart - before.QuadPart) / (double)frequency.QuadPart);
+
+    /* TimeDilationMs: a stall holds the counter back as far as GetTickCount */
+    g_config.time_dilation_ms = 1000;
+    tick = hook_GetTickCount();
+    hook_QueryPerformanceCounter(&before);
+    clock_advance(CLOCK_STALL_MS + 1000);
+    DWORD  tick_moved = hook_GetTickCount() - tick;
+    hook_QueryPerformanceCounter(&after);
+    double counter_moved = (double)(after.QuadPart - before.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    DWORD  lag = clock_dilation_ms();
+    CHECK(lag == 1000 * (100 - CLOCK_STALL_RATE_PERCENT) / 100, "lag %lu ms after a 1 s stall", (unsigned long)lag);
+    CHECK(tick_moved == CLOCK_STALL_MS + 1000 - lag, "GetTickCount moved %lu ms", (unsigned long)tick_moved);
+    CHECK(counter_moved > tick_moved - 0.01 && counter_moved < tick_moved + 0.01,
+          "counter moved %.3f ms, GetTickCount %lu ms", counter_moved, (unsigned long)tick_moved);
+
+    /* ClockSync=2: the counter takes the host offset together with GetTickCount */
+    clock_reset_shaping();
+    g_config.time_dilation_ms = 0;
+    tick = hook_GetTickCount();
+    hook_QueryPerformanceCounter(&before);
+    g_config.clock_sync = CLOCK_SYNC_ALIGN;
+    clock_set_alignment(250000);
+    DWORD aligned = hook_GetTickCount();
+    hook_QueryPerformanceCounter(&after);
+    counter_moved = (double)(after.QuadPart - before.QuadPart) * 1000.0 / (double)frequency.QuadPart;
+    CHECK(aligned - tick == 250, "GetTickCount moved %lu ms for a 250 ms offset", (unsigned long)(aligned - tick));
+    CHECK(counter_moved > 249.99 && counter_moved < 250.01, "counter moved %.3f ms for a 250 ms offset",
+          counter_moved);
+
+    clock_reset_shaping();
+    clock_set_virtual(FALSE);
+    real_GetTickCount = NULL;
+    real_QueryPerformanceCounter = NULL;
+}
+
+/* An offset that arrives after server.dll read its clock is slewed in at CLOCK_SLEW_PERCENT, never stepped back. */
+static void test_clock_alignment_slews_after_first_read(void)
+{
+    LARGE_INTEGER frequency, counter, last_counter;
+
+    QueryPerformanceFrequency(&frequency);
+    real_GetTickCount = GetTickCount;
+    real_QueryPerformanceCounter = QueryPerformanceCounter;
+    clock_reset_shaping();
+    clock_set_virtual(TRUE);
+    g_config.high_res_clock = TRUE;
+    g_config.clock_sync = CLOCK_SYNC_ALIGN;
+
+    DWORD last = hook_GetTickCount();
+    hook_QueryPerformanceCounter(&last_counter);
+    clock_set_alignment(-2000000);
+    CHECK(hook_GetTickCount() == last, "a 2 s offset stepped server.dll's clock to %lu from %lu",
+          (unsigned long)hook_GetTickCount(), (unsigned long)last);
+
+    BOOL forward = TRUE;
+    for (int second = 0; second < 50; second++)
+    {
+        clock_advance(1000);
+        DWORD now = hook_GetTickCount();
+        hook_QueryPerformanceCounter(&counter);
+        forward &= now - last >= 1000 * (100 - CLOCK_SLEW_PERCENT) / 100 && now - last <= 1000;
+        forward &= counter.QuadPart - last_counter.QuadPart >= frequency.QuadPart * (100 - CLOCK_SLEW_PERCENT) / 100;
+        last = now;
+        last_counter = counter;
+    }
+    CHECK(forward, "server.dll's time slowed by more than %d%% or ran backwards", CLOCK_SLEW_PERCENT);
+    CHECK(clock_alignment_us() == -2000000, "offset %lld us after 50 s", (long long)clock_alignment_us());
+    CHECK(clock_now_ms() - last == 2000, "server.dll's clock %lu ms behind", (unsigned long)(clock_now_ms() - last));
+
+    clock_reset_shaping();
+    clock_set_virtual(FALSE);
+    real_GetTickCount = NULL;
+    real_QueryPerformanceCounter = NULL;
+}
+
+static void test_virtual_clock_fast_forwards_an_hour(void)
+{
+    int logged = 0;
+
+    clock_set_virtual(TRUE);
+    DWORD start = clock_ticks();
+    CHECK(clock_now_ms() == start, "virtual time started at %lu, clock at %lu", (unsigned long)start,
+          (unsigned long)clock_now_ms());
+
+    /* One message a second for an hour: the rate limiter lets one through every LOG_RATE_LIMIT_MS */
+    for (int second = 0; second < 3600; second++)
+    {
+        if (logf_rate_limited("virtual_clock_test", "[TEST] second %d", second))
+            logged++;
+        test_sleep(1000);
+    }
+    CHECK(clock_ticks() - start == 3600000, "virtual hour lasted %lu ms", (unsigned long)(clock_ticks() - start));
+    CHECK(clock_now_ms() == clock_ticks(), "clock_now_ms left virtual time");
+    CHECK(logged == 3600000 / LOG_RATE_LIMIT_MS, "rate limiter logged %d times, expected %d", logged,
+          3600000 / LOG_RATE_LIMIT_MS);
+
+    /* The send retry loop's sleeps move virtual time forward, as its stall timeout expects */
+    start = clock_ticks();
+    g_sleep_total_ms = 0;
+    g_send_script.block_count = 2000;
+    CHECK(hook_send((SOCKET)1, "abc", 3, 0) == 3, "send did not complete");
+    CHECK(g_sleep_total_ms > 0 && clock_ticks() - start == (DWORD)g_sleep_total_ms,
+          "retries slept %d ms but virtual time moved %lu ms", g_sleep_total_ms,
+          (unsigned long)(clock_ticks() - start));
+
+    clock_set_virtual(FALSE);
+}
+
+/* A peer 5 s ahead and 50 ppm fast, behind a VPN that queues a quarter of the packets by up to 40 ms. */
+static void test_timesync_filters_jittered_exchanges(void)
+{
+    static timesync sync;
+    const int64_t   offset_us = 5000000;
+    const double    drift_ppm = 50.0;
+    uint32_t        seed = 4242;
+    double          worst_raw_us = 0.0;
+
+    memset(&sync, 0, sizeof(sync));
+    for (int i = 0; i < 300; i++)
+    {
+        int64_t t1 = 1000000000 + (int64_t)i * 2000000; /* One exchange every 2 s for 10 minutes */
+        int64_t delay[2];
+        for (int d = 0; d < 2; d++)
+        {
+            seed = seed * 1103515245u + 12345u;
+            delay[d] = 10000 + ((seed >> 16) % 4 == 0 ? (seed >> 8) % 40000 : (seed >> 8) % 1000);
+        }
+        int64_t there = delay[0];
+        int64_t back = delay[1];
+        int64_t peer_t2 = t1 + there;
+        int64_t peer_t3 = peer_t2 + 300; /* The peer answers 0.3 ms later */
+        int64_t t4 = peer_t3 + back;
+        int64_t skew2 = offset_us + (int64_t)(drift_ppm * (double)(peer_t2 - 1000000000) / 1000000.0);
+        int64_t skew3 = offset_us + (int64_t)(drift_ppm * (double)(peer_t3 - 1000000000) / 1000000.0);
+
+        CHECK(timesync_add(&sync, t1, peer_t2 + skew2, peer_t3 + skew3, t4), "exchange %d rejected", i);
+        double raw_error = (double)(there - back) / 2.0;
+        worst_raw_us = raw_error > worst_raw_us ? raw_error : worst_raw_us;
+    }
+
+    int64_t last_us = 1000000000 + 299LL * 2000000;
+    int64_t truth = offset_us + (int64_t)(drift_ppm * (double)(last_us - 1000000000) / 1000000.0);
+    double  error_ms = (double)(timesync_offset_at(&sync, last_us) - truth) / 1000.0;
+    printf("  offset error %.2f ms (single exchanges up to %.2f ms), drift %.1f ppm\n", error_ms,
+           worst_raw_us / 1000.0, sync.drift_ppm);
+    CHECK(error_ms > -1.0 && error_ms < 1.0, "offset off by %.2f ms", error_ms);
+    CHECK(sync.drift_ppm > drift_ppm - 10.0 && sync.drift_ppm < drift_ppm + 10.0, "drift %.1f ppm, expected %.1f",
+          sync.drift_ppm, drift_ppm);
+
+    /* A reply that arrived before its request left is discarded */
+    CHECK(!timesync_add(&sync, 2000, 5000, 5100, 1000) && sync.rejected == 1, "impossible exchange accepted");
+}
+
+/* Two patched ends with ClockSync=2 measure each other's clock; the connecting side aligns to it. */
+static void test_peer_clock_sync_estimates_offset(void)
+{
+    static peer_end a, b;
+
+    use_real_winsock();
+    g_config.clock_sync = CLOCK_SYNC_ALIGN;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    CHECK(make_tcp_pair(&a.s, &b.s) == TRUE, "could not create loopback pair");
+    a.hooked = b.hooked = TRUE;
+    CHECK(hook_send(a.s, "x", 1, 0) == 1, "initial send failed");
+    CHECK(wait_until_framed(&a, &b), "peers did not switch to framed mode");
+
+    socket_state *sa = get_socket_state(a.s, FALSE);
+    socket_state *sb = get_socket_state(b.s, FALSE);
+    CHECK(sa && sb, "socket states missing");
+    if (!sa || !sb)
+        return;
+    sa->direction = SOCKET_DIRECTION_OUTGOING;
+
+    /* Both clocks are this process's: the estimates should be close to zero */
+    DWORD start = GetTickCount();
+    while ((sa->peer.clock.exchanges < TIMESYNC_FILTER_SAMPLES || sb->peer.clock.exchanges < TIMESYNC_FILTER_SAMPLES) &&
+           GetTickCount() - start < 5000)
+    {
+        pump_end(&a);
+        pump_end(&b);
+        Sleep(1);
+    }
+    printf("  offsets %+.3f / %+.3f ms after %lu / %lu exchanges\n", (double)sa->peer.clock.best.offset_us / 1000.0,
+           (double)sb->peer.clock.best.offset_us / 1000.0, (unsigned long)sa->peer.clock.exchanges,
+           (unsigned long)sb->peer.clock.exchanges);
+    CHECK(sa->peer.clock.exchanges >= TIMESYNC_FILTER_SAMPLES && sb->peer.clock.exchanges >= TIMESYNC_FILTER_SAMPLES,
+          "too few exchanges: %lu / %lu", (unsigned long)sa->peer.clock.exchanges,
+          (unsigned long)sb->peer.clock.exchanges);
+    CHECK(llabs(sa->peer.clock.best.offset_us) < 2000 && llabs(sb->peer.clock.best.offset_us) < 2000,
+          "same-process clocks differ by %lld / %lld us", (long long)sa->peer.clock.best.offset_us,
+          (long long)sb->peer.clock.best.offset_us);
+    CHECK(llabs(clock_alignment_us()) < 2000, "alignment %lld us for a peer on the same clock",
+          (long long)clock_alignment_us());
+
+    hook_closesocket(a.s);
+    hook_closesocket(b.s);
+}
+
+/* A 60 fps loop reading GetTickCount once at the top and twice inside, with one frame held up by a full send buffer */
+static void test_frame_profiler_attributes_stutter(void)
+{
+    const uintptr_t outer_site = 0x1000;
+    const uintptr_t inner_site = 0x2000;
+
+    g_config.frame_profiler = TRUE;
+    clock_set_virtual(TRUE);
+
+    /* Learn for a little over FRAMEPROF_LEARN_US, then 100 more frames */
+    for (int frame = 0; frame < 64 + 100; frame++)
+    {
+        frameprof_tick(outer_site);
+        frameprof_tick(inner_site);
+        clock_advance(8);
+        frameprof_tick(inner_site);
+        clock_advance(8);
+    }
+    const frameprof_thread *thread = frameprof_current();
+    CHECK(thread != NULL && thread->frame_site == outer_site, "frame site not found at the outer loop");
+    if (!thread)
+    {
+        clock_set_virtual(FALSE);
+        return;
+    }
+    uint32_t frames = thread->frames;
+    CHECK(frames >= 99 && thread->histogram[2] == frames, "expected ~100 frames of 16 ms, got %lu (%lu in 10-17 ms)",
+          (unsigned long)frames, (unsigned long)thread->histogram[2]);
+    CHECK(thread->stutters == 0, "%lu stutters in a steady loop", (unsigned long)thread->stutters);
+
+    /* The next frame waits in hook_send until the receiver makes room */
+    frameprof_tick(outer_site);
+    g_sleep_total_ms = 0;
+    g_send_script.block_count = 60;
+    CHECK(hook_send((SOCKET)1, "abc", 3, 0) == 3, "send did not complete");
+    clock_advance(16);
+    frameprof_tick(outer_site);
+
+    CHECK(thread->frames == frames + 2, "expected %lu frames, got %lu", (unsigned long)frames + 2,
+          (unsigned long)thread->frames);
+    CHECK(thread->stutters == 1, "expected 1 stutter, got %lu", (unsigned long)thread->stutters);
+    CHECK(thread->stutter_part_us[FRAMEPROF_SEND] == (int64_t)g_sleep_total_ms * 1000,
+          "stutter send time %lld us, send slept %d ms", (long long)thread->stutter_part_us[FRAMEPROF_SEND],
+          g_sleep_total_ms);
+    CHECK(thread->stutter_us == thread->stutter_part_us[FRAMEPROF_SEND] + 16000, "stutter lasted %lld us",
+          (long long)thread->stutter_us);
+
+    frameprof_log();
+    CHECK(thread->frames == 0 && thread->stutters == 0, "frameprof_log() did not reset the statistics");
+    clock_set_virtual(FALSE);
+}
+
+/* Ticks once from a site, optionally waits out the learning period, and reports whether the thread kept a slot. */
+typedef struct
+{
+    BOOL learn;
+    BOOL has_slot;
+} tick_thread_args;
+
+static DWORD WINAPI tick_thread(LPVOID param)
+{
+    tick_thread_args *args = (tick_thread_args *)param;
+    frameprof_tick(0x3000);
+    if (args->learn)
+    {
+        clock_advance(FRAMEPROF_LEARN_US / 1000);
+        frameprof_tick(0x3000);
+    }
+    args->has_slot = frameprof_current() != NULL;
+    return 0;
+}
+
+static BOOL run_tick_thread(tick_thread_args *args)
+{
+    HANDLE done = CreateThread(NULL, 0, tick_thread, args, 0, NULL);
+    BOOL   finished = done && WaitForSingleObject(done, 5000) == WAIT_OBJECT_0;
+    if (done)
+        CloseHandle(done);
+    Sleep(20); /* Let the thread exit, not just return */
+    return finished;
+}
+
+/* A thread without a frame loop gives its slot back; a full table frees the slots of exited threads */
+static void test_frame_profiler_frees_thread_slots(void)
+{
+    tick_thread_args args;
+
+    clock_set_virtual(TRUE);
+    memset(&args, 0, sizeof(args));
+    args.learn = TRUE;
+    CHECK(run_tick_thread(&args), "thread did not finish");
+    CHECK(!args.has_slot, "a thread without a frame loop kept its slot");
+
+    /* Threads that tick once and exit fill the table */
+    clock_advance(FRAMEPROF_EVICT_CHECK_MS);
+    args.learn = FALSE;
+    for (int i = 0; i < FRAMEPROF_THREADS; i++)
+    {
+        CHECK(run_tick_thread(&args), "filler %d did not finish", i);
+        CHECK(args.has_slot, "filler %d got no slot", i);
+    }
+
+    clock_advance(FRAMEPROF_EVICT_CHECK_MS);
+    args.has_slot = FALSE;
+    CHECK(run_tick_thread(&args), "thread did not finish");
+    CHECK(args.has_slot, "no slot freed for a new thread in a table of exited threads");
+    clock_set_virtual(FALSE);
+}
+
+/* select() and WSAPoll() from server.dll: quiet sockets are answered from the watcher, data wakes a waiting poll */
+static void test_select_cache_answers_quiet_polls(void)
+{
+    SOCKET         a, b;
+    fd_set         readable;
+    struct timeval zero = {0, 0};
+    struct timeval wait = {2, 0};
+    char           buf[16];
+    u_long         non_blocking = 1;
+
+    use_real_winsock();
+    real_select = select;
+    real_WSAPoll = WSAPoll;
+    g_config.select_cache = TRUE;
+    CHECK(make_tcp_pair(&a, &b) == TRUE, "could not create loopback pair");
+    CHECK(hook_ioctlsocket(b, FIONBIO, &non_blocking) == 0, "FIONBIO failed");
+
+    /* The first poll registers the socket and asks Winsock; the next ones are cached */
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &zero) == 0, "idle socket reported readable");
+    readiness_stats before = readiness_get_stats();
+    for (int i = 0; i < 1000; i++)
+    {
+        FD_ZERO(&readable);
+        FD_SET(b, &readable);
+        CHECK(hook_select(0, &readable, NULL, NULL, &zero) == 0 && readable.fd_count == 0, "idle poll %d not empty", i);
+    }
+    readiness_stats after = readiness_get_stats();
+    CHECK(after.cached - before.cached == 1000, "%lu of 1000 idle polls answered from the cache",
+          (unsigned long)(after.cached - before.cached));
+
+    /* A waiting poll wakes when data arrives, well before its timeout */
+    CHECK(send(a, "ping", 4, 0) == 4, "send failed");
+    DWORD start = GetTickCount();
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &wait) == 1 && FD_ISSET(b, &readable), "data not reported readable");
+    CHECK(GetTickCount() - start < 1000, "select took %lu ms", (unsigned long)(GetTickCount() - start));
+
+    /* Unread data stays readable; once drained, polls are cached again */
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &zero) == 1, "unread data no longer reported");
+    CHECK(recv(b, buf, sizeof(buf), 0) == 4, "recv failed");
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &zero) == 0, "drained socket reported readable");
+    before = readiness_get_stats();
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &zero) == 0, "drained socket reported readable");
+    CHECK(readiness_get_stats().cached == before.cached + 1, "poll after draining not cached");
+
+    /* A timeout without data expires instead of returning early */
+    start = GetTickCount();
+    struct timeval short_wait = {0, 50000};
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &short_wait) == 0, "timeout reported data");
+    CHECK(GetTickCount() - start >= 40, "50 ms select returned after %lu ms", (unsigned long)(GetTickCount() - start));
+
+    /* WSAPoll shares the watcher */
+    WSAPOLLFD fd;
+    fd.fd = b;
+    fd.events = POLLRDNORM;
+    fd.revents = 0;
+    before = readiness_get_stats();
+    CHECK(hook_WSAPoll(&fd, 1, 0) == 0 && fd.revents == 0, "idle WSAPoll reported events");
+    CHECK(readiness_get_stats().cached == before.cached + 1, "idle WSAPoll not cached");
+    CHECK(send(a, "pong", 4, 0) == 4, "send failed");
+    CHECK(hook_WSAPoll(&fd, 1, 2000) == 1 && (fd.revents & POLLRDNORM), "WSAPoll missed data");
+    CHECK(recv(b, buf, sizeof(buf), 0) == 4, "recv failed");
+
+    hook_closesocket(a);
+    hook_closesocket(b);
+    real_select = NULL;
+    real_WSAPoll = NULL;
+}
+
+static DWORD WINAPI send_after_a_moment(LPVOID param)
+{
+    Sleep(1);
+    send(*(SOCKET *)param, "late", 4, 0);
+    return 0;
+}
+
+/* A blocking socket polled with select() stays blocking: recv() waits for data instead of failing */
+static void test_select_cache_keeps_blocking_sockets(void)
+{
+    SOCKET         a, b;
+    fd_set         readable;
+    struct timeval zero = {0, 0};
+    struct timeval wait = {2, 0};
+    char           buf[16];
+    u_long         mode = 0;
+
+    use_real_winsock();
+    real_select = select;
+    g_config.select_cache = TRUE;
+    CHECK(make_tcp_pair(&a, &b) == TRUE, "could not create loopback pair");
+    CHECK(hook_ioctlsocket(b, FIONBIO, &mode) == 0, "FIONBIO failed");
+
+    /* Polls of a blocking socket go to Winsock without registering it */
+    readiness_stats before = readiness_get_stats();
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &zero) == 0, "idle socket reported readable");
+    CHECK(send(a, "ping", 4, 0) == 4, "send failed");
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &wait) == 1 && FD_ISSET(b, &readable), "data not reported readable");
+    readiness_stats after = readiness_get_stats();
+    CHECK(after.watched == before.watched && after.unwatched - before.unwatched == 2, "blocking socket watched");
+    CHECK(hook_recv(b, buf, sizeof(buf), 0) == 4, "recv failed");
+
+    HANDLE thread = CreateThread(NULL, 0, send_after_a_moment, &a, 0, NULL);
+    CHECK(hook_recv(b, buf, sizeof(buf), 0) == 4 && memcmp(buf, "late", 4) == 0, "blocking recv did not wait");
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+
+    /* A watched socket can go back to blocking mode; it leaves the watcher first */
+    mode = 1;
+    CHECK(hook_ioctlsocket(b, FIONBIO, &mode) == 0, "FIONBIO failed");
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &zero) == 0, "idle socket reported readable");
+    CHECK(readiness_get_stats().watched == after.watched + 1, "non-blocking socket not watched");
+    mode = 0;
+    CHECK(hook_ioctlsocket(b, FIONBIO, &mode) == 0, "switch back to blocking mode failed: %d", WSAGetLastError());
+    thread = CreateThread(NULL, 0, send_after_a_moment, &a, 0, NULL);
+    CHECK(hook_recv(b, buf, sizeof(buf), 0) == 4 && memcmp(buf, "late", 4) == 0, "blocking recv did not wait");
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+
+    hook_closesocket(a);
+    hook_closesocket(b);
+    real_select = NULL;
+}
+
+/* A recv loop spinning on an empty socket waits for data instead, and gets data that arrives during a wait */
+static void test_recv_wait_catches_late_data(void)
+{
+    SOCKET a, b;
+    char   buf[16];
+
+    use_real_winsock();
+    g_config.recv_wait_us = 5000;
+    CHECK(make_tcp_pair(&a, &b) == TRUE, "could not create loopback pair");
+
+    DWORD start = GetTickCount();
+    for (int i = 0; i < 12; i++)
+    {
+        CHECK(hook_recv(b, buf, sizeof(buf), 0) == 0, "empty socket returned data");
+    }
+    socket_state *state = get_socket_state(b, FALSE);
+    CHECK(state != NULL, "socket not tracked");
+    if (!state)
+        return;
+    CHECK(state->stats.recv_empty_calls == 12, "%lu empty calls counted", (unsigned long)state->stats.recv_empty_calls);
+    /* The first calls of a streak return at once */
+    CHECK(state->stats.recv_waits > 0 && state->stats.recv_waits < 12 && state->stats.recv_wait_hits == 0,
+          "%lu waits, %lu hits on an idle socket", (unsigned long)state->stats.recv_waits,
+          (unsigned long)state->stats.recv_wait_hits);
+    CHECK(GetTickCount() - start < 500, "idle recv calls took %lu ms", (unsigned long)(GetTickCount() - start));
+
+    /* Data sent while the game spins arrives during one of the waits */
+    HANDLE thread = CreateThread(NULL, 0, send_after_a_moment, &a, 0, NULL);
+    int    received = 0;
+    for (int i = 0; i < 200 && received == 0; i++)
+    {
+        received = hook_recv(b, buf, sizeof(buf), 0);
+    }
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    CHECK(received == 4 && memcmp(buf, "late", 4) == 0, "late data not received (%d)", received);
+    CHECK(state->stats.recv_wait_hits == 1, "expected the data to end a wait, %lu hits",
+          (unsigned long)state->stats.recv_wait_hits);
+    CHECK(state->recv_streak == 0, "streak not reset by data");
+
+    hook_closesocket(a);
+    hook_closesocket(b);
+}
+
+/* HighResSleep=1 times server.dll's Sleep(1) calls; =2 serves them on time without oversleeping */
+static void test_high_res_sleep_wakes_on_time(void)
+{
+    clock_sleep_stats before, coarse, precise;
+
+    real_Sleep = Sleep;
+    before = clock_get_sleep_stats();
+    g_config.high_res_sleep = HIGH_RES_SLEEP_MEASURE;
+    for (int i = 0; i < 20; i++)
+        hook_Sleep(1);
+    coarse = clock_get_sleep_stats();
+    g_config.high_res_sleep = HIGH_RES_SLEEP_ON;
+    for (int i = 0; i < 20; i++)
+        hook_Sleep(1);
+    hook_Sleep(0);
+    precise = clock_get_sleep_stats();
+    real_Sleep = NULL;
+
+    CHECK(coarse.calls - before.calls == 20 && coarse.precise == before.precise, "measured %lu sleeps, %lu precise",
+          (unsigned long)(coarse.calls - before.calls), (unsigned long)(coarse.precise - before.precise));
+    CHECK(precise.calls - coarse.calls == 20 && precise.precise - coarse.precise == 20,
+          "HighResSleep=2 served %lu of %lu sleeps precisely", (unsigned long)(precise.precise - coarse.precise),
+          (unsigned long)(precise.calls - coarse.calls));
+    CHECK(precise.requested_us - coarse.requested_us == 20000, "requested time not recorded");
+
+    double coarse_us = (double)(coarse.actual_us - before.actual_us) / 20.0;
+    double precise_us = (double)(precise.actual_us - coarse.actual_us) / 20.0;
+    printf("  Sleep(1) took %.0f us with the original, %.0f us with HighResSleep=2\n", coarse_us, precise_us);
+    CHECK(precise_us >= 1000.0, "HighResSleep woke up early: %.0f us", precise_us);
+    CHECK(precise_us < 2000.0, "HighResSleep overslept: %.0f us", precise_us);
+}
+
+/* OverlappedIo=1 moves data through the completion port engine and answers select() from its buffers */
+static void test_overlapped_io_moves_data(void)
+{
+    SOCKET         a, b;
+    fd_set         readable;
+    struct timeval zero = {0, 0};
+    struct timeval wait = {1, 0};
+    char           buf[16];
+    static char    big_out[100000];
+    static char    big_in[100000];
+
+    use_real_winsock();
+    real_select = select;
+    real_WSAPoll = WSAPoll;
+    g_config.overlapped_io = TRUE;
+    CHECK(make_tcp_pair(&a, &b) == TRUE, "could not create loopback pair");
+    iocp_stats before = iocp_get_stats();
+
+    /* The first recv takes the socket over; like the plain hook, an empty socket returns 0 */
+    CHECK(hook_recv(b, buf, sizeof(buf), 0) == 0, "empty socket returned data");
+    CHECK(iocp_owns(b), "socket not taken over by the engine");
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &zero) == 0, "idle socket reported readable");
+
+    CHECK(hook_send(a, "hello", 5, 0) == 5, "send not buffered");
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &wait) == 1 && FD_ISSET(b, &readable), "data not reported readable");
+    CHECK(hook_recv(b, buf, sizeof(buf), 0) == 5 && memcmp(buf, "hello", 5) == 0, "data not received");
+
+    /* More than one ring's worth: the send waits for room, the reader drains it in pieces */
+    for (int i = 0; i < (int)sizeof(big_out); i++)
+        big_out[i] = (char)(i * 7);
+    CHECK(hook_send(a, big_out, sizeof(big_out), 0) == (int)sizeof(big_out), "large send not buffered");
+    int   received = 0;
+    DWORD start = GetTickCount();
+    while (received < (int)sizeof(big_in) && GetTickCount() - start < 5000)
+    {
+        int n = hook_recv(b, big_in + received, (int)sizeof(big_in) - received, 0);
+        if (n > 0)
+            received += n;
+        else
+            Sleep(1);
+    }
+    CHECK(received == (int)sizeof(big_in) && memcmp(big_in, big_out, sizeof(big_in)) == 0,
+          "large transfer corrupted (%d bytes)", received);
+
+    iocp_stats after = iocp_get_stats();
+    CHECK(after.sockets - before.sockets == 2, "%lu sockets taken over",
+          (unsigned long)(after.sockets - before.sockets));
+    CHECK(after.bytes_in - before.bytes_in == 100005 && after.bytes_out - before.bytes_out == 100005,
+          "%llu bytes in, %llu out", (unsigned long long)(after.bytes_in - before.bytes_in),
+          (unsigned long long)(after.bytes_out - before.bytes_out));
+    CHECK(after.recv_posts > before.recv_posts && after.send_posts > before.send_posts, "no operations posted");
+
+    /* The peer's close shows up as readable with an end of stream */
+    hook_closesocket(a);
+    FD_ZERO(&readable);
+    FD_SET(b, &readable);
+    CHECK(hook_select(0, &readable, NULL, NULL, &wait) == 1, "close not reported readable");
+    CHECK(hook_recv(b, buf, sizeof(buf), 0) == 0, "close not reported as end of stream");
+    hook_closesocket(b);
+    CHECK(!iocp_owns(b), "closed socket still owned");
+
+    /* A datagram socket would lose its message boundaries in the rings */
+    SOCKET udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    CHECK(udp != INVALID_SOCKET && !iocp_adopt(udp) && !iocp_owns(udp), "datagram socket taken over");
+    closesocket(udp);
+    real_select = NULL;
+    real_WSAPoll = NULL;
+}
+
+/* A link for the send mock: the socket's real SO_SNDBUF is its capacity, and it drains at a fixed rate */
+static struct
+{
+    int   queued;      /* Bytes in the simulated send buffer */
+    DWORD last_drain;  /* Virtual tick count of the last drain */
+    int   bytes_per_ms;
+} g_link;
+
+static int WSAAPI link_send(SOCKET s, const char *buf, int len, int flags)
+{
+    int capacity = 0;
+    int capacity_len = sizeof(capacity);
+    (void)buf;
+    (void)flags;
+
+    g_link.queued -= (int)(clock_ticks() - g_link.last_drain) * g_link.bytes_per_ms;
+    g_link.queued = g_link.queued < 0 ? 0 : g_link.queued;
+    g_link.last_drain = clock_ticks();
+    getsockopt(s, SOL_SOCKET, SO_SNDBUF, (char *)&capacity, &capacity_len);
+    if (g_link.queued >= capacity)
+    {
+        WSASetLastError(WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+    int taken = len < capacity - g_link.queued ? len : capacity - g_link.queued;
+    g_link.queued += taken;
+    return taken;
+}
+
+/* Sends a 16 KB burst every 10 ms frame over a 4 MB/s link with an 8 KB send buffer; returns the retries */
+static int stream_bursts(BOOL tuning, int *sndbuf_after)
+{
+    static char burst[16384];
+    int         small_buffer = 4096;
+    int         size_len = sizeof(*sndbuf_after);
+
+    reset_state();
+    use_real_winsock();
+    real_send = link_send;
+    g_config.buffer_tuning = tuning;
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); /* Only its options are used */
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, (const char *)&small_buffer, sizeof(small_buffer));
+    memset(&g_link, 0, sizeof(g_link));
+    g_link.last_drain = clock_ticks();
+    g_link.bytes_per_ms = 4096;
+
+    for (int frame = 0; frame < 100; frame++)
+    {
+        CHECK(hook_send(s, burst, sizeof(burst), 0) == (int)sizeof(burst), "burst %d not sent", frame);
+        clock_advance(10);
+    }
+    getsockopt(s, SOL_SOCKET, SO_SNDBUF, (char *)sndbuf_after, &size_len);
+    hook_closesocket(s);
+    return g_sleep_calls;
+}
+
+/* BufferTuning=1 grows the buffers of a socket whose writes keep blocking or whose reads fall behind */
+static void test_buffer_tuning_reduces_stalls(void)
+{
+    int fixed_sndbuf, tuned_sndbuf;
+
+    clock_set_virtual(TRUE);
+    int           fixed_stalls = stream_bursts(FALSE, &fixed_sndbuf);
+    buftune_stats before = buftune_get_stats();
+    int           tuned_stalls = stream_bursts(TRUE, &tuned_sndbuf);
+    buftune_stats after = buftune_get_stats();
+
+    printf("  send retries: %d with fixed buffers, %d with BufferTuning (SO_SNDBUF %d -> %d)\n", fixed_stalls,
+           tuned_stalls, fixed_sndbuf, tuned_sndbuf);
+    CHECK(after.send_grows > before.send_grows, "send buffer never grew");
+    CHECK(tuned_sndbuf > fixed_sndbuf, "SO_SNDBUF %d not above %d", tuned_sndbuf, fixed_sndbuf);
+    CHECK(tuned_stalls * 4 < fixed_stalls, "%d retries with tuning, %d without", tuned_stalls, fixed_stalls);
+    /* A 4 MB/s link with the assumed 100 ms round trip needs at most 800 KB (Linux reports twice the size set) */
+    CHECK(tuned_sndbuf <= 2 * 800 * 1024, "SO_SNDBUF %d past the bandwidth-delay cap", tuned_sndbuf);
+
+    /* A reader that leaves most of its receive buffer unread gets a larger one */
+    SOCKET      a, b;
+    static char data[96 * 1024];
+    char        small[100];
+    int         rcvbuf = 65536, rcvbuf_after = 0, size_len = sizeof(rcvbuf_after);
+
+    reset_state();
+    use_real_winsock();
+    g_config.buffer_tuning = TRUE;
+    CHECK(make_tcp_pair(&a, &b) == TRUE, "could not create loopback pair");
+    setsockopt(b, SOL_SOCKET, SO_RCVBUF, (const char *)&rcvbuf, sizeof(rcvbuf));
+    getsockopt(b, SOL_SOCKET, SO_RCVBUF, (char *)&rcvbuf, &size_len);
+    int queued = 0;
+    for (int r; queued < rcvbuf * 3 / 4 && (r = send(a, data, (int)sizeof(data), 0)) > 0;)
+        queued += r;
+    Sleep(20);
+    CHECK(hook_recv(b, small, sizeof(small), 0) == (int)sizeof(small), "no data");
+    clock_advance(BUFTUNE_WINDOW_MS);
+    CHECK(hook_recv(b, small, sizeof(small), 0) == (int)sizeof(small), "no data");
+    size_len = sizeof(rcvbuf_after);
+    getsockopt(b, SOL_SOCKET, SO_RCVBUF, (char *)&rcvbuf_after, &size_len);
+    CHECK(buftune_get_stats().recv_grows > after.recv_grows && rcvbuf_after > rcvbuf,
+          "SO_RCVBUF %d -> %d with %d bytes unread", rcvbuf, rcvbuf_after, queued);
+    hook_closesocket(a);
+    hook_closesocket(b);
+    clock_set_virtual(FALSE);
+}
+
+/* Reads one int-sized socket option, -1 if it cannot be read. */
+static int get_int_option(SOCKET s, int level, int option)
+{
+    int value = 0;
+    int value_len = sizeof(value);
+    if (getsockopt(s, level, option, (char *)&value, &value_len) == SOCKET_ERROR)
+        return -1;
+    return value;
+}
+
+/* TCP_NODELAY of the sockets as the real connect() and listen() see them */
+static int g_nodelay_at_connect = -1;
+static int g_nodelay_at_listen = -1;
+
+static int WSAAPI connect_recording_options(SOCKET s, const struct sockaddr *name, int namelen)
+{
+    g_nodelay_at_connect = get_int_option(s, IPPROTO_TCP, TCP_NODELAY);
+    return connect(s, name, namelen);
+}
+
+static int WSAAPI listen_recording_options(SOCKET s, int backlog)
+{
+    g_nodelay_at_listen = get_int_option(s, IPPROTO_TCP, TCP_NODELAY);
+    return listen(s, backlog);
+}
+
+/* SocketProfile sets its options on both ends before the handshake: before connect() and on the listener */
+static void test_socket_profile_applies_on_connect_and_accept(void)
+{
+    SOCKET                listener, client, server;
+    sockprofile_stats     before = sockprofile_get_stats();
+    const socket_profile *profile = sockprofile_get(SOCKET_PROFILE_VPN);
+
+    use_real_winsock();
+    CHECK(profile != NULL && sockprofile_get(SOCKET_PROFILE_OFF) == NULL, "profile table lookup broken");
+    CHECK(make_hooked_pair(&listener, &client, &server) == TRUE, "could not create hooked pair");
+    CHECK(sockprofile_get_stats().applied == before.applied, "profile applied while SocketProfile=0");
+    CHECK(get_int_option(client, IPPROTO_TCP, TCP_NODELAY) == 0, "TCP_NODELAY on by default");
+    hook_closesocket(client);
+    hook_closesocket(server);
+    closesocket(listener);
+
+    g_config.socket_profile = SOCKET_PROFILE_VPN;
+    real_connect = connect_recording_options;
+    real_listen = listen_recording_options;
+    CHECK(make_hooked_pair(&listener, &client, &server) == TRUE, "could not create hooked pair");
+    use_real_winsock();
+    sockprofile_stats after = sockprofile_get_stats();
+    CHECK(after.applied == before.applied + 3 && after.failed == before.failed, "applied %u, failed %u",
+          after.applied - before.applied, after.failed - before.failed);
+    CHECK(g_nodelay_at_connect > 0 && g_nodelay_at_listen > 0, "TCP_NODELAY %d at connect, %d at listen",
+          g_nodelay_at_connect, g_nodelay_at_listen);
+
+    /* A caller polling its connection in progress does not get the profile again */
+    struct sockaddr_in addr;
+    int                addr_len = sizeof(addr);
+    getsockname(listener, (struct sockaddr *)&addr, &addr_len);
+    CHECK(hook_connect(client, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR, "connect poll succeeded");
+    CHECK(sockprofile_get_stats().applied == after.applied, "profile applied again by a connect poll");
+
+    SOCKET ends[3] = {client, server, listener};
+    for (int i = 0; i < 3; i++)
+    {
+        struct linger linger_value;
+        int           linger_len = sizeof(linger_value);
+        int           sndbuf = get_int_option(ends[i], SOL_SOCKET, SO_SNDBUF);
+        int           rcvbuf = get_int_option(ends[i], SOL_SOCKET, SO_RCVBUF);
+
+        CHECK(get_int_option(ends[i], IPPROTO_TCP, TCP_NODELAY) != 0, "end %d: TCP_NODELAY off", i);
+        CHECK(sndbuf >= profile->buffer_bytes && rcvbuf >= profile->buffer_bytes,
+              "end %d: SO_SNDBUF %d, SO_RCVBUF %d below %d", i, sndbuf, rcvbuf, profile->buffer_bytes);
+        CHECK(getsockopt(ends[i], SOL_SOCKET, SO_LINGER, (char *)&linger_value, &linger_len) == 0 &&
+                  !linger_value.l_onoff,
+              "end %d: linger on", i);
+    }
+
+    /* The options survive the connection carrying data */
+    char buf[16];
+    CHECK(hook_send(client, "profile", 7, 0) == 7, "send failed");
+    Sleep(20);
+    CHECK(hook_recv(server, buf, sizeof(buf), 0) == 7, "no data");
+    CHECK(sockprofile_get_stats().applied == after.applied, "profile applied again during traffic");
+
+    hook_closesocket(client);
+    hook_closesocket(server);
+    closesocket(listener);
+}
+
+/* With BufferTuning, a profile applied later keeps a buffer the tuner grew instead of shrinking it */
+static void test_socket_profile_keeps_tuned_buffers(void)
+{
+    SOCKET client, server;
+    int    tuned = 1024 * 1024;
+
+    use_real_winsock();
+    CHECK(make_tcp_pair(&client, &server) == TRUE, "could not create TCP pair");
+    setsockopt(client, SOL_SOCKET, SO_SNDBUF, (const char *)&tuned, sizeof(tuned));
+    tuned = get_int_option(client, SOL_SOCKET, SO_SNDBUF);
+    CHECK(tuned > sockprofile_get(SOCKET_PROFILE_LAN)->buffer_bytes, "SO_SNDBUF %d did not grow", tuned);
+
+    g_config.buffer_tuning = TRUE;
+    CHECK(sockprofile_apply(client, SOCKET_PROFILE_LAN) == TRUE, "profile not applied");
+    CHECK(get_int_option(client, SOL_SOCKET, SO_SNDBUF) == tuned, "SO_SNDBUF shrank from %d to %d", tuned,
+          get_int_option(client, SOL_SOCKET, SO_SNDBUF));
+
+    g_config.buffer_tuning = FALSE;
+    CHECK(sockprofile_apply(client, SOCKET_PROFILE_LAN) == TRUE, "profile not applied");
+    CHECK(get_int_option(client, SOL_SOCKET, SO_SNDBUF) < tuned, "SO_SNDBUF kept %d without BufferTuning", tuned);
+
+    closesocket(client);
+    closesocket(server);
+}
+
+/* Feeds one classification window of writes to a watched socket; the last write closes the window. */
+static void feed_class_window(SOCKET s, int sends, int blocks)
+{
+    for (int i = 0; i < sends; i++)
+    {
+        if (i == sends - 1)
+            clock_advance(NETCLASS_WINDOW_MS);
+        netclass_note_send(s, i < blocks);
+    }
+}
+
+static void feed_class_windows(SOCKET s, int windows, int sends, int blocks)
+{
+    for (int i = 0; i < windows; i++)
+        feed_class_window(s, sends, blocks);
+}
+
+/* AutoProfile classifies connections by address, then retunes them from their metrics with hysteresis */
+static void test_auto_profile_classifies_and_retunes(void)
+{
+    struct sockaddr_in addr;
+    const char        *vpn;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x19010203); /* 25.1.2.3 */
+    vpn = netclass_vpn_subnet((struct sockaddr *)&addr);
+    CHECK(vpn && strcmp(vpn, "Hamachi") == 0, "25.1.2.3 not on the Hamachi subnet");
+    addr.sin_addr.s_addr = htonl(0x1A040506); /* 26.4.5.6 */
+    vpn = netclass_vpn_subnet((struct sockaddr *)&addr);
+    CHECK(vpn && strcmp(vpn, "Radmin VPN") == 0, "26.4.5.6 not on the Radmin VPN subnet");
+    addr.sin_addr.s_addr = htonl(0xC0A8010A); /* 192.168.1.10 */
+    CHECK(netclass_vpn_subnet((struct sockaddr *)&addr) == NULL, "192.168.1.10 taken for a VPN");
+
+    SOCKET         listener, client, server;
+    netclass_stats before = netclass_get_stats();
+
+    use_real_winsock();
+    clock_set_virtual(TRUE);
+    g_config.auto_profile = TRUE;
+    CHECK(make_hooked_pair(&listener, &client, &server) == TRUE, "could not create hooked pair");
+    CHECK(netclass_get(client) == SOCKET_PROFILE_LAN && netclass_get(server) == SOCKET_PROFILE_LAN,
+          "loopback classified as %lu/%lu", (unsigned long)netclass_get(client), (unsigned long)netclass_get(server));
+    CHECK(netclass_retry_delay_ms(client, 1) == 1 && netclass_recv_wait_us(client, 1000) == 1000,
+          "LAN changed the hook settings");
+
+    /* A tunnel's round trip: one window is not enough to switch, NETCLASS_CONFIRM_WINDOWS are */
+    socket_state *state = get_socket_state(client, TRUE);
+    state->stats.rtt_samples = 10;
+    state->stats.srtt_us = 60000;
+    state->stats.rttvar_us = 5000;
+    feed_class_windows(client, NETCLASS_CONFIRM_WINDOWS - 1, 20, 0);
+    CHECK(netclass_get(client) == SOCKET_PROFILE_LAN, "switched before %d windows", NETCLASS_CONFIRM_WINDOWS);
+    feed_class_window(client, 20, 0);
+    CHECK(netclass_get(client) == SOCKET_PROFILE_VPN, "60 ms round trip left class %lu",
+          (unsigned long)netclass_get(client));
+    CHECK(netclass_retry_delay_ms(client, 1) > 1 && netclass_recv_wait_us(client, 1000) < 1000,
+          "VPN kept the LAN hook settings");
+    CHECK(get_int_option(client, SOL_SOCKET, SO_SNDBUF) >= sockprofile_get(SOCKET_PROFILE_VPN)->buffer_bytes,
+          "VPN profile not applied");
+
+    /* Jitter and blocked writes mark it lossy; a steady window in between starts the count again */
+    state->stats.rttvar_us = 40000;
+    feed_class_windows(client, NETCLASS_CONFIRM_WINDOWS - 1, 20, 8);
+    state->stats.rttvar_us = 5000;
+    feed_class_window(client, 20, 0);
+    state->stats.rttvar_us = 40000;
+    feed_class_windows(client, NETCLASS_CONFIRM_WINDOWS - 1, 20, 8);
+    CHECK(netclass_get(client) == SOCKET_PROFILE_VPN, "a steady window did not restart the count");
+    feed_class_window(client, 20, 8);
+    CHECK(netclass_get(client) == SOCKET_PROFILE_VPN_LOSSY, "jitter and blocks left class %lu",
+          (unsigned long)netclass_get(client));
+    CHECK(netclass_recv_wait_us(client, 1000) == 0, "lossy tunnel still waits in recv");
+
+    /* Between the enter and the leave levels the class holds */
+    state->stats.rttvar_us = 20000;
+    feed_class_windows(client, NETCLASS_CONFIRM_WINDOWS + 2, 20, 4);
+    CHECK(netclass_get(client) == SOCKET_PROFILE_VPN_LOSSY, "class flapped between thresholds");
+
+    /* Below the leave levels it is a steady tunnel again, and a short round trip makes it a LAN */
+    state->stats.rttvar_us = 5000;
+    feed_class_windows(client, NETCLASS_CONFIRM_WINDOWS, 20, 0);
+    CHECK(netclass_get(client) == SOCKET_PROFILE_VPN, "steady metrics left class %lu",
+          (unsigned long)netclass_get(client));
+    state->stats.srtt_us = 3000;
+    state->stats.rttvar_us = 1000;
+    feed_class_windows(client, NETCLASS_CONFIRM_WINDOWS, 20, 0);
+    CHECK(netclass_get(client) == SOCKET_PROFILE_LAN, "3 ms round trip left class %lu",
+          (unsigned long)netclass_get(client));
+
+    netclass_stats after = netclass_get_stats();
+    CHECK(after.sockets == before.sockets + 2, "%u sockets classified", after.sockets - before.sockets);
+    CHECK(after.changes == before.changes + 4, "%u class changes", after.changes - before.changes);
+    CHECK(after.held > before.held, "no window was held back");
+    CHECK(netclass_get(server) == SOCKET_PROFILE_LAN, "server end changed with the client's metrics");
+
+    hook_closesocket(client);
+    hook_closesocket(server);
+    closesocket(listener);
+    CHECK(netclass_get(client) == SOCKET_PROFILE_OFF, "closed socket still watched");
+    clock_set_virtual(FALSE);
+}
+
 int main(void)
 {
     WSADATA wsa;
@@ -797,6 +3389,54 @@ int main(void)
     RUN(test_send_zero_indicates_closed);
     RUN(test_send_retry_counter_resets);
 
+    RUN(test_lz4_roundtrip_compressible);
+    RUN(test_lz4_roundtrip_incompressible);
+    RUN(test_lz4_rejects_malformed_input);
+    RUN(test_delta_roundtrip_sparse_changes);
+    RUN(test_delta_rejects_malformed_runs);
+    RUN(test_delta_history_finds_closest_message);
+    RUN(test_replay_buffer_wraps_and_rejects_stale);
+    RUN(test_peer_negotiates_and_compresses);
+    RUN(test_peer_role_follows_connect_direction);
+    RUN(test_peer_delta_encodes_repeated_messages);
+    RUN(test_peer_heartbeat_measures_rtt_and_detects_silence);
+    RUN(test_peer_heartbeat_follows_virtual_time);
+    RUN(test_peer_stalled_send_is_aborted);
+    RUN(test_peer_deadlines_follow_virtual_time);
+    RUN(test_peer_session_resumes_after_drop);
+    RUN(test_peer_accept_never_waits_for_resume);
+    RUN(test_rudp_recovers_from_loss_and_reordering);
+    RUN(test_pacer_estimates_bandwidth_and_spaces_packets);
+    RUN(test_rudp_pacing_keeps_bottleneck_queue_short);
+    RUN(test_rudp_discovers_path_mtu);
+    RUN(test_peer_tunnel_carries_game_stream);
+    RUN(test_shm_ring_wraps_and_detects_close);
+    RUN(test_peer_shared_memory_carries_game_stream);
+    RUN(test_peer_falls_back_for_unpatched_peer);
+    RUN(test_peer_skips_oob_inline_sockets);
+    RUN(test_send_queue_fans_out_without_stalling);
+    RUN(test_send_queue_flush_gathers_entries);
+    RUN(test_send_queue_partial_gather_keeps_offsets);
+    RUN(test_high_res_clock_tracks_qpc);
+    RUN(test_time_dilation_absorbs_stall);
+    RUN(test_clock_hooks_share_one_clock);
+    RUN(test_virtual_clock_drives_query_performance_counter);
+    RUN(test_clock_alignment_slews_after_first_read);
+    RUN(test_virtual_clock_fast_forwards_an_hour);
+    RUN(test_timesync_filters_jittered_exchanges);
+    RUN(test_peer_clock_sync_estimates_offset);
+    RUN(test_frame_profiler_attributes_stutter);
+    RUN(test_frame_profiler_frees_thread_slots);
+    RUN(test_select_cache_answers_quiet_polls);
+    RUN(test_select_cache_keeps_blocking_sockets);
+    RUN(test_recv_wait_catches_late_data);
+    RUN(test_high_res_sleep_wakes_on_time);
+    RUN(test_overlapped_io_moves_data);
+    RUN(test_buffer_tuning_reduces_stalls);
+    RUN(test_socket_profile_applies_on_connect_and_accept);
+    RUN(test_socket_profile_keeps_tuned_buffers);
+    RUN(test_auto_profile_classifies_and_retunes);
+
     RUN(test_srv_null_ctx_returns_minus_one);
     RUN(test_srv_negative_ctx_e_is_zeroed);
     RUN(test_srv_negative_return_is_zeroed);